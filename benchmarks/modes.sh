@@ -0,0 +1,17 @@
+# The build modes of Makefile.default, sourced by the benchmark scripts.
+#
+# mode_env MODE prints the variable that selects MODE for make, and fails for
+# an unknown mode. The modes are NO_LTO, VTV, LLVMCFI, SD, SD_REL (REL_VTBL)
+# and SD_DEAD (DEAD_VIRTUALS).
+
+mode_env() {
+  case $1 in
+    NO_LTO)  echo NO_LTO=OK ;;
+    VTV)     echo VTV=OK ;;
+    LLVMCFI) echo LLVMCFI=OK ;;
+    SD)      echo SD=OK ;;
+    SD_REL)  echo REL_VTBL=OK ;;
+    SD_DEAD) echo DEAD_VIRTUALS=OK ;;
+    *)       return 1 ;;
+  esac
+}
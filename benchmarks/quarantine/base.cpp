@@ -0,0 +1,3 @@
+#include "base.h"
+
+int Base::f() { return 1; }
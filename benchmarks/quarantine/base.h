@@ -0,0 +1,10 @@
+#ifndef __BASE_H__
+#define __BASE_H__
+
+class Base {
+public:
+  virtual ~Base() {}
+  virtual int f();
+};
+
+#endif
@@ -0,0 +1,9 @@
+#include "classes.h"
+
+int Derived::f() { return 2; }
+int Derived::g() { return 3; }
+int MoreDerived::g() { return 4; }
+
+int A::h() { return 5; }
+int A::g() { return 6; }
+int B::h() { return 7; }
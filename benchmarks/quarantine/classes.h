@@ -0,0 +1,31 @@
+#ifndef __CLASSES_H__
+#define __CLASSES_H__
+
+#include "base.h"
+
+// quarantined: keeps its layout, checked by comparing with its address points
+class Derived : public Base {
+public:
+  int f();
+  virtual int g();
+};
+
+class MoreDerived : public Derived {
+public:
+  int g();
+};
+
+// not related to Base: interleaved and range checked
+class A {
+public:
+  virtual ~A() {}
+  virtual int h();
+  virtual int g();
+};
+
+class B : public A {
+public:
+  int h();
+};
+
+#endif
@@ -0,0 +1,22 @@
+#include "classes.h"
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+  Derived* d = new Derived();
+  Derived* md = new MoreDerived();
+  A* a = new A();
+  A* b = new B();
+
+  std::cout << "quarantined: " << d->f() << " " << d->g() << " " << md->g() << std::endl;
+  std::cout << "interleaved: " << a->h() << " " << b->h() << " " << b->g() << std::endl;
+
+  // with an argument, call through a Derived* pointing to an A, the equality
+  // check of the quarantined cloud has to trap
+  if (argc > 1) {
+    Derived* bad = (Derived*) (void*) a;
+    std::cout << "bad call: " << bad->g() << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Link a cloud deriving from a class built without SD next to a normal one.
+# The link has to succeed and quarantine the cloud, the valid calls through
+# both clouds have to run and a bad call through the quarantined one has to
+# fail its equality check.
+
+make clean all > link.txt 2>&1 || { cat link.txt; echo "link failed"; exit 1; }
+grep -q "Quarantined" link.txt || { echo "no cloud was quarantined"; exit 1; }
+
+./main || { echo "valid calls failed"; exit 1; }
+
+if ./main bad > /dev/null 2>&1; then
+  echo "the bad call through the quarantined cloud was not caught"
+  exit 1
+fi
+echo "quarantine ok"
@@ -0,0 +1,27 @@
+#include "classes.h"
+
+#define DEFINE_METHODS(name, k) \
+  int name::f0() { return k + 0; } int name::f1() { return k + 1; } \
+  int name::f2() { return k + 2; } int name::f3() { return k + 3; } \
+  int name::f4() { return k + 4; } int name::f5() { return k + 5; } \
+  int name::f6() { return k + 6; } int name::f7() { return k + 7; }
+
+DEFINE_METHODS(Base, 0)
+DEFINE_METHODS(A0, 10) DEFINE_METHODS(A1, 20) DEFINE_METHODS(A2, 30) DEFINE_METHODS(A3, 40)
+DEFINE_METHODS(B0, 50) DEFINE_METHODS(B1, 60) DEFINE_METHODS(B2, 70) DEFINE_METHODS(B3, 80)
+DEFINE_METHODS(B4, 90) DEFINE_METHODS(B5, 100) DEFINE_METHODS(B6, 110) DEFINE_METHODS(B7, 120)
+DEFINE_METHODS(C0, 130) DEFINE_METHODS(C1, 140) DEFINE_METHODS(C2, 150) DEFINE_METHODS(C3, 160)
+DEFINE_METHODS(C4, 170) DEFINE_METHODS(C5, 180) DEFINE_METHODS(C6, 190) DEFINE_METHODS(C7, 200)
+
+Base* create(int kind) {
+  switch (kind % NUM_CLASSES) {
+    case 0:  return new Base();
+    case 1:  return new A0(); case 2:  return new A1(); case 3:  return new A2();
+    case 4:  return new A3(); case 5:  return new B0(); case 6:  return new B1();
+    case 7:  return new B2(); case 8:  return new B3(); case 9:  return new B4();
+    case 10: return new B5(); case 11: return new B6(); case 12: return new B7();
+    case 13: return new C0(); case 14: return new C1(); case 15: return new C2();
+    case 16: return new C3(); case 17: return new C4(); case 18: return new C5();
+    case 19: return new C6(); default: return new C7();
+  }
+}
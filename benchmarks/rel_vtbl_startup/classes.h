@@ -0,0 +1,30 @@
+#ifndef CLASSES_H
+#define CLASSES_H
+
+// A wide hierarchy with many virtual functions, so that the interleaved
+// vtables are large enough for their relocations to show up at startup.
+
+#define DECLARE_METHODS \
+  virtual int f0(); virtual int f1(); virtual int f2(); virtual int f3(); \
+  virtual int f4(); virtual int f5(); virtual int f6(); virtual int f7();
+
+class Base {
+public:
+  virtual ~Base() {}
+  DECLARE_METHODS
+};
+
+#define DECLARE_CLASS(name, parent) \
+  class name : public parent { public: DECLARE_METHODS };
+
+DECLARE_CLASS(A0, Base) DECLARE_CLASS(A1, Base) DECLARE_CLASS(A2, Base) DECLARE_CLASS(A3, Base)
+DECLARE_CLASS(B0, A0)   DECLARE_CLASS(B1, A0)   DECLARE_CLASS(B2, A1)   DECLARE_CLASS(B3, A1)
+DECLARE_CLASS(B4, A2)   DECLARE_CLASS(B5, A2)   DECLARE_CLASS(B6, A3)   DECLARE_CLASS(B7, A3)
+DECLARE_CLASS(C0, B0)   DECLARE_CLASS(C1, B1)   DECLARE_CLASS(C2, B2)   DECLARE_CLASS(C3, B3)
+DECLARE_CLASS(C4, B4)   DECLARE_CLASS(C5, B5)   DECLARE_CLASS(C6, B6)   DECLARE_CLASS(C7, B7)
+
+#define NUM_CLASSES 21
+
+Base* create(int kind);
+
+#endif
@@ -0,0 +1,24 @@
+#include "classes.h"
+
+#include <typeinfo>
+#include <cstdio>
+
+// The benchmark is the process startup: create one object of each class,
+// make a virtual call and a dynamic_cast through it and exit.
+int main(int argc, char *argv[])
+{
+  int sum = 0;
+
+  for (int i = 0; i < NUM_CLASSES; i++) {
+    Base* b = create(i);
+    sum += b->f3();
+
+    if (dynamic_cast<A0*>(b))
+      sum += 1;
+
+    delete b;
+  }
+
+  printf("%d\n", sum);
+  return 0;
+}
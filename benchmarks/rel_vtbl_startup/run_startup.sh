@@ -0,0 +1,23 @@
+#!/bin/bash
+# Compare the startup time and the number of dynamic relocations of the
+# benchmark built with absolute and with relative interleaved vtables.
+#   ./run_startup.sh [runs]
+
+RUNS=${1:-2000}
+
+measure() {
+  local start=$(date +%s%N)
+  for ((i = 0; i < RUNS; i++)); do
+    ./main > /dev/null
+  done
+  local end=$(date +%s%N)
+  echo "$(( (end - start) / RUNS / 1000 )) us/run," \
+       "$(readelf -rW main | grep -c R_X86_64_RELATIVE) relative relocations," \
+       "$(readelf -SW main | awk '$2 == ".data.rel.ro" { print strtonum("0x" $6) }') bytes .data.rel.ro"
+}
+
+make clean all > /dev/null || exit 1
+echo "absolute vtables: $(measure)"
+
+REL_VTBL=OK make clean all > /dev/null || exit 1
+echo "relative vtables: $(measure)"
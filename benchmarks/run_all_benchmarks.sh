@@ -48,7 +48,8 @@ run_benchmarks() {
                        'simp0'
                        'virtual_diamond'
                        'virtual_with_virtual_primary_base'
-                       'shrink_wrap_paper_example')
+                       'shrink_wrap_paper_example'
+                       'void_cast_trim')
 
   local -a benchmarks=('shrink_wrap_paper_example')
                        #'shrink_wrap_paper_example_overwrite')
@@ -0,0 +1,66 @@
+#include "classes.h"
+
+#define NOINLINE __attribute__((noinline))
+
+#define DEFINE_ROOT(C) \
+  unsigned C::f(unsigned x) { return x * 3 + 1; } \
+  static C C##_obj;
+
+DEFINE_ROOT(Cloud1)
+DEFINE_ROOT(Cloud4)
+DEFINE_ROOT(Cloud16)
+DEFINE_ROOT(Cloud64)
+
+#define LEAF(C, n) \
+  unsigned C##_##n::f(unsigned x) { return x * 5 + 1; } \
+  static C##_##n C##_##n##_obj;
+
+LEAVES_4(Cloud4, L)
+LEAVES_16(Cloud16, L)
+LEAVES_64(Cloud64, L)
+
+#undef LEAF
+#define LEAF(C, n) &C##_##n##_obj,
+
+Cloud1  *cloud1Objects[1]   = { &Cloud1_obj };
+Cloud4  *cloud4Objects[5]   = { LEAVES_4(Cloud4, L) &Cloud4_obj };
+Cloud16 *cloud16Objects[17] = { LEAVES_16(Cloud16, L) &Cloud16_obj };
+Cloud64 *cloud64Objects[65] = { LEAVES_64(Cloud64, L) &Cloud64_obj };
+
+#undef LEAF
+
+unsigned DBase::f(unsigned x)   { return x * 3 + 1; }
+unsigned DBase::g(unsigned x)   { return x * 3 + 2; }
+unsigned DLeft::f(unsigned x)   { return x * 5 + 1; }
+unsigned DRight::g(unsigned x)  { return x * 5 + 2; }
+unsigned DBottom::f(unsigned x) { return x * 7 + 1; }
+unsigned DBottom::g(unsigned x) { return x * 7 + 2; }
+
+static DBase   diamondBase;
+static DLeft   diamondLeft;
+static DRight  diamondRight;
+static DBottom diamondBottom;
+
+DBase  *diamondBaseObjects[4]  = { &diamondBottom, &diamondLeft,
+                                   &diamondRight, &diamondBase };
+DRight *diamondRightObjects[2] = { &diamondBottom, &diamondRight };
+
+NOINLINE unsigned chain7(unsigned x) { return x * 3 + 1; }
+NOINLINE unsigned chain6(unsigned x) { return chain7(x) + 1; }
+NOINLINE unsigned chain5(unsigned x) { return chain6(x) + 1; }
+NOINLINE unsigned chain4(unsigned x) { return chain5(x) + 1; }
+NOINLINE unsigned chain3(unsigned x) { return chain4(x) + 1; }
+NOINLINE unsigned chain2(unsigned x) { return chain3(x) + 1; }
+NOINLINE unsigned chain1(unsigned x) { return chain2(x) + 1; }
+NOINLINE unsigned chain0(unsigned x) { return chain1(x) + 1; }
+
+#define DEFINE_FN(n) \
+  NOINLINE static unsigned fn##n(unsigned x) { return x * 3 + n; }
+
+DEFINE_FN(0)  DEFINE_FN(1)  DEFINE_FN(2)  DEFINE_FN(3)
+DEFINE_FN(4)  DEFINE_FN(5)  DEFINE_FN(6)  DEFINE_FN(7)
+DEFINE_FN(8)  DEFINE_FN(9)  DEFINE_FN(10) DEFINE_FN(11)
+DEFINE_FN(12) DEFINE_FN(13) DEFINE_FN(14) DEFINE_FN(15)
+
+fn_t fnTable[16] = { fn0, fn1, fn2,  fn3,  fn4,  fn5,  fn6,  fn7,
+                     fn8, fn9, fn10, fn11, fn12, fn13, fn14, fn15 };
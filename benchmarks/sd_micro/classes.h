@@ -0,0 +1,83 @@
+#ifndef CLASSES_H
+#define CLASSES_H
+
+// The call targets of the kernels, kept in their own TU so that only LTO can
+// see through the calls.
+
+// Clouds of a root and 0, 4, 16 and 64 leaves. A call through the root is
+// checked against the whole cloud.
+
+#define LEAVES_4(C, n)  LEAF(C, n##0) LEAF(C, n##1) LEAF(C, n##2) LEAF(C, n##3)
+#define LEAVES_16(C, n) LEAVES_4(C, n##0) LEAVES_4(C, n##1) \
+                        LEAVES_4(C, n##2) LEAVES_4(C, n##3)
+#define LEAVES_64(C, n) LEAVES_16(C, n##0) LEAVES_16(C, n##1) \
+                        LEAVES_16(C, n##2) LEAVES_16(C, n##3)
+
+#define DECLARE_ROOT(C) \
+  class C { public: virtual ~C() {} virtual unsigned f(unsigned x); };
+
+DECLARE_ROOT(Cloud1)
+DECLARE_ROOT(Cloud4)
+DECLARE_ROOT(Cloud16)
+DECLARE_ROOT(Cloud64)
+
+#define LEAF(C, n) \
+  class C##_##n : public C { public: virtual unsigned f(unsigned x); };
+
+LEAVES_4(Cloud4, L)
+LEAVES_16(Cloud16, L)
+LEAVES_64(Cloud64, L)
+
+#undef LEAF
+
+// one object of every class of the cloud, the root is the last one
+extern Cloud1  *cloud1Objects[1];
+extern Cloud4  *cloud4Objects[5];
+extern Cloud16 *cloud16Objects[17];
+extern Cloud64 *cloud64Objects[65];
+
+/*
+       DBase
+      /     \
+   DLeft   DRight   (virtual)
+      \     /
+      DBottom
+*/
+
+class DBase {
+public:
+  virtual ~DBase() {}
+  virtual unsigned f(unsigned x);
+  virtual unsigned g(unsigned x);
+};
+
+class DLeft : public virtual DBase {
+public:
+  virtual unsigned f(unsigned x);
+};
+
+class DRight : public virtual DBase {
+public:
+  virtual unsigned g(unsigned x);
+};
+
+class DBottom : public DLeft, public DRight {
+public:
+  virtual unsigned f(unsigned x);
+  virtual unsigned g(unsigned x);
+};
+
+// calls through the virtual base and through the secondary base go through
+// the thunks of DBottom
+extern DBase  *diamondBaseObjects[4];
+extern DRight *diamondRightObjects[2];
+
+// a chain of CHAIN_LENGTH static calls, every one of them returns
+#define CHAIN_LENGTH 8
+unsigned chain0(unsigned x);
+
+// the targets of the indirect calls
+typedef unsigned (*fn_t)(unsigned);
+extern fn_t fnTable[16];
+
+#endif
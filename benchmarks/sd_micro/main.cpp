@@ -0,0 +1,212 @@
+#include "classes.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Runs every kernel for a number of calls and prints a CSV line per kernel:
+// the time per call and, where perf_event_open is allowed, the hardware
+// counters per call. The checksums of the kernels go to stderr, they must not
+// depend on the mode the benchmark was built in.
+//   ./main [calls per kernel]
+
+#define NOINLINE __attribute__((noinline))
+#define REPETITIONS 5
+
+enum { INSTRUCTIONS, BRANCHES, BRANCH_MISSES, L1I_MISSES, NUM_COUNTERS };
+
+static const char *counterNames[NUM_COUNTERS] = {
+  "instructions", "branches", "branch_misses", "l1i_misses"
+};
+
+static int counterFds[NUM_COUNTERS];
+
+#ifdef __linux__
+static int openCounter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void openCounters() {
+  for (int i = 0; i < NUM_COUNTERS; i++)
+    counterFds[i] = -1;
+#ifdef __linux__
+  counterFds[INSTRUCTIONS] = openCounter(PERF_TYPE_HARDWARE,
+                                         PERF_COUNT_HW_INSTRUCTIONS);
+  counterFds[BRANCHES] = openCounter(PERF_TYPE_HARDWARE,
+                                     PERF_COUNT_HW_BRANCH_INSTRUCTIONS);
+  counterFds[BRANCH_MISSES] = openCounter(PERF_TYPE_HARDWARE,
+                                          PERF_COUNT_HW_BRANCH_MISSES);
+  counterFds[L1I_MISSES] = openCounter(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1I |
+      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+}
+
+static void startCounters() {
+#ifdef __linux__
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (counterFds[i] < 0)
+      continue;
+    ioctl(counterFds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(counterFds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static void stopCounters(uint64_t values[NUM_COUNTERS]) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    values[i] = 0;
+#ifdef __linux__
+    if (counterFds[i] < 0)
+      continue;
+    ioctl(counterFds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counterFds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+      values[i] = 0;
+#endif
+  }
+}
+
+static uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the kernels return a checksum of their calls, n is a multiple of 128
+
+template <class T, unsigned N>
+NOINLINE unsigned vcallKernel(T *(&objects)[N], unsigned n) {
+  unsigned x = 0;
+  for (unsigned i = 0; i < n; i++)
+    x = objects[i % N]->f(x);
+  return x;
+}
+
+NOINLINE static unsigned vcallCloud1(unsigned n) {
+  return vcallKernel(cloud1Objects, n);
+}
+
+NOINLINE static unsigned vcallCloud4(unsigned n) {
+  return vcallKernel(cloud4Objects, n);
+}
+
+NOINLINE static unsigned vcallCloud16(unsigned n) {
+  return vcallKernel(cloud16Objects, n);
+}
+
+NOINLINE static unsigned vcallCloud64(unsigned n) {
+  return vcallKernel(cloud64Objects, n);
+}
+
+NOINLINE static unsigned diamondVirtualBase(unsigned n) {
+  unsigned x = 0;
+  for (unsigned i = 0; i < n; i++)
+    x = diamondBaseObjects[i % 4]->g(x);
+  return x;
+}
+
+NOINLINE static unsigned diamondSecondaryBase(unsigned n) {
+  unsigned x = 0;
+  for (unsigned i = 0; i < n; i++)
+    x = diamondRightObjects[i % 2]->g(x);
+  return x;
+}
+
+NOINLINE static unsigned staticChain(unsigned n) {
+  unsigned x = 0;
+  for (unsigned i = 0; i < n / CHAIN_LENGTH; i++)
+    x = chain0(x);
+  return x;
+}
+
+NOINLINE static unsigned indirectCall(unsigned n) {
+  unsigned x = 0;
+  for (unsigned i = 0; i < n; i++)
+    x = fnTable[i % 16](x);
+  return x;
+}
+
+struct Kernel {
+  const char *name;
+  unsigned (*run)(unsigned n);
+};
+
+static const Kernel kernels[] = {
+  { "vcall_cloud1",           vcallCloud1 },
+  { "vcall_cloud4",           vcallCloud4 },
+  { "vcall_cloud16",          vcallCloud16 },
+  { "vcall_cloud64",          vcallCloud64 },
+  { "diamond_virtual_base",   diamondVirtualBase },
+  { "diamond_secondary_base", diamondSecondaryBase },
+  { "static_chain",           staticChain },
+  { "indirect_call",          indirectCall },
+};
+
+int main(int argc, char *argv[])
+{
+  unsigned calls = argc > 1 ? strtoul(argv[1], NULL, 0) : 10000000;
+  calls = calls / 128 * 128;
+  if (calls == 0) {
+    fprintf(stderr, "usage: %s [calls per kernel]\n", argv[0]);
+    return 1;
+  }
+
+  openCounters();
+
+  printf("kernel,calls,ns_per_call");
+  for (int i = 0; i < NUM_COUNTERS; i++)
+    printf(",%s", counterNames[i]);
+  printf("\n");
+
+  for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    const Kernel &kernel = kernels[k];
+    unsigned checksum = kernel.run(calls / 16);
+
+    // the repetition with the shortest time is the least disturbed one
+    uint64_t best = ~(uint64_t) 0;
+    uint64_t counters[NUM_COUNTERS], bestCounters[NUM_COUNTERS];
+    for (int r = 0; r < REPETITIONS; r++) {
+      uint64_t start = now();
+      startCounters();
+      checksum = kernel.run(calls);
+      stopCounters(counters);
+      uint64_t elapsed = now() - start;
+
+      if (elapsed < best) {
+        best = elapsed;
+        memcpy(bestCounters, counters, sizeof(counters));
+      }
+    }
+
+    printf("%s,%u,%.3f", kernel.name, calls, (double) best / calls);
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      if (counterFds[i] < 0)
+        printf(",");
+      else
+        printf(",%.3f", (double) bestCounters[i] / calls);
+    }
+    printf("\n");
+    fprintf(stderr, "%s %u\n", kernel.name, checksum);
+  }
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Build the kernels in the modes of Makefile.default and collect the cost per
+# call of each one into a CSV.
+#   ./run_micro.sh [-o results.csv] [calls per kernel]
+#
+# MODES selects the modes (default "NO_LTO LLVMCFI VTV SD"), out of the ones
+# of ../modes.sh. The counter columns are empty where perf_event_open is not
+# allowed, see /proc/sys/kernel/perf_event_paranoid. A mode whose checksums
+# differ from the first mode is reported.
+
+CUR_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+source "$CUR_DIR/../modes.sh"
+
+MODES=${MODES:-NO_LTO LLVMCFI VTV SD}
+RESULTS=$CUR_DIR/results.csv
+
+if [[ "$1" == "-o" ]]; then
+  RESULTS=$(readlink -f "$2")
+  shift 2
+fi
+CALLS=${1:-10000000}
+
+pushd "$CUR_DIR" > /dev/null
+
+echo "mode,kernel,calls,ns_per_call,instructions,branches,branch_misses," \
+     "l1i_misses" | tr -d ' ' > "$RESULTS"
+
+reference=""
+for mode in $MODES; do
+  env=$(mode_env $mode) || { echo "unknown mode $mode"; continue; }
+  echo "############################################################"
+  echo "$mode"
+
+  env $env make clean all > build.log 2>&1
+  if [[ $? -ne 0 ]]; then echo "$mode compilation fail"; continue; fi
+
+  ./main $CALLS > run.csv 2> checksums.txt
+  if [[ $? -ne 0 ]]; then echo "$mode run fail"; continue; fi
+
+  if [[ -z "$reference" ]]; then
+    reference=$(cat checksums.txt)
+  elif [[ "$(cat checksums.txt)" != "$reference" ]]; then
+    echo "$mode checksums differ !!!"
+  fi
+
+  tail -n +2 run.csv | sed "s/^/$mode,/" >> "$RESULTS"
+done
+
+rm -f run.csv checksums.txt
+make clean > /dev/null
+popd > /dev/null
+
+echo
+echo "############################################################"
+echo "results in $RESULTS"
+echo "############################################################"
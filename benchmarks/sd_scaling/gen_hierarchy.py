@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+"""
+Generates a synthetic C++ program with a parameterized class hierarchy, used to
+measure how the SafeDispatch link scales with the shape of the hierarchy.
+
+  ./gen_hierarchy.py -o DIR [--clouds N] [--depth N] [--fanout N] ...
+
+Every cloud is a tree of classes under one root with --methods virtual
+functions. A class at depth >= 2 gets a second base with probability
+--mi-ratio: a sibling of its parent when both inherit their parent virtually
+(a diamond) or otherwise a class of an earlier cloud. A class is inherited
+virtually by its children with probability --vi-ratio. The call side is a
+graph of --static-funcs functions, each making --vcall-density virtual calls
+through pointers of random classes and calling up to two earlier functions.
+
+The output is a benchmark directory: classes.h, classes_<i>.cpp and
+calls_<i>.cpp for each of the --files TUs, main.cpp and a Makefile including
+Makefile.config and Makefile.default of the benchmarks. The program prints a
+checksum that must not depend on the mode it was built in.
+"""
+
+import argparse
+import os
+import random
+import sys
+
+BENCH_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+class Class:
+  def __init__(self, cloud, idx, level, parent):
+    self.cloud = cloud
+    self.name = "C%d_%d" % (cloud, idx)
+    self.level = level
+    self.parent = parent
+    self.second = None
+    self.virtualChildren = False
+    self.children = []
+    self.secondChildren = []
+    self.overrides = []
+
+  def isPure(self):
+    """No class above this one has a second base"""
+    cls = self
+    while cls is not None:
+      if cls.second is not None:
+        return False
+      cls = cls.parent
+    return True
+
+  def clouds(self):
+    """The clouds of all the bases, a second base from one of them would be
+    ambiguous"""
+    res = set([self.cloud])
+    for base in (self.parent, self.second):
+      if base is not None:
+        res |= base.clouds()
+    return res
+
+  def bases(self):
+    res = []
+    for base in (self.parent, self.second):
+      if base is not None:
+        res.append(("public virtual " if base.virtualChildren else "public ") +
+                   base.name)
+    return res
+
+
+class Hierarchy:
+  def __init__(self, args, rnd):
+    self.args = args
+    self.rnd = rnd
+    self.clouds = []
+    self.classes = []
+    self.diamonds = 0
+    self.crossCloud = 0
+
+    for c in range(args.clouds):
+      self.clouds.append(self.buildCloud(c))
+
+  def method(self, cloud, m):
+    return "m%d_%d" % (cloud, m)
+
+  def buildCloud(self, c):
+    args = self.args
+    root = Class(c, 0, 0, None)
+    root.overrides = list(range(args.methods))
+    cloud = [root]
+    level = [root]
+
+    for depth in range(1, args.depth):
+      nextLevel = []
+      for parent in level:
+        for _ in range(args.fanout):
+          cls = Class(c, len(cloud), depth, parent)
+          parent.children.append(cls)
+          cloud.append(cls)
+          nextLevel.append(cls)
+      level = nextLevel
+
+    for cls in cloud:
+      cls.virtualChildren = self.rnd.random() < args.vi_ratio
+
+    for cls in cloud[1:]:
+      if cls.level >= 2 and self.rnd.random() < args.mi_ratio:
+        self.addSecondBase(cls)
+      # a diamond needs a final overrider for every method of the shared base
+      if cls.second is not None and cls.second.cloud == c:
+        cls.overrides = list(range(args.methods))
+      else:
+        cls.overrides = [m for m in range(args.methods)
+                         if self.rnd.random() < 0.5]
+
+    self.classes.extend(cloud)
+    return cloud
+
+  def addSecondBase(self, cls):
+    parent = cls.parent
+    grand = parent.parent
+
+    if grand.virtualChildren:
+      siblings = [s for s in grand.children if s is not parent and s.isPure()]
+      if siblings:
+        cls.second = self.rnd.choice(siblings)
+        cls.second.secondChildren.append(cls)
+        self.diamonds += 1
+        return
+
+    clouds = cls.clouds()
+    candidates = [o for o in self.classes
+                  if o.cloud not in clouds and o.isPure()]
+    if candidates:
+      cls.second = self.rnd.choice(candidates)
+      cls.second.secondChildren.append(cls)
+      self.crossCloud += 1
+
+  def descendants(self, cls):
+    res = []
+    seen = set()
+    work = [cls]
+    while work:
+      cur = work.pop()
+      if cur.name in seen:
+        continue
+      seen.add(cur.name)
+      res.append(cur)
+      work.extend(cur.children)
+      work.extend(cur.secondChildren)
+    return res
+
+
+def classDecl(h, cls):
+  bases = cls.bases()
+  out = "class %s%s {\npublic:\n" % (cls.name,
+                                     " : " + ", ".join(bases) if bases else "")
+  if cls.parent is None:
+    out += "  virtual ~%s() {}\n" % cls.name
+  for m in cls.overrides:
+    out += "  virtual unsigned %s(unsigned x);\n" % h.method(cls.cloud, m)
+  return out + "};\n"
+
+
+def writeHeader(h, path):
+  with open(path, "w") as f:
+    f.write("#ifndef CLASSES_H\n#define CLASSES_H\n\n")
+    f.write("// generated by gen_hierarchy.py, do not edit\n\n")
+    for cls in h.classes:
+      f.write(classDecl(h, cls) + "\n")
+    for cls in h.classes:
+      f.write("%s *make_%s(unsigned k);\n" % (cls.name, cls.name))
+    f.write("\n")
+    for i in range(h.args.static_funcs):
+      f.write("unsigned f_%d(unsigned x, unsigned d);\n" % i)
+    f.write("\n#endif\n")
+
+
+def writeClasses(h, clouds, path):
+  with open(path, "w") as f:
+    f.write('#include "classes.h"\n\n')
+    for cloud in clouds:
+      for cls in cloud:
+        for m in cls.overrides:
+          f.write("unsigned %s::%s(unsigned x) { return x * %du + %du; }\n" %
+                  (cls.name, h.method(cls.cloud, m),
+                   2 * h.rnd.randint(1, 50) + 1, h.rnd.randint(0, 1000)))
+      f.write("\n")
+      for cls in cloud:
+        subs = h.descendants(cls)
+        f.write("%s *make_%s(unsigned k) {\n  switch (k %% %du) {\n" %
+                (cls.name, cls.name, len(subs)))
+        for i, sub in enumerate(subs[:-1]):
+          f.write("    case %d: return new %s();\n" % (i, sub.name))
+        f.write("    default: return new %s();\n  }\n}\n\n" % subs[-1].name)
+
+
+def writeCalls(h, funcs, path):
+  args = h.args
+  with open(path, "w") as f:
+    f.write('#include "classes.h"\n\n')
+    for i in funcs:
+      f.write("unsigned f_%d(unsigned x, unsigned d) {\n" % i)
+      for v in range(args.vcall_density):
+        cls = h.rnd.choice(h.classes)
+        m = h.rnd.randrange(args.methods)
+        f.write("  { %s *p = make_%s(x); x = p->%s(x); delete p; }\n" %
+                (cls.name, cls.name, h.method(cls.cloud, m)))
+      if i > 0:
+        callees = set(h.rnd.randrange(i) for _ in range(2))
+        f.write("  if (d > 0) {\n")
+        for c in sorted(callees):
+          f.write("    x += f_%d(x, d - 1);\n" % c)
+        f.write("  }\n")
+      f.write("  return x;\n}\n\n")
+
+
+def writeMain(h, path):
+  args = h.args
+  with open(path, "w") as f:
+    f.write('#include "classes.h"\n\n#include <cstdio>\n\n')
+    f.write("int main(int argc, char *argv[])\n{\n  unsigned x = argc;\n\n")
+    for i in range(args.static_funcs):
+      f.write("  x = f_%d(x, %d);\n" % (i, args.call_depth))
+    f.write('\n  printf("%u\\n", x);\n  return 0;\n}\n')
+
+
+def writeMakefile(objs, path):
+  with open(path, "w") as f:
+    f.write("# generated by gen_hierarchy.py, do not edit\n")
+    f.write("OBJS = %s\n\n" % " ".join(objs))
+    f.write("include %s/Makefile.config\n" % BENCH_DIR)
+    f.write("include %s/Makefile.default\n\n" % BENCH_DIR)
+    f.write("objs:\t$(ALL_OBJS)\n")
+
+
+def main():
+  parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+  parser.add_argument("-o", "--output", required=True,
+                      help="directory of the generated benchmark")
+  parser.add_argument("--clouds", type=int, default=8,
+                      help="number of class hierarchies (root classes)")
+  parser.add_argument("--depth", type=int, default=3,
+                      help="number of levels of each cloud")
+  parser.add_argument("--fanout", type=int, default=3,
+                      help="children of every class above the last level")
+  parser.add_argument("--methods", type=int, default=4,
+                      help="virtual functions of every root class")
+  parser.add_argument("--mi-ratio", type=float, default=0.1,
+                      help="probability of a class having a second base")
+  parser.add_argument("--vi-ratio", type=float, default=0.1,
+                      help="probability of a class being inherited virtually")
+  parser.add_argument("--vcall-density", type=int, default=4,
+                      help="virtual call sites in every static function")
+  parser.add_argument("--static-funcs", type=int, default=64,
+                      help="number of functions of the static call graph")
+  parser.add_argument("--call-depth", type=int, default=2,
+                      help="depth main walks the static call graph to")
+  parser.add_argument("--files", type=int, default=4,
+                      help="number of TUs of the classes and of the calls")
+  parser.add_argument("--seed", type=int, default=0)
+  args = parser.parse_args()
+
+  if args.clouds < 1 or args.depth < 1 or args.fanout < 1 or \
+     args.methods < 1 or args.files < 1:
+    sys.exit("gen_hierarchy.py: the counts must be positive")
+
+  rnd = random.Random(args.seed)
+  h = Hierarchy(args, rnd)
+
+  if not os.path.isdir(args.output):
+    os.makedirs(args.output)
+
+  objs = []
+  writeHeader(h, os.path.join(args.output, "classes.h"))
+  for tu in range(args.files):
+    clouds = h.clouds[tu::args.files]
+    funcs = range(tu, args.static_funcs, args.files)
+    writeClasses(h, clouds, os.path.join(args.output, "classes_%d.cpp" % tu))
+    writeCalls(h, funcs, os.path.join(args.output, "calls_%d.cpp" % tu))
+    objs += ["classes_%d.o" % tu, "calls_%d.o" % tu]
+  writeMain(h, os.path.join(args.output, "main.cpp"))
+  writeMakefile(objs, os.path.join(args.output, "Makefile"))
+
+  print("classes=%d diamonds=%d cross_cloud=%d vcalls=%d static_funcs=%d" %
+        (len(h.classes), h.diamonds, h.crossCloud,
+         args.static_funcs * args.vcall_density, args.static_funcs))
+
+
+if __name__ == "__main__":
+  main()
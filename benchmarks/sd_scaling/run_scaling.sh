@@ -0,0 +1,130 @@
+#!/bin/bash
+# Generate the configurations of configs.txt with gen_hierarchy.py, build each
+# one in the modes of Makefile.default and record the cost of its link.
+#   ./run_scaling.sh [-o results.csv] [config...]
+#
+# MODES selects the modes (default "NO_LTO LLVMCFI SD"), out of the ones of
+# ../modes.sh. The programs are generated into OUT_DIR (default ./build). The
+# peak memory is the one of the biggest process of the link, the check counts
+# and the time of SDBuildCHA and SDLayoutBuilder come from the SD trace of the
+# link, they are empty for the other modes. The output column compares what
+# the program prints with the first mode.
+
+CUR_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+source "$CUR_DIR/../modes.sh"
+
+OUT_DIR=${OUT_DIR:-$CUR_DIR/build}
+MODES=${MODES:-NO_LTO LLVMCFI SD}
+RESULTS=$CUR_DIR/results.csv
+
+if [[ "$1" == "-o" ]]; then
+  RESULTS=$(readlink -f "$2")
+  shift 2
+fi
+
+# prints vptr_checks,return_checks,cha_ms,layout_ms,trace_peak_rss_kb
+trace_summary() {
+  python3 - "$1" <<'EOF'
+import json, sys
+
+try:
+  events = json.load(open(sys.argv[1]))["traceEvents"]
+except (IOError, ValueError):
+  print(",,,,")
+  sys.exit(0)
+
+counters = {}
+durations = {}
+peak = 0
+for e in events:
+  durations[e["name"]] = durations.get(e["name"], 0) + e["dur"]
+  for k, v in e["args"].items():
+    if k == "peak_rss_kb":
+      peak = max(peak, v)
+    elif k != "peak_rss_delta_kb":
+      counters[k] = counters.get(k, 0) + v
+
+print("%d,%d,%.1f,%.1f,%d" % (
+  counters.get("range_checks", 0) + counters.get("eq_checks", 0),
+  counters.get("return_checks", 0),
+  durations.get("SDBuildCHA", 0) / 1000.0,
+  durations.get("SDLayoutBuilder", 0) / 1000.0, peak))
+EOF
+}
+
+run_config() {
+  local name=$1
+  shift
+  local dir=$OUT_DIR/$name
+
+  rm -rf "$dir"
+  local stats
+  stats=$("$CUR_DIR/gen_hierarchy.py" -o "$dir" "$@") || return 1
+  local classes=$(echo "$stats" | sed -E 's/.*classes=([0-9]+).*/\1/')
+
+  pushd "$dir" > /dev/null
+  local reference=""
+  local mode
+  for mode in $MODES; do
+    local env
+    env=$(mode_env $mode) || { echo "unknown mode $mode"; continue; }
+    echo "############################################################"
+    echo "$name: $mode"
+
+    make clean > /dev/null
+    rm -f sd_trace.json link.time
+
+    local start=$(date +%s%N)
+    env $env make objs > build.log 2>&1
+    if [[ $? -ne 0 ]]; then echo "$mode compilation fail"; continue; fi
+    local compile=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    start=$(date +%s%N)
+    if [[ -x /usr/bin/time ]]; then
+      /usr/bin/time -f "%M" -o link.time \
+        env $env SD_TRACE="$dir/sd_trace.json" make main >> build.log 2>&1
+    else
+      env $env SD_TRACE="$dir/sd_trace.json" make main >> build.log 2>&1
+    fi
+    if [[ $? -ne 0 ]]; then echo "$mode link fail"; continue; fi
+    local link=$(( ($(date +%s%N) - start) / 1000000 ))
+
+    local output result=ok
+    output=$(./main 2> /dev/null)
+    if [[ $? -ne 0 ]]; then
+      result=fail
+    elif [[ -z "$reference" ]]; then
+      reference=$output
+    elif [[ "$output" != "$reference" ]]; then
+      result=diff
+    fi
+
+    local summary=$(trace_summary sd_trace.json)
+    local peak=$(tail -n 1 link.time 2> /dev/null)
+    if [[ -z "$peak" ]]; then
+      peak=${summary##*,}
+    fi
+
+    echo "$name,$mode,$classes,$compile,$link,$peak,$(stat -c %s main)," \
+         "$(size main | awk 'NR == 2 { print $1 }'),$result,${summary%,*}" \
+         | tr -d ' ' >> "$RESULTS"
+  done
+  popd > /dev/null
+}
+
+echo "config,mode,classes,compile_ms,link_ms,peak_rss_kb,binary_bytes," \
+     "text_bytes,output,vptr_checks,return_checks,cha_ms,layout_ms" \
+     | tr -d ' ' > "$RESULTS"
+
+while read -r name args; do
+  [[ -z "$name" || "$name" == \#* ]] && continue
+  if [[ $# -gt 0 ]] && ! [[ " $* " == *" $name "* ]]; then
+    continue
+  fi
+  run_config "$name" $args < /dev/null
+done < "$CUR_DIR/configs.txt"
+
+echo
+echo "############################################################"
+echo "results in $RESULTS"
+echo "############################################################"
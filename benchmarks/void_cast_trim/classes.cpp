@@ -0,0 +1,6 @@
+#include "classes.h"
+
+int A::f() { return 1; }
+int B::g() { return 2; }
+int C::f() { return 3; }
+int C::g() { return 4; }
@@ -0,0 +1,23 @@
+#ifndef __CLASSES__H_
+#define __CLASSES__H_
+
+class A {
+public:
+  virtual ~A() {}
+  virtual int f();
+};
+
+class B {
+public:
+  virtual ~B() {}
+  virtual int g();
+};
+
+// B is a secondary base, its offset-to-top is not zero
+class C : public A, public B {
+public:
+  int f();
+  int g();
+};
+
+#endif
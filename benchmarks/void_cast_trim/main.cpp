@@ -0,0 +1,21 @@
+#include "classes.h"
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+  C* c = new C();
+  B* b = c;
+
+  // the only reader of the offset-to-top in this program
+  void* top = dynamic_cast<void*>(b);
+
+  std::cout << "g: " << b->g() << std::endl;
+  if (top != (void*) c) {
+    std::cout << "dynamic_cast<void*> returned " << top << " instead of " << (void*) c << std::endl;
+    return 1;
+  }
+
+  std::cout << "dynamic_cast<void*> ok" << std::endl;
+  delete c;
+  return 0;
+}
@@ -0,0 +1,55 @@
+//===-- llvm/CodeGen/ParallelCG.h - Parallel code generation ----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This header declares functions that can be used for parallel code generation
+// of a module after link time optimization.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_CODEGEN_PARALLELCG_H
+#define LLVM_CODEGEN_PARALLELCG_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include <functional>
+#include <memory>
+
+namespace llvm {
+
+class Module;
+class TargetMachine;
+class raw_pwrite_stream;
+
+/// Creates the target machine of one code generation thread from the target
+/// triple of its partition.
+typedef std::function<std::unique_ptr<TargetMachine>(StringRef TripleStr)>
+    TargetMachineFactory;
+
+/// Split M into OSs.size() partitions and generate an object file for each of
+/// them on its own thread and LLVMContext. Linked together, the objects are
+/// equivalent to the single object that would have been generated from M.
+///
+/// The definitions are balanced by instruction count. Members of a comdat stay
+/// together, aliases follow their aliasee and appending variables go to the
+/// first partition. Local symbols used from another partition are renamed and
+/// made hidden so that the objects can refer to each other, M is modified
+/// accordingly.
+///
+/// The SafeDispatch call-site tables are loaded once from M and shared by the
+/// SDMachineFunction passes of all threads, their statistics are written once
+/// for the whole module.
+void splitCodeGen(Module &M, ArrayRef<raw_pwrite_stream *> OSs,
+                  const TargetMachineFactory &TMFactory,
+                  LLVMContext::DiagnosticHandlerTy DiagHandler = nullptr,
+                  void *DiagContext = nullptr);
+
+} // End llvm namespace
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "llvm/Transforms/IPO/SafeDispatchReturnRange.h"
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
+#include "llvm/IR/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 
@@ -16,12 +17,53 @@
 #include "llvm/MC/MCSymbol.h"
 
 
+#include <map>
 #include <string>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 
 namespace llvm {
+
+/**
+ * CallSite tables generated by SafeDispatchReturnRange, keyed by debug location.
+ * When the code generation is split over several threads the tables are
+ * loaded once from the combined module and shared read-only.
+ */
+struct SDCallSiteTables {
+  std::map <std::string, std::string> CallSiteDebugLocVirtual;
+  std::map <std::string, std::string> CallSiteDebugLocStatic;
+
+  std::map <std::string, std::pair<uint64_t , uint64_t>> CallSiteRange;
+  std::map <std::string, uint64_t> CallSiteID;
+
+  uint64_t getCallSiteID(const std::string &DebugLoc) const {
+    auto it = CallSiteID.find(DebugLoc);
+    return it == CallSiteID.end() ? 0 : it->second;
+  }
+
+  // These read and remove the named metadata of the module.
+  int loadVirtualCallSiteData(Module &M);
+  int loadStaticCallSiteData(Module &M);
+};
+
+/**
+ * Statistics gathered while instrumenting the call sites.
+ */
+struct SDCallSiteStats {
+  std::vector<uint64_t> RangeWidths;
+  std::map <uint64_t, int> IDCount;
+
+  int NumberOfVirtual = 0;
+  int NumberOfStaticDirect = 0;
+  int NumberOfIndirect = 0;
+  int NumberOfTail = 0;
+  int NumberOfUnknown = 0;
+
+  void merge(const SDCallSiteStats &Other);
+};
+
 /**
  * This pass receives information generated in the SafeDispatch LTO passes
  * (SafeDispatchReturnRange) for use in the X86 backend.
@@ -41,32 +83,35 @@ public:
     //errs() << stopper;
   }
 
-  virtual ~SDMachineFunction() {
-    analyse(M);
-    sdLog::stream() << "deleting SDMachineFunction pass\n";
-  }
+  virtual ~SDMachineFunction();
 
   bool runOnMachineFunction(MachineFunction &MF) override;
 
+  /**
+   * Use the given tables instead of loading them from the module and merge
+   * the statistics into Sink instead of writing them when the pass is
+   * deleted. Used by parallel code generation, pass nullptr to reset.
+   */
+  static void setSharedData(const SDCallSiteTables *Tables, SDCallSiteStats *Sink);
+
+  /**
+   * Print the statistics and write the ID counts next to the output of M.
+   */
+  static void analyse(const Module *M, const SDCallSiteStats &Stats);
+
 private:
   // Constants
-  const uint64_t unknownID = 0xFFFFF;
-  const uint64_t indirectID = 0xFFFFF;
-  const uint64_t tailID = 0xFFFFE;
+  const uint64_t unknownID = SD_RETURN_UNKNOWN_ID;
+  const uint64_t indirectID = SD_RETURN_UNKNOWN_ID;
+  const uint64_t tailID = SD_RETURN_TAIL_ID;
   const Module* M = nullptr;
   bool SkipPass = false;
 
   // Data
-  std::map <std::string, std::string> CallSiteDebugLocVirtual;
-  std::map <std::string, std::string> CallSiteDebugLocStatic;
-
-  std::map <std::string, std::pair<uint64_t , uint64_t>> CallSiteRange;
-  std::map <std::string, uint64_t> CallSiteID;
+  SDCallSiteTables OwnTables;
+  const SDCallSiteTables *Tables = nullptr;
 
   // Functions
-  int loadVirtualCallSiteData();
-  int loadStaticCallSiteData();
-
   bool processVirtualCallSite(std::string &DebugLocString,
                               MachineInstr &MI,
                               MachineBasicBlock &MBB,
@@ -85,17 +130,8 @@ private:
   std::string debugLocToString(const DebugLoc &Log);
 
   // Analysis
-  std::vector<uint64_t> RangeWidths;
-  std::map <uint64_t, int> IDCount;
-
-  int NumberOfVirtual;
-  int NumberOfStaticDirect;
-  int NumberOfIndirect;
-  int NumberOfTail;
-  int NumberOfUnknown;
-
-  void analyse(const Module *M);
+  SDCallSiteStats Stats;
 };
 }
 
-#endif //LLVM_SAFEDISPATCHMACHINEFUNCION_H
\ No newline at end of file
+#endif //LLVM_SAFEDISPATCHMACHINEFUNCION_H
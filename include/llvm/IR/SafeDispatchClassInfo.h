@@ -0,0 +1,97 @@
+#ifndef LLVM_IR_SAFEDISPATCHCLASSINFO_H
+#define LLVM_IR_SAFEDISPATCHCLASSINFO_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <string>
+
+/**
+ * Compact encoding of the sd.class_info records.
+ *
+ * Instead of one MDTuple per sub-vtable with a ConstantAsMetadata for every
+ * number, the frontend emits a single tuple per class:
+ *
+ *   { MDString blob, parent vtable GV md ... }
+ *
+ * The blob starts with SD_CLASSINFO_MAGIC followed by the number of sub-vtables
+ * and, for each sub-vtable, order, start, end, address point, the parents as
+ * (name hash, order) and the functions as (name hash, offset). Numbers are
+ * LEB128 varints, name hashes are 64-bit FNV-1a in little endian order. The
+ * names themselves are stored once per TU in the SD_MD_STRTAB named md. The
+ * parent GV md operands follow the order in which the parents appear in the
+ * blob, they are needed to rename the parents after linking.
+ */
+#define SD_CLASSINFO_MAGIC "SDv1"
+
+/**
+ * hash used for the empty parent name of a root sub-vtable
+ */
+#define SD_CLASSINFO_NO_PARENT 0
+
+static inline uint64_t sd_hashName(llvm::StringRef name) {
+  if (name.empty())
+    return SD_CLASSINFO_NO_PARENT;
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static inline void sd_encodeNumber(std::string &blob, uint64_t val) {
+  do {
+    unsigned char byte = val & 0x7f;
+    val >>= 7;
+    if (val != 0)
+      byte |= 0x80;
+    blob.push_back(byte);
+  } while (val != 0);
+}
+
+static inline void sd_encodeHash(std::string &blob, uint64_t hash) {
+  for (unsigned i = 0; i < 8; i++)
+    blob.push_back((hash >> (i * 8)) & 0xff);
+}
+
+static inline uint64_t sd_decodeNumber(llvm::StringRef blob, size_t &pos) {
+  uint64_t val = 0;
+  unsigned shift = 0;
+  unsigned char byte;
+  do {
+    if (pos >= blob.size())
+      llvm::report_fatal_error("SD: truncated class info record");
+    byte = blob[pos++];
+    val |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return val;
+}
+
+static inline uint64_t sd_decodeHash(llvm::StringRef blob, size_t &pos) {
+  if (pos + 8 > blob.size())
+    llvm::report_fatal_error("SD: truncated class info record");
+  uint64_t hash = 0;
+  for (unsigned i = 0; i < 8; i++)
+    hash |= (uint64_t)(unsigned char)blob[pos++] << (i * 8);
+  return hash;
+}
+
+/**
+ * Returns the blob if the given node is a compact class info record
+ */
+static inline llvm::MDString* sd_getCompactClassInfo(const llvm::MDNode *node) {
+  if (!node || node->getNumOperands() == 0)
+    return nullptr;
+
+  llvm::MDString *blob = llvm::dyn_cast_or_null<llvm::MDString>(node->getOperand(0).get());
+  if (!blob || !blob->getString().startswith(SD_CLASSINFO_MAGIC))
+    return nullptr;
+  return blob;
+}
+
+#endif
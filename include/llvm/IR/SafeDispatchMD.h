@@ -1,5 +1,5 @@
-#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_MD_H
-#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_MD_H
+#ifndef LLVM_IR_SAFEDISPATCH_MD_H
+#define LLVM_IR_SAFEDISPATCH_MD_H
 
 #include "llvm/IR/Metadata.h"
 
@@ -8,6 +8,28 @@
  */
 #define SD_DYNCAST_FUNC_NAME "__ivtbl_dynamic_cast"
 
+/**
+ * variant of the above reading 32-bit relative vtable entries
+ */
+#define SD_DYNCAST_REL_FUNC_NAME "__ivtbl_rel_dynamic_cast"
+
+/**
+ * cross-DSO return check runtime, see libdlcfi. Referenced weakly, the checks
+ * work without it.
+ */
+#define SD_RT_PREFIX              "__sd_"
+#define SD_RT_RETURN_EXTERNAL     "__sd_return_external"
+#define SD_RT_REGISTER_RETURN_IDS "__sd_register_return_ids"
+
+/**
+ * words SDMachineFunction puts into the NOPs after a checked call site: the
+ * call-site ID (or the start and width of the ID range) tagged with
+ * SD_RETURN_ID_TAG, or one of the magic words of the unchecked call sites
+ */
+#define SD_RETURN_ID_TAG      0x80000
+#define SD_RETURN_UNKNOWN_ID  0xFFFFF
+#define SD_RETURN_TAIL_ID     0xFFFFE
+
 /**
  * metadata names used for the SafeDispatch project.
  * This meta data names are added to the new metadata
@@ -27,6 +49,23 @@
  */
 #define SD_MD_CLASSINFO  "sd.class_info."
 
+/**
+ * named md holding the names referenced by hash from the class info records
+ */
+#define SD_MD_STRTAB     "sd.strtab"
+
+/**
+ * named md holding the cache key computed by the thin link, the thin backends
+ * use it to find the global layout table, see llvm-sd-thin
+ */
+#define SD_MD_THIN_KEY   "sd.thin.key"
+
+/**
+ * version of the on-disk formats of the SD analysis cache and of the object
+ * cache of the gold plugin, part of both keys; bump it when a format changes
+ */
+#define SD_CACHE_FORMAT_VERSION "1"
+
 #define SD_MD_FUNCINFO_VIRTUAL  "sd.func_info.virtual."
 #define SD_MD_FUNCINFO_NORMAL  "sd.func_info.normal."
 #define SD_MD_FUNCINFO_BLACKLIST  "sd.func_info.blacklist."
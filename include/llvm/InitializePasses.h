@@ -308,6 +308,9 @@ void initializeSDFixPass(PassRegistry&);
 //this pass is used to collect the v tables 
 void initializeSDBuildCHAPass(PassRegistry&);
 
+//this pass is used to remove virtual functions that are never called
+void initializeSDDeadVirtualsPass(PassRegistry&);
+
 //this pass is used to build the new v table layout
 void initializeSDLayoutBuilderPass(PassRegistry&);
 
@@ -329,6 +332,9 @@ void initializeSDReturnAddressPass(PassRegistry&);
 //this pass is used to create the return address ranges
 void initializeSDReturnRangePass(PassRegistry&);
 
+//this analysis indexes the call sites and returns for the return passes
+void initializeSDCallSiteIndexPass(PassRegistry&);
+
 void initializeSDReturnChecksPass(PassRegistry&);
 
 void initializeSDMachineFunctionPass(PassRegistry&);
@@ -81,6 +81,16 @@ struct LTOCodeGenerator {
 
   void setShouldInternalize(bool Value) { ShouldInternalize = Value; }
 
+  // SafeDispatch hardening of the merged module, see PassManagerBuilder. The
+  // -sd-* options enable the same passes for libLTO clients.
+  void setSDEmitIVTBLs(bool Value) { SDEmitIVTBLs = Value; }
+  void setSDEmitOVTBLs(bool Value) { SDEmitOVTBLs = Value; }
+  void setSDEmitReturnChecks(bool Value) { SDEmitReturnChecks = Value; }
+  void setSDRelativeVTBLs(bool Value) { SDRelativeVTBLs = Value; }
+  void setSDRemoveDeadVirtuals(bool Value) { SDRemoveDeadVirtuals = Value; }
+  void setSDTrimRTTISlots(bool Value) { SDTrimRTTISlots = Value; }
+  void setSDCacheDir(const char *Dir) { SDCacheDir = Dir; }
+
   void addMustPreserveSymbol(const char *sym) { MustPreserveSymbols[sym] = 1; }
 
   // To pass options to the driver and optimization passes. These options are
@@ -133,6 +143,13 @@ struct LTOCodeGenerator {
   // if the compilation was not successful.
   const void *compileOptimized(size_t *length, std::string &errMsg);
 
+  // Compiles the merged optimized module into one object file per stream in
+  // Out. With more than one stream the module is split and the objects are
+  // generated in parallel, see llvm::splitCodeGen. Returns true on success,
+  // an empty Out is an error.
+  bool compileOptimized(ArrayRef<raw_pwrite_stream *> Out,
+                        std::string &errMsg);
+
   void setDiagnosticHandler(lto_diagnostic_handler_t, void *);
 
   LLVMContext &getContext() { return Context; }
@@ -177,6 +194,13 @@ private:
   void *DiagContext;
   LTOModule *OwnedModule;
   bool ShouldInternalize;
+  bool SDEmitIVTBLs;
+  bool SDEmitOVTBLs;
+  bool SDEmitReturnChecks;
+  bool SDRelativeVTBLs;
+  bool SDRemoveDeadVirtuals;
+  bool SDTrimRTTISlots;
+  std::string SDCacheDir;
 };
 }
 #endif
@@ -189,6 +189,7 @@ namespace {
       used to link all passes*/
       (void) llvm::createSDFixPass();
       (void) llvm::createSDBuildCHAPass();
+      (void) llvm::createSDDeadVirtualsPass();
       (void) llvm::createSDLayoutBuilderPass();
       (void) llvm::createSDUpdateIndicesPass();
       (void) llvm::createSDCleanupPass();
@@ -197,6 +198,7 @@ namespace {
       (void) llvm::createSDReturnAddressPass();
       (void) llvm::createSDReturnRangePass();
       (void) llvm::createSDReturnChecksPass();
+      (void) llvm::createSDCallSiteIndexPass();
     }
   } ForcePassLinking; // Force link by creating a global definition.
 }
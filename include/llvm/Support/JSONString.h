@@ -0,0 +1,25 @@
+//===- JSONString.h - Write quoted JSON strings -----------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_SUPPORT_JSONSTRING_H
+#define LLVM_SUPPORT_JSONSTRING_H
+
+#include "llvm/ADT/StringRef.h"
+
+namespace llvm {
+
+class raw_ostream;
+
+/// Writes Str to OS as a quoted JSON string, escaping the quotes, the
+/// backslashes and the control characters.
+void writeJSONString(raw_ostream &OS, StringRef Str);
+
+} // end namespace llvm
+
+#endif
@@ -208,8 +208,11 @@ this are the safedispatch passes*/
 
 // safedispatch additions
 ModulePass* createSDFixPass();
-ModulePass* createSDBuildCHAPass();
-ModulePass* createSDLayoutBuilderPass(bool interleave = false);
+ModulePass* createSDBuildCHAPass(const char *cacheDir = "", bool cacheRequired = false);
+ModulePass* createSDDeadVirtualsPass();
+ModulePass* createSDLayoutBuilderPass(bool interleave = false,
+                                      bool relative = false,
+                                      bool trimRTTI = false);
 ModulePass* createSDUpdateIndicesPass();
 ModulePass* createSDCleanupPass();
 ModulePass* createSDMoveBasicBlocksPass();
@@ -217,6 +220,7 @@ ModulePass* createSDSubstModulePass();
 ModulePass* createSDReturnRangePass();
 ModulePass* createSDReturnAddressPass();
 ModulePass* createSDReturnChecksPass();
+ModulePass* createSDCallSiteIndexPass();
 
 } // End llvm namespace
 
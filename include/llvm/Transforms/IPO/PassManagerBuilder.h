@@ -15,6 +15,7 @@
 #ifndef LLVM_TRANSFORMS_IPO_PASSMANAGERBUILDER_H
 #define LLVM_TRANSFORMS_IPO_PASSMANAGERBUILDER_H
 
+#include <string>
 #include <vector>
 
 namespace llvm {
@@ -124,6 +125,10 @@ public:
   bool EmitIVTBLs; //Paul: flag variable used for interleaving the v tables
   bool EmitOVTBLs; //Paul: flag variable used for ordering the v tables
   bool EmitReturnChecks; //Matt: flag variable used for backward edge checks
+  bool EmitRelVTBLs; //flag variable used for 32-bit relative v table entries
+  bool RemoveDeadVirtuals; //flag variable used for dead virtual function elimination
+  bool TrimRTTISlots; //flag variable used for dropping unused offset-to-top and rtti slots
+  std::string SDCacheDir; //directory of the on-disk SD analysis cache, empty if disabled
 
 private:
   /// ExtensionList - This is list of all of the extensions that are registered.
@@ -154,6 +159,11 @@ public:
   /// populateModulePassManager - This sets up the primary pass manager.
   void populateModulePassManager(legacy::PassManagerBase &MPM);
   void populateLTOPassManager(legacy::PassManagerBase &PM);
+
+  /// populateSDThinPassManager - The SafeDispatch passes of the thin link on
+  /// the index (Backend = false) or of a thin backend on one TU that imported
+  /// the index (Backend = true), see llvm-sd-thin.
+  void populateSDThinPassManager(legacy::PassManagerBase &PM, bool Backend);
 };
 
 /// Registers a function for adding a standard set of passes.  This should be
@@ -1,5 +1,6 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/SafeDispatch.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/InstIterator.h"
@@ -59,6 +60,7 @@ namespace llvm {
     typedef std::map<vtbl_name_t, std::vector<vtbl_name_t>> subvtbl_map_t;  //Paul: map of v table name -> vector of vt names
     typedef std::map<vtbl_name_t, ConstantArray*>           oldvtbl_map_t;  //Paul: map of v table name -> ConstantArray
     typedef std::map<vtbl_name_t, std::vector<vtbl_set_t> > parent_map_t;   //Paul: map of v table name -> vector of vt sets of names
+    typedef std::map<uint64_t, std::string>                 strtab_t;       // name hash -> name, see SafeDispatchClassInfo.h
 
     typedef std::string                                     func_name_t;
     typedef std::pair<func_name_t, vtbl_name_t>             func_and_class_t;
@@ -102,6 +104,9 @@ namespace llvm {
     oldvtbl_map_t oldVTables;                          // vtbl -> &[vtable element]
     std::map<vtbl_t, uint32_t> cloudSizeMap;           // vtbl -> # vtables derived from (vtbl,0), holds the range width for each v table 
     std::set<vtbl_name_t> undefinedVTables;            // contains dynamic classes that don't have vtables defined
+    std::set<vtbl_name_t> quarantinedVTables;          // classes of the clouds that reference vtables without class info
+    cloud_map_t quarantineCloudMap;                    // cloudMap of the quarantined classes
+    addrpt_map_t quarantineAddrPtMap;                  // addrPtMap of the quarantined classes
 
     vtbl_function_map_t vTableFunctionMap;
     function_map_t functionMap;
@@ -111,6 +116,11 @@ namespace llvm {
     uint64_t  currentID;
 
     std::map<func_name_t, func_name_t> functionParentMap;
+
+    std::string cacheDir;                              // directory of the on-disk analysis cache, empty if disabled
+    std::string cacheKey;                              // hash of the sd.class_info metadata and the vtables it describes
+    bool cacheRequired;                                // thin backends must find the results of the thin link
+    bool cacheDirCreated;                              // the cache directory exists
     
     /**
      * These functions and variables used to deal with duplication
@@ -155,6 +165,12 @@ namespace llvm {
      * Reads the NamedMDNodes in the given module and creates the class hierarchy
      */
     void buildClouds(Module &M);
+    /**
+     * Take the clouds connected to a vtable without class info out of the
+     * hierarchy. They keep their original layout and are checked against
+     * their address points, the remaining clouds are interleaved as usual.
+     */
+    void quarantineClouds(const vtbl_set_t &unknownVtables);
     /**
      * Recursive function that calculates the number of deriving (primitive) sub-vtables of each
      * (primitive) vtable
@@ -177,18 +193,40 @@ namespace llvm {
     */
     void printClouds(const std::string &suffix);
 
+    /**
+     * Read the per-TU string tables the compact class info records refer to
+     */
+    static strtab_t buildStringTable(Module &M);
+
     /**
      * Extract the vtable info from the metadata and put it into a struct
      */
-    std::vector<nmd_t> static extractMetadata(NamedMDNode* md);
+    std::vector<nmd_t> static extractMetadata(NamedMDNode* md, const strtab_t &strtab);
+
+    /**
+     * Decode a compact class info record into the sub-vtables of info
+     */
+    static void decodeClassInfo(const MDNode* record, const strtab_t &strtab, nmd_t &info);
 
     range_t buildFunctionInfoForFunction(FunctionEntry &function, std::string rootFunctionName);
 
+    bool loadFunctionInfo();
+    void storeFunctionInfo();
+
     void topoSortHelper(vtbl_name_t node, std::deque<vtbl_name_t> &ordered,
                         std::set<vtbl_name_t> &visited, std::set<vtbl_name_t> &tempMarked);
 
   public:
-    SDBuildCHA() : ModulePass(ID) {
+    /**
+     * Hash all sd.class_info metadata together with the contents of the vtables
+     * it describes, the results of every SD analysis are a function of it.
+     * A module carrying SD_MD_THIN_KEY uses the key of the thin link instead.
+     */
+    static std::string computeCacheKey(Module &M);
+
+    SDBuildCHA(const char *cacheDirectory = "", bool requireCache = false) :
+      ModulePass(ID), cacheDir(cacheDirectory), cacheRequired(requireCache),
+      cacheDirCreated(false) {
       std::cerr << "\nCreating SDBuildCHA pass!\n";
       currentID = -1;
       initializeSDBuildCHAPass(*PassRegistry::getPassRegistry());
@@ -218,9 +256,13 @@ namespace llvm {
       The executed code resides than in the corresponding .cpp file
       */
       sd_print("\nP2. Started building CHA ...\n");
+      sdTrace::Scope Trace("SDBuildCHA");
 
       vcallMDId = M.getMDKindID(SD_MD_VCALL);
 
+      if (hasCache())
+        cacheKey = computeCacheKey(M);
+
       //Paul: builds the class hierachy
       buildClouds(M);
       std::cerr << "Finished building clouds.\n";
@@ -244,6 +286,10 @@ namespace llvm {
         std::cerr << i << "\n";
       }
 
+      Trace.count("clouds", roots.size());
+      Trace.count("undefined_vtables", undefinedVTables.size());
+      Trace.count("quarantined_classes", quarantinedVTables.size());
+
       sd_print("\nP2. Finished building CHA ...\n");
 
       return roots.size() > 0;
@@ -262,6 +308,14 @@ namespace llvm {
 
     void clearAnalysisResults();
 
+    /**
+     * Called by the pass manager once the last pass requiring the CHA has
+     * run, the maps are the largest SD allocation of a big link.
+     */
+    void releaseMemory() override {
+      clearAnalysisResults();
+    }
+
     /**
      * Calculates the order of the primitive vtable in which
      * the given the index relative to the beginning of the vtable lays.
@@ -311,6 +365,20 @@ namespace llvm {
       return !isUndefined(vtbl); //Paul: notice this calls the above method 
     }
 
+    /*
+     * Quarantined classes are unknown to the other accessors
+     */
+    bool isQuarantined(const vtbl_name_t &vtbl) {
+      return quarantinedVTables.find(vtbl) != quarantinedVTables.end();
+    }
+
+    /**
+     * The original (vtable, address point) pairs a vptr to the given
+     * quarantined vtable may hold. False if part of its cloud has no class
+     * info, the vptr cannot be checked then.
+     */
+    bool getQuarantinedAddrPts(const vtbl_t &vtbl, order_t &addrPts);
+
     /*
      * Ancestor Map Accessors
      */
@@ -333,6 +401,10 @@ namespace llvm {
       return oldVTables[vtbl];
     }
 
+    void setOldVTable(const vtbl_name_t &vtbl, ConstantArray *arr) {
+      oldVTables[vtbl] = arr;
+    }
+
     oldvtbl_map_t::const_iterator oldVTables_begin() {
       return oldVTables.cbegin();
     }
@@ -416,6 +488,11 @@ namespace llvm {
      * the vtable pointer must lie in.
      */
     int64_t getCloudSize(const vtbl_name_t& vtbl);
+
+    /**
+     * Same for the cloud of a (potentially non-primary) vtable, 0 if unknown.
+     */
+    int64_t getCloudSize(const vtbl_t& vtbl);
     
     /**
      * Get the start of the valid range for vptrs for a (potentially non-primary) vtable.
@@ -442,6 +519,36 @@ namespace llvm {
 
     void buildFunctionInfo();
 
+    bool hasFunctionInfo() {
+      return currentID != (uint64_t) -1;
+    }
+
+    /*
+     * On-disk cache of the analysis results, keyed by the class hierarchy
+     */
+    bool hasCache() {
+      return !cacheDir.empty();
+    }
+
+    // the results must come from the cache, see llvm-sd-thin
+    bool isCacheRequired() {
+      return cacheRequired;
+    }
+
+    const std::string &getCacheKey() {
+      return cacheKey;
+    }
+
+    // the tag names the analysis and encodes the options its result depends on
+    std::string getCachePath(const std::string &tag) {
+      return cacheDir + "/sd-" + cacheKey + "-" + tag + ".cache";
+    }
+
+    // concurrent links may share the cache, files are written to a temporary
+    // and renamed once complete
+    std::string getCacheTmpPath(const std::string &tag);
+    bool commitCacheFile(const std::string &tmpPath, const std::string &tag);
+
     std::deque<vtbl_name_t> topoSort();
 
     std::vector<uint64_t> getFunctionID(std::string functionName) {
@@ -483,6 +590,22 @@ namespace llvm {
       return vTableFunctionMap[v];
     }
 
+    vtbl_function_map_t::const_iterator functionEntries_begin() {
+      return vTableFunctionMap.cbegin();
+    }
+
+    vtbl_function_map_t::const_iterator functionEntries_end() {
+      return vTableFunctionMap.cend();
+    }
+
+    // IDs start at 1, 0 means the entry was not numbered
+    uint64_t getFunctionEntryID(const FunctionEntry &entry) {
+      auto entryID = functionIDMap.find(entry);
+      if (entryID == functionIDMap.end())
+        return 0;
+      return entryID->second;
+    }
+
     uint64_t getMaxID() {
       assert(currentID != -1 && "buildFunctionInfo was not executed first!");
       return currentID;
@@ -0,0 +1,121 @@
+//===-- llvm/Transforms/IPO/SafeDispatchCallSiteIndex.h --------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains an analysis for the SafeDispatch backward edge protection.
+// It walks the module once and records the call sites and returns of every
+// function, so that the return passes do not have to scan the module again.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_SAFEDISPATCHCALLSITEINDEX_H
+#define LLVM_SAFEDISPATCHCALLSITEINDEX_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+
+#include <vector>
+
+namespace llvm {
+
+/**
+ * Index of the call sites and returns of a module, stored in flat arrays. The
+ * entries of a function are contiguous and in instruction order.
+ */
+class SDCallSiteIndex : public ModulePass {
+public:
+  static char ID;
+
+  struct CallSiteInfo {
+    /// The CallInst or InvokeInst.
+    Instruction *Call;
+
+    /// The called function, nullptr for indirect calls.
+    Function *Callee;
+
+    /// The sd_get_checked_vptr call that produced the vptr of a virtual call,
+    /// nullptr for all other calls.
+    CallInst *CheckedVptr;
+  };
+
+  struct FunctionInfo {
+    Function *F;
+    unsigned FirstCallSite;
+    unsigned NumCallSites;
+    unsigned FirstReturn;
+    unsigned NumReturns;
+  };
+
+  SDCallSiteIndex() : ModulePass(ID) {
+    initializeSDCallSiteIndexPass(*PassRegistry::getPassRegistry());
+  }
+
+  bool runOnModule(Module &M) override;
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+  }
+
+  void releaseMemory() override {
+    Functions.clear();
+    CallSites.clear();
+    Returns.clear();
+    FunctionIndex.clear();
+    NumVirtualCallSites = 0;
+  }
+
+  ArrayRef<FunctionInfo> getFunctions() const {
+    return Functions;
+  }
+
+  ArrayRef<CallSiteInfo> getCallSites() const {
+    return CallSites;
+  }
+
+  ArrayRef<CallSiteInfo> getCallSites(const FunctionInfo &Info) const {
+    return ArrayRef<CallSiteInfo>(CallSites).slice(Info.FirstCallSite, Info.NumCallSites);
+  }
+
+  ArrayRef<ReturnInst *> getReturns(const FunctionInfo &Info) const {
+    return ArrayRef<ReturnInst *>(Returns).slice(Info.FirstReturn, Info.NumReturns);
+  }
+
+  /// Returns nullptr for functions created after the index was built.
+  const FunctionInfo *lookup(const Function &F) const {
+    auto Itr = FunctionIndex.find(&F);
+    return Itr == FunctionIndex.end() ? nullptr : &Functions[Itr->second];
+  }
+
+  ArrayRef<ReturnInst *> getReturns(const Function &F) const {
+    const FunctionInfo *Info = lookup(F);
+    return Info ? getReturns(*Info) : ArrayRef<ReturnInst *>();
+  }
+
+  unsigned getNumVirtualCallSites() const {
+    return NumVirtualCallSites;
+  }
+
+private:
+  std::vector<FunctionInfo> Functions;
+  std::vector<CallSiteInfo> CallSites;
+  std::vector<ReturnInst *> Returns;
+  DenseMap<const Function *, unsigned> FunctionIndex;
+  unsigned NumVirtualCallSites = 0;
+
+  void indexFunction(Function &F, DenseMap<const Instruction *, unsigned> &CallSiteMap);
+
+  /// Attach the sd_get_checked_vptr calls to the virtual calls using their vptr.
+  void linkVirtualCallSites(Module &M, const DenseMap<const Instruction *, unsigned> &CallSiteMap);
+};
+
+} // End llvm namespace
+
+#endif //LLVM_SAFEDISPATCHCALLSITEINDEX_H
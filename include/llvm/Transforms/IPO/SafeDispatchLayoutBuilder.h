@@ -1,6 +1,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/SafeDispatch.h"
 #include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/InstIterator.h"
@@ -25,6 +26,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <tuple>
 #include <math.h>
 #include <algorithm>
 
@@ -75,9 +77,16 @@ namespace llvm {
     mem_range_map_t memRangeMap;                            // this is the memory range map for each of the nodes in a cloud
     pad_map_t prePadMap;
     bool interleave;                                        // this is a flag used to decide if we interleave or order the cloud 
-
-    SDLayoutBuilder(bool interl = false) : ModulePass(ID), interleave(interl) {
-      std::cerr << "SDLayoutBuilder(" << interl << ")\n";
+    bool relative;                                          // emit 32-bit pc-relative vtable entries where possible
+    std::set<vtbl_name_t> relativeClouds;                   // roots of the clouds using the relative encoding
+    bool trim;                                              // drop offset-to-top and rtti slots where unused
+    std::set<vtbl_name_t> trimmedClouds;                    // roots of the clouds without offset-to-top and rtti
+
+    SDLayoutBuilder(bool interl = false, bool rel = false, bool trm = false) :
+      ModulePass(ID), interleave(interl), relative(rel), trim(trm),
+      relBytesSaved(0), relRelocsRemoved(0), trimBytesSaved(0),
+      thunksRequested(0), thunkInstsBefore(0), thunkInstsAfter(0) {
+      std::cerr << "SDLayoutBuilder(" << interl << "," << rel << "," << trm << ")\n";
       initializeSDLayoutBuilderPass(*PassRegistry::getPassRegistry());
       dummyVtable = vtbl_t("DUMMY_VTBL", 0); //this v tables are used during padding 
     }
@@ -86,6 +95,7 @@ namespace llvm {
 
     bool runOnModule(Module &M) {
       sd_print("\nP3. Started building layout ...\n");
+      sdTrace::Scope Trace("SDLayoutBuilder");
 
       /**Paul:
       first, pass the results from the CHA pass
@@ -136,6 +146,13 @@ namespace llvm {
     /*Paul:
     clear the analysis results after we are done with building the new layouts*/
     virtual void clearAnalysisResults();
+
+    /*
+    the new layouts only live in the metadata once SDUpdateIndices has run*/
+    void releaseMemory() override {
+      if (cha)
+        clearAnalysisResults();
+    }
    
 
     virtual int64_t translateVtblInd(vtbl_t vtbl, int64_t offset, bool isRelative);
@@ -149,6 +166,40 @@ namespace llvm {
 
     bool hasMemRange(const vtbl_t& vtbl);
     const std::vector<mem_range_t> &getMemRange(const vtbl_t& vtbl);
+
+    /**
+     * True if the cloud of the given vtable uses 32-bit pc-relative entries.
+     */
+    bool isRelative(const vtbl_t& vtbl);
+
+    /**
+     * Size in bytes of one entry of the new vtable of the given cloud root.
+     */
+    uint64_t entryWidth(const vtbl_name_t& root);
+
+    /**
+     * Rewrite the loads through slotPtr (a GEP computing a vtable slot address)
+     * to decode the relative entry found byteOff bytes from the GEP base.
+     * Returns false if a user of the slot could not be rewritten.
+     */
+    bool rewriteRelativeSlot(Instruction* slotPtr, int64_t byteOff);
+
+    /**
+     * True if rewriteRelativeSlot can rewrite every user of slotPtr.
+     */
+    static bool canRewriteRelativeSlot(User* slotPtr);
+
+    /**
+     * True if user scales a vtable index to a byte offset, (vbase offsets,
+     * arguments of __ivtbl_dynamic_cast).
+     */
+    static bool isScaledIndex(User* user, const DataLayout& DL);
+
+    /**
+     * True if all the users of a sd_get_vtbl_index call can be rewritten for a
+     * relative vtable, see SDUpdateIndices::handleRelativeIndexUses.
+     */
+    static bool canRewriteRelativeIndex(CallInst* CI, const DataLayout& DL);
   
   private:
     /**
@@ -215,6 +266,51 @@ namespace llvm {
      */
     void fillVtablePart(interleaving_list_t& part, const order_t& order, bool positiveOff);
 
+    /**
+     * Relative vtables: every element of the cloud must be expressible as a
+     * 32-bit offset from its slot, i.e. point to something defined in this module,
+     * and every read of a slot must be rewritable to decode it.
+     */
+    bool canUseRelativeLayout(Module& M, const vtbl_name_t& root,
+                              const std::set<vtbl_name_t>& absoluteClouds);
+
+    /**
+     * Internal stub forwarding to an external function, so that the relative
+     * entry does not need a dynamic relocation.
+     */
+    Function* getRelativeStub(Module& M, Function* F);
+
+    /**
+     * Encode a vtable element as the offset from the given slot.
+     */
+    Constant* relativeEntry(Module& M, Constant* elem, Constant* slot);
+
+    uint64_t relBytesSaved;                                 // statistics for the relative encoding
+    uint64_t relRelocsRemoved;
+
+    /**
+     * A cloud can drop the offset-to-top and rtti slots of all of its vtables if no
+     * typeid or dynamic_cast reads them through a class of the cloud. All of its
+     * vtables have to be defined here and invisible to other DSOs, whose code
+     * (e.g. the runtime for a class derived from std::locale::facet) reads them.
+     */
+    bool canTrimRTTISlots(Module& M, const vtbl_name_t& root, const std::set<vtbl_name_t>& rttiClouds);
+
+    /**
+     * True if the old vtable element at index pos is a dropped offset-to-top or rtti slot.
+     */
+    bool isTrimmedSlot(const vtbl_t& vtbl, int64_t pos);
+
+    uint64_t trimBytesSaved;                                // statistics for the trimmed slots
+
+    /**
+     * On-disk cache of the interleavings, paddings, alignments and vptr ranges.
+     * The tag encodes the layout options and the per cloud encoding decisions.
+     */
+    std::string layoutCacheTag();
+    bool loadLayoutCache();
+    void storeLayoutCache();
+
     /**
      * These functions and variables used to deal with duplication
      * of the vthunks in the vtables
@@ -222,6 +318,14 @@ namespace llvm {
     unsigned vcallMDId;
     std::set<Function*> vthunksToRemove;
 
+    // original thunk, entry width, relative encoding and its new vcall offsets -> shared clone
+    typedef std::tuple<Function*, uint64_t, bool, std::vector<int64_t> > vthunk_key_t;
+    std::map<vthunk_key_t, Function*> vthunkCloneMap;
+    std::map<std::string, Function*> vthunkMap;            // NEW_VTHUNK_NAME -> clone used in the new vtables
+    uint64_t thunksRequested;
+    uint64_t thunkInstsBefore;
+    uint64_t thunkInstsAfter;
+
     void createThunkFunctions(Module&, const vtbl_name_t& rootName);
     Function* getVthunkFunction(Constant* vtblElement);
     
@@ -232,7 +336,7 @@ namespace llvm {
      results will be passed to SDLayoutBuilder pass after
      CHA has finisched inside *char variable.
     */
-    SDBuildCHA *cha; 
+    SDBuildCHA *cha = nullptr; 
   };
 
 }
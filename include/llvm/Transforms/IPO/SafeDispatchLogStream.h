@@ -9,12 +9,19 @@ namespace sdLog {
 
 typedef llvm::raw_string_ostream stream_t;
 
+// llvm::nulls() is buffered and shared, the backend pass can run on several
+// code generation threads at once
+static inline llvm::raw_ostream &quiet() {
+  static thread_local llvm::raw_null_ostream S;
+  return S;
+}
+
 static inline llvm::raw_ostream &log() {
 #ifdef SD_STREAM_DEBUG
   llvm::errs() << "SD] ";
   return llvm::errs();
 #else
-  return llvm::nulls();
+  return quiet();
 #endif
 }
 
@@ -23,7 +30,7 @@ static inline llvm::raw_ostream &stream() {
   llvm::errs() << "SD] ";
   return llvm::errs();
 #else
-  return llvm::nulls();
+  return quiet();
 #endif
 }
 
@@ -32,7 +39,7 @@ static inline llvm::raw_ostream &warn() {
   llvm::errs() << "SD WARNING] ";
   return llvm::errs();
 #else
-  return llvm::nulls();
+  return quiet();
 #endif
 }
 
@@ -45,7 +52,7 @@ static inline llvm::raw_ostream &logNoToken() {
 #ifdef SD_STREAM_DEBUG
   return llvm::errs();
 #else
-  return llvm::nulls();
+  return quiet();
 #endif
 }
 
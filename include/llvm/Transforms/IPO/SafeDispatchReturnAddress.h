@@ -18,6 +18,7 @@
 
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 #include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 
 namespace llvm {
 
@@ -40,6 +41,7 @@ public:
   bool runOnModule(Module &M) override {
     sdLog::blankLine();
     sdLog::stream() << "P7b. Started running the SDReturnAddress pass ..." << sdLog::newLine << "\n";
+    sdTrace::Scope Trace("SDReturnAddress");
 
     // get analysis results
     CHA = &getAnalysis<SDBuildCHA>();
@@ -50,9 +52,12 @@ public:
 
     sdLog::stream() << "Start ID for static functions: " << functionID << "\n";
 
+    uint64_t firstStaticID = functionID;
     for (auto &F : M) {
       processFunction(F);
     }
+    Trace.count("virtual_ids", firstStaticID);
+    Trace.count("static_ids", functionID - firstStaticID);
 
     sdLog::stream() << sdLog::newLine << "P7b. Finished running the SDReturnAddress pass ..." << "\n";
     sdLog::blankLine();
@@ -69,10 +74,14 @@ public:
     return &Encoder;
   }
 
-  const std::map<std::string, uint64_t> getFunctionIDMap() const {
+  const std::map<std::string, uint64_t> &getFunctionIDMap() const {
     return FunctionIDMap;
   }
 
+  void releaseMemory() override {
+    FunctionIDMap.clear();
+  }
+
 private:
   SDBuildCHA *CHA = nullptr;
   SDEncoder Encoder;
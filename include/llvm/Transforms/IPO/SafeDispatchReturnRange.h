@@ -18,6 +18,7 @@
 
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Transforms/IPO/SDEncode.h"
+#include "llvm/Transforms/IPO/SafeDispatchCallSiteIndex.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
 #include "llvm/Transforms/IPO/SafeDispatchReturnAddress.h"
 
@@ -42,13 +43,24 @@ public:
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<SDBuildCHA>();
     AU.addRequired<SDReturnAddress>();
+    AU.addRequired<SDCallSiteIndex>();
     AU.addPreserved<SDBuildCHA>();
+    AU.addPreserved<SDCallSiteIndex>();
+  }
+
+  /// The call sites are stored in the module by storeCallSites.
+  void releaseMemory() override {
+    FunctionIDMap = nullptr;
+    CallSiteDebugLocsVirtual.clear();
+    CallSiteDebugLocsStatic.clear();
+    IsVirtualCallSite.clear();
   }
 
 private:
   SDBuildCHA *CHA = nullptr;
   SDEncoder *Encoder = nullptr;
-  std::map<std::string, uint64_t> FunctionIDMap{};
+  SDCallSiteIndex *Index = nullptr;
+  const std::map<std::string, uint64_t> *FunctionIDMap = nullptr;
 
   /// Information about the virtual CallSites that are being found by this pass.
   std::vector<std::string> CallSiteDebugLocsVirtual;
@@ -56,8 +68,8 @@ private:
   /// Information about the static CallSites that are being found by this pass.
   std::vector<std::string> CallSiteDebugLocsStatic;
 
-  /// Set of all virtual CallSites.
-  std::set<CallSite> VirtualCallSites {};
+  /// The virtual CallSites that were added, by position in the index.
+  std::vector<bool> IsVirtualCallSite;
 
   /// Current ID for the DebugLoc hack.
   uint64_t pseudoDebugLoc;
@@ -0,0 +1,66 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_THIN_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_THIN_H
+
+#include "llvm/ADT/StringRef.h"
+
+/**
+ * Module transformations of the thin SafeDispatch mode, see llvm-sd-thin.
+ *
+ * Instead of merging every TU into one module, each TU is reduced to a summary
+ * holding its sd.class_info records, its vtables and the virtual thunks they
+ * point to. The thin link merges the summaries into an index, computes the
+ * layouts once and emits the new vtables into a table object. The per-TU
+ * backends import the index, load the layouts from the SD cache under the key
+ * of the index and rewrite their code against the shared tables.
+ */
+
+namespace llvm {
+
+class Module;
+
+/**
+ * The prefix of the vtables emitted by SDLayoutBuilder
+ */
+#define SD_THIN_TABLE_PREFIX "_SD_ZT"
+
+/**
+ * Make everything the vtables of M refer to linkable from the table object:
+ * local symbols are renamed by module and made hidden, discardable definitions
+ * are kept until the final link. InputHash identifies the contents of the TU,
+ * module identifiers alone are not unique, e.g. for archive members.
+ */
+void sd_thinPromoteLocals(Module &M, StringRef InputHash);
+
+/**
+ * Reduce a prepared TU to its summary: the class info records, the vtables and
+ * the virtual thunks, everything else becomes a declaration.
+ */
+void sd_thinStripToSummary(Module &M);
+
+/**
+ * Turn the definitions of the index into available_externally ones, so that
+ * a TU linked into it keeps its own definitions.
+ */
+void sd_thinImportIndex(Module &M);
+
+/**
+ * Keep only the new vtables and what they need in the table object, the rest
+ * is defined by the TUs.
+ */
+void sd_thinFinalizeTable(Module &M);
+
+/**
+ * Refer to the new vtables of the table object instead of emitting them again.
+ */
+void sd_thinFinalizeBackend(Module &M);
+
+/**
+ * Returns true if name is the name of a vtable emitted by SDLayoutBuilder
+ */
+static inline bool sd_isThinTableName(StringRef name) {
+  return name.startswith(SD_THIN_TABLE_PREFIX);
+}
+
+} // End llvm namespace
+
+#endif
@@ -4,6 +4,7 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
 
 #include <string>
 
@@ -37,5 +38,15 @@ static bool sd_isVtableName(std::string& className) {
 
   return sd_isVtableName_ref(name);
 }
+
+/*
+ * Number of IR instructions of F, used for the code size statistics
+ */
+static uint64_t sd_instCount(const llvm::Function* F) {
+  uint64_t count = 0;
+  for (const llvm::BasicBlock& BB : *F)
+    count += BB.size();
+  return count;
+}
 #endif
 
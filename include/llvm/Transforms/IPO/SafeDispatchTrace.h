@@ -0,0 +1,58 @@
+#ifndef LLVM_TRANSFORMS_IPO_SAFEDISPATCH_TRACE_H
+#define LLVM_TRANSFORMS_IPO_SAFEDISPATCH_TRACE_H
+
+#include "llvm/ADT/StringRef.h"
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Machine readable cost of the SD pipeline: every pass opens a scope that
+ * records its wall time, the growth of the peak RSS and the counters the pass
+ * reports. The scopes of a link are written as one Chrome trace (JSON, load it
+ * in chrome://tracing), see the sd-trace= option of the gold plugin.
+ *
+ * Nothing is recorded before enable() is called.
+ */
+namespace sdTrace {
+
+/// Starts recording, the trace is written to Path by write()
+void enable(llvm::StringRef Path);
+
+bool isEnabled();
+
+/// Adds Value to the counter Name of the innermost scope open on this thread,
+/// counters reported outside of a scope are dropped
+void count(llvm::StringRef Name, int64_t Value);
+
+/// Writes the recorded scopes to a temporary file and renames it to the path
+/// given to enable(), returns false and sets Error if that failed
+bool write(std::string &Error);
+
+/// The high-water mark of the resident set of the process in KB, 0 if unknown
+long getPeakRSS();
+
+class Scope {
+public:
+  explicit Scope(llvm::StringRef Name);
+  ~Scope();
+
+  void count(llvm::StringRef Name, int64_t Value);
+
+private:
+  Scope(const Scope &) = delete;
+  void operator=(const Scope &) = delete;
+
+  std::string Name;
+  bool Active;
+  Scope *Parent;
+  std::chrono::steady_clock::time_point Start;
+  long StartPeakRSS;
+  std::vector<std::pair<std::string, int64_t>> Counters;
+};
+
+}
+
+#endif
@@ -5,17 +5,34 @@
 #include "clang/AST/DeclCXX.h"
 #include "clang/AST/VTableBuilder.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/Timer.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
-#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/IR/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO/SafeDispatchGVMd.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
 
+/**
+ * Adds the given name to the per-TU string table the compact class info
+ * records refer to by hash. Every name is only added once.
+ */
+static void sd_addToStringTable(clang::CodeGen::CodeGenModule *CGM,
+                                const std::string &name)
+{
+  if (name.empty() || !CGM->getSDStringTable().insert(name).second)
+    return;
+
+  llvm::LLVMContext &C = CGM->getLLVMContext();
+  llvm::NamedMDNode *strtab = CGM->getModule().getOrInsertNamedMetadata(SD_MD_STRTAB);
+  strtab->addOperand(llvm::MDNode::get(C, sd_getMDString(C, name)));
+}
+
 namespace
 {
 typedef std::pair<std::string, uint64_t> vtbl_t;
@@ -55,37 +72,34 @@ public:
   {
   }
 
-  //returns the MDNode
-  llvm::MDNode *getMDNode(llvm::Module &M, llvm::LLVMContext &C)
+  //appends the compact encoding of this sub-vtable to the class info blob
+  void encode(clang::CodeGen::CodeGenModule *CGM,
+              std::string &blob,
+              std::vector<llvm::Metadata *> &parentGVs)
   {
-    std::vector<llvm::Metadata *> tuple;
-    std::vector<llvm::Metadata *> parentsTuple;
-    std::vector<llvm::Metadata *> functionsTuple;
+    llvm::Module &M = CGM->getModule();
 
-    parentsTuple.push_back(sd_getMDNumber(C, parents.size()));
+    sd_encodeNumber(blob, order);
+    sd_encodeNumber(blob, start);
+    sd_encodeNumber(blob, end);
+    sd_encodeNumber(blob, addressPoint);
 
+    sd_encodeNumber(blob, parents.size());
     for (auto it : parents)
     {
-      parentsTuple.push_back(sd_getMDString(C, it.first));
-      parentsTuple.push_back(sd_getMDNumber(C, it.second));
-      parentsTuple.push_back(sd_getClassVtblGVMD(it.first, M));
+      sd_addToStringTable(CGM, it.first);
+      sd_encodeHash(blob, sd_hashName(it.first));
+      sd_encodeNumber(blob, it.second);
+      parentGVs.push_back(sd_getClassVtblGVMD(it.first, M));
     }
 
-    functionsTuple.push_back(sd_getMDNumber(C, functions.size()));
-
-    for (auto it : functions) {
-      functionsTuple.push_back(sd_getMDString(C, it.first));
-      functionsTuple.push_back(sd_getMDNumber(C, it.second));
+    sd_encodeNumber(blob, functions.size());
+    for (auto it : functions)
+    {
+      sd_addToStringTable(CGM, it.first);
+      sd_encodeHash(blob, sd_hashName(it.first));
+      sd_encodeNumber(blob, it.second);
     }
-
-    tuple.push_back(sd_getMDNumber(C, order));
-    tuple.push_back(sd_getMDNumber(C, start));
-    tuple.push_back(sd_getMDNumber(C, end));
-    tuple.push_back(sd_getMDNumber(C, addressPoint));
-    tuple.push_back(llvm::MDNode::get(C, parentsTuple));
-    tuple.push_back(llvm::MDNode::get(C, functionsTuple));
-
-    return llvm::MDNode::get(C, tuple);
   }
 
   void dump(std::ostream &out)
@@ -370,16 +384,25 @@ static std::vector<SD_VtableMD> sd_generateSubvtableInfo(clang::CodeGen::CodeGen
  *
  * This function is called during code generation. Before any of our passes starts.
  */
-static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
-                              llvm::GlobalVariable *VTable,
-                              const clang::VTableLayout *VTLayout,
-                              const clang::CXXRecordDecl *RD,
-                              const clang::BaseSubobject *Base = NULL)
+static void sd_insertVtableMDImpl(clang::CodeGen::CodeGenModule *CGM,
+                                  llvm::GlobalVariable *VTable,
+                                  const clang::VTableLayout *VTLayout,
+                                  const clang::CXXRecordDecl *RD,
+                                  const clang::BaseSubobject *Base)
 {
 
   //std::cerr << " CGM: " << CGM << " VTLayout: " << VTLayout << " RD: " << RD << " RD->getQualifiedNameAsString() (class name): " << RD->getQualifiedNameAsString() << "\n";
   assert(CGM && VTLayout && RD);
 
+  // the recursion below reaches the same bases again for every class of a
+  // hierarchy, generate the info of each vtable only once per module
+  if (!CGM->markSDVTableEmitted(RD,
+                                Base ? Base->getBase() : NULL,
+                                Base ? Base->getBaseOffset().getQuantity() : 0))
+  {
+    return;
+  }
+
   clang::CodeGen::CGCXXABI *ABI = &CGM->getCXXABI();
 
   //this is the class name in which we insert the new named meta data
@@ -391,6 +414,13 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
     return;
   }
 
+  // don't produce any duplicate md
+  llvm::NamedMDNode *classInfo = CGM->getModule().getNamedMetadata(SD_MD_CLASSINFO + className);
+  if (classInfo && classInfo->getNumOperands() > 0)
+  {
+    return;
+  }
+
   //this generates the sub vtable info from the base and returns a vector of SD_VtableMD objects
   //all the v tables of the most derived parent classes of this class are added to the subVtables
   std::vector<SD_VtableMD> subVtables = sd_generateSubvtableInfo(CGM, ABI, VTLayout, RD, Base);
@@ -402,21 +432,7 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
   }
 
   //our named metadata SD_MD_CLASSINFO will be inserted as a new NamedMDNode
-  llvm::NamedMDNode *classInfo = CGM->getModule().getOrInsertNamedMetadata(SD_MD_CLASSINFO + className);
-
-  // don't produce any duplicate md
-  if (classInfo->getNumOperands() > 0)
-  {
-    std::set<uint64_t> aps;
-    for (auto &&AP : VTLayout->getAddressPoints())
-    {
-      aps.insert(AP.second);
-    }
-
-    // last 1 is for class vtable
-    //assert(classInfo->getNumOperands() == (2 + aps.size() + 1));
-    return;
-  }
+  classInfo = CGM->getModule().getOrInsertNamedMetadata(SD_MD_CLASSINFO + className);
 
   llvm::LLVMContext &C = CGM->getLLVMContext();
 
@@ -428,15 +444,21 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
   // second put the vtable global variable as a new MDNode into classInfo
   classInfo->addOperand(sd_getClassVtblGVMD(className, M, VTable));
 
-  // third put the size of the tuple
-  classInfo->addOperand(llvm::MDNode::get(C, sd_getMDNumber(C, subVtables.size())));
+  // third put the compact record of all sub-vtables, followed by the
+  // vtable md of the parents referenced from it
+  std::string blob(SD_CLASSINFO_MAGIC);
+  std::vector<llvm::Metadata *> record;
+  record.push_back(nullptr);
 
-  // then add md for each sub-vtable
+  sd_encodeNumber(blob, subVtables.size());
   for (unsigned i = 0; i < subVtables.size(); ++i)
   {
-    classInfo->addOperand(subVtables[i].getMDNode(M, C));
+    subVtables[i].encode(CGM, blob, record);
   }
 
+  record[0] = sd_getMDString(C, blob);
+  classInfo->addOperand(llvm::MDNode::get(C, record));
+
   // make sure parent class' metadata is added too
   for (auto &&AP : VTLayout->getAddressPoints())
   {
@@ -447,11 +469,11 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
     if (subRD != RD)
     {
       //std::cerr << "Recursively calling sd_insertVtableMD for " << subRD->getQualifiedNameAsString() << "\n";
-      sd_insertVtableMD(CGM,
-                        NULL,
-                        &(CGM->getVTables().getItaniumVTableContext().getVTableLayout(subRD)),
-                        subRD,
-                        NULL);
+      sd_insertVtableMDImpl(CGM,
+                            NULL,
+                            &(CGM->getVTables().getItaniumVTableContext().getVTableLayout(subRD)),
+                            subRD,
+                            NULL);
     }
   }
 
@@ -475,4 +497,18 @@ static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
   }
 }
 
+/**
+ * Entry point of the vtable metadata emission, accounts the time spent
+ * in it to the SafeDispatch timer shown by -ftime-report.
+ */
+static void sd_insertVtableMD(clang::CodeGen::CodeGenModule *CGM,
+                              llvm::GlobalVariable *VTable,
+                              const clang::VTableLayout *VTLayout,
+                              const clang::CXXRecordDecl *RD,
+                              const clang::BaseSubobject *Base = NULL)
+{
+  llvm::TimeRegion region(llvm::TimePassesIsEnabled ? &CGM->getSDMetadataTime() : nullptr);
+  sd_insertVtableMDImpl(CGM, VTable, VTLayout, RD, Base);
+}
+
 #endif
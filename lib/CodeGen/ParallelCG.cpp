@@ -0,0 +1,267 @@
+//===-- ParallelCG.cpp ----------------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines functions that can be used for parallel code generation
+// of a module after link time optimization.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/CodeGen/SafeDispatchMachineFunction.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static unsigned getPartitionWeight(const GlobalObject &GO) {
+  unsigned Weight = 1;
+  if (const Function *F = dyn_cast<Function>(&GO))
+    for (const BasicBlock &BB : *F)
+      Weight += BB.size();
+  return Weight;
+}
+
+/// Collects the partitions of the definitions that use V.
+static void collectUserPartitions(const Value *V,
+                                  const StringMap<unsigned> &Partition,
+                                  std::set<unsigned> &Parts,
+                                  SmallPtrSetImpl<const Value *> &Visited) {
+  for (const User *U : V->users()) {
+    if (!Visited.insert(U).second)
+      continue;
+
+    const GlobalValue *Owner = nullptr;
+    if (const Instruction *I = dyn_cast<Instruction>(U))
+      Owner = I->getParent()->getParent();
+    else if (const GlobalValue *GV = dyn_cast<GlobalValue>(U))
+      Owner = GV;
+    else if (isa<Constant>(U))
+      collectUserPartitions(U, Partition, Parts, Visited);
+
+    if (Owner) {
+      auto I = Partition.find(Owner->getName());
+      if (I != Partition.end())
+        Parts.insert(I->second);
+    }
+  }
+}
+
+/// Assigns every definition of M to one of NumParts partitions.
+static void partitionModule(Module &M, unsigned NumParts,
+                            StringMap<unsigned> &Partition) {
+  std::vector<GlobalValue *> Defined;
+  for (Function &F : M)
+    Defined.push_back(&F);
+  for (GlobalVariable &GV : M.globals())
+    Defined.push_back(&GV);
+  for (GlobalAlias &GA : M.aliases())
+    Defined.push_back(&GA);
+
+  // Partitions are identified by name in the parsed copies of the module.
+  for (GlobalValue *GV : Defined)
+    if (!GV->isDeclaration() && !GV->hasName())
+      GV->setName("__sd_part");
+
+  std::map<const Comdat *, std::vector<GlobalObject *>> ComdatGroups;
+  std::vector<std::vector<GlobalObject *>> Groups;
+  auto AddObject = [&](GlobalObject &GO) {
+    if (GO.isDeclaration() || GO.hasAppendingLinkage())
+      return;
+    if (const Comdat *C = GO.getComdat())
+      ComdatGroups[C].push_back(&GO);
+    else
+      Groups.push_back(std::vector<GlobalObject *>(1, &GO));
+  };
+  for (Function &F : M)
+    AddObject(F);
+  for (GlobalVariable &GV : M.globals())
+    AddObject(GV);
+  for (auto &Group : ComdatGroups)
+    Groups.push_back(Group.second);
+
+  std::vector<std::pair<unsigned, unsigned>> Weights; // weight, group
+  for (unsigned I = 0; I < Groups.size(); ++I) {
+    unsigned Weight = 0;
+    for (GlobalObject *GO : Groups[I])
+      Weight += getPartitionWeight(*GO);
+    Weights.push_back(std::make_pair(Weight, I));
+  }
+  std::stable_sort(Weights.begin(), Weights.end(),
+                   [](const std::pair<unsigned, unsigned> &A,
+                      const std::pair<unsigned, unsigned> &B) {
+                     return A.first > B.first;
+                   });
+
+  std::vector<uint64_t> Loads(NumParts, 0);
+  for (auto &W : Weights) {
+    unsigned Part =
+        std::min_element(Loads.begin(), Loads.end()) - Loads.begin();
+    Loads[Part] += W.first;
+    for (GlobalObject *GO : Groups[W.second])
+      Partition[GO->getName()] = Part;
+  }
+
+  for (GlobalVariable &GV : M.globals())
+    if (GV.hasAppendingLinkage())
+      Partition[GV.getName()] = 0;
+
+  for (GlobalAlias &GA : M.aliases()) {
+    const GlobalObject *Base = GA.getBaseObject();
+    auto I = Base ? Partition.find(Base->getName()) : Partition.end();
+    Partition[GA.getName()] = I != Partition.end() ? I->second : 0;
+  }
+
+  unsigned Externalized = 0;
+  for (GlobalValue *GV : Defined) {
+    if (!GV->hasLocalLinkage() || GV->isDeclaration())
+      continue;
+
+    std::set<unsigned> Parts;
+    SmallPtrSet<const Value *, 8> Visited;
+    collectUserPartitions(GV, Partition, Parts, Visited);
+
+    unsigned Part = Partition.lookup(GV->getName());
+    Parts.erase(Part);
+    if (Parts.empty())
+      continue;
+
+    Partition.erase(GV->getName());
+    GV->setName(GV->getName() + ".sdpart");
+    GV->setLinkage(GlobalValue::ExternalLinkage);
+    GV->setVisibility(GlobalValue::HiddenVisibility);
+    Partition[GV->getName()] = Part;
+    ++Externalized;
+  }
+
+  for (unsigned I = 0; I < NumParts; ++I)
+    sdLog::stream() << "Codegen partition " << I << ": weight " << Loads[I]
+                    << "\n";
+  sdLog::stream() << "Externalized " << Externalized
+                  << " local symbols for split codegen\n";
+}
+
+/// Turns every definition of M that belongs to another partition into a
+/// declaration.
+static void keepPartition(Module &M, unsigned Part,
+                          const StringMap<unsigned> &Partition) {
+  auto InPart = [&](const GlobalValue &GV) {
+    auto I = Partition.find(GV.getName());
+    return I != Partition.end() && I->second == Part;
+  };
+
+  std::vector<GlobalAlias *> Aliases;
+  for (GlobalAlias &GA : M.aliases())
+    if (!InPart(GA))
+      Aliases.push_back(&GA);
+  for (GlobalAlias *GA : Aliases) {
+    Type *Ty = GA->getType()->getElementType();
+    GlobalValue *Decl;
+    if (FunctionType *FTy = dyn_cast<FunctionType>(Ty))
+      Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+    else
+      Decl = new GlobalVariable(M, Ty, false, GlobalValue::ExternalLinkage,
+                                nullptr, "", nullptr,
+                                GlobalValue::NotThreadLocal,
+                                GA->getType()->getAddressSpace());
+    Decl->takeName(GA);
+    Decl->setVisibility(GA->getVisibility());
+    GA->replaceAllUsesWith(Decl);
+    GA->eraseFromParent();
+  }
+
+  for (Function &F : M) {
+    if (F.isDeclaration() || InPart(F))
+      continue;
+    F.deleteBody();
+    F.setComdat(nullptr);
+  }
+
+  std::vector<GlobalVariable *> Appending;
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.isDeclaration() || InPart(GV))
+      continue;
+    if (GV.hasAppendingLinkage()) {
+      Appending.push_back(&GV);
+      continue;
+    }
+    GV.setInitializer(nullptr);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setComdat(nullptr);
+  }
+  for (GlobalVariable *GV : Appending)
+    GV->eraseFromParent();
+}
+
+void llvm::splitCodeGen(Module &M, ArrayRef<raw_pwrite_stream *> OSs,
+                        const TargetMachineFactory &TMFactory,
+                        LLVMContext::DiagnosticHandlerTy DiagHandler,
+                        void *DiagContext) {
+  unsigned NumParts = OSs.size();
+
+  SDCallSiteTables Tables;
+  Tables.loadVirtualCallSiteData(M);
+  Tables.loadStaticCallSiteData(M);
+  SDCallSiteStats Stats;
+
+  StringMap<unsigned> Partition;
+  partitionModule(M, NumParts, Partition);
+
+  SmallString<0> BC;
+  {
+    raw_svector_ostream OS(BC);
+    WriteBitcodeToFile(&M, OS);
+  }
+
+  SDMachineFunction::setSharedData(&Tables, &Stats);
+
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I < NumParts; ++I) {
+    raw_pwrite_stream *OS = OSs[I];
+    Threads.emplace_back([&BC, &Partition, &TMFactory, DiagHandler,
+                          DiagContext, OS, I]() {
+      LLVMContext Context;
+      if (DiagHandler)
+        Context.setDiagnosticHandler(DiagHandler, DiagContext, true);
+
+      ErrorOr<Module *> MOrErr =
+          parseBitcodeFile(MemoryBufferRef(BC.str(), "ld-temp.o"), Context);
+      if (std::error_code EC = MOrErr.getError())
+        report_fatal_error("Could not read partition " + Twine(I) + ": " +
+                           EC.message());
+      std::unique_ptr<Module> Part(MOrErr.get());
+
+      keepPartition(*Part, I, Partition);
+      std::unique_ptr<TargetMachine> TM = TMFactory(Part->getTargetTriple());
+
+      legacy::PassManager CodeGenPasses;
+      if (TM->addPassesToEmitFile(CodeGenPasses, *OS,
+                                  TargetMachine::CGFT_ObjectFile))
+        report_fatal_error("Failed to setup codegen");
+      CodeGenPasses.run(*Part);
+    });
+  }
+  for (std::thread &T : Threads)
+    T.join();
+
+  SDMachineFunction::setSharedData(nullptr, nullptr);
+  SDMachineFunction::analyse(&M, Stats);
+}
@@ -1,8 +1,42 @@
 #include <llvm/Support/FileSystem.h>
 #include "llvm/CodeGen/SafeDispatchMachineFunction.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Mutex.h"
 
 using namespace llvm;
 
+// set by parallel code generation, see SDMachineFunction::setSharedData
+static const SDCallSiteTables *SharedTables = nullptr;
+static SDCallSiteStats *SharedStats = nullptr;
+static ManagedStatic<sys::SmartMutex<true> > SharedStatsLock;
+
+void SDMachineFunction::setSharedData(const SDCallSiteTables *Tables, SDCallSiteStats *Sink) {
+  SharedTables = Tables;
+  SharedStats = Sink;
+}
+
+void SDCallSiteStats::merge(const SDCallSiteStats &Other) {
+  RangeWidths.insert(RangeWidths.end(), Other.RangeWidths.begin(), Other.RangeWidths.end());
+  for (auto &entry : Other.IDCount)
+    IDCount[entry.first] += entry.second;
+
+  NumberOfVirtual += Other.NumberOfVirtual;
+  NumberOfStaticDirect += Other.NumberOfStaticDirect;
+  NumberOfIndirect += Other.NumberOfIndirect;
+  NumberOfTail += Other.NumberOfTail;
+  NumberOfUnknown += Other.NumberOfUnknown;
+}
+
+SDMachineFunction::~SDMachineFunction() {
+  if (SharedStats) {
+    sys::SmartScopedLock<true> Lock(*SharedStatsLock);
+    SharedStats->merge(Stats);
+  } else {
+    analyse(M, Stats);
+  }
+  sdLog::stream() << "deleting SDMachineFunction pass\n";
+}
+
 static std::string findOutputFileName(const Module *M) {
   auto SDOutputMD = M->getNamedMetadata("sd_output");
   auto SDFilenameMD = M->getNamedMetadata("sd_filename");
@@ -39,17 +73,28 @@ bool SDMachineFunction::runOnMachineFunction(MachineFunction &MF)  {
   if (M == nullptr) {
     M = MF.getMMI().getModule();
 
-    int VirtualLoaded = loadVirtualCallSiteData();
-    int StaticLoaded = loadStaticCallSiteData();
+    if (SharedTables) {
+      Tables = SharedTables;
+      if (Tables->CallSiteDebugLocVirtual.empty() && Tables->CallSiteDebugLocStatic.empty()) {
+        SkipPass = true;
+        return false;
+      }
+    } else {
+      Tables = &OwnTables;
 
-    if (VirtualLoaded == 0 && StaticLoaded == 0) {
-      sdLog::stream() << "No CallSites loaded.\n";
-      SkipPass = true;
-      return false;
-    }
+      Module &Mod = const_cast<Module &>(*M);
+      int VirtualLoaded = OwnTables.loadVirtualCallSiteData(Mod);
+      int StaticLoaded = OwnTables.loadStaticCallSiteData(Mod);
 
-    sdLog::stream() << "Loaded virtual CallSites: " << VirtualLoaded << "\n";
-    sdLog::stream() << "Loaded static CallSites: " << StaticLoaded << "\n";
+      if (VirtualLoaded == 0 && StaticLoaded == 0) {
+        sdLog::stream() << "No CallSites loaded.\n";
+        SkipPass = true;
+        return false;
+      }
+
+      sdLog::stream() << "Loaded virtual CallSites: " << VirtualLoaded << "\n";
+      sdLog::stream() << "Loaded static CallSites: " << StaticLoaded << "\n";
+    }
   }
 
   sdLog::log() << "Running SDMachineFunction pass: "<< MF.getName() << "\n";
@@ -88,8 +133,8 @@ bool SDMachineFunction::processVirtualCallSite(std::string &DebugLocString,
                                                MachineInstr &MI,
                                                MachineBasicBlock &MBB,
                                                const TargetInstrInfo *TII) {
-  auto FunctionNameIt = CallSiteDebugLocVirtual.find(DebugLocString);
-  if (FunctionNameIt == CallSiteDebugLocVirtual.end()) {
+  auto FunctionNameIt = Tables->CallSiteDebugLocVirtual.find(DebugLocString);
+  if (FunctionNameIt == Tables->CallSiteDebugLocVirtual.end()) {
     return false;
   }
 
@@ -98,8 +143,8 @@ bool SDMachineFunction::processVirtualCallSite(std::string &DebugLocString,
                << " in " << MBB.getParent()->getName()
                << " is virtual Caller for " << FunctionName << "\n";
 
-  auto range = CallSiteRange.find(DebugLocString);
-  if (range == CallSiteRange.end()) {
+  auto range = Tables->CallSiteRange.find(DebugLocString);
+  if (range == Tables->CallSiteRange.end()) {
     sdLog::errs() << DebugLocString << " has not Range!\n";
     return false;
   }
@@ -107,17 +152,17 @@ bool SDMachineFunction::processVirtualCallSite(std::string &DebugLocString,
   uint64_t width = range->second.second - min;
 
 
-  RangeWidths.push_back(width);
+  Stats.RangeWidths.push_back(width);
   for (int64_t i = min; i <= range->second.second; ++i) {
-    IDCount[i]++;
+    Stats.IDCount[i]++;
   }
 
   TII->insertNoop(MBB, MI.getNextNode());
-  MI.getNextNode()->operands_begin()[3].setImm(width | 0x80000);
+  MI.getNextNode()->operands_begin()[3].setImm(width | SD_RETURN_ID_TAG);
   TII->insertNoop(MBB, MI.getNextNode());
-  MI.getNextNode()->operands_begin()[3].setImm(min | 0x80000);
+  MI.getNextNode()->operands_begin()[3].setImm(min | SD_RETURN_ID_TAG);
 
-  ++NumberOfVirtual;
+  ++Stats.NumberOfVirtual;
   return true;
 }
 
@@ -125,8 +170,8 @@ bool SDMachineFunction::processStaticCallSite(std::string &DebugLocString,
                                               MachineInstr &MI,
                                               MachineBasicBlock &MBB,
                                               const TargetInstrInfo *TII) {
-  auto FunctionNameIt = CallSiteDebugLocStatic.find(DebugLocString);
-  if (FunctionNameIt == CallSiteDebugLocStatic.end()) {
+  auto FunctionNameIt = Tables->CallSiteDebugLocStatic.find(DebugLocString);
+  if (FunctionNameIt == Tables->CallSiteDebugLocStatic.end()) {
     return false;
   }
 
@@ -136,11 +181,11 @@ bool SDMachineFunction::processStaticCallSite(std::string &DebugLocString,
                << " is static Caller for " << FunctionName << "\n";
 
   if (StringRef(FunctionName).startswith("__INDIRECT__")) {
-    uint64_t ID = CallSiteID[DebugLocString];
+    uint64_t ID = Tables->getCallSiteID(DebugLocString);
     TII->insertNoop(MBB, MI.getNextNode());
-    MI.getNextNode()->operands_begin()[3].setImm(ID | 0x80000);
-    IDCount[ID]++;
-    ++NumberOfIndirect;
+    MI.getNextNode()->operands_begin()[3].setImm(ID | SD_RETURN_ID_TAG);
+    Stats.IDCount[ID]++;
+    ++Stats.NumberOfIndirect;
     return true;
   }
 
@@ -148,16 +193,16 @@ bool SDMachineFunction::processStaticCallSite(std::string &DebugLocString,
     return true;
     TII->insertNoop(MBB, MI.getNextNode());
     MI.getNextNode()->operands_begin()[3].setImm(tailID);
-    IDCount[tailID]++;
-    ++NumberOfTail;
+    Stats.IDCount[tailID]++;
+    ++Stats.NumberOfTail;
     return true;
   }
 
-  uint64_t ID = CallSiteID[DebugLocString];
+  uint64_t ID = Tables->getCallSiteID(DebugLocString);
   TII->insertNoop(MBB, MI.getNextNode());
-  MI.getNextNode()->operands_begin()[3].setImm(ID | 0x80000);
-  IDCount[ID]++;
-  ++NumberOfStaticDirect;
+  MI.getNextNode()->operands_begin()[3].setImm(ID | SD_RETURN_ID_TAG);
+  Stats.IDCount[ID]++;
+  ++Stats.NumberOfStaticDirect;
   return true;
 }
 
@@ -171,13 +216,13 @@ bool SDMachineFunction::processUnknownCallSite(std::string &DebugLocString,
       && !(MI.getOperand(0).getType() == MachineOperand::MO_ExternalSymbol)) {
     TII->insertNoop(MBB, MI.getNextNode());
     MI.getNextNode()->operands_begin()[3].setImm(unknownID);
-    IDCount[unknownID]++;
+    Stats.IDCount[unknownID]++;
     sdLog::warn() << "Machine CallInst (@" << DebugLocString << ") ";
     MI.print(sdLog::warn(), false);
     sdLog::warn() << " in " << MBB.getParent()->getName()
                   << " is an unknown Caller! \n";
 
-    ++NumberOfUnknown;
+    ++Stats.NumberOfUnknown;
     return true;
   }
   return false;
@@ -192,9 +237,8 @@ std::string SDMachineFunction::debugLocToString(const DebugLoc &Loc) {
   return Stream.str();
 };
 
-int SDMachineFunction::loadVirtualCallSiteData() {
-  assert(M != nullptr && "Module not initialized!");
-  auto MD = M->getNamedMetadata(SD_MD_RETUR_VIRTUAL);
+int SDCallSiteTables::loadVirtualCallSiteData(Module &M) {
+  auto MD = M.getNamedMetadata(SD_MD_RETUR_VIRTUAL);
   if (MD == nullptr)
     return 0;
 
@@ -224,9 +268,8 @@ int SDMachineFunction::loadVirtualCallSiteData() {
   return i;
 }
 
-int SDMachineFunction::loadStaticCallSiteData() {
-  assert(M != nullptr && "Module not initialized!");
-  auto MD = M->getNamedMetadata(SD_MD_RETUR_NORMAL);
+int SDCallSiteTables::loadStaticCallSiteData(Module &M) {
+  auto MD = M.getNamedMetadata(SD_MD_RETUR_NORMAL);
   if (MD == nullptr)
     return 0;
 
@@ -256,24 +299,24 @@ int SDMachineFunction::loadStaticCallSiteData() {
   return i;
 }
 
-void SDMachineFunction::analyse(const Module *M) {
+void SDMachineFunction::analyse(const Module *M, const SDCallSiteStats &Stats) {
   uint64_t sum = 0;
-  if (!RangeWidths.empty()) {
-    for (uint64_t i : RangeWidths) {
+  if (!Stats.RangeWidths.empty()) {
+    for (uint64_t i : Stats.RangeWidths) {
       sum += i;
     }
-    double avg = double(sum) / RangeWidths.size();
+    double avg = double(sum) / Stats.RangeWidths.size();
     sdLog::stream() << "AVG RANGE WIDTH: " << avg << "\n";
-    sdLog::stream() << "TOTAL RANGES: " << RangeWidths.size() << "\n";
+    sdLog::stream() << "TOTAL RANGES: " << Stats.RangeWidths.size() << "\n";
   }
 
-  if (IDCount.empty())
+  if (Stats.IDCount.empty() || M == nullptr)
     return;
 
   std::string outName = findOutputFileName(M);
   std::ofstream Outfile(outName);
   std::ostream_iterator <std::string> OutIterator(Outfile, "\n");
-  for (auto &entry : IDCount) {
+  for (auto &entry : Stats.IDCount) {
     Outfile << entry.first << "," << entry.second << "\n";
   }
   Outfile.close();
@@ -18,6 +18,7 @@
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/CodeGen/ParallelCG.h"
 #include "llvm/CodeGen/RuntimeLibcalls.h"
 #include "llvm/Config/config.h"
 #include "llvm/IR/Constants.h"
@@ -55,6 +56,35 @@
 #include <system_error>
 using namespace llvm;
 
+static cl::opt<bool>
+SDIVTBL("sd-ivtbl", cl::init(false),
+  cl::desc("Interleave the vtables and check virtual calls (SafeDispatch)"));
+
+static cl::opt<bool>
+SDOVTBL("sd-ovtbl", cl::init(false),
+  cl::desc("Order the vtables and check virtual calls (SafeDispatch)"));
+
+static cl::opt<bool>
+SDReturn("sd-return", cl::init(false),
+  cl::desc("Insert SafeDispatch return checks"));
+
+static cl::opt<bool>
+SDRelVTBL("sd-rel-vtbl", cl::init(false),
+  cl::desc("Use 32-bit relative entries in the SafeDispatch vtables"));
+
+static cl::opt<bool>
+SDDeadVirtuals("sd-dead-virtuals", cl::init(false),
+  cl::desc("Remove virtual functions that no virtual call can reach"));
+
+static cl::opt<bool>
+SDTrimRTTI("sd-trim-rtti", cl::init(false),
+  cl::desc("Drop the unused offset-to-top and RTTI vtable slots"));
+
+static cl::opt<std::string>
+SDCacheDirOpt("sd-cache-dir", cl::init(""),
+  cl::desc("Directory of the on-disk SafeDispatch analysis cache"),
+  cl::value_desc("directory"));
+
 const char* LTOCodeGenerator::getVersionString() {
 #ifdef LLVM_VERSION_INFO
   return PACKAGE_NAME " version " PACKAGE_VERSION ", " LLVM_VERSION_INFO;
@@ -83,6 +113,12 @@ void LTOCodeGenerator::initialize() {
   DiagContext = nullptr;
   OwnedModule = nullptr;
   ShouldInternalize = true;
+  SDEmitIVTBLs = false;
+  SDEmitOVTBLs = false;
+  SDEmitReturnChecks = false;
+  SDRelativeVTBLs = false;
+  SDRemoveDeadVirtuals = false;
+  SDTrimRTTISlots = false;
 
   initializeLTOPasses();
 }
@@ -558,6 +594,13 @@ bool LTOCodeGenerator::optimize(bool DisableInline,
   PMB.OptLevel = OptLevel;
   PMB.VerifyInput = true;
   PMB.VerifyOutput = true;
+  PMB.EmitIVTBLs = SDEmitIVTBLs || SDIVTBL;
+  PMB.EmitOVTBLs = SDEmitOVTBLs || SDOVTBL;
+  PMB.EmitReturnChecks = SDEmitReturnChecks || SDReturn;
+  PMB.EmitRelVTBLs = SDRelativeVTBLs || SDRelVTBL;
+  PMB.RemoveDeadVirtuals = SDRemoveDeadVirtuals || SDDeadVirtuals;
+  PMB.TrimRTTISlots = SDTrimRTTISlots || SDTrimRTTI;
+  PMB.SDCacheDir = SDCacheDir.empty() ? SDCacheDirOpt : SDCacheDir;
 
   PMB.populateLTOPassManager(passes);
 
@@ -592,6 +635,42 @@ bool LTOCodeGenerator::compileOptimized(raw_pwrite_stream &out,
   return true;
 }
 
+bool LTOCodeGenerator::compileOptimized(ArrayRef<raw_pwrite_stream *> Out,
+                                        std::string &errMsg) {
+  if (Out.empty()) {
+    errMsg = "no output streams to compile to";
+    return false;
+  }
+  if (Out.size() == 1)
+    return compileOptimized(*Out[0], errMsg);
+
+  if (!this->determineTarget(errMsg))
+    return false;
+
+  // Every thread needs its own target machine, they are created like the one
+  // of the merged module.
+  const Target *March = &TargetMach->getTarget();
+  std::string Cpu = TargetMach->getTargetCPU();
+  std::string Features = TargetMach->getTargetFeatureString();
+  TargetOptions TMOptions = TargetMach->Options;
+  Reloc::Model RelocModel = TargetMach->getRelocationModel();
+  CodeGenOpt::Level CGOptLevel = TargetMach->getOptLevel();
+
+  // the diagnostics of the threads go to the handler of the client as well
+  splitCodeGen(*IRLinker.getModule(), Out,
+               [&](StringRef TripleStr) {
+                 return std::unique_ptr<TargetMachine>(
+                     March->createTargetMachine(TripleStr, Cpu, Features,
+                                                TMOptions, RelocModel,
+                                                CodeModel::Default,
+                                                CGOptLevel));
+               },
+               DiagHandler ? LTOCodeGenerator::DiagnosticHandler : nullptr,
+               this);
+
+  return true;
+}
+
 /// setCodeGenDebugOptions - Set codegen debugging options to aid in debugging
 /// LTO problems.
 void LTOCodeGenerator::setCodeGenDebugOptions(const char *options) {
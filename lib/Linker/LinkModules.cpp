@@ -25,6 +25,8 @@
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
+#include "llvm/IR/SafeDispatchMD.h"
 #include "llvm/IR/TypeFinder.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
@@ -505,6 +507,8 @@ private:
   bool linkGlobalValueBody(GlobalValue &Src);
 
   void linkNamedMDNodes();
+  void linkSDClassInfo(const NamedMDNode &SrcNMD, NamedMDNode *DstNMD);
+  void linkSDStringTable(const NamedMDNode &SrcNMD, NamedMDNode *DstNMD);
   void stripReplacedSubprograms();
 };
 }
@@ -1260,6 +1264,16 @@ void ModuleLinker::linkNamedMDNodes() {
     // Don't link module flags here. Do them separately.
     if (&*I == SrcModFlags) continue;
     NamedMDNode *DestNMD = DstM->getOrInsertNamedMetadata(I->getName());
+    // SafeDispatch class info is emitted by every TU that sees the class,
+    // keep a single record per class.
+    if (I->getName().startswith(SD_MD_CLASSINFO)) {
+      linkSDClassInfo(*I, DestNMD);
+      continue;
+    }
+    if (I->getName() == SD_MD_STRTAB) {
+      linkSDStringTable(*I, DestNMD);
+      continue;
+    }
     // Add Src elements into Dest node.
     for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i)
       DestNMD->addOperand(MapMetadata(I->getOperand(i), ValueMap, RF_None,
@@ -1267,6 +1281,169 @@ void ModuleLinker::linkNamedMDNodes() {
   }
 }
 
+/// An sd.class_info node is a sequence of per-TU records: the class name, the
+/// class vtable and either one compact record or the number of sub-vtables
+/// followed by one tuple per sub-vtable (see SafeDispatchVtblMD.h). Returns
+/// the number of operands of the record starting at operand \p Start.
+static unsigned getSDClassInfoRecordSize(ArrayRef<MDNode *> Ops,
+                                         unsigned Start) {
+  assert(Start + 2 < Ops.size() && "truncated SafeDispatch class info");
+  MDNode *Third = Ops[Start + 2];
+  if (sd_getCompactClassInfo(Third))
+    return 3;
+  return 3 + mdconst::extract<ConstantInt>(Third->getOperand(0))
+                 ->getZExtValue();
+}
+
+/// Returns true if \p MD is a vtable reference of a class info record, either
+/// the vtable global or the "NO_VTABLE" placeholder.
+static bool isSDVTableMD(const Metadata *MD, bool &Resolved) {
+  const MDNode *N = dyn_cast_or_null<MDNode>(MD);
+  if (!N || N->getNumOperands() != 1)
+    return false;
+
+  const Metadata *Op = N->getOperand(0).get();
+  if (const ConstantAsMetadata *C = dyn_cast_or_null<ConstantAsMetadata>(Op)) {
+    Resolved = true;
+    return isa<GlobalVariable>(C->getValue()->stripPointerCasts());
+  }
+
+  const MDString *S = dyn_cast_or_null<MDString>(Op);
+  Resolved = false;
+  return S && S->getString() == "NO_VTABLE";
+}
+
+/// Compares two parts of class info records. Vtable references only have to
+/// agree on being vtable references, whether a TU saw the vtable global
+/// depends on what it defines.
+static bool isSameSDLayout(const Metadata *A, const Metadata *B) {
+  if (A == B)
+    return true;
+
+  bool AResolved, BResolved;
+  if (isSDVTableMD(A, AResolved) && isSDVTableMD(B, BResolved))
+    return !AResolved || !BResolved;
+
+  const MDTuple *TA = dyn_cast_or_null<MDTuple>(A);
+  const MDTuple *TB = dyn_cast_or_null<MDTuple>(B);
+  if (!TA || !TB || TA->getNumOperands() != TB->getNumOperands())
+    return false;
+
+  for (unsigned i = 0, e = TA->getNumOperands(); i != e; ++i)
+    if (!isSameSDLayout(TA->getOperand(i).get(), TB->getOperand(i).get()))
+      return false;
+  return true;
+}
+
+/// Counts the vtable globals a class info record refers to.
+static unsigned countSDVTableRefs(const Metadata *MD) {
+  bool Resolved;
+  if (isSDVTableMD(MD, Resolved))
+    return Resolved ? 1 : 0;
+
+  unsigned Count = 0;
+  if (const MDTuple *T = dyn_cast_or_null<MDTuple>(MD))
+    for (const MDOperand &Op : T->operands())
+      Count += countSDVTableRefs(Op.get());
+  return Count;
+}
+
+/// Returns the vtable global of the class info record starting at operand
+/// \p Start, or null if the TU that emitted it did not see the vtable.
+static const GlobalVariable *getSDRecordVTable(ArrayRef<MDNode *> Ops,
+                                               unsigned Start) {
+  bool Resolved;
+  if (!isSDVTableMD(Ops[Start + 1], Resolved) || !Resolved)
+    return nullptr;
+  const ConstantAsMetadata *C =
+      cast<ConstantAsMetadata>(Ops[Start + 1]->getOperand(0).get());
+  return cast<GlobalVariable>(C->getValue()->stripPointerCasts());
+}
+
+/// Link the class info records of one class. The first record of a vtable is
+/// the one SDBuildCHA uses, so later records of the same vtable are only
+/// checked against it. Classes in anonymous namespaces of different TUs share
+/// the node name, but the linker renamed their vtables apart, so a record
+/// whose vtable differs from all the kept ones is a class of its own.
+void ModuleLinker::linkSDClassInfo(const NamedMDNode &SrcNMD,
+                                   NamedMDNode *DstNMD) {
+  SmallVector<MDNode *, 8> SrcOps;
+  for (unsigned i = 0, e = SrcNMD.getNumOperands(); i != e; ++i)
+    SrcOps.push_back(MapMetadata(SrcNMD.getOperand(i), ValueMap, RF_None,
+                                 &TypeMap, &ValMaterializer));
+
+  StringRef ClassName =
+      DstNMD->getName().substr(sizeof(SD_MD_CLASSINFO) - 1);
+
+  for (unsigned Start = 0; Start < SrcOps.size();) {
+    unsigned Size = getSDClassInfoRecordSize(SrcOps, Start);
+    ArrayRef<MDNode *> Record = makeArrayRef(SrcOps).slice(Start, Size);
+    const GlobalVariable *SrcVTable = getSDRecordVTable(SrcOps, Start);
+    Start += Size;
+
+    SmallVector<MDNode *, 8> DstOps;
+    for (unsigned i = 0, e = DstNMD->getNumOperands(); i != e; ++i)
+      DstOps.push_back(DstNMD->getOperand(i));
+
+    // Find the kept record of the same vtable. A record without the vtable
+    // global cannot tell which one it is and is matched with the first one.
+    unsigned DstStart = DstOps.size(), DstSize = 0;
+    for (unsigned i = 0; i < DstOps.size(); i += DstSize) {
+      DstSize = getSDClassInfoRecordSize(DstOps, i);
+      const GlobalVariable *DstVTable = getSDRecordVTable(DstOps, i);
+      if (DstVTable == SrcVTable) {
+        DstStart = i;
+        break;
+      }
+      if ((!DstVTable || !SrcVTable) && DstStart == DstOps.size())
+        DstStart = i;
+    }
+
+    if (DstStart == DstOps.size()) {
+      for (MDNode *Op : Record)
+        DstNMD->addOperand(Op);
+      continue;
+    }
+    DstSize = getSDClassInfoRecordSize(DstOps, DstStart);
+
+    bool Same = DstSize == Size;
+    for (unsigned i = 0; Same && i != Size; ++i)
+      Same = isSameSDLayout(DstOps[DstStart + i], Record[i]);
+
+    if (!Same) {
+      emitWarning("SafeDispatch class info for '" + ClassName +
+                  "' differs between modules, keeping the first record");
+      continue;
+    }
+
+    // Prefer the record that could resolve more of the vtables it refers to.
+    unsigned DstRefs = 0, SrcRefs = 0;
+    for (unsigned i = 0; i != Size; ++i) {
+      DstRefs += countSDVTableRefs(DstOps[DstStart + i]);
+      SrcRefs += countSDVTableRefs(Record[i]);
+    }
+    if (SrcRefs > DstRefs)
+      for (unsigned i = 0; i != Size; ++i)
+        DstNMD->setOperand(DstStart + i, Record[i]);
+  }
+}
+
+/// The per-TU string tables of the compact class info records share most of
+/// their names, only add the ones the destination does not have yet.
+void ModuleLinker::linkSDStringTable(const NamedMDNode &SrcNMD,
+                                     NamedMDNode *DstNMD) {
+  SmallPtrSet<const MDNode *, 32> Known;
+  for (unsigned i = 0, e = DstNMD->getNumOperands(); i != e; ++i)
+    Known.insert(DstNMD->getOperand(i));
+
+  for (unsigned i = 0, e = SrcNMD.getNumOperands(); i != e; ++i) {
+    MDNode *Op = MapMetadata(SrcNMD.getOperand(i), ValueMap, RF_None,
+                             &TypeMap, &ValMaterializer);
+    if (Known.insert(Op).second)
+      DstNMD->addOperand(Op);
+  }
+}
+
 /// Drop DISubprograms that have been superseded.
 ///
 /// FIXME: this creates an asymmetric result: we strip functions from losing
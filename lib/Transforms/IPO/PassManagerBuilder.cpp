@@ -105,6 +105,9 @@ PassManagerBuilder::PassManagerBuilder() {
     EmitIVTBLs = false;
     EmitOVTBLs = false;
     EmitReturnChecks = false;
+    EmitRelVTBLs = false;
+    RemoveDeadVirtuals = false;
+    TrimRTTISlots = false;
 }
 
 PassManagerBuilder::~PassManagerBuilder() {
@@ -532,7 +535,11 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
 
     //Paul: these are the 4 four passes, the other 2 passes are down
     PM.add(llvm::createSDFixPass());
-    PM.add(llvm::createSDBuildCHAPass());
+    PM.add(llvm::createSDBuildCHAPass(SDCacheDir.c_str()));
+
+    //clear never called vtable slots before the IDs and layouts are used
+    if (RemoveDeadVirtuals && (EmitIVTBLs || EmitOVTBLs))
+      PM.add(llvm::createSDDeadVirtualsPass());
 
     if (EmitReturnChecks) {
       //Matt: SDReturnRange relies on the intrinsics generated by itanium,
@@ -541,7 +548,7 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
       PM.add(llvm::createSDReturnRangePass());
     }
     if (EmitIVTBLs || EmitOVTBLs) {
-      PM.add(llvm::createSDLayoutBuilderPass(EmitIVTBLs));
+      PM.add(llvm::createSDLayoutBuilderPass(EmitIVTBLs, EmitRelVTBLs, TrimRTTISlots));
       PM.add(llvm::createSDUpdateIndicesPass());
     }
   }
@@ -578,6 +585,33 @@ void PassManagerBuilder::populateLTOPassManager(legacy::PassManagerBase &PM) {
     PM.add(createVerifierPass());
 }
 
+void PassManagerBuilder::populateSDThinPassManager(legacy::PassManagerBase &PM,
+                                                   bool Backend) {
+  if (LibraryInfo)
+    PM.add(new TargetLibraryInfoWrapperPass(*LibraryInfo));
+
+  // no GlobalDCE and SDFix, the index and the backends have to agree on the
+  // vtables and the TU objects keep what the vtables point to. The backends
+  // load the layouts of the thin link from the cache.
+  PM.add(llvm::createSDBuildCHAPass(SDCacheDir.c_str(), Backend));
+  PM.add(llvm::createSDLayoutBuilderPass(EmitIVTBLs, false, false));
+  PM.add(llvm::createSDUpdateIndicesPass());
+
+  if (VerifyInput)
+    PM.add(createVerifierPass());
+
+  if (Backend)
+    PM.add(llvm::createSDSubstModulePass());
+  PM.add(createSDCleanupPass());
+  PM.add(createLowerBitSetsPass());
+
+  if (Backend)
+    PM.add(llvm::createSDMoveBasicBlocksPass());
+
+  if (VerifyOutput)
+    PM.add(createVerifierPass());
+}
+
 inline PassManagerBuilder *unwrap(LLVMPassManagerBuilderRef P) {
     return reinterpret_cast<PassManagerBuilder*>(P);
 }
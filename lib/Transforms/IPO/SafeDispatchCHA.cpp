@@ -18,6 +18,11 @@
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchTools.h"
+#include "llvm/IR/SafeDispatchClassInfo.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Config/llvm-config.h"
 
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -29,6 +34,7 @@
 #include <math.h>
 #include <algorithm>
 #include <deque>
+#include <fstream>
 
 // you have to modify the following 4 files for each additional LLVM pass
 // 1. include/llvm/IPO.h
@@ -45,8 +51,8 @@ char SDBuildCHA::ID = 0;
 
 INITIALIZE_PASS(SDBuildCHA, "sdcha", "Build CHA pass for SafeDispatch", false, false)
 
-ModulePass* llvm::createSDBuildCHAPass() {
-  return new SDBuildCHA();
+ModulePass* llvm::createSDBuildCHAPass(const char *cacheDir, bool cacheRequired) {
+  return new SDBuildCHA(cacheDir, cacheRequired);
 }
 
 /**
@@ -201,6 +207,9 @@ void SDBuildCHA::buildClouds(Module &M) {
   // this set is used for checking if a parent class is defined or not
   std::set<vtbl_t> build_undefinedVtables;
 
+  // names referenced by hash from the compact class info records
+  strtab_t strtab = buildStringTable(M);
+
   for(auto itr = M.getNamedMDList().begin(); itr != M.getNamedMDList().end(); itr++) {
     
     //Paul: get all metadata of this module
@@ -217,7 +226,7 @@ void SDBuildCHA::buildClouds(Module &M) {
     // and puts it into this vector, this metadata was previously added 
     // inside SafeDispatchVtblMD.h, in: sd_insertVtableMD() function
     // this function is called for each generated v table, during code generation  
-    std::vector<nmd_t> infoVec = extractMetadata(md);
+    std::vector<nmd_t> infoVec = extractMetadata(md, strtab);
 
     //nmd_t is the main top root node type, now iterate through the info vector   
     for (const nmd_t& info : infoVec) {
@@ -326,11 +335,12 @@ void SDBuildCHA::buildClouds(Module &M) {
     for (auto n : build_undefinedVtables) {
       sd_print("%s,%d\n", n.first.c_str(), n.second);
     }
+
+    // a class compiled without SD (e.g. in a third-party library) only shows
+    // up as a parent, its cloud cannot be laid out
+    quarantineClouds(build_undefinedVtables);
   }
   
-  //Paul: assertion to check that the are no undefined v tables
-  assert(build_undefinedVtables.size() == 0);
-  
   //Paul: build the ancestor map for each of the child nodes of a root node
   for (auto rootName : roots) {
     vtbl_t root(rootName, 0);
@@ -385,6 +395,103 @@ void SDBuildCHA::buildClouds(Module &M) {
   }
 }
 
+void SDBuildCHA::quarantineClouds(const vtbl_set_t &unknownVtables) {
+  // the classes of a cloud are linked through the parents of their sub-vtables
+  std::map<vtbl_name_t, std::set<vtbl_name_t>> links;
+  for (auto &it : parentMap) {
+    for (const vtbl_set_t &parents : it.second) {
+      for (const vtbl_t &pt : parents) {
+        links[it.first].insert(pt.first);
+        links[pt.first].insert(it.first);
+      }
+    }
+  }
+
+  // unknown vtable -> number of classes in its cloud
+  std::map<vtbl_t, size_t> clouds;
+  for (const vtbl_t &unknown : unknownVtables) {
+    if (isQuarantined(unknown.first))
+      continue;
+
+    size_t before = quarantinedVTables.size();
+    std::vector<vtbl_name_t> worklist(1, unknown.first);
+    quarantinedVTables.insert(unknown.first);
+
+    while (!worklist.empty()) {
+      vtbl_name_t cls = worklist.back();
+      worklist.pop_back();
+      for (const vtbl_name_t &next : links[cls]) {
+        if (quarantinedVTables.insert(next).second)
+          worklist.push_back(next);
+      }
+    }
+    clouds[unknown] = quarantinedVTables.size() - before;
+  }
+
+  // keep what the checks need, the rest of the analysis never sees them
+  for (auto itr = cloudMap.begin(); itr != cloudMap.end();) {
+    if (isQuarantined(itr->first.first)) {
+      quarantineCloudMap.insert(*itr);
+      itr = cloudMap.erase(itr);
+    } else {
+      itr++;
+    }
+  }
+
+  for (auto itr = vTableFunctionMap.begin(); itr != vTableFunctionMap.end();) {
+    if (isQuarantined(itr->first.first))
+      itr = vTableFunctionMap.erase(itr);
+    else
+      itr++;
+  }
+
+  for (const vtbl_name_t &cls : quarantinedVTables) {
+    auto addrPts = addrPtMap.find(cls);
+    if (addrPts != addrPtMap.end()) {
+      quarantineAddrPtMap[cls] = addrPts->second;
+      addrPtMap.erase(addrPts);
+    }
+
+    parentMap.erase(cls);
+    rangeMap.erase(cls);
+    roots.erase(cls);
+    oldVTables.erase(cls);
+    undefinedVTables.erase(cls);
+  }
+
+  sdLog::warn() << "Quarantined " << clouds.size() << " cloud(s) with "
+                << quarantinedVTables.size() << " classes, they reference "
+                << "vtables without class info and keep their layout:\n";
+  for (auto &it : clouds) {
+    sdLog::warn() << "  " << it.first.first << "," << it.first.second
+                  << ": " << it.second << " classes\n";
+  }
+}
+
+bool SDBuildCHA::getQuarantinedAddrPts(const vtbl_t &vtbl, order_t &addrPts) {
+  vtbl_set_t visited;
+  std::vector<vtbl_t> worklist(1, vtbl);
+
+  while (!worklist.empty()) {
+    vtbl_t n = worklist.back();
+    worklist.pop_back();
+    if (!visited.insert(n).second)
+      continue;
+
+    // the unknown vtables have no address points
+    auto pts = quarantineAddrPtMap.find(n.first);
+    if (pts == quarantineAddrPtMap.end() || pts->second.size() <= n.second)
+      return false;
+
+    addrPts.push_back(vtbl_t(n.first, pts->second[n.second]));
+
+    auto children = quarantineCloudMap.find(n);
+    if (children != quarantineCloudMap.end())
+      worklist.insert(worklist.end(), children->second.begin(), children->second.end());
+  }
+  return true;
+}
+
 std::deque<SDBuildCHA::vtbl_name_t> SDBuildCHA::topoSort() {
   std::deque<vtbl_name_t> ordered;
   std::set<vtbl_name_t> visited;
@@ -415,6 +522,13 @@ void SDBuildCHA::topoSortHelper(vtbl_name_t node, std::deque<vtbl_name_t> &order
 }
 
 void SDBuildCHA::buildFunctionInfo() {
+  // several SD passes need the IDs, only build them once
+  if (hasFunctionInfo())
+    return;
+
+  if (hasCache() && loadFunctionInfo())
+    return;
+
   currentID = 1;
   std::deque<vtbl_name_t> topologicalOrder = topoSort();
 
@@ -493,6 +607,9 @@ void SDBuildCHA::buildFunctionInfo() {
       }
     }
   }
+
+  if (hasCache())
+    storeFunctionInfo();
 }
 
 SDBuildCHA::range_t SDBuildCHA::buildFunctionInfoForFunction(FunctionEntry &function, std::string rootFunctionName) {
@@ -566,7 +683,90 @@ static llvm::GlobalVariable* sd_mdnodeToGV(Metadata* vtblMd) {
 this method extracts the metadata for each module.
 This is used in the buildClouds method from above.
 */
-std::vector<SDBuildCHA::nmd_t> SDBuildCHA::extractMetadata(NamedMDNode* md) {
+SDBuildCHA::strtab_t SDBuildCHA::buildStringTable(Module &M) {
+  strtab_t strtab;
+  NamedMDNode* md = M.getNamedMetadata(SD_MD_STRTAB);
+  if (!md)
+    return strtab;
+
+  // after linking this holds the tables of all TUs, the same name can appear
+  // more than once but two different names must not share a hash
+  for (unsigned i = 0; i < md->getNumOperands(); i++) {
+    std::string name = sd_getStringFromMDTuple(md->getOperand(i)->getOperand(0));
+    uint64_t hash = sd_hashName(name);
+
+    auto itr = strtab.find(hash);
+    if (itr != strtab.end()) {
+      // the records only carry the hashes, a collision makes them ambiguous
+      if (itr->second != name)
+        report_fatal_error("SD: class info name hash collision between " +
+                           itr->second + " and " + name);
+      continue;
+    }
+    strtab[hash] = name;
+  }
+
+  sdLog::stream() << "Class info string table: " << strtab.size() << " names ("
+                  << md->getNumOperands() << " entries)\n";
+  return strtab;
+}
+
+static const std::string& sd_lookupName(const SDBuildCHA::strtab_t &strtab, uint64_t hash) {
+  static const std::string noParent = "";
+  if (hash == SD_CLASSINFO_NO_PARENT)
+    return noParent;
+
+  auto itr = strtab.find(hash);
+  if (itr == strtab.end())
+    report_fatal_error("SD: class info name missing from the string table");
+  return itr->second;
+}
+
+void SDBuildCHA::decodeClassInfo(const MDNode* record, const strtab_t &strtab, nmd_t &info) {
+  StringRef blob = sd_getCompactClassInfo(record)->getString();
+  size_t pos = sizeof(SD_CLASSINFO_MAGIC) - 1;
+  unsigned gvOp = 1;
+
+  uint64_t numSubVTables = sd_decodeNumber(blob, pos);
+  for (uint64_t i = 0; i < numSubVTables; i++) {
+    SDBuildCHA::nmd_sub_t subInfo;
+    subInfo.order        = sd_decodeNumber(blob, pos);
+    subInfo.start        = sd_decodeNumber(blob, pos);
+    subInfo.end          = sd_decodeNumber(blob, pos);
+    subInfo.addressPoint = sd_decodeNumber(blob, pos);
+
+    uint64_t numParents = sd_decodeNumber(blob, pos);
+    for (uint64_t j = 0; j < numParents; j++) {
+      vtbl_name_t ptName = sd_lookupName(strtab, sd_decodeHash(blob, pos));
+      uint64_t ptIdx = sd_decodeNumber(blob, pos);
+
+      assert(gvOp < record->getNumOperands());
+      GlobalVariable* parentVtable = sd_mdnodeToGV(record->getOperand(gvOp++).get());
+      if (parentVtable) {
+        ptName = parentVtable->getName();
+      }
+
+      subInfo.parents.insert(vtbl_t(ptName, ptIdx));
+    }
+
+    uint64_t numFunctions = sd_decodeNumber(blob, pos);
+    for (uint64_t j = 0; j < numFunctions; j++) {
+      std::string funcName = sd_lookupName(strtab, sd_decodeHash(blob, pos));
+      uint64_t offset = sd_decodeNumber(blob, pos);
+      subInfo.functions.push_back(FunctionEntry(funcName, vtbl_t(info.className, subInfo.order), offset));
+    }
+
+    bool currRangeCheck = (subInfo.start <= subInfo.addressPoint && subInfo.addressPoint <= subInfo.end);
+    bool prevVtblCheck = (i == 0 || (--info.subVTables.end())->end < subInfo.start);
+    assert(currRangeCheck && prevVtblCheck);
+
+    info.subVTables.push_back(subInfo);
+  }
+
+  assert(pos == blob.size() && gvOp == record->getNumOperands());
+}
+
+std::vector<SDBuildCHA::nmd_t> SDBuildCHA::extractMetadata(NamedMDNode* md, const strtab_t &strtab) {
   
   std::set<vtbl_name_t> classes;
   std::vector<SDBuildCHA::nmd_t> infoVec;
@@ -589,6 +789,17 @@ std::vector<SDBuildCHA::nmd_t> SDBuildCHA::extractMetadata(NamedMDNode* md) {
     if (classVtbl) {
       info.className = classVtbl->getName();
     }
+
+    // compact records keep all sub-vtables in a single operand
+    if (sd_getCompactClassInfo(md->getOperand(op))) {
+      decodeClassInfo(md->getOperand(op++), strtab, info);
+
+      if (classes.count(info.className) == 0) {
+        classes.insert(info.className);
+        infoVec.push_back(info);
+      }
+      continue;
+    }
     
     /*Paul:
     get the number of operands for the first operand 0 for each of the module operands*/
@@ -676,6 +887,11 @@ int64_t SDBuildCHA::getCloudSize(const SDBuildCHA::vtbl_name_t& vtbl) {
   return cloudSizeMap[v];//returns the cloud size for a certain v table 
 }
 
+int64_t SDBuildCHA::getCloudSize(const SDBuildCHA::vtbl_t& vtbl) {
+  auto itr = cloudSizeMap.find(vtbl);
+  return itr == cloudSizeMap.end() ? 0 : itr->second;
+}
+
 //calculate number of children for a single root node 
 uint32_t SDBuildCHA::calculateChildrenCounts(const SDBuildCHA::vtbl_t& root){
   uint32_t count = isDefined(root) ? 1 : 0;
@@ -704,10 +920,286 @@ void SDBuildCHA::clearAnalysisResults() {
   ancestorMap.clear();
   oldVTables.clear();
   cloudSizeMap.clear();
+  parentMap.clear();
+  subObjNameMap.clear();
+  undefinedVTables.clear();
+  quarantinedVTables.clear();
+  quarantineCloudMap.clear();
+  quarantineAddrPtMap.clear();
+  vthunksToRemove.clear();
+
+  vTableFunctionMap.clear();
+  functionMap.clear();
+  functionImplMap.clear();
+  functionRangeMap.clear();
+  functionIDMap.clear();
+  functionParentMap.clear();
+  currentID = -1;
 
   sd_print("Cleared SDBuildCHA analysis results ... \n");
 }
 
+/// ----------------------------------------------------------------------------
+/// On-disk analysis cache
+/// ----------------------------------------------------------------------------
+
+static std::string sd_md5String(MD5 &hash) {
+  MD5::MD5Result result;
+  SmallString<32> str;
+  hash.final(result);
+  MD5::stringifyResult(result, str);
+  return str.str();
+}
+
+/**
+ * Hash a metadata tree. The class info shares the base class layouts between
+ * nodes, so every node is hashed once and referred to by its digest.
+ */
+static std::string sd_hashMetadata(const Metadata *md, std::map<const MDNode*, std::string> &digests) {
+  if (!md)
+    return "null";
+
+  if (const MDString *mdStr = dyn_cast<MDString>(md))
+    return "s" + mdStr->getString().str();
+
+  if (const ConstantAsMetadata *cam = dyn_cast<ConstantAsMetadata>(md)) {
+    Constant *C = cam->getValue();
+    if (ConstantInt *ci = dyn_cast<ConstantInt>(C))
+      return "i" + std::to_string(ci->getSExtValue());
+    if (GlobalValue *gv = dyn_cast<GlobalValue>(C->stripPointerCasts()))
+      return "g" + gv->getName().str();
+    return "c";
+  }
+
+  const MDNode *node = dyn_cast<MDNode>(md);
+  if (!node)
+    return "?";
+
+  auto itr = digests.find(node);
+  if (itr != digests.end())
+    return itr->second;
+
+  MD5 hash;
+  for (const MDOperand &op : node->operands()) {
+    hash.update(sd_hashMetadata(op.get(), digests));
+    hash.update(",");
+  }
+  return digests[node] = "n" + sd_md5String(hash);
+}
+
+std::string SDBuildCHA::computeCacheKey(Module &M) {
+  // a thin backend only sees part of the program, it uses the key of the index
+  if (NamedMDNode *thinKey = M.getNamedMetadata(SD_MD_THIN_KEY)) {
+    assert(thinKey->getNumOperands() == 1 && "malformed thin key");
+    MDString *key = cast<MDString>(thinKey->getOperand(0)->getOperand(0));
+    sdLog::stream() << "SD cache key: " << key->getString() << " (thin link)\n";
+    return key->getString();
+  }
+
+  std::map<const MDNode*, std::string> digests;
+  std::map<std::string, std::string> classInfos;
+
+  for (auto itr = M.getNamedMDList().begin(); itr != M.getNamedMDList().end(); itr++) {
+    NamedMDNode* md = itr;
+    if (!md->getName().startswith(SD_MD_CLASSINFO))
+      continue;
+
+    MD5 hash;
+    for (unsigned i = 0; i < md->getNumOperands(); i++) {
+      hash.update(sd_hashMetadata(md->getOperand(i), digests));
+      hash.update(",");
+    }
+    classInfos[md->getName()] = sd_md5String(hash);
+  }
+
+  // the layouts also depend on which vtables are defined and what they point to
+  std::map<std::string, std::string> vtables;
+  for (GlobalVariable &GV : M.globals()) {
+    if (!sd_isVtableName_ref(GV.getName()))
+      continue;
+
+    MD5 hash;
+    ConstantArray *vtable = GV.hasInitializer() ? dyn_cast<ConstantArray>(GV.getInitializer()) : nullptr;
+    hash.update(vtable ? "defined" : "undefined");
+
+    for (unsigned i = 0; vtable && i < vtable->getNumOperands(); i++) {
+      Constant *elem = vtable->getOperand(i)->stripPointerCasts();
+      if (GlobalValue *gv = dyn_cast<GlobalValue>(elem)) {
+        hash.update(gv->getName());
+        hash.update(gv->isDeclaration() ? "d" : "D");
+      } else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(elem)) {
+        ConstantInt *ci = dyn_cast<ConstantInt>(CE->getOperand(0));
+        hash.update(ci ? std::to_string(ci->getSExtValue()) : "e");
+      } else {
+        hash.update(elem->isNullValue() ? "0" : "?");
+      }
+      hash.update(",");
+    }
+    vtables[GV.getName()] = sd_md5String(hash);
+  }
+
+  // files written by another format or another build of the passes are stale
+  MD5 hash;
+  hash.update(SD_CACHE_FORMAT_VERSION);
+  hash.update(LLVM_VERSION_STRING);
+  for (auto &entry : classInfos) {
+    hash.update(entry.first);
+    hash.update(entry.second);
+  }
+  for (auto &entry : vtables) {
+    hash.update(entry.first);
+    hash.update(entry.second);
+  }
+  std::string key = sd_md5String(hash);
+
+  sdLog::stream() << "SD cache key: " << key << " (" << classInfos.size()
+                  << " class infos, " << vtables.size() << " vtables)\n";
+  return key;
+}
+
+static void sd_writeEntry(std::ostream &out, const SDBuildCHA::FunctionEntry &entry) {
+  out << entry.functionName << " " << entry.vTable.first << " "
+      << entry.vTable.second << " " << entry.offsetInVTable;
+}
+
+static SDBuildCHA::FunctionEntry sd_readEntry(std::istream &in) {
+  SDBuildCHA::func_name_t functionName;
+  SDBuildCHA::vtbl_t vtbl;
+  uint64_t offset = 0;
+  in >> functionName >> vtbl.first >> vtbl.second >> offset;
+  return SDBuildCHA::FunctionEntry(functionName, vtbl, offset);
+}
+
+template<typename K>
+static void sd_writeEntryMap(std::ostream &out, const std::map<K, std::vector<SDBuildCHA::FunctionEntry>> &entryMap) {
+  out << entryMap.size() << "\n";
+  for (auto &entry : entryMap) {
+    out << entry.second.size();
+    for (auto &function : entry.second) {
+      out << " ";
+      sd_writeEntry(out, function);
+    }
+    out << "\n";
+  }
+}
+
+std::string SDBuildCHA::getCacheTmpPath(const std::string &tag) {
+  if (!cacheDirCreated) {
+    if (std::error_code EC = sys::fs::create_directories(cacheDir)) {
+      sdLog::warn() << "Could not create SD cache directory " << cacheDir << ": "
+                    << EC.message() << "\n";
+      return "";
+    }
+    cacheDirCreated = true;
+  }
+
+  SmallString<128> tmpPath;
+  if (sys::fs::createUniqueFile(getCachePath(tag) + ".tmp%%%%%%", tmpPath)) {
+    sdLog::warn() << "Could not write SD cache " << getCachePath(tag) << "\n";
+    return "";
+  }
+  return tmpPath.str();
+}
+
+bool SDBuildCHA::commitCacheFile(const std::string &tmpPath, const std::string &tag) {
+  if (sys::fs::rename(tmpPath, getCachePath(tag))) {
+    sdLog::warn() << "Could not write SD cache " << getCachePath(tag) << "\n";
+    sys::fs::remove(tmpPath);
+    return false;
+  }
+  return true;
+}
+
+void SDBuildCHA::storeFunctionInfo() {
+  std::string tmpPath = getCacheTmpPath("functions");
+  if (tmpPath.empty())
+    return;
+
+  std::ofstream out(tmpPath);
+
+  out << currentID << "\n";
+
+  out << functionIDMap.size() << "\n";
+  for (auto &entry : functionIDMap) {
+    sd_writeEntry(out, entry.first);
+    out << " " << entry.second << "\n";
+  }
+
+  out << functionRangeMap.size() << "\n";
+  for (auto &entry : functionRangeMap) {
+    sd_writeEntry(out, entry.first);
+    out << " " << entry.second.first << " " << entry.second.second << "\n";
+  }
+
+  // both maps are keyed by data contained in their entries
+  sd_writeEntryMap(out, functionMap);
+  sd_writeEntryMap(out, functionImplMap);
+  out.close();
+
+  if (out.fail()) {
+    sys::fs::remove(tmpPath);
+    return;
+  }
+
+  if (commitCacheFile(tmpPath, "functions"))
+    sdLog::stream() << "Stored function info in " << getCachePath("functions") << "\n";
+}
+
+bool SDBuildCHA::loadFunctionInfo() {
+  std::string path = getCachePath("functions");
+  std::ifstream in(path);
+  if (!in.good())
+    return false;
+
+  uint64_t cachedID = 0, count = 0, size = 0;
+  in >> cachedID;
+
+  in >> count;
+  for (uint64_t i = 0; i < count && in.good(); i++) {
+    FunctionEntry entry = sd_readEntry(in);
+    in >> functionIDMap[entry];
+  }
+
+  in >> count;
+  for (uint64_t i = 0; i < count && in.good(); i++) {
+    FunctionEntry entry = sd_readEntry(in);
+    range_t &range = functionRangeMap[entry];
+    in >> range.first >> range.second;
+  }
+
+  in >> count;
+  for (uint64_t i = 0; i < count && in.good(); i++) {
+    in >> size;
+    for (uint64_t j = 0; j < size && in.good(); j++) {
+      FunctionEntry entry = sd_readEntry(in);
+      functionMap[func_and_class_t(entry.functionName, entry.vTable.first)].push_back(entry);
+    }
+  }
+
+  in >> count;
+  for (uint64_t i = 0; i < count && in.good(); i++) {
+    in >> size;
+    std::vector<FunctionEntry> entries;
+    for (uint64_t j = 0; j < size && in.good(); j++)
+      entries.push_back(sd_readEntry(in));
+    if (!entries.empty())
+      functionImplMap[entries[0].functionName] = entries;
+  }
+
+  if (in.fail()) {
+    sdLog::warn() << "Ignoring corrupt SD cache " << path << "\n";
+    functionIDMap.clear();
+    functionRangeMap.clear();
+    functionMap.clear();
+    functionImplMap.clear();
+    return false;
+  }
+
+  currentID = cachedID;
+  sdLog::stream() << "Loaded function info from " << path << "\n";
+  return true;
+}
+
 /// ----------------------------------------------------------------------------
 /// Helper functions
 /// ----------------------------------------------------------------------------
@@ -0,0 +1,113 @@
+//===- SafeDispatchCallSiteIndex.cpp - SafeDispatch call site index -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the SDCallSiteIndex class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Transforms/IPO/SafeDispatchCallSiteIndex.h"
+
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
+
+using namespace llvm;
+
+bool SDCallSiteIndex::runOnModule(Module &M) {
+  sdTrace::Scope Trace("SDCallSiteIndex");
+  releaseMemory();
+
+  DenseMap<const Instruction *, unsigned> CallSiteMap;
+  Functions.reserve(M.size());
+  for (auto &F : M)
+    indexFunction(F, CallSiteMap);
+
+  linkVirtualCallSites(M, CallSiteMap);
+  Trace.count("callsites", CallSites.size());
+  Trace.count("returns", Returns.size());
+
+  sdLog::stream() << "Indexed " << Functions.size() << " functions, "
+                  << CallSites.size() << " CallSites (" << NumVirtualCallSites
+                  << " virtual) and " << Returns.size() << " returns\n";
+  return false;
+}
+
+void SDCallSiteIndex::indexFunction(Function &F,
+                                    DenseMap<const Instruction *, unsigned> &CallSiteMap) {
+  FunctionInfo Info;
+  Info.F = &F;
+  Info.FirstCallSite = CallSites.size();
+  Info.FirstReturn = Returns.size();
+
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      if (ReturnInst *RI = dyn_cast<ReturnInst>(&I)) {
+        Returns.push_back(RI);
+        continue;
+      }
+
+      CallSite Call(&I);
+      if (!Call.getInstruction())
+        continue;
+
+      CallSiteMap[&I] = CallSites.size();
+      CallSites.push_back({&I, Call.getCalledFunction(), nullptr});
+    }
+  }
+
+  Info.NumCallSites = CallSites.size() - Info.FirstCallSite;
+  Info.NumReturns = Returns.size() - Info.FirstReturn;
+  FunctionIndex[&F] = Functions.size();
+  Functions.push_back(Info);
+}
+
+void SDCallSiteIndex::linkVirtualCallSites(Module &M,
+                                           const DenseMap<const Instruction *, unsigned> &CallSiteMap) {
+  Function *IntrinsicFunction = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_checked_vptr));
+  if (IntrinsicFunction == nullptr)
+    return;
+
+  for (const Use &U : IntrinsicFunction->uses()) {
+    CallInst *IntrinsicCall = dyn_cast<CallInst>(U.getUser());
+    assert(IntrinsicCall && "Intrinsic was not wrapped in a CallInst?");
+
+    // The vptr reaches the call through the vtable GEP, the load of the
+    // function pointer and possibly a bitcast: follow the first user chain.
+    const User *Current = IntrinsicCall;
+    const Instruction *Call = nullptr;
+    for (int i = 0; i < 4 && !Current->user_empty(); ++i) {
+      Current = *Current->user_begin();
+      if (isa<CallInst>(Current) || isa<InvokeInst>(Current)) {
+        Call = cast<Instruction>(Current);
+        break;
+      }
+    }
+
+    auto Itr = Call ? CallSiteMap.find(Call) : CallSiteMap.end();
+    if (Itr == CallSiteMap.end()) {
+      sdLog::warn() << "CallSite for intrinsic was not found.\n";
+      continue;
+    }
+
+    if (!CallSites[Itr->second].CheckedVptr)
+      ++NumVirtualCallSites;
+    CallSites[Itr->second].CheckedVptr = IntrinsicCall;
+  }
+}
+
+char SDCallSiteIndex::ID = 0;
+
+INITIALIZE_PASS(SDCallSiteIndex, "sdcallsiteindex", "Index the call sites and returns", false, true)
+
+ModulePass *llvm::createSDCallSiteIndexPass() {
+  return new SDCallSiteIndex();
+}
@@ -15,6 +15,7 @@ namespace {
 
     bool runOnModule(Module &M) override {
       sdLog::stream() << "Started SDCleanup pass ...\n";
+      sdTrace::Scope Trace("SDCleanup");
 
       handleSDGetVtblIndex(&M);
       handleSDGetCheckedVtbl(&M);
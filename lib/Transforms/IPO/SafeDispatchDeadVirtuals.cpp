@@ -0,0 +1,338 @@
+//===-- SafeDispatchDeadVirtuals.cpp - SD dead virtual elimination --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file contains a ModulePass that removes virtual functions which can
+// never be reached through a vtable. Every checked virtual call names the
+// static class and the called function, so the union of the CHA function
+// ranges of all call sites gives the set of live vtable slots. The remaining
+// slots are pointed at a shared trap stub before the layout is built and the
+// function bodies that become unreferenced are erased. Only clouds whose
+// vtables are all internal or hidden are touched, the call sites of a DSO
+// loaded at run time are not in the live set.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchTools.h"
+
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+#define SD_DEAD_VIRTUAL_NAME "_SD_dead_virtual"
+
+namespace {
+  struct SDDeadVirtuals : public ModulePass {
+    static char ID; // Pass identification, replacement for typeid
+
+    typedef SDBuildCHA::vtbl_t        vtbl_t;
+    typedef SDBuildCHA::vtbl_name_t   vtbl_name_t;
+    typedef SDBuildCHA::range_t       range_t;
+    typedef SDBuildCHA::FunctionEntry FunctionEntry;
+
+    SDDeadVirtuals() : ModulePass(ID) {
+      sdLog::stream() << "Initializing SDDeadVirtuals pass\n";
+      initializeSDDeadVirtualsPass(*PassRegistry::getPassRegistry());
+    }
+
+    bool runOnModule(Module &M) override {
+      sdLog::blankLine();
+      sdLog::stream() << "Started SDDeadVirtuals pass ...\n";
+      sdTrace::Scope Trace("SDDeadVirtuals");
+
+      cha = &getAnalysis<SDBuildCHA>();
+      cha->buildFunctionInfo();
+
+      bool changed = false;
+      if (collectLiveRanges(M))
+        changed = removeDeadSlots(M);
+
+      sdLog::stream() << "Finished SDDeadVirtuals pass ...\n";
+      sdLog::blankLine();
+      return changed;
+    }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<SDBuildCHA>();
+      AU.addPreserved<SDBuildCHA>();
+    }
+
+    void releaseMemory() override {
+      liveRanges.clear();
+    }
+
+  private:
+    SDBuildCHA *cha = nullptr;
+    std::vector<range_t> liveRanges;
+
+    bool collectLiveRanges(Module &M);
+    bool removeDeadSlots(Module &M);
+    bool isLive(uint64_t id);
+    bool isClosedCloud(Module &M, const vtbl_name_t &root);
+    Function *getTrapStub(Module &M);
+  };
+} // namespace
+
+static StringRef sd_getClassNameFromMD(MDNode *mdNode) {
+  MDTuple *mdTuple = cast<MDTuple>(mdNode);
+  MDNode *nameMdNode = cast<MDNode>(mdTuple->getOperand(0).get());
+  return cast<MDString>(nameMdNode->getOperand(0))->getString();
+}
+
+static StringRef sd_getFunctionNameFromMD(MDNode *mdNode) {
+  return cast<MDString>(mdNode->getOperand(0))->getString();
+}
+
+static MDNode *sd_getMDArg(CallInst *CI, unsigned argNo) {
+  MetadataAsValue *arg = dyn_cast<MetadataAsValue>(CI->getArgOperand(argNo));
+  assert(arg);
+  MDNode *mdNode = dyn_cast<MDNode>(arg->getMetadata());
+  assert(mdNode);
+  return mdNode;
+}
+
+/**
+ * Every vtable load of a function slot has to go through a checked vptr,
+ * otherwise the call site does not tell us which function it can reach.
+ */
+static bool sd_allVcallsChecked(Module &M, Function *checkedF) {
+  Function *vtblIndexF = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_vtbl_index));
+  if (!vtblIndexF)
+    return true;
+
+  for (const Use &U : vtblIndexF->uses()) {
+    CallInst *CI = cast<CallInst>(U.getUser());
+    ConstantInt *idx = dyn_cast<ConstantInt>(CI->getArgOperand(0));
+    assert(idx);
+
+    // negative indices are offset-to-top, rtti and vbase/vcall offsets
+    if (idx->getSExtValue() < 0)
+      continue;
+
+    for (const Use &IU : CI->uses()) {
+      GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(IU.getUser());
+      if (!gep)
+        continue;
+
+      CallInst *base = dyn_cast<CallInst>(gep->getPointerOperand()->stripPointerCasts());
+      if (!base || base->getCalledFunction() != checkedF) {
+        sdLog::warn() << "Unchecked vtable load in " << CI->getParent()->getParent()->getName() << "\n";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool SDDeadVirtuals::collectLiveRanges(Module &M) {
+  Function *checkedF = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_checked_vptr));
+  if (!checkedF) {
+    sdLog::warn() << "No checked virtual calls, dead virtual elimination disabled\n";
+    return false;
+  }
+
+  for (Function &F : M)
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+      if (I->getMetadata(SD_MD_MEMPTR_OPT)) {
+        sdLog::warn() << "Virtual member function pointers found, dead virtual elimination disabled\n";
+        return false;
+      }
+
+  if (!sd_allVcallsChecked(M, checkedF)) {
+    sdLog::warn() << "Dead virtual elimination disabled\n";
+    return false;
+  }
+
+  uint64_t callSites = 0;
+  for (const Use &U : checkedF->uses()) {
+    CallInst *CI = cast<CallInst>(U.getUser());
+    std::string className = sd_getClassNameFromMD(sd_getMDArg(CI, 1));
+    std::string functionName = sd_getFunctionNameFromMD(sd_getMDArg(CI, 3));
+
+    std::vector<range_t> ranges = cha->getFunctionRange(functionName, className);
+    if (ranges.empty()) {
+      sdLog::warn() << "Call for " << functionName << " (" << className
+                    << ") has no range, dead virtual elimination disabled\n";
+      return false;
+    }
+
+    liveRanges.insert(liveRanges.end(), ranges.begin(), ranges.end());
+    callSites++;
+  }
+
+  sdLog::stream() << "Collected " << liveRanges.size() << " live ranges from "
+                  << callSites << " checked call sites\n";
+  return true;
+}
+
+bool SDDeadVirtuals::isLive(uint64_t id) {
+  // entries without an ID were never numbered, keep them
+  if (id == 0)
+    return true;
+
+  for (auto &range : liveRanges)
+    if (range.first <= id && id <= range.second)
+      return true;
+  return false;
+}
+
+/**
+ * A cloud is closed if no other DSO can see its vtables, so that all the calls
+ * through them are among the checked call sites of this module.
+ */
+bool SDDeadVirtuals::isClosedCloud(Module &M, const vtbl_name_t &root) {
+  for (const vtbl_t &v : cha->preorder(vtbl_t(root, 0))) {
+    GlobalVariable *vtblGV = M.getGlobalVariable(v.first, true);
+    if (!vtblGV || !vtblGV->hasInitializer())
+      return false;
+
+    if (!vtblGV->hasLocalLinkage() && !vtblGV->hasHiddenVisibility()) {
+      sdLog::log() << "Cloud " << root << " keeps its virtuals because "
+                   << v.first << " is visible outside of the module\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+Function *SDDeadVirtuals::getTrapStub(Module &M) {
+  if (Function *stub = M.getFunction(SD_DEAD_VIRTUAL_NAME))
+    return stub;
+
+  LLVMContext &C = M.getContext();
+  FunctionType *stubTy = FunctionType::get(Type::getVoidTy(C), false);
+  Function *stub = Function::Create(stubTy, GlobalValue::InternalLinkage, SD_DEAD_VIRTUAL_NAME, &M);
+  stub->addFnAttr(Attribute::NoReturn);
+  stub->addFnAttr(Attribute::NoUnwind);
+
+  IRBuilder<> builder(BasicBlock::Create(C, "entry", stub));
+  builder.CreateCall(Intrinsic::getDeclaration(&M, Intrinsic::trap), {});
+  builder.CreateUnreachable();
+  return stub;
+}
+
+bool SDDeadVirtuals::removeDeadSlots(Module &M) {
+  // vtable name -> slot indices in the old vtable array
+  std::map<vtbl_name_t, std::set<uint64_t>> deadSlots;
+  // root -> whether the cloud is closed
+  std::map<vtbl_name_t, bool> closedClouds;
+  uint64_t openClouds = 0;
+
+  for (auto itr = cha->functionEntries_begin(); itr != cha->functionEntries_end(); itr++) {
+    const vtbl_t &vtbl = itr->first;
+    if (cha->isUndefined(vtbl) || cha->isUndefined(cha->getAncestor(vtbl)))
+      continue;
+
+    vtbl_name_t root = cha->getAncestor(vtbl);
+    auto closed = closedClouds.find(root);
+    if (closed == closedClouds.end()) {
+      closed = closedClouds.insert(std::make_pair(root, isClosedCloud(M, root))).first;
+      if (!closed->second)
+        openClouds++;
+    }
+    if (!closed->second)
+      continue;
+
+    for (const FunctionEntry &entry : itr->second) {
+      if (isLive(cha->getFunctionEntryID(entry)))
+        continue;
+
+      sdLog::log() << "Dead slot: " << entry << "\n";
+      deadSlots[vtbl.first].insert(cha->addrPt(vtbl) + entry.offsetInVTable);
+    }
+  }
+
+  if (openClouds)
+    sdLog::stream() << "Dead virtuals: skipped " << openClouds
+                    << " clouds with vtables visible outside of the module\n";
+
+  if (deadSlots.empty()) {
+    sdLog::stream() << "No dead virtual functions found\n";
+    return false;
+  }
+
+  Function *stub = getTrapStub(M);
+  std::set<Function *> candidates;
+  uint64_t slotsRemoved = 0;
+
+  for (auto &vtblSlots : deadSlots) {
+    const vtbl_name_t &vtbl = vtblSlots.first;
+    GlobalVariable *vtblGV = M.getGlobalVariable(vtbl, true);
+    assert(vtblGV && cha->hasOldVTable(vtbl));
+
+    ConstantArray *oldArr = cha->getOldVTable(vtbl);
+    std::vector<Constant *> elems;
+    for (unsigned i = 0; i < oldArr->getNumOperands(); i++)
+      elems.push_back(oldArr->getOperand(i));
+
+    for (uint64_t slot : vtblSlots.second) {
+      assert(slot < elems.size());
+      Constant *elem = elems[slot];
+
+      if (Function *F = dyn_cast<Function>(elem->stripPointerCasts())) {
+        if (F == stub)
+          continue;
+        candidates.insert(F);
+      } else if (elem->isNullValue()) {
+        continue;
+      }
+
+      elems[slot] = ConstantExpr::getBitCast(stub, elem->getType());
+      slotsRemoved++;
+    }
+
+    ConstantArray *newArr = cast<ConstantArray>(ConstantArray::get(oldArr->getType(), elems));
+    vtblGV->setInitializer(newArr);
+    cha->setOldVTable(vtbl, newArr);
+    if (oldArr->use_empty())
+      oldArr->destroyConstant();
+  }
+
+  // drop the bodies that are not referenced from anywhere else
+  uint64_t functionsRemoved = 0;
+  uint64_t instsRemoved = 0;
+  for (Function *F : candidates) {
+    F->removeDeadConstantUsers();
+    if (!F->use_empty() || !F->isDiscardableIfUnused())
+      continue;
+
+    sdLog::log() << "Removing dead virtual function " << F->getName() << "\n";
+    if (!F->isDeclaration()) {
+      instsRemoved += sd_instCount(F);
+      functionsRemoved++;
+    }
+    F->eraseFromParent();
+  }
+
+  sdLog::stream() << "Dead virtuals: " << slotsRemoved << " vtable slots cleared, "
+                  << functionsRemoved << " functions removed ("
+                  << instsRemoved << " IR instructions)\n";
+  return true;
+}
+
+char SDDeadVirtuals::ID = 0;
+
+INITIALIZE_PASS_BEGIN(SDDeadVirtuals, "sddve", "Dead virtual function elimination for SafeDispatch", false, false)
+INITIALIZE_PASS_DEPENDENCY(SDBuildCHA)
+INITIALIZE_PASS_END(SDDeadVirtuals, "sddve", "Dead virtual function elimination for SafeDispatch", false, false)
+
+ModulePass* llvm::createSDDeadVirtualsPass() {
+  return new SDDeadVirtuals();
+}
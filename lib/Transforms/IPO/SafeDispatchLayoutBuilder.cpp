@@ -7,6 +7,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
@@ -14,6 +15,8 @@
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
 
 #include "llvm/Transforms/IPO/SafeDispatchLayoutBuilder.h"
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
@@ -27,6 +30,7 @@
 #include <set>
 #include <map>
 #include <algorithm>
+#include <fstream>
 #include <llvm/Transforms/IPO/SafeDispatchLogStream.h>
 
 // you have to modify the following 4 files for each additional LLVM pass
@@ -39,6 +43,9 @@
 using namespace llvm;
 
 #define WORD_WIDTH 8
+#define REL_ENTRY_WIDTH 4
+#define RTTI_SLOTS 2                    // offset-to-top and rtti right before the address point
+#define TRIMMED_SLOT_IND ((uint64_t) -1)
 #define NEW_VTABLE_NAME(vtbl) ("_SD" + vtbl)
 #define NEW_VTHUNK_NAME(fun,parent) ("_SVT" + parent + fun->getName().str())
 #define GEP_OPCODE      29
@@ -54,6 +61,111 @@ static bool sd_isVthunk(const llvm::StringRef& name) {
          name.startswith("_ZTcv");  // virtual covariant thunk
 }
 
+/**
+ * Virtual calls through member function pointers index the vtable with the
+ * byte offset stored in the member pointer.
+ */
+static bool sd_hasVirtualMemberPointerCall(Module& M) {
+  for (Function& F : M)
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+      if (I->getMetadata(SD_MD_MEMPTR_OPT))
+        return true;
+  return false;
+}
+
+/**
+ * Loads of the offset-to-top straight from a loaded vptr, e.g. dynamic_cast<void*>
+ * compiled without -femit-ivtbl. They carry no class name, so the slot can not
+ * be attributed to a cloud.
+ */
+static bool sd_hasRawOffsetToTopLoad(Module& M) {
+  const DataLayout& DL = M.getDataLayout();
+
+  for (Function& F : M)
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      LoadInst* LI = dyn_cast<LoadInst>(&*I);
+      GEPOperator* gep = LI ? dyn_cast<GEPOperator>(LI->getPointerOperand()->stripPointerCasts()) : NULL;
+      if (!gep || gep->getNumIndices() != 1 ||
+          !isa<LoadInst>(gep->getPointerOperand()->stripPointerCasts()))
+        continue;
+
+      APInt offset(DL.getPointerSizeInBits(), 0);
+      if (gep->accumulateConstantOffset(DL, offset) &&
+          offset.getSExtValue() == -RTTI_SLOTS * WORD_WIDTH) {
+        sdLog::log() << "Offset-to-top read without a vtable index in " << F.getName() << ": "
+                     << *LI << "\n";
+        return true;
+      }
+    }
+  return false;
+}
+
+/**
+ * Collect the clouds whose offset-to-top or rtti slots are read by typeid or
+ * dynamic_cast. Returns false if the runtime __dynamic_cast is called or the
+ * offset-to-top is read without a vtable index, since these read the slots from
+ * vtables that can not be attributed to a cloud.
+ */
+static bool sd_collectRTTIClouds(Module& M, SDBuildCHA* cha,
+                                 std::set<SDLayoutBuilder::vtbl_name_t>& rttiClouds) {
+  if (M.getFunction("__dynamic_cast") || sd_hasRawOffsetToTopLoad(M))
+    return false;
+
+  Function* vtblIndexF = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_vtbl_index));
+  if (!vtblIndexF)
+    return true;
+
+  for (const Use& U : vtblIndexF->uses()) {
+    CallInst* CI = cast<CallInst>(U.getUser());
+    ConstantInt* oldIndex = dyn_cast<ConstantInt>(CI->getArgOperand(0));
+    assert(oldIndex);
+
+    int64_t ind = oldIndex->getSExtValue();
+    if (ind >= 0 || ind < -RTTI_SLOTS)
+      continue;
+
+    MDNode* mdNode = cast<MDNode>(cast<MetadataAsValue>(CI->getArgOperand(1))->getMetadata());
+    MDNode* nameMdNode = cast<MDNode>(mdNode->getOperand(0).get());
+    SDLayoutBuilder::vtbl_t vtbl(cast<MDString>(nameMdNode->getOperand(0))->getString(), 0);
+
+    // same lookup as translateVtblInd
+    if (cha->isUndefined(vtbl) && cha->hasFirstDefinedChild(vtbl))
+      vtbl = cha->getFirstDefinedChild(vtbl);
+
+    if (cha->hasAncestor(vtbl))
+      rttiClouds.insert(cha->getAncestor(vtbl));
+  }
+
+  return true;
+}
+
+/**
+ * Collect the clouds in which a vtable index has a use the relative encoding
+ * cannot rewrite, their slots would be read as 8-byte entries.
+ */
+static void sd_collectAbsoluteClouds(Module& M, SDBuildCHA* cha,
+                                     std::set<SDLayoutBuilder::vtbl_name_t>& absoluteClouds) {
+  Function* vtblIndexF = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_vtbl_index));
+  if (!vtblIndexF)
+    return;
+
+  for (const Use& U : vtblIndexF->uses()) {
+    CallInst* CI = cast<CallInst>(U.getUser());
+    if (SDLayoutBuilder::canRewriteRelativeIndex(CI, M.getDataLayout()))
+      continue;
+
+    MDNode* mdNode = cast<MDNode>(cast<MetadataAsValue>(CI->getArgOperand(1))->getMetadata());
+    MDNode* nameMdNode = cast<MDNode>(mdNode->getOperand(0).get());
+    SDLayoutBuilder::vtbl_t vtbl(cast<MDString>(nameMdNode->getOperand(0))->getString(), 0);
+
+    if (cha->hasAncestor(vtbl)) {
+      sdLog::log() << "Cloud " << cha->getAncestor(vtbl) << " keeps absolute entries because of "
+                   << *CI << "\n";
+      absoluteClouds.insert(cha->getAncestor(vtbl));
+    }
+  }
+}
+
 /**Paul:
 this function is used to dump the new layout. 
 It is used 7 times in this pass in order to check if
@@ -144,8 +256,18 @@ bool SDLayoutBuilder::verifyNewLayouts(Module &M) {
       const range_t &r = cha->getRange(n);
       uint64_t oldVtblSize = r.second - (r.first - prePadMap[n]) + 1;
       auto minMax = std::minmax_element (indMap[n].begin(), indMap[n].end());
+      uint64_t span = minMax.second->first - minMax.first->first + 1;
+
+      // dropped offset-to-top/rtti slots are missing from the new layout
+      for (int64_t pos = r.first; pos <= (int64_t) r.second; pos++) {
+        if (!isTrimmedSlot(n, pos))
+          continue;
+        oldVtblSize--;
+        if (minMax.first->first < (uint64_t) pos && (uint64_t) pos < minMax.second->first)
+          span--;
+      }
 
-      if ((minMax.second->first - minMax.first->first + 1) != oldVtblSize) {
+      if (span != oldVtblSize) {
           std::cerr << "In ivtbl " << vtbl << " min-max rangefor "
             << n.first << "," << n.second << 
             " is (" << minMax.first->first << "-"
@@ -234,6 +356,9 @@ bool SDLayoutBuilder::verifyNewLayouts(Module &M) {
         uint64_t newChildAddrPt = indMap[*child][childAddrPt];
 
         for (int64_t ind = 0; ind < ptEnd - ptStart + prePadMap[pt] + 1; ind++) {
+          if (isTrimmedSlot(pt, ptStart + ind - prePadMap[pt]))
+            continue;
+
           int64_t newPtInd =  indMap[pt][ptStart + ind - prePadMap[pt]] - newPtAddrPt;
           int64_t newChildInd = indMap[*child][ptStart + ind - prePadMap[pt] + ptToChildAdj] - newChildAddrPt;
 
@@ -254,8 +379,8 @@ bool SDLayoutBuilder::verifyNewLayouts(Module &M) {
   return true;
 }
 
-ModulePass* llvm::createSDLayoutBuilderPass(bool interleave) {
-  return new SDLayoutBuilder(interleave);
+ModulePass* llvm::createSDLayoutBuilderPass(bool interleave, bool relative, bool trimRTTI) {
+  return new SDLayoutBuilder(interleave, relative, trimRTTI);
 }
 
 /// ----------------------------------------------------------------------------
@@ -338,11 +463,34 @@ void SDLayoutBuilder::createThunkFunctions(Module& M, const vtbl_name_t& rootNam
       std::string newThunkName(NEW_VTHUNK_NAME(thunkF, parentClass));
       
       //if allready exists than skip 
-      if (M.getFunction(newThunkName)) {
+      if (vthunkMap.count(newThunkName)) {
         // we already created such function, will use that later
         continue;
       }
 
+      thunksRequested++;
+      thunkInstsBefore += sd_instCount(thunkF);
+
+      // the clones only differ in the rewritten vcall offsets, so a clone of the
+      // same thunk with the same new offsets can be shared between parents whose
+      // vtables use the same entry encoding
+      vthunk_key_t key(thunkF, entryWidth(rootName), relativeClouds.count(rootName) != 0,
+                       std::vector<int64_t>());
+      if (sd_vcall_indexF) {
+        for (inst_iterator I = inst_begin(thunkF), E = inst_end(thunkF); I != E; ++I) {
+          CallInst* call = dyn_cast<CallInst>(&*I);
+          if (call && call->getCalledFunction() == sd_vcall_indexF) {
+            int64_t oldIndex = cast<ConstantInt>(call->getArgOperand(0))->getSExtValue() / WORD_WIDTH;
+            std::get<3>(key).push_back(translateVtblInd(vtbl_t(vtbl,order), oldIndex, true));
+          }
+        }
+      }
+
+      if (vthunkCloneMap.count(key)) {
+        vthunkMap[newThunkName] = vthunkCloneMap[key];
+        continue;
+      }
+
       // duplicate the function and rename it
       ValueToValueMapTy VMap;
 
@@ -355,6 +503,10 @@ void SDLayoutBuilder::createThunkFunctions(Module& M, const vtbl_name_t& rootNam
       //insert the new thunk function into the module function list 
       M.getFunctionList().push_back(newThunkF);
 
+      vthunkMap[newThunkName] = newThunkF;
+      vthunkCloneMap[key] = newThunkF;
+      thunkInstsAfter += sd_instCount(newThunkF);
+
       //start replacing the old index in the instruction witht the new index 
       CallInst* CI = NULL; //declare a new call instruction 
       
@@ -392,9 +544,23 @@ void SDLayoutBuilder::createThunkFunctions(Module& M, const vtbl_name_t& rootNam
             //compute new index based on the fact that it is relative or not
             //in our case relative is always on  
             int64_t newIndex = translateVtblInd(vtbl_t(vtbl,order), oldIndex, true);
-            
-            //multiply with word_width == 8
-            Value* newValue = ConstantInt::get(IntegerType::getInt64Ty(C), newIndex * WORD_WIDTH);
+
+            //multiply with the entry width (8, or 4 for relative vtables)
+            uint64_t width = entryWidth(rootName);
+
+            //relative vtables: the thunk loads a 32-bit offset instead of a ptrdiff
+            if (relativeClouds.count(rootName)) {
+              std::vector<User*> slots(CI->user_begin(), CI->user_end());
+              for (User* slot : slots) {
+                // checked by canUseRelativeLayout
+                if (!isa<GetElementPtrInst>(slot) ||
+                    !rewriteRelativeSlot(cast<Instruction>(slot), newIndex * width))
+                  report_fatal_error("SD: unexpected use of the vcall offset in the relative vthunk " +
+                                     newThunkName);
+              }
+            }
+
+            Value* newValue = ConstantInt::get(IntegerType::getInt64Ty(C), newIndex * width);
             
             //set the new index value in the call instrunction 
             //set the new value of the v pointer 
@@ -428,10 +594,11 @@ void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
   vtbl_t root(vtbl,0);
   order_t pre = cha->preorder(root);
   uint64_t max = 0;
+  uint64_t trimmed = trimmedClouds.count(vtbl) ? RTTI_SLOTS : 0;
 
   for(const vtbl_t child : pre) {
     const range_t& r = cha->getRange(child);
-    uint64_t size = r.second - r.first + 1;
+    uint64_t size = r.second - r.first + 1 - trimmed;
     if (size > max)
       max = size;
   }
@@ -449,7 +616,7 @@ void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
 
   assert((max & (max-1)) == 0 && "max is not a power of 2");
 
-  alignmentMap[vtbl] = max * WORD_WIDTH;
+  alignmentMap[vtbl] = max * entryWidth(vtbl);
 
   //sd_print("ALIGNMENT: %s, %u\n", vtbl.data(), max*WORD_WIDTH);
 
@@ -459,7 +626,7 @@ void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
 
     const range_t &r = cha->getRange(child);
     uint64_t size = r.second - r.first + 1;
-    uint64_t addrpt = cha->addrPt(child) - r.first;
+    uint64_t addrpt = cha->addrPt(child) - r.first - trimmed;
     uint64_t padEntries = orderedVtbl.size() + addrpt;
     uint64_t padSize = (padEntries % max == 0) ? 0 : max - (padEntries % max);
 
@@ -471,6 +638,8 @@ void SDLayoutBuilder::orderCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
     }
 
     for(unsigned i=0; i<size; i++) {
+      if (isTrimmedSlot(child, r.first + i))
+        continue;
       orderedVtbl.push_back(interleaving_t(child, r.first + i));
     }
   }
@@ -586,7 +755,7 @@ void SDLayoutBuilder::interleaveCloudNew(SDLayoutBuilder::vtbl_name_t& vtbl) {
 
   // append the positive part to the negative part in the interleaving map 
   interleavingMap[vtbl].insert(interleavingMap[vtbl].end(), positive_list_Part.begin(), positive_list_Part.end());
-  alignmentMap[vtbl] = WORD_WIDTH;
+  alignmentMap[vtbl] = entryWidth(vtbl);
   
   sd_print("Finishing Interleaving for v table %s...\n", vtbl.c_str());
 }
@@ -685,7 +854,7 @@ void SDLayoutBuilder::interleaveCloud(SDLayoutBuilder::vtbl_name_t& vtbl) {
 
   // append the positive part to the negative part in the interleaving map 
   interleavingMap[vtbl].insert(interleavingMap[vtbl].end(), positive_list_Part.begin(), positive_list_Part.end());
-  alignmentMap[vtbl] = WORD_WIDTH;
+  alignmentMap[vtbl] = entryWidth(vtbl);
   
   sd_print("Finishing Interleaving for v table %s...\n", vtbl.c_str());
 }
@@ -708,8 +877,20 @@ void SDLayoutBuilder::calculateNewLayoutInds(SDLayoutBuilder::vtbl_name_t& vtbl)
     
     sd_print("NewLayoutInds for vtable (%s, %d)\n", ivtbl.first.first.c_str(), ivtbl.first.second);
     if(ivtbl.first != dummyVtable) {//Paul: do not count dummy v tables
+      std::vector<uint64_t>& inds = newLayoutInds[ivtbl.first];
+
+      // dropped slots keep their place in the index vector, but have no new index
+      if (trimmedClouds.count(vtbl)) {
+        int64_t first = (int64_t) cha->getRange(ivtbl.first).first - (int64_t) prePadMap[ivtbl.first];
+        while (first + (int64_t) inds.size() < (int64_t) ivtbl.second) {
+          assert(isTrimmedSlot(ivtbl.first, first + inds.size()));
+          inds.push_back(TRIMMED_SLOT_IND);
+          trimBytesSaved += entryWidth(vtbl);
+        }
+      }
+
       // record the new index of the vtable element coming from the current vtable
-      newLayoutInds[ivtbl.first].push_back(currentIndex++);
+      inds.push_back(currentIndex++);
     } else {
       currentIndex++;
     }
@@ -926,14 +1107,24 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
 
   // get the size
   uint64_t newSize = newVtbl.size();
-  
-  //set the v table to pointer type
-  PointerType* vtblElemType = PointerType::get(IntegerType::get(M.getContext(), WORD_WIDTH), 0);
+
+  LLVMContext& Context = M.getContext();
+  bool isRel = relativeClouds.count(vtbl);
+
+  //set the v table to pointer type, or to i32 offsets for relative vtables
+  Type* vtblElemType = isRel ? (Type*) IntegerType::getInt32Ty(Context) :
+    (Type*) PointerType::get(IntegerType::get(Context, WORD_WIDTH), 0);
   
   //create and array of pointers of newSize 
   ArrayType* newArrType = ArrayType::get(vtblElemType, newSize);
 
-  LLVMContext& Context = M.getContext();
+  // create the new v global variable which will be used to replace the old one,
+  // relative entries refer to their own slot so it has to exist before the initializer
+  GlobalVariable* newGlobalVariable = new GlobalVariable(M,
+                                        newArrType, 
+                                              true,
+                   GlobalVariable::InternalLinkage,
+                    nullptr, NEW_VTABLE_NAME(vtbl)); // give new v table name, NEW_VTABLE_NAME(vtbl) ("_SD" + vtbl)
 
   // fill the interleaved vtable element list
   std::vector<Constant*> newVtableElems;
@@ -967,7 +1158,7 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
       if (thunk) {
 
         //create a new thunk function with a new name based on thunk and the parent class name 
-        Function* newThunk = M.getFunction(NEW_VTHUNK_NAME(thunk, cha->getLayoutClassName(ivtbl.first)));
+        Function* newThunk = vthunkMap[NEW_VTHUNK_NAME(thunk, cha->getLayoutClassName(ivtbl.first))];
         assert(newThunk);
         
         //create a new bit cast constant using the newthunk and the context Context
@@ -986,6 +1177,22 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
     }
   }
   
+  //relative vtables: replace each element by its offset from the slot holding it
+  if (isRel) {
+    Constant* zero32 = ConstantInt::get(Type::getInt32Ty(Context), 0);
+
+    for (uint64_t i = 0; i < newVtableElems.size(); i++) {
+      Constant* slotInd[2] = {zero32, ConstantInt::get(Type::getInt32Ty(Context), i)};
+      Constant* slot = ConstantExpr::getGetElementPtr(newArrType, newGlobalVariable, slotInd, true);
+
+      if (isa<GlobalValue>(newVtableElems[i]->stripPointerCasts()))
+        relRelocsRemoved++;
+
+      newVtableElems[i] = relativeEntry(M, newVtableElems[i], slot);
+    }
+    relBytesSaved += newSize * (WORD_WIDTH - entryWidth(vtbl));
+  }
+
   /*
   start creating the new global variables witht the new v table layouts inside  
   */
@@ -993,13 +1200,6 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
   // create the constant initializer
   Constant* newVtableInit = ConstantArray::get(newArrType, newVtableElems);
 
-  // create the new v global variable which will be used to replace the old one
-  GlobalVariable* newGlobalVariable = new GlobalVariable(M,
-                                        newArrType, 
-                                              true,
-                   GlobalVariable::InternalLinkage,
-                    nullptr, NEW_VTABLE_NAME(vtbl)); // give new v table name, NEW_VTABLE_NAME(vtbl) ("_SD" + vtbl)
-
   assert(alignmentMap.count(vtbl));
 
   // compute the new v table alignment
@@ -1107,6 +1307,10 @@ void SDLayoutBuilder::createNewVTable(Module& M, SDLayoutBuilder::vtbl_name_t& v
                                                                  indices, //std::vector<Constant*>
                                                                    true); //bool inBounds
       
+      // relative vtables have i32 elements, keep the type the users expect
+      if (newConstExpr->getType() != userCE->getType())
+        newConstExpr = ConstantExpr::getBitCast(newConstExpr, userCE->getType());
+
       // replace in the user constant expression 
       // with the one that uses the new vtable, newConstExpr
       userCE->replaceAllUsesWith(newConstExpr);
@@ -1139,6 +1343,8 @@ void SDLayoutBuilder::fillVtablePart(SDLayoutBuilder::interleaving_list_t& vtblP
     uint64_t addrPt = cha->addrPt(n);  // get the address point of the vtable
     const range_t &r = cha->getRange(n); // get the range (start & end address) of that particular v table 
     posMap[n]     = positivePartOn_Off ? addrPt : (addrPt - 1); // position map = addrPt or addrPt - 1
+    if (!positivePartOn_Off && isTrimmedSlot(n, addrPt - 1))
+      posMap[n]  -= RTTI_SLOTS;                                  // start below the dropped slots
     lastPosMap[n] = positivePartOn_Off ? r.second : (r.first - prePadMap[n]); //set last position map 
   }
 
@@ -1223,6 +1429,8 @@ int64_t SDLayoutBuilder::translateVtblInd(SDLayoutBuilder::vtbl_t vname, int64_t
       assert(false);
     }
     
+    assert(newInds.at(fullIndex) != TRIMMED_SLOT_IND && "offset-to-top/rtti slot was dropped");
+
     //return the new index as the difference between the fullIndex and old address point 
     return ((int64_t) newInds.at(fullIndex)) - ((int64_t) newInds.at(oldAddrPt));
 
@@ -1230,6 +1438,7 @@ int64_t SDLayoutBuilder::translateVtblInd(SDLayoutBuilder::vtbl_t vname, int64_t
   } else {
     //offset >= 0 and offset <= new indices size()
     assert(0 <= offset && offset <= (int64_t)newInds.size());
+    assert(newInds[offset] != TRIMMED_SLOT_IND && "offset-to-top/rtti slot was dropped");
 
     //return the new index 
     return newInds[offset];
@@ -1241,6 +1450,403 @@ llvm::Constant* SDLayoutBuilder::getVTableRangeStart(const SDLayoutBuilder::vtbl
   return newVTableStartAddrMap[vtbl];
 }
 
+/*
+ * Relative vtables: every entry is a 32-bit offset from the entry to its target,
+ * so the new vtables need no dynamic relocations and take half of the space.
+ */
+bool SDLayoutBuilder::isRelative(const SDLayoutBuilder::vtbl_t& vtbl) {
+  return cha->hasAncestor(vtbl) && relativeClouds.count(cha->getAncestor(vtbl));
+}
+
+uint64_t SDLayoutBuilder::entryWidth(const SDLayoutBuilder::vtbl_name_t& root) {
+  return relativeClouds.count(root) ? REL_ENTRY_WIDTH : WORD_WIDTH;
+}
+
+bool SDLayoutBuilder::canUseRelativeLayout(Module& M, const SDLayoutBuilder::vtbl_name_t& root,
+                                           const std::set<SDLayoutBuilder::vtbl_name_t>& absoluteClouds) {
+  if (absoluteClouds.count(root))
+    return false;
+
+  Function* vcallIndexF = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_vcall_index));
+  order_t pre = cha->preorder(vtbl_t(root, 0));
+  std::set<vtbl_name_t> visited;
+
+  for (const vtbl_t& v : pre) {
+    if (!cha->hasOldVTable(v.first) || !visited.insert(v.first).second)
+      continue;
+
+    ConstantArray* vtableArr = cha->getOldVTable(v.first);
+
+    for (unsigned i = 0; i < vtableArr->getNumOperands(); i++) {
+      Constant* elem = vtableArr->getOperand(i)->stripPointerCasts();
+      ConstantExpr* CE = dyn_cast<ConstantExpr>(elem);
+
+      if (elem->isNullValue())
+        continue;
+
+      // offset-to-top and vbase offsets
+      if (CE && CE->getOpcode() == Instruction::IntToPtr) {
+        ConstantInt* off = dyn_cast<ConstantInt>(CE->getOperand(0));
+        if (off && off->getValue().isSignedIntN(32))
+          continue;
+      }
+
+      // the vthunks load the vcall offset from the slot
+      Function* F = dyn_cast<Function>(elem);
+      if (F && vcallIndexF && sd_isVthunk(F->getName()) && !F->isDeclaration()) {
+        for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+          CallInst* call = dyn_cast<CallInst>(&*I);
+          if (!call || call->getCalledFunction() != vcallIndexF)
+            continue;
+
+          for (User* slot : call->users()) {
+            if (!canRewriteRelativeSlot(slot)) {
+              sdLog::log() << "Cloud " << root << " keeps absolute entries because of "
+                           << F->getName() << "\n";
+              return false;
+            }
+          }
+        }
+      }
+
+      // external functions are reached through an internal stub
+      if (F && !F->isVarArg())
+        continue;
+
+      // rtti and functions defined in this module
+      GlobalValue* GV = dyn_cast<GlobalValue>(elem);
+      if (GV && !GV->isDeclaration())
+        continue;
+
+      sdLog::log() << "Cloud " << root << " keeps absolute entries because of "
+                   << v.first << "[" << i << "]\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+Function* SDLayoutBuilder::getRelativeStub(Module& M, Function* F) {
+  if (!F->isDeclaration())
+    return F;
+
+  std::string stubName = "_SDRel" + F->getName().str();
+  if (Function* stub = M.getFunction(stubName))
+    return stub;
+
+  Function* stub = Function::Create(F->getFunctionType(), GlobalValue::InternalLinkage, stubName, &M);
+  stub->setAttributes(F->getAttributes());
+  stub->setCallingConv(F->getCallingConv());
+
+  IRBuilder<> builder(BasicBlock::Create(M.getContext(), "entry", stub));
+  std::vector<Value*> args;
+  for (Argument& arg : stub->args())
+    args.push_back(&arg);
+
+  CallInst* call = builder.CreateCall(F, args);
+  call->setTailCall();
+  call->setAttributes(F->getAttributes());
+  call->setCallingConv(F->getCallingConv());
+
+  if (F->getReturnType()->isVoidTy())
+    builder.CreateRetVoid();
+  else
+    builder.CreateRet(call);
+
+  return stub;
+}
+
+Constant* SDLayoutBuilder::relativeEntry(Module& M, Constant* elem, Constant* slot) {
+  LLVMContext& C = M.getContext();
+  Type* Int32Ty = Type::getInt32Ty(C);
+  Type* Int64Ty = Type::getInt64Ty(C);
+  Constant* target = elem->stripPointerCasts();
+
+  // padding and missing rtti
+  if (target->isNullValue())
+    return ConstantInt::get(Int32Ty, 0);
+
+  // offset-to-top and vbase offsets are stored as they are
+  ConstantExpr* CE = dyn_cast<ConstantExpr>(target);
+  if (CE && CE->getOpcode() == Instruction::IntToPtr)
+    return ConstantExpr::getTrunc(CE->getOperand(0), Int32Ty);
+
+  if (Function* F = dyn_cast<Function>(target))
+    target = getRelativeStub(M, F);
+
+  Constant* targetInt = ConstantExpr::getPtrToInt(target, Int64Ty);
+  Constant* slotInt   = ConstantExpr::getPtrToInt(slot, Int64Ty);
+  return ConstantExpr::getTrunc(ConstantExpr::getSub(targetInt, slotInt), Int32Ty);
+}
+
+/*
+ * Replace the loads through oldPtr by a load of the 32-bit entry at entryAddr.
+ */
+static bool sd_rewriteRelativeLoads(Value* oldPtr, Value* entryAddr) {
+  LLVMContext& C = entryAddr->getContext();
+  std::vector<User*> users(oldPtr->user_begin(), oldPtr->user_end());
+  bool rewritten = true;
+
+  for (User* user : users) {
+    if (BitCastInst* BC = dyn_cast<BitCastInst>(user)) {
+      rewritten &= sd_rewriteRelativeLoads(BC, entryAddr);
+      if (BC->use_empty())
+        BC->eraseFromParent();
+    } else if (LoadInst* LI = dyn_cast<LoadInst>(user)) {
+      IRBuilder<> builder(LI);
+      Value* entryPtr = builder.CreateBitCast(entryAddr, Type::getInt32PtrTy(C));
+      Value* entry    = builder.CreateLoad(entryPtr, "sd.rel.entry");
+      Value* result;
+
+      if (LI->getType()->isPointerTy()) {
+        // function pointers and rtti are relative to the entry itself
+        Value* offset = builder.CreateSExt(entry, Type::getInt64Ty(C));
+        result = builder.CreateBitCast(builder.CreateGEP(entryAddr, offset), LI->getType());
+      } else {
+        // offset-to-top and vbase offsets
+        result = builder.CreateSExtOrTrunc(entry, LI->getType());
+      }
+
+      LI->replaceAllUsesWith(result);
+      LI->eraseFromParent();
+    } else {
+      sdLog::warn() << "Cannot rewrite use of a relative vtable slot: " << *user << "\n";
+      rewritten = false;
+    }
+  }
+
+  return rewritten;
+}
+
+/*
+ * Same walk as sd_rewriteRelativeLoads, without changing anything.
+ */
+static bool sd_canRewriteRelativeLoads(Value* ptr) {
+  for (User* user : ptr->users()) {
+    if (isa<BitCastInst>(user)) {
+      if (!sd_canRewriteRelativeLoads(user))
+        return false;
+    } else if (!isa<LoadInst>(user)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SDLayoutBuilder::canRewriteRelativeSlot(User* slotPtr) {
+  GetElementPtrInst* gep = dyn_cast<GetElementPtrInst>(slotPtr);
+  return gep && gep->getNumIndices() == 1 && sd_canRewriteRelativeLoads(gep);
+}
+
+bool SDLayoutBuilder::isScaledIndex(User* user, const DataLayout& DL) {
+  // the scaling might have been turned into a shift already
+  BinaryOperator* mul = dyn_cast<BinaryOperator>(user);
+  ConstantInt* scale = mul ? dyn_cast<ConstantInt>(mul->getOperand(1)) : NULL;
+  return scale &&
+    ((mul->getOpcode() == Instruction::Mul && scale->getZExtValue() == DL.getPointerSize()) ||
+     (mul->getOpcode() == Instruction::Shl && (1ULL << scale->getZExtValue()) == DL.getPointerSize()));
+}
+
+bool SDLayoutBuilder::canRewriteRelativeIndex(CallInst* CI, const DataLayout& DL) {
+  for (User* user : CI->users()) {
+    if (isa<GetElementPtrInst>(user)) {
+      if (!canRewriteRelativeSlot(user))
+        return false;
+      continue;
+    }
+
+    if (!isScaledIndex(user, DL))
+      return false;
+
+    for (User* scaledUser : user->users()) {
+      CallInst* call = dyn_cast<CallInst>(scaledUser);
+      bool isDyncast = call &&
+        call->getCalledValue()->stripPointerCasts()->getName() == SD_DYNCAST_FUNC_NAME;
+      if (!isDyncast && !canRewriteRelativeSlot(scaledUser))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool SDLayoutBuilder::rewriteRelativeSlot(Instruction* slotPtr, int64_t byteOff) {
+  GetElementPtrInst* gep = dyn_cast<GetElementPtrInst>(slotPtr);
+  assert(gep && gep->getNumIndices() == 1);
+
+  LLVMContext& C = slotPtr->getContext();
+  IRBuilder<> builder(slotPtr);
+  Value* base      = builder.CreateBitCast(gep->getPointerOperand(), Type::getInt8PtrTy(C));
+  Value* entryAddr = builder.CreateGEP(base, ConstantInt::getSigned(Type::getInt64Ty(C), byteOff),
+                                       "sd.rel.slot");
+
+  bool rewritten = sd_rewriteRelativeLoads(slotPtr, entryAddr);
+  if (slotPtr->use_empty())
+    slotPtr->eraseFromParent();
+
+  return rewritten;
+}
+
+/*
+ * Trimmed vtables: typeid and dynamic_cast are the only readers of the offset-to-top
+ * and rtti slots, clouds that are never used with them can drop both slots.
+ */
+bool SDLayoutBuilder::canTrimRTTISlots(Module& M, const SDLayoutBuilder::vtbl_name_t& root,
+                                       const std::set<SDLayoutBuilder::vtbl_name_t>& rttiClouds) {
+  if (rttiClouds.count(root))
+    return false;
+
+  for (const vtbl_t& v : cha->preorder(vtbl_t(root, 0))) {
+    if (cha->isUndefined(v.first)) {
+      sdLog::log() << "Cloud " << root << " keeps rtti slots because " << v.first
+                   << " is not defined in this module\n";
+      return false;
+    }
+
+    GlobalVariable* vtblGV = M.getGlobalVariable(v.first, true);
+    if (!vtblGV || (!vtblGV->hasLocalLinkage() && !vtblGV->hasHiddenVisibility())) {
+      sdLog::log() << "Cloud " << root << " keeps rtti slots because " << v.first
+                   << " is visible outside of the module\n";
+      return false;
+    }
+
+    // the address point has to stay inside the new layout
+    const range_t& r = cha->getRange(v);
+    if (r.second < cha->addrPt(v)) {
+      sdLog::log() << "Cloud " << root << " keeps rtti slots because " << v.first
+                   << "," << v.second << " has no function entries\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool SDLayoutBuilder::isTrimmedSlot(const SDLayoutBuilder::vtbl_t& vtbl, int64_t pos) {
+  if (trimmedClouds.empty() || !cha->hasAncestor(vtbl) || !trimmedClouds.count(cha->getAncestor(vtbl)))
+    return false;
+
+  int64_t addrPt = cha->addrPt(vtbl);
+  return addrPt - RTTI_SLOTS <= pos && pos < addrPt;
+}
+
+std::string SDLayoutBuilder::layoutCacheTag() {
+  MD5 hash;
+  MD5::MD5Result result;
+  SmallString<32> str;
+
+  hash.update(interleave ? "interleave" : "order");
+  for (auto &root : relativeClouds) {
+    hash.update(",r");
+    hash.update(root);
+  }
+  for (auto &root : trimmedClouds) {
+    hash.update(",t");
+    hash.update(root);
+  }
+
+  hash.final(result);
+  MD5::stringifyResult(result, str);
+  return "layout-" + str.str().str();
+}
+
+/*
+ * Cache format: the interleaving of every cloud, then the pre-paddings,
+ * then the vptr ranges in terms of preorder indices.
+ */
+void SDLayoutBuilder::storeLayoutCache() {
+  std::string tag = layoutCacheTag();
+  std::string tmpPath = cha->getCacheTmpPath(tag);
+  if (tmpPath.empty())
+    return;
+
+  std::ofstream out(tmpPath);
+
+  out << interleavingMap.size() << "\n";
+  for (auto &cloud : interleavingMap) {
+    out << cloud.first << " " << alignmentMap[cloud.first] << " " << cloud.second.size() << "\n";
+    for (const interleaving_t& ivtbl : cloud.second)
+      out << ivtbl.first.first << " " << ivtbl.first.second << " " << ivtbl.second << "\n";
+  }
+
+  out << prePadMap.size() << "\n";
+  for (auto &pad : prePadMap)
+    out << pad.first.first << " " << pad.first.second << " " << pad.second << "\n";
+
+  out << rangeMap.size() << "\n";
+  for (auto &ranges : rangeMap) {
+    out << ranges.first.first << " " << ranges.first.second << " " << ranges.second.size();
+    for (const range_t& r : ranges.second)
+      out << " " << r.first << " " << r.second;
+    out << "\n";
+  }
+  out.close();
+
+  if (out.fail()) {
+    sys::fs::remove(tmpPath);
+    return;
+  }
+
+  if (cha->commitCacheFile(tmpPath, tag))
+    sdLog::stream() << "Stored layouts in " << cha->getCachePath(tag) << "\n";
+}
+
+bool SDLayoutBuilder::loadLayoutCache() {
+  std::string path = cha->getCachePath(layoutCacheTag());
+  std::ifstream in(path);
+  if (!in.good())
+    return false;
+
+  uint64_t count = 0, size = 0;
+  bool valid = true;
+
+  in >> count;
+  valid = count == (uint64_t) cha->getNumberOfRoots();
+  for (uint64_t i = 0; valid && i < count && in.good(); i++) {
+    vtbl_name_t root;
+    in >> root >> alignmentMap[root] >> size;
+    valid = cha->isRoot(root);
+
+    interleaving_list_t& list = interleavingMap[root];
+    for (uint64_t j = 0; j < size && in.good(); j++) {
+      interleaving_t ivtbl;
+      in >> ivtbl.first.first >> ivtbl.first.second >> ivtbl.second;
+      list.push_back(ivtbl);
+    }
+  }
+
+  in >> count;
+  for (uint64_t i = 0; valid && i < count && in.good(); i++) {
+    vtbl_t vtbl;
+    in >> vtbl.first >> vtbl.second;
+    in >> prePadMap[vtbl];
+  }
+
+  in >> count;
+  for (uint64_t i = 0; valid && i < count && in.good(); i++) {
+    vtbl_t vtbl;
+    in >> vtbl.first >> vtbl.second >> size;
+    std::vector<range_t>& ranges = rangeMap[vtbl];
+    for (uint64_t j = 0; j < size && in.good(); j++) {
+      range_t r;
+      in >> r.first >> r.second;
+      ranges.push_back(r);
+    }
+  }
+
+  if (!valid || in.fail()) {
+    sdLog::warn() << "Ignoring stale SD cache " << path << "\n";
+    interleavingMap.clear();
+    alignmentMap.clear();
+    prePadMap.clear();
+    rangeMap.clear();
+    return false;
+  }
+
+  sdLog::stream() << "Loaded layouts from " << path << "\n";
+  return true;
+}
+
 /*Paul:
 as usual, after the analysis is done clear all the 
 used data structures*/
@@ -1248,6 +1854,10 @@ void SDLayoutBuilder::clearAnalysisResults() {
   cha->clearAnalysisResults();
   newLayoutInds.clear();
   interleavingMap.clear();
+  relativeClouds.clear();
+  trimmedClouds.clear();
+  vthunkMap.clear();
+  vthunkCloneMap.clear();
 
   sd_print("Cleared SDLayoutBuilder analysis results \n");
 }
@@ -1320,6 +1930,7 @@ Value* SDLayoutBuilder::newVtblAddress(Module& M, const vtbl_name_t& name, Instr
 
   // sanity checks
   assert(cha->isRoot(rootName));
+  uint64_t width = entryWidth(rootName);
 
   // switch to the new vtable name
   rootName = NEW_VTABLE_NAME(rootName);
@@ -1349,7 +1960,7 @@ Value* SDLayoutBuilder::newVtblAddress(Module& M, const vtbl_name_t& name, Instr
 
   // add the offset to the beginning of the vtable
   Value* vtableStart   = builder.CreatePtrToInt(gv, type);
-  Value* offsetVal     = ConstantInt::get(type, addrPtOff * WORD_WIDTH);
+  Value* offsetVal     = ConstantInt::get(type, addrPtOff * width);
   Value* vtableAddrPtr = builder.CreateAdd(vtableStart, offsetVal);
 
   return vtableAddrPtr;
@@ -1366,6 +1977,7 @@ Constant* SDLayoutBuilder::newVtblAddressConst(Module& M, const vtbl_t& vtbl) {
 
   // sanity checks
   assert(cha->isRoot(rootName));
+  uint64_t width = entryWidth(rootName);
 
   // switch to the new vtable name
   rootName = NEW_VTABLE_NAME(rootName);
@@ -1388,7 +2000,7 @@ Constant* SDLayoutBuilder::newVtblAddressConst(Module& M, const vtbl_t& vtbl) {
 
   // add the offset to the beginning of the vtable
   Constant* gvInt     = ConstantExpr::getPtrToInt(gv, IntPtrTy);
-  Constant* offsetVal = ConstantInt::get(IntPtrTy, addrPtOff * WORD_WIDTH);
+  Constant* offsetVal = ConstantInt::get(IntPtrTy, addrPtOff * width);
   Constant* gvOffInt  = ConstantExpr::getAdd(gvInt, offsetVal);
 
   return gvOffInt;
@@ -1405,14 +2017,56 @@ Constant* SDLayoutBuilder::newVtblAddressConst(Module& M, const vtbl_t& vtbl) {
 void SDLayoutBuilder::buildNewLayouts(Module &M) {
 
   sd_print("CHA cloud map has %d root nodes \n", cha->getNumberOfRoots());
+
+  // virtual member function pointers index the vtable with a raw byte offset,
+  // which cannot be translated to the relative encoding
+  if (relative && sd_hasVirtualMemberPointerCall(M)) {
+    sdLog::warn() << "Virtual member function pointers found, emitting absolute vtables\n";
+    relative = false;
+  }
+
+  // an offset-to-top read straight from the vptr would load two 32-bit entries
+  if (relative && sd_hasRawOffsetToTopLoad(M)) {
+    sdLog::warn() << "Offset-to-top read without a vtable index, emitting absolute vtables\n";
+    relative = false;
+  }
+
+  // clouds whose offset-to-top or rtti slots are needed
+  std::set<vtbl_name_t> rttiClouds;
+  if (trim && !sd_collectRTTIClouds(M, cha, rttiClouds)) {
+    sdLog::warn() << "Unattributed rtti slot reads found, keeping offset-to-top and rtti slots\n";
+    trim = false;
+  }
   
+  // clouds whose vtable indices are used in ways the relative encoding cannot rewrite
+  std::set<vtbl_name_t> absoluteClouds;
+  if (relative)
+    sd_collectAbsoluteClouds(M, cha, absoluteClouds);
+
+  //decide on the entry encoding and the dropped slots first, the layout of a cloud depends on them
+  for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
+    if (relative && canUseRelativeLayout(M, *itr, absoluteClouds))
+      relativeClouds.insert(*itr);
+
+    if (trim && canTrimRTTISlots(M, *itr, rttiClouds))
+      trimmedClouds.insert(*itr);
+  }
+
+  // an unchanged class hierarchy reuses the layouts of the previous link
+  bool cached = cha->hasCache() && loadLayoutCache();
+  if (cha->isCacheRequired() && !cached)
+    report_fatal_error("SD thin backend: no layout table for key " +
+                       cha->getCacheKey() + " in the cache directory");
+
   //1: we iterate through all roots contained in the cloud, order or interleave them 
   for (auto itr = cha->roots_begin(); itr != cha->roots_end(); itr++) {
    
     vtbl_name_t vtbl = *itr;         // get the v table name as string
  
     //Paul: interleave or order for each v table separatelly 
-    if (interleave){
+    if (cached) {
+      // interleavingMap, prePadMap and alignmentMap were loaded
+    } else if (interleave){
       //interleaveCloud(vtbl);         // interleave the cloud or
 
       //our interleaving method 
@@ -1470,5 +2124,32 @@ void SDLayoutBuilder::buildNewLayouts(Module &M) {
     //2.Check that each descendent is in one of the ranges. 
     verifyVPtrRanges(vtbl);         
   }
+
+  if (cha->hasCache() && !cached)
+    storeLayoutCache();
+
+  sdTrace::count("clouds", cha->getNumberOfRoots());
+  sdTrace::count("layout_cache_hit", cached);
+  sdTrace::count("thunks_requested", thunksRequested);
+  sdTrace::count("thunks_cloned", vthunkCloneMap.size());
+  sdTrace::count("relative_clouds", relativeClouds.size());
+  sdTrace::count("trimmed_clouds", trimmedClouds.size());
+
+  sdLog::stream() << "VThunks: " << thunksRequested << " clones requested, "
+                  << vthunkCloneMap.size() << " emitted, thunk code size "
+                  << thunkInstsBefore << " -> " << thunkInstsAfter << " IR instructions\n";
+
+  if (relative) {
+    sdLog::stream() << "Relative vtables: " << relativeClouds.size() << "/"
+                    << cha->getNumberOfRoots() << " clouds, "
+                    << relBytesSaved << " bytes saved, "
+                    << relRelocsRemoved << " relocations removed\n";
+  }
+
+  if (trim) {
+    sdLog::stream() << "Trimmed vtables: " << trimmedClouds.size() << "/"
+                    << cha->getNumberOfRoots() << " clouds without offset-to-top and rtti, "
+                    << trimBytesSaved << " bytes saved\n";
+  }
 }
 
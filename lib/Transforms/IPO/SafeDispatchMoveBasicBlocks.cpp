@@ -61,6 +61,7 @@ namespace {
       sd_print("P6. 2. remove bb from the bbs list (Function::BasicBlockListType &bbs) and insert it at the end ...\n");
       sd_print("P6. 3. so basically all bb blocks are reshufled at the end of the bbs list ...\n");
       sd_print("P6. 4. this improves runtime overhead ...\n");
+      sdTrace::Scope Trace("SDMoveBasicBlocks");
 
       for (auto fIt = M.begin(); fIt != M.end(); fIt++) {
         std::vector<BasicBlock*> toMove; 
@@ -76,6 +77,7 @@ namespace {
         
         // Paul: this is an internal LLVM Function
         Function::BasicBlockListType &bbs = fIt->getBasicBlockList(); //Paul; this is a LLVM bb function list type
+        Trace.count("blocks_moved", toMove.size());
         for (auto bb : toMove) {
           std::cerr << "Moving " << bb->getName().str() << " to end in " << 
             fIt->getName().str() << "\n";
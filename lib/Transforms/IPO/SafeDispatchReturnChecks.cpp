@@ -5,9 +5,12 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/SafeDispatchCallSiteIndex.h"
 #include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
-#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include <fstream>
 #include <set>
 #include <map>
@@ -144,6 +147,8 @@ private:
   std::map<std::string, StaticFunctionInfo> StaticFunctions{};
   std::map<std::string, BlackListedInfo> BlackListedFunctions{};
 
+  SDCallSiteIndex *Index = nullptr;
+
 public:
   SDReturnChecks() : ModulePass(ID) {
     sdLog::stream() << "initializing SDReturnChecks pass ...\n";
@@ -156,7 +161,9 @@ public:
 
   bool runOnModule(Module &M) override {
     sdLog::stream() << "P7b. Started the SDReturnChecks pass ..." << sdLog::newLine << "\n";
+    sdTrace::Scope Trace("SDReturnChecks");
 
+    Index = &getAnalysis<SDCallSiteIndex>();
     loadFunctionData(M);
 
     sdLog::stream() << "Finished loading data.\n";
@@ -171,6 +178,9 @@ public:
     int NumberOfTotalChecks = 0;
     int NumberOfFunctions = 0;
     for (auto &F : M) {
+      // the declarations of the cross-DSO runtime
+      if (F.getName().startswith(SD_RT_PREFIX))
+        continue;
 
       // do processing
       FunctionInfo Info = processFunction(F);
@@ -225,6 +235,13 @@ public:
     sdLog::stream() << "Total number of external functions: " << FunctionsMarkedExternal.size() << "\n";
     sdLog::stream() << "Total number of functions without return: " << FunctionsMarkedNoReturn.size() << "\n";
 
+    Trace.count("return_checks", NumberOfTotalChecks);
+    Trace.count("functions", NumberOfFunctions);
+    Trace.count("external_functions", FunctionsMarkedExternal.size());
+
+    if (NumberOfTotalChecks > 0)
+      generateReturnIDRegistration(M);
+
     storeStatistics(M, NumberOfTotalChecks,
                     FunctionsMarkedStatic,
                     FunctionsMarkedVirtual,
@@ -238,6 +255,10 @@ public:
     return NumberOfTotalChecks > 0;
   }
 
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<SDCallSiteIndex>();
+  }
+
   FunctionInfo processFunction(Function &F) {
     auto BLPtr = BlackListedFunctions.find(F.getName());
     if (BLPtr != BlackListedFunctions.end()) {
@@ -349,16 +370,9 @@ private:
       sdLog::stream() << F.getName() << " has " << FunctionInfo.IDs.size() << " IDs!\n";
     }
 
-    // Collect all return statements (usually just a single one) first.
-    // We need to do this first, because inserting checks invalidates the Instruction-Iterator.
-    std::vector<Instruction *> Returns;
-    for (auto &B : F) {
-      for (auto &I : B) {
-        if (isa<ReturnInst>(I)) {
-          Returns.push_back(&I);
-        }
-      }
-    }
+    // The returns (usually just a single one) come from the index, inserting
+    // the checks splits their blocks but keeps the instructions.
+    ArrayRef<ReturnInst *> Returns = Index->getReturns(F);
 
     Module *M = F.getParent();
     unsigned count = 0;
@@ -374,7 +388,6 @@ private:
       ConstantInt *zero = builder.getInt32(0);
       ConstantInt *offsetFirstNOP = builder.getInt32(3);
       ConstantInt *offsetSecondNOP = builder.getInt32(3 + 7);
-      auto int64Ty = Type::getInt64Ty(M->getContext());
       auto int32PtrTy = Type::getInt32PtrTy(M->getContext());
 
       // Get return address
@@ -391,7 +404,7 @@ private:
       auto width = builder.CreateLoad(width32Ptr);
 
       // Build first check
-      ConstantInt *IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[0]| 0x80000));
+      ConstantInt *IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[0]| SD_RETURN_ID_TAG));
       auto diff = builder.CreateSub(IDValue, minID);
       auto check = builder.CreateICmpUGT(diff, width);
 
@@ -410,7 +423,7 @@ private:
         // Build check
         builder.SetInsertPoint(CurrentBlock);
         CurrentBlock->setName("sd.range");
-        IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[i] | 0x80000));
+        IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[i] | SD_RETURN_ID_TAG));
         diff = builder.CreateSub(IDValue, minID);
         check = builder.CreateICmpULE(diff, width);
         CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
@@ -418,32 +431,26 @@ private:
       }
 
       if (F.hasAddressTaken() && FunctionInfo.TypeID != -1) {
-        // Handle external call case
-        //TODO MATT: fix constant for external call
-        builder.SetInsertPoint(CurrentBlock);
-        CurrentBlock->setName("sd.external");
-        ConstantInt *memRange = builder.getInt64(0x2000000);
-        auto returnAddressAsInt = builder.CreatePtrToInt(ReturnAddress, int64Ty);
-        auto checkExternal = builder.CreateICmpUGT(returnAddressAsInt, memRange);
-        CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
-        builder.CreateCondBr(checkExternal, SuccessBlock, CurrentBlock);
-
         // Handle indirect call case
         builder.SetInsertPoint(CurrentBlock);
         CurrentBlock->setName("sd.indirect");
         FunctionInfo.ExtraIDs.insert(FunctionInfo.TypeID);
-        ConstantInt *indirectMagicNumber = builder.getInt32(FunctionInfo.TypeID);
+        ConstantInt *indirectMagicNumber = builder.getInt32(uint32_t(FunctionInfo.TypeID | SD_RETURN_ID_TAG));
         auto checkIndirectCall = builder.CreateICmpEQ(minID, indirectMagicNumber);
         CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
         builder.CreateCondBr(checkIndirectCall, SuccessBlock, CurrentBlock);
 
         builder.SetInsertPoint(CurrentBlock);
         CurrentBlock->setName("sd.indirect2");
-        FunctionInfo.ExtraIDs.insert(0x7FFFF);
-        ConstantInt *unknownMagicNumber = builder.getInt32(0x7FFFF);
+        FunctionInfo.ExtraIDs.insert(SD_RETURN_UNKNOWN_ID);
+        ConstantInt *unknownMagicNumber = builder.getInt32(SD_RETURN_UNKNOWN_ID);
         auto checkUnknownCall = builder.CreateICmpEQ(minID, unknownMagicNumber);
         CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
         builder.CreateCondBr(checkUnknownCall, SuccessBlock, CurrentBlock);
+
+        // Handle external call case, the runtime lookup is the slowest check
+        CurrentBlock = generateExternalCheck(builder, F, ReturnAddress, minID,
+                                             CurrentBlock, SuccessBlock);
       }
 
       // Build the fail block (CurrentBlock is the block after the last check failed)
@@ -474,16 +481,9 @@ private:
       sdLog::warn() << "Static Function " << F.getName() << " has " << FunctionInfo.IDs.size() << " IDs!\n";
     }
 
-    // Collect all return statements (usually just a single one) first.
-    // We need to do this first, because inserting checks invalidates the Instruction-Iterator.
-    std::vector<Instruction *> Returns;
-    for (auto &B : F) {
-      for (auto &I : B) {
-        if (isa<ReturnInst>(I)) {
-          Returns.push_back(&I);
-        }
-      }
-    }
+    // The returns (usually just a single one) come from the index, inserting
+    // the checks splits their blocks but keeps the instructions.
+    ArrayRef<ReturnInst *> Returns = Index->getReturns(F);
 
     Module *M = F.getParent();
     unsigned count = 0;
@@ -498,7 +498,6 @@ private:
       // Some constants we need
       ConstantInt *zero = builder.getInt32(0);
       ConstantInt *offsetFirstNOP = builder.getInt32(3);
-      auto int64Ty = Type::getInt64Ty(M->getContext());
       auto int32PtrTy = Type::getInt32PtrTy(M->getContext());
 
       // Get return address
@@ -510,7 +509,7 @@ private:
       auto minID = builder.CreateLoad(min32Ptr);
 
       // Build ID compare check
-      ConstantInt *IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[0] | 0x80000));
+      ConstantInt *IDValue = builder.getInt32(uint32_t(FunctionInfo.IDs[0] | SD_RETURN_ID_TAG));
       auto check = builder.CreateICmpEQ(IDValue, minID);
 
       // Branch to CheckFailed if the ID check fails
@@ -527,32 +526,26 @@ private:
       builder.SetInsertPoint(CurrentBlock);
 
       if (F.hasAddressTaken() && FunctionInfo.TypeID != -1) {
-        // Handle external call case
-        //TODO MATT: fix constant for external call
-        builder.SetInsertPoint(CurrentBlock);
-        CurrentBlock->setName("sd.external");
-        ConstantInt *memRange = builder.getInt64(0x2000000);
-        auto returnAddressAsInt = builder.CreatePtrToInt(ReturnAddress, int64Ty);
-        auto checkExternal = builder.CreateICmpUGT(returnAddressAsInt, memRange);
-        CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
-        builder.CreateCondBr(checkExternal, SuccessBlock, CurrentBlock);
-
         // Handle indirect call case
         builder.SetInsertPoint(CurrentBlock);
         CurrentBlock->setName("sd.indirect");
         FunctionInfo.ExtraIDs.insert(FunctionInfo.TypeID);
-        ConstantInt *indirectMagicNumber = builder.getInt32(FunctionInfo.TypeID);
+        ConstantInt *indirectMagicNumber = builder.getInt32(uint32_t(FunctionInfo.TypeID | SD_RETURN_ID_TAG));
         auto checkIndirectCall = builder.CreateICmpEQ(minID, indirectMagicNumber);
         CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
         builder.CreateCondBr(checkIndirectCall, SuccessBlock, CurrentBlock);
 
         builder.SetInsertPoint(CurrentBlock);
         CurrentBlock->setName("sd.indirect2");
-        FunctionInfo.ExtraIDs.insert(0x7FFFF);
-        ConstantInt *unknownMagicNumber = builder.getInt32(0x7FFFF);
+        FunctionInfo.ExtraIDs.insert(SD_RETURN_UNKNOWN_ID);
+        ConstantInt *unknownMagicNumber = builder.getInt32(SD_RETURN_UNKNOWN_ID);
         auto checkUnknownCall = builder.CreateICmpEQ(minID, unknownMagicNumber);
         CurrentBlock = BasicBlock::Create(F.getContext(), "", CurrentBlock->getParent());
         builder.CreateCondBr(checkUnknownCall, SuccessBlock, CurrentBlock);
+
+        // Handle external call case, the runtime lookup is the slowest check
+        CurrentBlock = generateExternalCheck(builder, F, ReturnAddress, minID,
+                                             CurrentBlock, SuccessBlock);
       }
 
       // Build the fail block (CurrentBlock is the block after the last check failed)
@@ -575,6 +568,112 @@ private:
     return count;
   }
 
+  /**
+   * A caller in another DSO cannot carry one of our IDs. The runtime (see
+   * libdlcfi) accepts the return address if it lies in the text of another
+   * loaded DSO and, if that DSO registered its call-site IDs, the word after
+   * the call is one of them. Without the runtime no caller is external.
+   */
+  BasicBlock *generateExternalCheck(IRBuilder<> &builder, Function &F,
+                                    Value *ReturnAddress, Value *minID,
+                                    BasicBlock *CurrentBlock,
+                                    BasicBlock *SuccessBlock) {
+    Module *M = F.getParent();
+    LLVMContext &C = M->getContext();
+    auto int8PtrTy = Type::getInt8PtrTy(C);
+
+    Function *ExternalF = getRuntimeFunction(*M, SD_RT_RETURN_EXTERNAL,
+            FunctionType::get(Type::getInt1Ty(C),
+                              {int8PtrTy, int8PtrTy, Type::getInt32Ty(C)},
+                              false));
+
+    builder.SetInsertPoint(CurrentBlock);
+    CurrentBlock->setName("sd.external");
+    auto hasRuntime = builder.CreateICmpNE(ExternalF, Constant::getNullValue(ExternalF->getType()));
+    BasicBlock *LookupBlock = BasicBlock::Create(C, "sd.external.lookup", &F);
+    BasicBlock *NextBlock = BasicBlock::Create(C, "", &F);
+    builder.CreateCondBr(hasRuntime, LookupBlock, NextBlock);
+
+    builder.SetInsertPoint(LookupBlock);
+    auto self = builder.CreatePointerCast(&F, int8PtrTy);
+    auto checkExternal = builder.CreateCall(ExternalF, {ReturnAddress, self, minID});
+    builder.CreateCondBr(checkExternal, SuccessBlock, NextBlock);
+
+    return NextBlock;
+  }
+
+  Function *getRuntimeFunction(Module &M, StringRef Name, FunctionType *FTy) {
+    Function *RuntimeF = M.getFunction(Name);
+    if (!RuntimeF) {
+      RuntimeF = Function::Create(FTy, GlobalValue::ExternalWeakLinkage, Name, &M);
+      RuntimeF->addFnAttr(Attribute::NoUnwind);
+    }
+    return RuntimeF;
+  }
+
+  /**
+   * Register the words our call sites carry after the call with the runtime,
+   * so that the checks of other DSOs can validate calls coming from us. These
+   * have to be exactly the words SDMachineFunction emits.
+   */
+  void generateReturnIDRegistration(Module &M) {
+    std::set<uint32_t> Words;
+    for (auto &Entry : StaticFunctions)
+      for (auto ID : Entry.second.IDs)
+        Words.insert(uint32_t(ID | SD_RETURN_ID_TAG));
+    for (auto &Entry : VirtualFunctions)
+      for (auto ID : Entry.second.IDs)
+        Words.insert(uint32_t(ID | SD_RETURN_ID_TAG));
+    for (auto &Entry : StaticFunctions)
+      if (Entry.second.TypeID != -1)
+        Words.insert(uint32_t(Entry.second.TypeID | SD_RETURN_ID_TAG));
+    for (auto &Entry : VirtualFunctions)
+      if (Entry.second.TypeID != -1)
+        Words.insert(uint32_t(Entry.second.TypeID | SD_RETURN_ID_TAG));
+    Words.insert(SD_RETURN_UNKNOWN_ID);
+
+    LLVMContext &C = M.getContext();
+    auto int8PtrTy = Type::getInt8PtrTy(C);
+    auto int32Ty = Type::getInt32Ty(C);
+    auto int64Ty = Type::getInt64Ty(C);
+
+    std::vector<uint32_t> WordList(Words.begin(), Words.end());
+    Constant *Table = ConstantDataArray::get(C, WordList);
+    auto TableGV = new GlobalVariable(M, Table->getType(), true,
+                                      GlobalValue::PrivateLinkage, Table,
+                                      "sd.return_ids");
+
+    Function *RegisterF = getRuntimeFunction(M, SD_RT_REGISTER_RETURN_IDS,
+            FunctionType::get(Type::getVoidTy(C),
+                              {int8PtrTy, PointerType::getUnqual(int32Ty), int64Ty},
+                              false));
+
+    Function *CtorF = Function::Create(FunctionType::get(Type::getVoidTy(C), false),
+                                       GlobalValue::InternalLinkage,
+                                       "sd.register_return_ids", &M);
+    BasicBlock *Entry = BasicBlock::Create(C, "entry", CtorF);
+    BasicBlock *Register = BasicBlock::Create(C, "register", CtorF);
+    BasicBlock *Done = BasicBlock::Create(C, "done", CtorF);
+
+    IRBuilder<> builder(Entry);
+    auto hasRuntime = builder.CreateICmpNE(RegisterF, Constant::getNullValue(RegisterF->getType()));
+    builder.CreateCondBr(hasRuntime, Register, Done);
+
+    builder.SetInsertPoint(Register);
+    builder.CreateCall(RegisterF, {builder.CreatePointerCast(CtorF, int8PtrTy),
+                                   builder.CreateConstGEP2_32(Table->getType(), TableGV, 0, 0),
+                                   builder.getInt64(WordList.size())});
+    builder.CreateBr(Done);
+
+    builder.SetInsertPoint(Done);
+    builder.CreateRetVoid();
+
+    // before the constructors that already run checked code
+    appendToGlobalCtors(M, CtorF, 1);
+
+    sdLog::stream() << "Registering " << WordList.size() << " call-site IDs with the runtime\n";
+  }
+
   void storeStatistics(Module &M, int NumberOfTotalChecks,
                        std::vector<FunctionInfo> &FunctionsMarkedStatic,
                        std::vector<FunctionInfo> &FunctionsMarkedVirtual,
@@ -660,7 +759,9 @@ private:
 
 char SDReturnChecks::ID = 0;
 
-INITIALIZE_PASS(SDReturnChecks, "sdretchecks", "Inserts the return checks", false, false)
+INITIALIZE_PASS_BEGIN(SDReturnChecks, "sdretchecks", "Inserts the return checks", false, false)
+INITIALIZE_PASS_DEPENDENCY(SDCallSiteIndex)
+INITIALIZE_PASS_END(SDReturnChecks, "sdretchecks", "Inserts the return checks", false, false)
 
 llvm::ModulePass *llvm::createSDReturnChecksPass() {
   return new SDReturnChecks();
@@ -15,7 +15,8 @@
 
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
-#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 
 #include <fstream>
 #include <sstream>
@@ -61,10 +62,13 @@ static bool isBlackListed(const Function &F) {
 bool SDReturnRange::runOnModule(Module &M) {
   sdLog::blankLine();
   sdLog::stream() << "P7a. Started running the SDReturnRange pass ..." << sdLog::newLine << "\n";
+  sdTrace::Scope Trace("SDReturnRange");
 
   CHA = &getAnalysis<SDBuildCHA>();
   Encoder = getAnalysis<SDReturnAddress>().getEncoder();
-  FunctionIDMap = getAnalysis<SDReturnAddress>().getFunctionIDMap();
+  FunctionIDMap = &getAnalysis<SDReturnAddress>().getFunctionIDMap();
+  Index = &getAnalysis<SDCallSiteIndex>();
+  IsVirtualCallSite.assign(Index->getCallSites().size(), false);
 
   // Process Callsites and annotate them for the backend pass.
   processVirtualCallSites(M);
@@ -72,6 +76,8 @@ bool SDReturnRange::runOnModule(Module &M) {
 
   // Store the data generated by this pass.
   storeCallSites(M);
+  Trace.count("virtual_callsites", CallSiteDebugLocsVirtual.size());
+  Trace.count("static_callsites", CallSiteDebugLocsStatic.size());
 
   sdLog::stream() << sdLog::newLine << "P7a. Finished running the SDReturnRange pass ..." << "\n";
   sdLog::blankLine();
@@ -79,46 +85,24 @@ bool SDReturnRange::runOnModule(Module &M) {
 }
 
 void SDReturnRange::processVirtualCallSites(Module &M) {
-  Function *IntrinsicFunction = M.getFunction(Intrinsic::getName(Intrinsic::sd_get_checked_vptr));
+  sdLog::stream() << "\n";
+  sdLog::stream() << "Processing virtual CallSites...\n";
 
-  if (IntrinsicFunction == nullptr) {
+  if (Index->getNumVirtualCallSites() == 0) {
     sdLog::warn() << "Intrinsic not found.\n";
     return;
   }
 
-  sdLog::stream() << "\n";
-  sdLog::stream() << "Processing virtual CallSites...\n";
   int count = 0;
-  for (const Use &U : IntrinsicFunction->uses()) {
-
-    // get the intrinsic call instruction
-    CallInst *IntrinsicCall = dyn_cast<CallInst>(U.getUser());
-    assert(IntrinsicCall && "Intrinsic was not wrapped in a CallInst?");
-    User *User = *(IntrinsicCall->users().begin());
-    CallSite *VCall = nullptr;
-    for (int i = 0; i < 4; ++i) {
-      // User was not found, this should not happen...
-      VCall = new CallSite(User);
-      if (VCall->getInstruction()) {
-        break;
-      }
-
-      for (auto *NextUser : User->users()) {
-        User = NextUser;
-        break;
-      }
-    }
-
-    if (VCall != nullptr && VCall->getInstruction()) {
-      // valid CallSite
-      if (addVirtualCallSite(IntrinsicCall, *VCall, M))
+  for (auto &Info : Index->getFunctions()) {
+    unsigned Position = Info.FirstCallSite;
+    for (auto &Entry : Index->getCallSites(Info)) {
+      if (Entry.CheckedVptr && addVirtualCallSite(Entry.CheckedVptr, CallSite(Entry.Call), M)) {
+        IsVirtualCallSite[Position] = true;
         ++count;
-    } else {
-      sdLog::log() << "\n";
-      sdLog::warn() << "CallSite for intrinsic was not found.\n";
-      IntrinsicCall->getParent()->dump();
+      }
+      ++Position;
     }
-    sdLog::log() << "\n";
   }
   sdLog::stream() << "Found virtual CallSites: " << count << "\n";
 
@@ -132,25 +116,22 @@ void SDReturnRange::processStaticCallSites(Module &M) {
 
   sdLog::stream() << "\n";
   sdLog::stream() << "Processing static CallSites...\n";
-  for (auto &F : M) {
-    for(auto &MBB : F) {
-      for (auto &I : MBB) {
-        CallSite Call(&I);
-        // Try to use I as a CallInst or a InvokeInst
-        if (Call.getInstruction()) {
-          if (Function *Callee = Call.getCalledFunction()) {
-            if (!isBlackListed(*Callee)) {
-              if (addStaticCallSite(Call, M))
-                ++countDirect;
-            }
-          } else if (CallSite(Call).isIndirectCall() && VirtualCallSites.find(Call) == VirtualCallSites.end()) {
-            if (addStaticCallSite(Call, M))
-              ++countIndirect;
-          }
+  for (auto &Info : Index->getFunctions()) {
+    unsigned Position = Info.FirstCallSite;
+    for (auto &Entry : Index->getCallSites(Info)) {
+      CallSite Call(Entry.Call);
+      if (Entry.Callee) {
+        if (!isBlackListed(*Entry.Callee)) {
+          if (addStaticCallSite(Call, M))
+            ++countDirect;
         }
+      } else if (Call.isIndirectCall() && !IsVirtualCallSite[Position]) {
+        if (addStaticCallSite(Call, M))
+          ++countIndirect;
       }
+      ++Position;
     }
-    sdLog::log() << F.getName() << " (direct: " << countDirect << ", indirect:"<< countIndirect << ")\n";
+    sdLog::log() << Info.F->getName() << " (direct: " << countDirect << ", indirect:"<< countIndirect << ")\n";
     totalDirect += countDirect;
     totalIndirect += countIndirect;
     countDirect = countIndirect = 0;
@@ -174,8 +155,8 @@ bool SDReturnRange::addStaticCallSite(CallSite CallSite, Module &M) {
   if (CallSite.getCalledFunction()) {
     // Direct Call
     FunctionName = CallSite.getCalledFunction()->getName();
-    auto Itr = FunctionIDMap.find(FunctionName);
-    if (Itr == FunctionIDMap.end()) {
+    auto Itr = FunctionIDMap->find(FunctionName);
+    if (Itr == FunctionIDMap->end()) {
       sdLog::log() << "Skipped static CallSite " << CallSite->getParent()->getParent()->getName()
                    << "(@" << DebugLocString
                    << ") for Callee " << FunctionName << "\n";
@@ -238,9 +219,6 @@ bool SDReturnRange::addVirtualCallSite(const CallInst *IntrinsicCall, CallSite C
          << "," << ranges[0].first << "," << ranges[0].second;
   CallSiteDebugLocsVirtual.push_back(Stream.str());
 
-  // Add to VirtualCallsites
-  VirtualCallSites.insert(CallSite);
-
   sdLog::log() << "Virtual CallSite (@" << DebugLocString
                << " for class " << ClassName << "(" << PreciseName << ")::" << FunctionName << "\n";
 
@@ -333,6 +311,7 @@ char SDReturnRange::ID = 0;
 INITIALIZE_PASS_BEGIN(SDReturnRange, "sdRetRange", "Build return ranges", false, false)
 INITIALIZE_PASS_DEPENDENCY(SDBuildCHA)
 INITIALIZE_PASS_DEPENDENCY(SDReturnAddress)
+INITIALIZE_PASS_DEPENDENCY(SDCallSiteIndex)
 INITIALIZE_PASS_END(SDReturnRange, "sdRetRange", "Build return ranges", false, false)
 
 ModulePass *llvm::createSDReturnRangePass() {
@@ -0,0 +1,236 @@
+#include "llvm/Transforms/IPO/SafeDispatchThin.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/Transforms/IPO/SafeDispatchLogStream.h"
+#include "llvm/Transforms/IPO/SafeDispatchTools.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// the thunks SDLayoutBuilder clones for the new vtables, it needs their bodies
+static bool sd_isThinVthunk(StringRef name) {
+  return name.startswith("_ZTv") || name.startswith("_ZTcv");
+}
+
+static bool sd_isThinVtable(const GlobalValue &GV) {
+  return isa<GlobalVariable>(GV) && sd_isVtableName_ref(GV.getName());
+}
+
+static std::string sd_thinModuleSuffix(Module &M, StringRef inputHash) {
+  MD5 hash;
+  MD5::MD5Result result;
+  SmallString<32> str;
+
+  hash.update(M.getModuleIdentifier());
+  hash.update(",");
+  hash.update(inputHash);
+  hash.final(result);
+  MD5::stringifyResult(result, str);
+  return ".sdthin." + str.str().str();
+}
+
+/// Collects the globals reachable from C without going through another global.
+static void sd_collectGlobals(Constant *C, std::vector<GlobalValue*> &worklist,
+                              SmallPtrSetImpl<Constant*> &visited) {
+  if (!visited.insert(C).second)
+    return;
+
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(C)) {
+    worklist.push_back(GV);
+    return;
+  }
+
+  for (Use &op : C->operands())
+    if (Constant *opC = dyn_cast<Constant>(op.get()))
+      sd_collectGlobals(opC, worklist, visited);
+}
+
+void llvm::sd_thinPromoteLocals(Module &M, StringRef InputHash) {
+  std::string suffix = sd_thinModuleSuffix(M, InputHash);
+
+  std::vector<GlobalValue*> worklist;
+  SmallPtrSet<Constant*, 64> visited;
+  for (GlobalVariable &GV : M.globals())
+    if (sd_isThinVtable(GV) && GV.hasInitializer())
+      sd_collectGlobals(&GV, worklist, visited);
+
+  unsigned promoted = 0, kept = 0;
+  while (!worklist.empty()) {
+    GlobalValue *GV = worklist.back();
+    worklist.pop_back();
+
+    if (GlobalVariable *var = dyn_cast<GlobalVariable>(GV)) {
+      if (sd_isThinVtable(*var) && var->hasInitializer())
+        sd_collectGlobals(var->getInitializer(), worklist, visited);
+    } else if (Function *F = dyn_cast<Function>(GV)) {
+      if (sd_isThinVthunk(F->getName()) && !F->isDeclaration())
+        for (BasicBlock &BB : *F)
+          for (Instruction &I : BB)
+            for (Use &op : I.operands())
+              if (Constant *C = dyn_cast<Constant>(op.get()))
+                sd_collectGlobals(C, worklist, visited);
+    }
+
+    // the table object and the other backends refer to it by name
+    if (GV->hasLocalLinkage()) {
+      GV->setName((GV->hasName() ? GV->getName().str() : "sdthin") + suffix);
+      GV->setLinkage(GlobalValue::ExternalLinkage);
+      GV->setVisibility(GlobalValue::HiddenVisibility);
+      promoted++;
+    } else if (GV->hasLinkOnceODRLinkage() && !sd_isThinVtable(*GV)) {
+      // the old vtables are removed by the backends, keep what only they used
+      GV->setLinkage(GlobalValue::WeakODRLinkage);
+      kept++;
+    } else if (GV->hasLinkOnceLinkage() && !sd_isThinVtable(*GV)) {
+      GV->setLinkage(GlobalValue::WeakAnyLinkage);
+      kept++;
+    }
+  }
+
+  sdLog::stream() << "Thin prepare: promoted " << promoted << " local and kept "
+                  << kept << " discardable symbols of the vtables\n";
+}
+
+void llvm::sd_thinStripToSummary(Module &M) {
+  for (Function &F : M) {
+    if (!F.isDeclaration() && !sd_isThinVthunk(F.getName()))
+      F.deleteBody();
+    F.setComdat(nullptr);
+  }
+
+  std::vector<GlobalVariable*> appending;
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.hasAppendingLinkage()) {
+      appending.push_back(&GV);
+      continue;
+    }
+    if (!GV.isDeclaration() && !sd_isThinVtable(GV)) {
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    GV.setComdat(nullptr);
+  }
+  for (GlobalVariable *GV : appending)
+    GV->eraseFromParent();
+
+  std::vector<GlobalAlias*> aliases;
+  for (GlobalAlias &GA : M.aliases())
+    aliases.push_back(&GA);
+  for (GlobalAlias *GA : aliases) {
+    Type *Ty = GA->getType()->getElementType();
+    GlobalValue *decl;
+    if (FunctionType *FTy = dyn_cast<FunctionType>(Ty))
+      decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+    else
+      decl = new GlobalVariable(M, Ty, false, GlobalValue::ExternalLinkage,
+                                nullptr, "", nullptr,
+                                GlobalValue::NotThreadLocal,
+                                GA->getType()->getAddressSpace());
+    decl->takeName(GA);
+    decl->setVisibility(GA->getVisibility());
+    GA->replaceAllUsesWith(decl);
+    GA->eraseFromParent();
+  }
+  M.getComdatSymbolTable().clear();
+
+  std::vector<NamedMDNode*> namedMDs;
+  for (NamedMDNode &md : M.named_metadata())
+    if (!md.getName().startswith(SD_MD_CLASSINFO) &&
+        md.getName() != SD_MD_STRTAB && md.getName() != "llvm.module.flags")
+      namedMDs.push_back(&md);
+  for (NamedMDNode *md : namedMDs)
+    M.eraseNamedMetadata(md);
+
+  StripDebugInfo(M);
+
+  // undefined vtables are still referenced by the class info records
+  bool changed = true;
+  unsigned removed = 0;
+  while (changed) {
+    changed = false;
+    for (auto itr = M.begin(); itr != M.end();) {
+      Function &F = *itr++;
+      if (F.isDeclaration() && F.use_empty()) {
+        F.eraseFromParent();
+        changed = true;
+        removed++;
+      }
+    }
+    for (auto itr = M.global_begin(); itr != M.global_end();) {
+      GlobalVariable &GV = *itr++;
+      if (GV.isDeclaration() && GV.use_empty() && !sd_isThinVtable(GV)) {
+        GV.eraseFromParent();
+        changed = true;
+        removed++;
+      }
+    }
+  }
+
+  sdLog::stream() << "Thin summary: " << M.size() << " thunks, "
+                  << M.getGlobalList().size() << " globals, removed "
+                  << removed << " declarations\n";
+}
+
+void llvm::sd_thinImportIndex(Module &M) {
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    F.setComdat(nullptr);
+  }
+
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.isDeclaration())
+      continue;
+    GV.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    GV.setComdat(nullptr);
+  }
+}
+
+void llvm::sd_thinFinalizeTable(Module &M) {
+  unsigned tables = 0;
+  for (GlobalVariable &GV : M.globals()) {
+    GV.setComdat(nullptr);
+    if (GV.isDeclaration())
+      continue;
+
+    if (sd_isThinTableName(GV.getName())) {
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setVisibility(GlobalValue::HiddenVisibility);
+      tables++;
+    } else if (!GV.hasLocalLinkage()) {
+      // defined by one of the TUs
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+  }
+
+  for (Function &F : M) {
+    F.setComdat(nullptr);
+    if (!F.isDeclaration() && !F.hasLocalLinkage())
+      F.deleteBody();
+  }
+  M.getComdatSymbolTable().clear();
+
+  sdLog::stream() << "Thin link: emitting " << tables << " vtables\n";
+}
+
+void llvm::sd_thinFinalizeBackend(Module &M) {
+  for (GlobalVariable &GV : M.globals()) {
+    if (GV.isDeclaration() || !sd_isThinTableName(GV.getName()))
+      continue;
+
+    // the alignment is kept, the vptr checks rely on it
+    GV.setInitializer(nullptr);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+  }
+}
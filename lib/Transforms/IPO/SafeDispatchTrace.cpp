@@ -0,0 +1,178 @@
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
+#include "llvm/Config/config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSONString.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <mutex>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using namespace llvm;
+
+namespace {
+
+struct Event {
+  std::string Name;
+  unsigned Thread;
+  int64_t Begin;      // us since enable()
+  int64_t Duration;   // us
+  long PeakRSS;       // KB
+  long PeakRSSDelta;  // KB
+  std::vector<std::pair<std::string, int64_t>> Counters;
+};
+
+struct Trace {
+  std::mutex Lock;
+  std::atomic<bool> Enabled;
+  std::string Path;
+  std::chrono::steady_clock::time_point Start;
+  std::vector<Event> Events;
+
+  Trace() : Enabled(false) {}
+};
+
+}
+
+static Trace &getTrace() {
+  static Trace T;
+  return T;
+}
+
+static thread_local sdTrace::Scope *CurrentScope = nullptr;
+
+static unsigned getThreadNumber() {
+  static std::atomic<unsigned> Next(1);
+  static thread_local unsigned Number = 0;
+  if (!Number)
+    Number = Next++;
+  return Number;
+}
+
+long sdTrace::getPeakRSS() {
+#ifdef LLVM_ON_UNIX
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) == 0)
+    return Usage.ru_maxrss;  // KB on Linux
+#endif
+  return 0;
+}
+
+void sdTrace::enable(StringRef Path) {
+  Trace &T = getTrace();
+  std::lock_guard<std::mutex> Guard(T.Lock);
+  T.Path = Path;
+  T.Start = std::chrono::steady_clock::now();
+  T.Events.clear();
+  T.Enabled = true;
+}
+
+bool sdTrace::isEnabled() {
+  return getTrace().Enabled;
+}
+
+void sdTrace::count(StringRef Name, int64_t Value) {
+  if (CurrentScope)
+    CurrentScope->count(Name, Value);
+}
+
+sdTrace::Scope::Scope(StringRef Name)
+    : Name(Name), Active(isEnabled()), Parent(nullptr), StartPeakRSS(0) {
+  if (!Active)
+    return;
+
+  Parent = CurrentScope;
+  CurrentScope = this;
+  StartPeakRSS = getPeakRSS();
+  Start = std::chrono::steady_clock::now();
+}
+
+sdTrace::Scope::~Scope() {
+  if (!Active)
+    return;
+
+  auto End = std::chrono::steady_clock::now();
+  CurrentScope = Parent;
+
+  Trace &T = getTrace();
+  Event E;
+  E.Name = Name;
+  E.Thread = getThreadNumber();
+  E.PeakRSS = getPeakRSS();
+  E.PeakRSSDelta = E.PeakRSS - StartPeakRSS;
+  E.Counters = std::move(Counters);
+
+  std::lock_guard<std::mutex> Guard(T.Lock);
+  E.Begin = std::chrono::duration_cast<std::chrono::microseconds>(Start - T.Start).count();
+  E.Duration = std::chrono::duration_cast<std::chrono::microseconds>(End - Start).count();
+  T.Events.push_back(std::move(E));
+}
+
+void sdTrace::Scope::count(StringRef CounterName, int64_t Value) {
+  for (auto &Counter : Counters) {
+    if (Counter.first == CounterName) {
+      Counter.second += Value;
+      return;
+    }
+  }
+  Counters.push_back(std::make_pair(CounterName.str(), Value));
+}
+
+bool sdTrace::write(std::string &Error) {
+  Trace &T = getTrace();
+  std::lock_guard<std::mutex> Guard(T.Lock);
+  if (!T.Enabled)
+    return true;
+
+  int FD;
+  SmallString<128> TempPath;
+  if (std::error_code EC = sys::fs::createUniqueFile(T.Path + ".tmp%%%%%%", FD, TempPath)) {
+    Error = "cannot create a temporary file for " + T.Path + ": " + EC.message();
+    return false;
+  }
+
+  {
+    raw_fd_ostream OS(FD, true);
+    int Pid = 0;
+#ifdef LLVM_ON_UNIX
+    Pid = getpid();
+#endif
+
+    OS << "{\"traceEvents\":[\n";
+    for (size_t i = 0; i < T.Events.size(); i++) {
+      const Event &E = T.Events[i];
+      OS << "{\"name\":";
+      writeJSONString(OS, E.Name);
+      OS << ",\"cat\":\"sd\",\"ph\":\"X\",\"pid\":" << Pid
+         << ",\"tid\":" << E.Thread << ",\"ts\":" << E.Begin
+         << ",\"dur\":" << E.Duration << ",\"args\":{\"peak_rss_kb\":"
+         << E.PeakRSS << ",\"peak_rss_delta_kb\":" << E.PeakRSSDelta;
+      for (auto &Counter : E.Counters) {
+        OS << ",";
+        writeJSONString(OS, Counter.first);
+        OS << ":" << Counter.second;
+      }
+      OS << "}}" << (i + 1 < T.Events.size() ? ",\n" : "\n");
+    }
+    OS << "],\"displayTimeUnit\":\"ms\"}\n";
+
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+      Error = "cannot write " + TempPath.str().str();
+      return false;
+    }
+  }
+
+  if (std::error_code EC = sys::fs::rename(TempPath, T.Path)) {
+    sys::fs::remove(TempPath);
+    Error = "cannot rename " + TempPath.str().str() + " to " + T.Path + ": " + EC.message();
+    return false;
+  }
+  return true;
+}
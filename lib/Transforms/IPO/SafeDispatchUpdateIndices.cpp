@@ -12,6 +12,7 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/CallSite.h"
@@ -19,6 +20,7 @@
 
 #include "llvm/Transforms/IPO/SafeDispatchLog.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -70,9 +72,11 @@ namespace {
       cha = &getAnalysis<SDBuildCHA>();
 
       sdLog::stream() << "P4. Started running the 4th pass (Update indices) ...\n";
+      sdTrace::Scope Trace("SDUpdateIndices");
 
       //Paul: substitute the old v table index witht the new one
       //Intrinsic::sd_get_vtbl_index -> Intrinsic::sd_subst_vtbl_index
+      uncheckedCallSites = 0;
       handleSDGetVtblIndex(&M); 
  
       //Paul: adds the range check (casted_vptr, start, width, alingment)
@@ -87,6 +91,16 @@ namespace {
       //Intrinsic::sd_get_vcall_index -> null (there is no substitution function used here)
       handleRemainingSDGetVcallIndex(&M);    
 
+      //lower downcasts to a check of the source vptr, the relative ones
+      //were redirected to __ivtbl_rel_dynamic_cast by handleSDGetVtblIndex
+      handleDynamicCasts(&M);
+
+      if (uncheckedCallSites > 0) {
+        sdLog::warn() << uncheckedCallSites << " call sites of quarantined clouds "
+                      << "with vtables without class info are not checked\n";
+      }
+      Trace.count("quarantine_unchecked", uncheckedCallSites);
+
       layoutBuilder->removeOldLayouts(M);    //Paul: remove old layouts
       layoutBuilder->clearAnalysisResults(); //Paul: clear all data structures holding analysis data
 
@@ -105,12 +119,18 @@ namespace {
   private:
     SDLayoutBuilder* layoutBuilder;
     SDBuildCHA* cha;
+    unsigned uncheckedCallSites;
     
     // metadata ids
     void handleSDGetVtblIndex(Module* M);
     void handleSDCheckVtbl(Module* M);
     void handleSDGetCheckedVtbl(Module* M);
     void handleRemainingSDGetVcallIndex(Module* M);
+    void handleDynamicCasts(Module* M);
+    bool lowerDynamicCast(Module* M, CallInst* CI);
+    void handleRelativeIndexUses(Module* M, CallInst* CI, int64_t byteOff);
+    bool getQuarantineRanges(Module* M, const std::string& className,
+                             std::vector<SDLayoutBuilder::mem_range_t>& ranges);
   };
 }
 
@@ -216,6 +236,16 @@ void SDUpdateIndices::handleSDGetVtblIndex(Module* M) {
     // calculate the new index
     int64_t newIndex = layoutBuilder->translateVtblInd(classVtbl, oldIndex, true);
 
+    // relative vtables: the loads of the slot have to decode a 32-bit entry
+    if (layoutBuilder->isRelative(classVtbl)) {
+      handleRelativeIndexUses(M, CI, newIndex * layoutBuilder->entryWidth(cha->getAncestor(classVtbl)));
+
+      if (CI->use_empty()) {
+        CI->eraseFromParent();
+        continue;
+      }
+    }
+
     // convert the integer to llvm value
     llvm::Value* newConsIntInd = llvm::ConstantInt::get(intType, newIndex);
 
@@ -230,6 +260,52 @@ void SDUpdateIndices::handleSDGetVtblIndex(Module* M) {
   }
 }
 
+/**
+ * Rewrite the users of a vtable index in a relative cloud. The index is either
+ * used directly by the GEP computing the slot (vcalls, typeid), or scaled by
+ * the pointer size first (vbase offsets, arguments of __ivtbl_dynamic_cast).
+ */
+void SDUpdateIndices::handleRelativeIndexUses(Module* M, CallInst* CI, int64_t byteOff) {
+  const DataLayout &DL = M->getDataLayout();
+  Type* intType = IntegerType::getInt64Ty(M->getContext());
+  std::vector<User*> users(CI->user_begin(), CI->user_end());
+
+  // SDLayoutBuilder::canUseRelativeLayout only picks clouds whose uses can be
+  // rewritten, anything else would read a 32-bit entry as an 8-byte one
+  if (!SDLayoutBuilder::canRewriteRelativeIndex(CI, DL))
+    report_fatal_error("SD: unexpected use of a relative vtable index");
+
+  for (User* user : users) {
+    if (isa<GetElementPtrInst>(user)) {
+      if (!layoutBuilder->rewriteRelativeSlot(cast<Instruction>(user), byteOff))
+        report_fatal_error("SD: unexpected use of a relative vtable slot");
+      continue;
+    }
+
+    Instruction* mul = cast<Instruction>(user);
+    std::vector<User*> scaledUsers(mul->user_begin(), mul->user_end());
+    for (User* scaledUser : scaledUsers) {
+      CallInst* call = dyn_cast<CallInst>(scaledUser);
+
+      if (isa<GetElementPtrInst>(scaledUser)) {
+        if (!layoutBuilder->rewriteRelativeSlot(cast<Instruction>(scaledUser), byteOff))
+          report_fatal_error("SD: unexpected use of a relative vtable slot");
+      } else {
+        Constant* relDyncast = M->getOrInsertFunction(SD_DYNCAST_REL_FUNC_NAME, call->getFunctionType());
+        call->setCalledFunction(relDyncast);
+
+        for (unsigned i = 0; i < call->getNumArgOperands(); i++) {
+          if (call->getArgOperand(i) == mul)
+            call->setArgOperand(i, ConstantInt::getSigned(intType, byteOff));
+        }
+      }
+    }
+
+    if (mul->use_empty())
+      mul->eraseFromParent();
+  }
+}
+
 //Paul: this is used for the in-place sort operation 
 struct range_less_than_key {
   inline bool operator()(const SDLayoutBuilder::mem_range_t &r1, const SDLayoutBuilder::mem_range_t &r2) {
@@ -237,6 +313,35 @@ struct range_less_than_key {
   }
 };
 
+/**
+ * Quarantined clouds keep their original vtables, a vptr of className has to
+ * be one of the address points of the sub-vtables deriving from it. These are
+ * returned as ranges of width 1, which are lowered to equality checks. False
+ * if they are not all known, the call site is not checked then.
+ */
+bool SDUpdateIndices::getQuarantineRanges(Module* M, const std::string& className,
+                                          std::vector<SDLayoutBuilder::mem_range_t>& ranges) {
+  SDBuildCHA::order_t addrPts;
+  if (!cha->getQuarantinedAddrPts(SDLayoutBuilder::vtbl_t(className, 0), addrPts))
+    return false;
+
+  const DataLayout &DL = M->getDataLayout();
+  Type *IntPtrTy = DL.getIntPtrType(M->getContext(), 0);
+
+  for (auto &addrPt : addrPts) {
+    GlobalVariable* vtable = M->getGlobalVariable(addrPt.first, true);
+    if (!vtable || !vtable->getType()->getElementType()->isArrayTy())
+      return false;
+
+    // same form as the range starts of the layout builder
+    uint64_t entrySize = DL.getTypeAllocSize(vtable->getType()->getElementType()->getArrayElementType());
+    Constant* vtableInt = ConstantExpr::getPtrToInt(vtable, IntPtrTy);
+    Constant* start = ConstantExpr::getAdd(vtableInt, ConstantInt::get(IntPtrTy, addrPt.second * entrySize));
+    ranges.push_back(SDLayoutBuilder::mem_range_t(start, 1));
+  }
+  return true;
+}
+
 //Paul: adds the range check (casted_vptr, start, width, alingment)
 //add check v table and check v table range 
 // it uses: 
@@ -406,6 +511,29 @@ void SDUpdateIndices::handleSDCheckVtbl(Module* M) {
         CI->eraseFromParent();
       }        
       */
+    } else if (cha->isQuarantined(className)) {
+      std::vector<SDLayoutBuilder::mem_range_t> ranges;
+      llvm::Value* valid = llvm::ConstantInt::getTrue(C);
+
+      if (getQuarantineRanges(M, className, ranges)) {
+        IRBuilder<> builder(CI);
+        llvm::Value *castVptr = builder.CreateBitCast(vptr, IntegerType::getInt8PtrTy(C));
+        llvm::Constant* alignment = llvm::ConstantInt::get(IntPtrTy, DL.getPointerSize());
+
+        for (unsigned i = 0; i < ranges.size(); i++) {
+          llvm::Value *Args[] = {castVptr, ranges[i].first,
+                                 llvm::ConstantInt::get(IntPtrTy, ranges[i].second), alignment};
+          llvm::Value* inRange = builder.CreateCall(
+            Intrinsic::getDeclaration(M, Intrinsic::sd_subst_check_range), Args);
+          valid = i == 0 ? inRange : builder.CreateOr(valid, inRange);
+        }
+      } else {
+        sdLog::log() << "Quarantined " << className << " is not checked\n";
+        uncheckedCallSites++;
+      }
+
+      CI->replaceAllUsesWith(valid);
+      CI->eraseFromParent();
     } else { //Paul: if start == NULL
       std::cerr << "llvm.sd.callsite.false:" << vtbl.first << "," << vtbl.second << std::endl;
       CI->replaceAllUsesWith(llvm::ConstantInt::getFalse(C));
@@ -497,6 +625,17 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
     }
     sd_print("\n"); //just add a gap in the printings 
 
+    // quarantined clouds keep their layout, see SDBuildCHA::quarantineClouds
+    std::vector<SDLayoutBuilder::mem_range_t> quarantineRanges;
+    if (!layoutBuilder->hasMemRange(vtbl) && cha->isQuarantined(className) &&
+        !getQuarantineRanges(M, className, quarantineRanges)) {
+      sdLog::log() << "Quarantined " << className << " is not checked\n";
+      uncheckedCallSites++;
+      CI->replaceAllUsesWith(vptr);
+      CI->eraseFromParent();
+      continue;
+    }
+
     LLVMContext& C = CI->getContext();                    //Paul: get call inst. context 
     llvm::BasicBlock *BB = CI->getParent();               //Paul: get the parent 
     llvm::Function *F = BB->getParent();                  //Paul: get the parent of the previous BB 
@@ -512,25 +651,32 @@ void SDUpdateIndices::handleSDGetCheckedVtbl(Module* M) {
     llvm::Value *castVptr = builder.CreateBitCast(vptr, Int8PtrTy);
  
     //Paul: layout builder has a memory range for that v table 
-    if (layoutBuilder->hasMemRange(vtbl)) {
-      if(!cha->hasAncestor(vtbl)) {
-        sd_print("%s\n", vtbl.first.data());
-        assert(false);
+    if (layoutBuilder->hasMemRange(vtbl) || !quarantineRanges.empty()) {
+      llvm::Constant* alignment;
+      std::vector<SDLayoutBuilder::mem_range_t> ranges(quarantineRanges);
+
+      if (quarantineRanges.empty()) {
+        if(!cha->hasAncestor(vtbl)) {
+          sd_print("%s\n", vtbl.first.data());
+          assert(false);
+        }
+
+        //get the root of this v table 
+        SDLayoutBuilder::vtbl_name_t root = cha->getAncestor(vtbl);
+        assert(layoutBuilder->alignmentMap.count(root));
+
+        //determine the alignment value 
+        alignment = llvm::ConstantInt::get(IntPtrTy, layoutBuilder->alignmentMap[root]);
+
+        //notice a v table can have multiple ranges 
+        ranges = layoutBuilder->getMemRange(vtbl);
+        std::sort(ranges.begin(), ranges.end(), range_less_than_key()); //Paul: sort the elements in the range 
+      } else {
+        alignment = llvm::ConstantInt::get(IntPtrTy, DL.getPointerSize());
       }
-      
-      //get the root of this v table 
-      SDLayoutBuilder::vtbl_name_t root = cha->getAncestor(vtbl);
-      assert(layoutBuilder->alignmentMap.count(root));
 
-      //determine the alignment value 
-      llvm::Constant* alignment = llvm::ConstantInt::get(IntPtrTy, layoutBuilder->alignmentMap[root]);
-      
       int i = 0;
 
-      //notice a v table can have multiple ranges 
-      std::vector<SDLayoutBuilder::mem_range_t> ranges(layoutBuilder->getMemRange(vtbl));
-      std::sort(ranges.begin(), ranges.end(), range_less_than_key()); //Paul: sort the elements in the range 
-
       uint64_t sum = 0;
       //Paul: iterate throught the ranges and compute width 
       // in oder to insert the check we need only to know the start address and the width
@@ -640,6 +786,121 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
   }
 }
 
+/**
+ * Returns the vtable name of the class described by the type info rtti, or an
+ * empty string if it is not one of the _ZTI globals of a named class.
+ */
+static std::string sd_getClassNameFromRTTI(Value* rtti) {
+  GlobalVariable* GV = dyn_cast<GlobalVariable>(rtti->stripPointerCasts());
+  if (!GV || !GV->getName().startswith("_ZTI") ||
+      GV->getName().find("_GLOBAL__N_") != StringRef::npos)
+    return "";
+
+  return "_ZTV" + GV->getName().substr(4).str();
+}
+
+/**
+ * Interleaved layouts put every sub-vtable cloud in a contiguous range. When src
+ * is a unique public nonvirtual base of dst (src2dst >= 0), the source subobject
+ * lies in a dst exactly when its vptr is in the range of the sub-vtable of dst
+ * that holds src, and the result is src_ptr - src2dst. Other vptrs (failed
+ * casts, construction vtables, vtables of other DSOs) still go to libdyncast.
+ */
+bool SDUpdateIndices::lowerDynamicCast(Module* M, CallInst* CI) {
+  ConstantInt* src2dst = dyn_cast<ConstantInt>(CI->getArgOperand(3));
+  if (!src2dst || src2dst->isNegative())
+    return false;
+
+  std::string srcName = sd_getClassNameFromRTTI(CI->getArgOperand(1));
+  std::string dstName = sd_getClassNameFromRTTI(CI->getArgOperand(2));
+  if (srcName.empty() || dstName.empty() ||
+      !cha->knowsAbout(SDLayoutBuilder::vtbl_t(dstName, 0)))
+    return false;
+
+  int64_t ind = cha->getSubVTableIndex(dstName, srcName);
+  if (ind == -1)
+    return false;
+
+  SDLayoutBuilder::vtbl_t vtbl(dstName, ind);
+  if (!cha->knowsAbout(vtbl) || !cha->hasAncestor(vtbl) ||
+      layoutBuilder->isRelative(vtbl) ||
+      (cha->isUndefined(vtbl) && !cha->hasFirstDefinedChild(vtbl)))
+    return false;
+
+  llvm::Constant* start = cha->isUndefined(vtbl) ?
+    layoutBuilder->getVTableRangeStart(cha->getFirstDefinedChild(vtbl)) :
+    layoutBuilder->getVTableRangeStart(vtbl);
+  int64_t rangeWidth = cha->getCloudSize(vtbl);
+  SDLayoutBuilder::vtbl_name_t root = cha->getAncestor(vtbl);
+  if (!start || rangeWidth == 0 || !layoutBuilder->alignmentMap.count(root))
+    return false;
+
+  const DataLayout &DL = M->getDataLayout();
+  LLVMContext& C = M->getContext();
+  Type *IntPtrTy = DL.getIntPtrType(C, 0);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+
+  IRBuilder<> builder(CI);
+  Value* srcPtr = builder.CreateBitCast(CI->getArgOperand(0), Int8PtrTy);
+  Value* vptr = builder.CreateLoad(builder.CreateBitCast(srcPtr, Int8PtrTy->getPointerTo()));
+
+  Value* Args[] = {vptr, start, ConstantInt::get(IntPtrTy, rangeWidth),
+                   ConstantInt::get(IntPtrTy, layoutBuilder->alignmentMap[root])};
+  Value* inRange = builder.CreateCall(
+    Intrinsic::getDeclaration(M, Intrinsic::sd_subst_check_range), Args);
+
+  TerminatorInst *fastTerm, *slowTerm;
+  SplitBlockAndInsertIfThenElse(inRange, CI, &fastTerm, &slowTerm);
+  BasicBlock* contBB = CI->getParent();
+  fastTerm->getParent()->setName("sd.dyncast.fast");
+  slowTerm->getParent()->setName("sd.dyncast.slow");
+
+  builder.SetInsertPoint(fastTerm);
+  Value* dstPtr = builder.CreateConstGEP1_64(srcPtr, -src2dst->getSExtValue());
+  dstPtr = builder.CreateBitCast(dstPtr, CI->getType());
+
+  CI->moveBefore(slowTerm);
+
+  PHINode* result = PHINode::Create(CI->getType(), 2, "", &contBB->front());
+  CI->replaceAllUsesWith(result);
+  result->addIncoming(dstPtr, fastTerm->getParent());
+  result->addIncoming(CI, slowTerm->getParent());
+  result->takeName(CI);
+  return true;
+}
+
+void SDUpdateIndices::handleDynamicCasts(Module* M) {
+  Function* dyncastF = M->getFunction(SD_DYNCAST_FUNC_NAME);
+  if (!dyncastF)
+    return;
+
+  std::vector<CallInst*> calls;
+  for (User* U : dyncastF->users()) {
+    if (CallInst* CI = dyn_cast<CallInst>(U)) {
+      if (CI->getCalledValue() == dyncastF)
+        calls.push_back(CI);
+    } else if (isa<ConstantExpr>(U)) {
+      for (User* castU : U->users()) {
+        CallInst* CI = dyn_cast<CallInst>(castU);
+        if (CI && CI->getCalledValue() == U)
+          calls.push_back(CI);
+      }
+    }
+  }
+
+  unsigned lowered = 0;
+  for (CallInst* CI : calls) {
+    if (CI->getNumArgOperands() == 6 && lowerDynamicCast(M, CI))
+      lowered++;
+  }
+
+  sdTrace::count("dyncasts", calls.size());
+  sdTrace::count("dyncasts_lowered", lowered);
+
+  sdLog::stream() << "Lowered " << lowered << " of " << calls.size()
+                  << " dynamic casts to vptr range checks\n";
+}
+
 
   /**
    * P5 Module pass for substittuing the final subst_ intrinsics
@@ -659,6 +920,7 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
 
     bool runOnModule(Module &M) {
       sd_print("\nP5. Started running SDSubstModule pass ...\n");
+      sdTrace::Scope Trace("SDSubstModule");
       sd_print("P5. Starting final range checks additions ...\n");
       
       //Paul: count the number of indexes substituted
@@ -748,8 +1010,11 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
           //this is just for statistics relevant
           sumWidth = sumWidth + widthInt;
 
+          //size of one vtable entry, 4 for relative vtables
+          int64_t entrySize = DL.getTypeAllocSize(rootVtbl->getType()->getElementType()->getArrayElementType());
+
           //check if vptr is constant
-          if (validConstVptr(rootVtbl, startOff->getSExtValue(), widthInt, DL, vptr, 0)) {
+          if (validConstVptr(rootVtbl, startOff->getSExtValue(), widthInt, entrySize, DL, vptr, 0)) {
             
             //replace call instruction with an constant int 
             CI->replaceAllUsesWith(llvm::ConstantInt::getTrue(C));
@@ -810,6 +1075,12 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
       //in the interleaving paper the average number of ranges per call site was close to 1 (1,005).
       sd_print("\n P5. Finished running SDSubstModule pass...\n");
 
+      Trace.count("index_substitutions", indexSubst);
+      Trace.count("range_checks", rangeSubst);
+      Trace.count("eq_checks", eqSubst);
+      Trace.count("const_vptrs", constPtr);
+      Trace.count("range_width_sum", sumWidth);
+
       sd_print("\n ---P5. SDSubst Statistics--- \n");
 
       sd_print(" Total index substitutions %d \n", indexSubst);
@@ -823,10 +1094,11 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
     }
 
 //Paul: this validates a constant pointer 
-//it is only true if start <= off && off < (start + width * 8) evaluates to true 
+//it is only true if start <= off && off < (start + width * entrySize) evaluates to true 
  bool validConstVptr(GlobalVariable *rootVtbl, 
                                 int64_t start, 
                                 int64_t width,
+                            int64_t entrySize,
                          const DataLayout &DL, 
                                      Value *V, 
                               uint64_t off) { //initial value is 0 
@@ -835,11 +1107,11 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         if (GV != rootVtbl)
           return false;
 
-        if (off % 8 != 0)
+        if (off % entrySize != 0)
           return false;
         
         //Paul: this is the only place that the check can get true in this method 
-        return start <= off && off < (start + width * 8);
+        return start <= off && off < (start + width * entrySize);
       }
 
       if (auto GEP = dyn_cast<GEPOperator>(V)) {
@@ -852,17 +1124,17 @@ void SDUpdateIndices::handleRemainingSDGetVcallIndex(Module* M) {
         //getZExtValue() - get the value as a 64-bit unsigned integer after is was zero extended
         //as appropriate for the type of this constant 
         off += APOffset.getZExtValue();
-        return validConstVptr(rootVtbl, start, width, DL, GEP->getPointerOperand(), off); //recursive call 
+        return validConstVptr(rootVtbl, start, width, entrySize, DL, GEP->getPointerOperand(), off); //recursive call 
       }
       
       //check the operand type 
       if (auto Op = dyn_cast<Operator>(V)) {
         if (Op->getOpcode() == Instruction::BitCast)//bitcast operation
-          return validConstVptr(rootVtbl, start, width, DL, Op->getOperand(0), off);//recursive call
+          return validConstVptr(rootVtbl, start, width, entrySize, DL, Op->getOperand(0), off);//recursive call
 
         if (Op->getOpcode() == Instruction::Select)//select operation
-          return validConstVptr(rootVtbl, start, width, DL, Op->getOperand(1), off) &&
-                 validConstVptr(rootVtbl, start, width, DL, Op->getOperand(2), off); //two recursive calls 
+          return validConstVptr(rootVtbl, start, width, entrySize, DL, Op->getOperand(1), off) &&
+                 validConstVptr(rootVtbl, start, width, entrySize, DL, Op->getOperand(2), off); //two recursive calls 
       }
 
       return false;
@@ -1,11 +1,49 @@
-#include <cstdio>
-#include <cstring>
 #include <cstdlib>
-#include <cassert>
-#include <unistd.h>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <pthread.h>
 #include <dlfcn.h>
 #include <link.h>
 
+/*
+ * Cross-DSO vptr checks.
+ *
+ * A hardened DSO points to its range map and white list with the dynamic
+ * tags below. Instead of looking them up on every check, the tables of every
+ * loaded DSO are copied into one registry when the DSO is loaded, hashed by
+ * the FNV-1a hash of the class name. The names are copied as well and
+ * compared when the hashes match. A check is a lock-free probe of the
+ * registry, it does not call into the dynamic loader, does not touch the
+ * memory of the DSOs and does no I/O.
+ *
+ * The registry is rebuilt under a mutex from dl_iterate_phdr when the program
+ * starts, after every dlopen and dlclose, and when a checked vptr does not
+ * lie in any known DSO. Readers never wait: tables only grow by publishing a
+ * new copy, entries of unloaded DSOs are turned off, nothing is ever freed.
+ * Finding the object of a vptr that is not in any range walks the loaded
+ * objects, this only happens for objects of unhardened DSOs and on failure.
+ *
+ * The return checks of address-taken functions ask the runtime whether a
+ * return address that carries none of their IDs belongs to a caller in
+ * another DSO. Hardened DSOs register the words their call sites carry
+ * after the call from a constructor, callers in them have to carry one of
+ * those. The text of the main executable is cached for the common case.
+ */
+
+#define DT_SD_RANGEMAP  0x70000035
+#define DT_SD_WHITELIST 0x70000036
+
+/*
+ * Words found after the call instructions of a DSO, see
+ * __sd_register_return_ids. Immutable once published.
+ */
+typedef struct _IDSet {
+  uint64_t mask;
+  uint64_t keys[1];             // word + 1, 0 marks an empty slot
+} IDSet_t;
+
 typedef struct _RangeMapElement {
   char *name;
   int64_t start;
@@ -28,113 +66,446 @@ typedef struct _WhiteList {
   WhiteListElement_t elements[1];
 } WhiteList_t;
 
-RangeMapElement_t *findRange(RangeMap_t *rMap, const char *className) {
-  //printf("%lld entries in rMap:\n", (long long) rMap->nelements);
-  for (int64_t i = 0; i < rMap->nelements; i++) {
-    /*
-    printf("%s start: %p size: %lld\n", rMap->elements[i].name,
-      (intptr_t) rMap->elements[i].start,
-      (intptr_t) rMap->elements[i].size
-      );
-    */
-
-    if (!strcmp(className, rMap->elements[i].name)) {
-    /*
-      printf("Its a match!\n");
-      fflush(stdout);
-    */
-      return &rMap->elements[i];
+enum DSOState { DSO_LOADING, DSO_LOADED, DSO_UNLOADED };
+
+/*
+ * A loaded object, identified by its load address and program headers.
+ * Unloaded objects are unlinked from the list but never freed.
+ */
+typedef struct _DSO {
+  uintptr_t addr;
+  const void *phdr;
+  uintptr_t start;              // lowest and highest address of the PT_LOAD segments
+  uintptr_t end;
+  uintptr_t textStart;          // same for the executable ones
+  uintptr_t textEnd;
+  bool hardened;                // has a range map
+  std::atomic<IDSet_t*> returnIDs;
+  bool seen;                    // found by the current rescan
+  std::atomic<int> state;
+  std::atomic<struct _DSO*> next;
+} DSO_t;
+
+/*
+ * One range map or white list entry. key is written last, readers that see
+ * it see the rest of the entry.
+ */
+typedef struct _Slot {
+  std::atomic<uint64_t> key;
+  uint64_t classHash;
+  const char *className;        // copy owned by the registry
+  uintptr_t start;              // white list: the allowed vptr
+  uintptr_t end;
+  uintptr_t alignment;
+  DSO_t *dso;
+} Slot_t;
+
+typedef struct _Table {
+  uint64_t mask;
+  uint64_t used;
+  Slot_t slots[1];
+} Table_t;
+
+#define INITIAL_TABLE_SIZE 1024
+
+static std::atomic<Table_t*> rangeTable(NULL);
+static std::atomic<Table_t*> whiteTable(NULL);
+static std::atomic<DSO_t*> dsoList(NULL);
+static std::atomic<DSO_t*> mainDSO(NULL);
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hashName(const char *name) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+    hash ^= *c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t whiteListKey(uint64_t classHash, uintptr_t vptr) {
+  return classHash ^ ((uint64_t) vptr * 0x9e3779b97f4a7c15ULL);
+}
+
+// 0 marks an empty slot
+static uint64_t slotKey(uint64_t hash) {
+  return hash ? hash : 1;
+}
+
+static Table_t *newTable(uint64_t size) {
+  void *mem = calloc(1, sizeof(Table_t) + (size - 1) * sizeof(Slot_t));
+  if (!mem)
+    return NULL;
+
+  // the slots hold atomics, construct them in the zeroed memory
+  Table_t *table = new (mem) Table_t();
+  for (uint64_t i = 1; i < size; i++)
+    new (&table->slots[i]) Slot_t();
+  table->mask = size - 1;
+  return table;
+}
+
+static void insertSlot(Table_t *table, uint64_t key, const Slot_t &entry) {
+  uint64_t i = key & table->mask;
+  while (table->slots[i].key.load(std::memory_order_relaxed))
+    i = (i + 1) & table->mask;
+
+  Slot_t &slot = table->slots[i];
+  slot.classHash = entry.classHash;
+  slot.className = entry.className;
+  slot.start = entry.start;
+  slot.end = entry.end;
+  slot.alignment = entry.alignment;
+  slot.dso = entry.dso;
+  slot.key.store(key, std::memory_order_release);
+  table->used++;
+}
+
+/*
+ * Add an entry, publishing a larger copy without the entries of unloaded
+ * DSOs when the table is half full. Called with registryLock held.
+ */
+static void insert(std::atomic<Table_t*> &current, uint64_t key, const Slot_t &entry) {
+  Table_t *table = current.load(std::memory_order_relaxed);
+
+  if (!table || (table->used + 1) * 2 > table->mask + 1) {
+    uint64_t size = table ? (table->mask + 1) * 2 : INITIAL_TABLE_SIZE;
+    Table_t *grown = newTable(size);
+    if (!grown)
+      abort();
+
+    for (uint64_t i = 0; table && i <= table->mask; i++) {
+      Slot_t &slot = table->slots[i];
+      uint64_t oldKey = slot.key.load(std::memory_order_relaxed);
+      if (oldKey && slot.dso->state.load(std::memory_order_relaxed) != DSO_UNLOADED)
+        insertSlot(grown, oldKey, slot);
     }
+
+    // the old table stays valid for the readers still probing it
+    current.store(grown, std::memory_order_release);
+    table = grown;
   }
-  return NULL;
+
+  insertSlot(table, key, entry);
 }
 
-bool vptr_safe(const void *vptr, const char *className) {
-  Dl_info inf, inf1;
+// the names outlive the DSO, entries of unloaded ones stay in the tables
+static const char *copyName(const char *name) {
+  char *copy = strdup(name);
+  if (!copy)
+    abort();
+  return copy;
+}
+
+static void registerTables(DSO_t *dso, uintptr_t base, const ElfW(Dyn) *dyn) {
   RangeMap_t *rMap = NULL;
   WhiteList_t *wList = NULL;
-  void *dlH;
 
-  printf("Checking %p for %s\n", vptr, className);
+  for (const ElfW(Dyn) *e = dyn; e && e->d_tag != DT_NULL; e++) {
+    if (e->d_tag == DT_SD_RANGEMAP) {
+      rMap = (RangeMap_t*) (base + (uintptr_t) e->d_un.d_ptr);
+    } else if (e->d_tag == DT_SD_WHITELIST) {
+      wList = (WhiteList_t*) (base + (uintptr_t) e->d_un.d_ptr);
+    }
+  }
+
+  // objects not compiled by our tool accept every vptr
+  dso->hardened = rMap != NULL;
+  if (!rMap)
+    return;
 
-  if (!dladdr(vptr, &inf)) {
-    return false;
+  for (int64_t i = 0; i < rMap->nelements; i++) {
+    const RangeMapElement_t &range = rMap->elements[i];
+    uintptr_t start = (uintptr_t) range.start;
+    if (start < dso->start || start >= dso->end)
+      continue;
+
+    Slot_t entry;
+    entry.classHash = hashName(range.name);
+    entry.className = copyName(range.name);
+    entry.start = start;
+    entry.end = start + (uintptr_t) (range.size * range.alignment);
+    entry.alignment = range.alignment > 0 ? (uintptr_t) range.alignment : 1;
+    entry.dso = dso;
+    insert(rangeTable, slotKey(entry.classHash), entry);
   }
 
-  printf("Pointer lies in library %s loaded at %p", inf.dli_fname, inf.dli_fbase);
-  if (inf.dli_sname) {
-    printf(" in symbol %s at index %p\n", inf.dli_sname, ((intptr_t)vptr - (intptr_t)inf.dli_saddr)/8);
-  } else {
-    printf("\n");
+  // only consulted for vptrs of this object
+  for (int64_t i = 0; wList && i < wList->nelements; i++) {
+    const WhiteListElement_t &white = wList->elements[i];
+    uintptr_t value = (uintptr_t) white.value;
+    if (value < dso->start || value >= dso->end)
+      continue;
+
+    Slot_t entry;
+    entry.classHash = hashName(white.name);
+    entry.className = copyName(white.name);
+    entry.start = value;
+    entry.end = value;
+    entry.alignment = 1;
+    entry.dso = dso;
+    insert(whiteTable, slotKey(whiteListKey(entry.classHash, value)), entry);
   }
+}
 
-  dlH = dlopen(inf.dli_fname, RTLD_NOLOAD | RTLD_LOCAL | RTLD_LAZY);
+static int registerDSO(struct dl_phdr_info *info, size_t, void *) {
+  for (DSO_t *dso = dsoList.load(std::memory_order_relaxed); dso;
+       dso = dso->next.load(std::memory_order_relaxed)) {
+    if (dso->addr == info->dlpi_addr && dso->phdr == info->dlpi_phdr) {
+      dso->seen = true;
+      return 0;
+    }
+  }
 
-  /*
-  printf("dlH = %p error=%s\n", dlH, dlerror());
-  */
+  DSO_t *newDSO = new (std::nothrow) DSO_t();
+  if (!newDSO)
+    abort();
 
-  assert(dlH && "dlH should be not null");
+  DSO_t &dso = *newDSO;
+  dso.addr = info->dlpi_addr;
+  dso.phdr = info->dlpi_phdr;
+  dso.start = UINTPTR_MAX;
+  dso.end = 0;
+  dso.textStart = UINTPTR_MAX;
+  dso.textEnd = 0;
+  dso.seen = true;
 
-  struct link_map *map;
+  // the tags are relative to the address of the ELF header, see dladdr
+  uintptr_t base = info->dlpi_addr;
+  const ElfW(Dyn) *dyn = NULL;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD) {
+      uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+      if (start < dso.start)
+        dso.start = start;
+      if (start + phdr.p_memsz > dso.end)
+        dso.end = start + phdr.p_memsz;
+      if ((phdr.p_flags & PF_X) && start < dso.textStart)
+        dso.textStart = start;
+      if ((phdr.p_flags & PF_X) && start + phdr.p_memsz > dso.textEnd)
+        dso.textEnd = start + phdr.p_memsz;
+      if (phdr.p_offset == 0)
+        base = start;
+    } else if (phdr.p_type == PT_DYNAMIC) {
+      dyn = (const ElfW(Dyn)*) (info->dlpi_addr + phdr.p_vaddr);
+    }
+  }
 
-  dlinfo(dlH, RTLD_DI_LINKMAP, &map);
+  registerTables(&dso, base, dyn);
 
-//  printf("%s loaded at %p dynamic sec at %p\n", map->l_name, map->l_addr, map->l_ld);
-  Elf64_Dyn *e = map->l_ld;
+  dso.state.store(DSO_LOADED, std::memory_order_release);
+  dso.next.store(dsoList.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  dsoList.store(&dso, std::memory_order_release);
 
-  while (e->d_tag != DT_NULL) {
-//    printf("Tag: %d val: %p\n", e->d_tag, e->d_un.d_ptr);
-    if (e->d_tag == 0x70000035) {
-      rMap = (RangeMap_t*) (((intptr_t)inf.dli_fbase) + ((intptr_t)e->d_un.d_ptr));
-    } else if (e->d_tag == 0x70000036) {
-      wList = (WhiteList_t*) (((intptr_t)inf.dli_fbase) + ((intptr_t)e->d_un.d_ptr));
-    }
-    e++;
-  }
-
-  if (rMap) {
-    RangeMapElement_t *range = findRange(rMap, className);
-    if (range) {
-      int64_t start = range->start;
-      int64_t size = range->size;
-      int64_t alignment = range->alignment;
-
-      if (((int64_t)vptr) >= start && ((int64_t)vptr < (start + size * alignment)) &&
-        ((int64_t)vptr) % alignment == 0) {
-        /*
-        printf("%p is in the range %p-%p for %s\n", (void*)vptr, (void*)start, (void*)(start+size), className);
-        fflush(stdout);
-        */
-        return true;
-      } else {
-        /*
-        printf("%p is not in the range %p-%p for %s\n", (void*)vptr, (void*)start, (void*)(start+size), className);
-        fflush(stdout);
-        */
-        goto fail_l;
-      }
+  // the program itself is reported first and never unloaded
+  if (!mainDSO.load(std::memory_order_relaxed))
+    mainDSO.store(&dso, std::memory_order_release);
+  return 0;
+}
+
+/*
+ * Bring the registry up to date with the loaded objects
+ */
+static void refresh() {
+  pthread_mutex_lock(&registryLock);
+
+  for (DSO_t *dso = dsoList.load(std::memory_order_relaxed); dso;
+       dso = dso->next.load(std::memory_order_relaxed))
+    dso->seen = false;
+
+  dl_iterate_phdr(registerDSO, NULL);
+
+  // readers standing on an unlinked object still find the rest of the list
+  std::atomic<DSO_t*> *link = &dsoList;
+  while (DSO_t *dso = link->load(std::memory_order_relaxed)) {
+    if (dso->seen) {
+      link = &dso->next;
+      continue;
     }
-  } else {
-    /*
-    printf("Module %s was not compiled by our tool :(\n", inf.dli_fname);
-    */
+    dso->state.store(DSO_UNLOADED, std::memory_order_release);
+    link->store(dso->next.load(std::memory_order_relaxed), std::memory_order_release);
+  }
+
+  pthread_mutex_unlock(&registryLock);
+}
+
+__attribute__((constructor))
+static void initRegistry() {
+  refresh();
+}
+
+/*
+ * Load hooks, interposed on the ones of libdl
+ */
+extern "C" void *dlopen(const char *file, int mode) {
+  typedef void *(*dlopen_t)(const char *, int);
+  static dlopen_t realDlopen = (dlopen_t) dlsym(RTLD_NEXT, "dlopen");
+
+  void *handle = realDlopen(file, mode);
+  if (handle)
+    refresh();
+  return handle;
+}
+
+extern "C" int dlclose(void *handle) {
+  typedef int (*dlclose_t)(void *);
+  static dlclose_t realDlclose = (dlclose_t) dlsym(RTLD_NEXT, "dlclose");
+
+  int result = realDlclose(handle);
+  refresh();
+  return result;
+}
+
+static bool inRange(uintptr_t vptr, uint64_t classHash, const char *className) {
+  Table_t *table = rangeTable.load(std::memory_order_acquire);
+  if (!table)
+    return false;
+
+  uint64_t key = slotKey(classHash);
+  for (uint64_t i = key & table->mask; ; i = (i + 1) & table->mask) {
+    const Slot_t &slot = table->slots[i];
+    uint64_t slotKey = slot.key.load(std::memory_order_acquire);
+    if (!slotKey)
+      return false;
+
+    if (slotKey == key && slot.classHash == classHash &&
+        slot.dso->state.load(std::memory_order_acquire) == DSO_LOADED &&
+        vptr >= slot.start && vptr < slot.end &&
+        vptr % slot.alignment == 0 &&
+        strcmp(slot.className, className) == 0)
+      return true;
+  }
+}
+
+static bool isWhiteListed(uintptr_t vptr, uint64_t classHash, const char *className) {
+  Table_t *table = whiteTable.load(std::memory_order_acquire);
+  if (!table)
+    return false;
+
+  uint64_t key = slotKey(whiteListKey(classHash, vptr));
+  for (uint64_t i = key & table->mask; ; i = (i + 1) & table->mask) {
+    const Slot_t &slot = table->slots[i];
+    uint64_t slotKey = slot.key.load(std::memory_order_acquire);
+    if (!slotKey)
+      return false;
+
+    if (slotKey == key && slot.classHash == classHash && slot.start == vptr &&
+        slot.dso->state.load(std::memory_order_acquire) == DSO_LOADED &&
+        strcmp(slot.className, className) == 0)
+      return true;
+  }
+}
+
+static DSO_t *findDSO(uintptr_t vptr) {
+  for (DSO_t *dso = dsoList.load(std::memory_order_acquire); dso;
+       dso = dso->next.load(std::memory_order_acquire)) {
+    if (vptr >= dso->start && vptr < dso->end &&
+        dso->state.load(std::memory_order_acquire) == DSO_LOADED)
+      return dso;
+  }
+  return NULL;
+}
+
+bool vptr_safe(const void *vptr, const char *className) {
+  uintptr_t addr = (uintptr_t) vptr;
+  uint64_t classHash = hashName(className);
+
+  if (inRange(addr, classHash, className) || isWhiteListed(addr, classHash, className))
     return true;
+
+  DSO_t *dso = findDSO(addr);
+  if (!dso) {
+    // loaded behind the back of the hooks, e.g. by libc itself
+    refresh();
+    if (inRange(addr, classHash, className) || isWhiteListed(addr, classHash, className))
+      return true;
+    dso = findDSO(addr);
   }
 
-fail_l:
-  if (wList) {
-    printf("wList->nelements=%d\n", wList->nelements);
-    for (int64_t i = 0; i < wList->nelements; i++) {
-      printf("Class %s\n", wList->elements[i].name);
-      if (!strcmp(className, wList->elements[i].name)) {
-        if (wList->elements[i].value == (intptr_t)vptr) {
-          // printf("%s found\n", className);
-          return true;
-        }
-      }
-    }
+  return dso && !dso->hardened;
+}
+
+static bool inText(const DSO_t *dso, uintptr_t addr) {
+  return addr >= dso->textStart && addr < dso->textEnd;
+}
+
+static DSO_t *findTextDSO(uintptr_t addr) {
+  DSO_t *program = mainDSO.load(std::memory_order_acquire);
+  if (program && inText(program, addr))
+    return program;
+
+  for (DSO_t *dso = dsoList.load(std::memory_order_acquire); dso;
+       dso = dso->next.load(std::memory_order_acquire)) {
+    if (inText(dso, addr) &&
+        dso->state.load(std::memory_order_acquire) == DSO_LOADED)
+      return dso;
   }
-  printf("%s not found\n", className);
-  return false;
+  return NULL;
+}
+
+static bool hasReturnID(const DSO_t *dso, uint32_t word) {
+  const IDSet_t *set = dso->returnIDs.load(std::memory_order_acquire);
+  // callers in unhardened DSOs carry no IDs
+  if (!set)
+    return true;
+
+  uint64_t key = (uint64_t) word + 1;
+  for (uint64_t i = (key * 0x9e3779b97f4a7c15ULL) & set->mask; ; i = (i + 1) & set->mask) {
+    if (set->keys[i] == key)
+      return true;
+    if (!set->keys[i])
+      return false;
+  }
+}
+
+/*
+ * Called by the constructor of a hardened DSO, anchor is an address in its text
+ */
+extern "C" void __sd_register_return_ids(const void *anchor, const uint32_t *words, uint64_t count) {
+  uint64_t size = 16;
+  while (size < count * 2)
+    size *= 2;
+
+  IDSet_t *set = (IDSet_t*) calloc(1, sizeof(IDSet_t) + (size - 1) * sizeof(uint64_t));
+  if (!set)
+    abort();
+  set->mask = size - 1;
+
+  for (uint64_t n = 0; n < count; n++) {
+    uint64_t key = (uint64_t) words[n] + 1;
+    uint64_t i = (key * 0x9e3779b97f4a7c15ULL) & set->mask;
+    while (set->keys[i] && set->keys[i] != key)
+      i = (i + 1) & set->mask;
+    set->keys[i] = key;
+  }
+
+  // the constructors run before dlopen returns to the hook
+  DSO_t *dso = findTextDSO((uintptr_t) anchor);
+  if (!dso) {
+    refresh();
+    dso = findTextDSO((uintptr_t) anchor);
+  }
+  if (dso)
+    dso->returnIDs.store(set, std::memory_order_release);
+}
+
+/*
+ * ra is the return address of a function in the DSO holding self, word the
+ * word after the call instruction at ra
+ */
+extern "C" bool __sd_return_external(const void *ra, const void *self, uint32_t word) {
+  uintptr_t addr = (uintptr_t) ra;
+
+  DSO_t *caller = findTextDSO(addr);
+  if (!caller) {
+    refresh();
+    caller = findTextDSO(addr);
+  }
+
+  // callers in the same DSO have to carry one of our IDs
+  if (!caller || inText(caller, (uintptr_t) self))
+    return false;
+
+  return hasReturnID(caller, word);
 }
@@ -22,6 +22,8 @@
 // <http://www.gnu.org/licenses/>.
 
 #include "tinfo.h"
+#include <atomic>
+#include <stdint.h>
 
 namespace __cxxabiv1 {
 
@@ -34,6 +36,124 @@ static ptrdiff_t __ivtbl_get_ott(const void *vtable, const ptrdiff_t off) {
   return *(adjust_pointer<ptrdiff_t>(vtable, off));
 }
 
+// relative vtables hold 32-bit entries: pointers are stored as the offset
+// from the entry itself, offset-to-top as a plain value
+static __class_type_info* __ivtbl_rel_get_rtti(const void *vtable, const ptrdiff_t off) {
+  const int32_t *entry = adjust_pointer<int32_t>(vtable, off);
+  return const_cast<__class_type_info*>(adjust_pointer<__class_type_info>(entry, *entry));
+}
+
+static ptrdiff_t __ivtbl_rel_get_ott(const void *vtable, const ptrdiff_t off) {
+  return *(adjust_pointer<int32_t>(vtable, off));
+}
+
+static void *
+__ivtbl_do_dynamic_cast (const void *src_ptr,
+                         const __class_type_info *src_type,
+                         const __class_type_info *dst_type,
+                         ptrdiff_t src2dst,
+                         const void *whole_ptr,
+                         const __class_type_info *whole_type);
+
+#ifndef IVTBL_DYNCAST_NO_CACHE
+// The result of a cast only depends on the vptr of the source subobject and
+// the static arguments: the vptr determines the whole object type and where
+// the subobject sits in it (repeated bases have distinct address points, so
+// the whole object vptr alone would not do). Results are kept as the offset
+// from src_ptr in a direct mapped table of seqlocked entries, readers never
+// block and writers give up on a contended entry.
+#define IVTBL_DYNCAST_CACHE_SIZE 4096
+#define IVTBL_DYNCAST_FAILED     PTRDIFF_MIN
+
+struct __ivtbl_cast_entry {
+  std::atomic<uintptr_t> seq;   // odd while an update is in progress
+  std::atomic<uintptr_t> vptr;
+  std::atomic<uintptr_t> src_type;
+  std::atomic<uintptr_t> dst_type;
+  std::atomic<ptrdiff_t> src2dst;
+  std::atomic<ptrdiff_t> offset;
+};
+
+static __ivtbl_cast_entry __ivtbl_cast_cache[IVTBL_DYNCAST_CACHE_SIZE];
+
+static inline __ivtbl_cast_entry &
+__ivtbl_cast_slot (const void *vptr, const __class_type_info *src_type,
+                   const __class_type_info *dst_type, ptrdiff_t src2dst) {
+  uint64_t h = (uintptr_t) vptr;
+  h = (h ^ (uintptr_t) src_type) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (uintptr_t) dst_type) * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (uint64_t) src2dst) * 0x9e3779b97f4a7c15ULL;
+  return __ivtbl_cast_cache[(h >> 32) & (IVTBL_DYNCAST_CACHE_SIZE - 1)];
+}
+
+static inline bool
+__ivtbl_cast_lookup (const __ivtbl_cast_entry &e, const void *vptr,
+                     const __class_type_info *src_type,
+                     const __class_type_info *dst_type, ptrdiff_t src2dst,
+                     ptrdiff_t &offset) {
+  uintptr_t seq = e.seq.load(std::memory_order_acquire);
+  if (seq & 1)
+    return false;
+
+  bool hit = e.vptr.load(std::memory_order_relaxed) == (uintptr_t) vptr &&
+             e.src_type.load(std::memory_order_relaxed) == (uintptr_t) src_type &&
+             e.dst_type.load(std::memory_order_relaxed) == (uintptr_t) dst_type &&
+             e.src2dst.load(std::memory_order_relaxed) == src2dst;
+  offset = e.offset.load(std::memory_order_relaxed);
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return hit && e.seq.load(std::memory_order_relaxed) == seq;
+}
+
+static inline void
+__ivtbl_cast_store (__ivtbl_cast_entry &e, const void *vptr,
+                    const __class_type_info *src_type,
+                    const __class_type_info *dst_type, ptrdiff_t src2dst,
+                    ptrdiff_t offset) {
+  uintptr_t seq = e.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) ||
+      !e.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+
+  e.vptr.store((uintptr_t) vptr, std::memory_order_relaxed);
+  e.src_type.store((uintptr_t) src_type, std::memory_order_relaxed);
+  e.dst_type.store((uintptr_t) dst_type, std::memory_order_relaxed);
+  e.src2dst.store(src2dst, std::memory_order_relaxed);
+  e.offset.store(offset, std::memory_order_relaxed);
+
+  e.seq.store(seq + 2, std::memory_order_release);
+}
+#endif
+
+static inline void *
+__ivtbl_cached_dynamic_cast (const void *src_ptr,
+                             const void *vtable,
+                             const __class_type_info *src_type,
+                             const __class_type_info *dst_type,
+                             ptrdiff_t src2dst,
+                             const void *whole_ptr,
+                             const __class_type_info *whole_type) {
+#ifndef IVTBL_DYNCAST_NO_CACHE
+  __ivtbl_cast_entry &e = __ivtbl_cast_slot(vtable, src_type, dst_type, src2dst);
+  ptrdiff_t offset;
+  if (__ivtbl_cast_lookup(e, vtable, src_type, dst_type, src2dst, offset))
+    return offset == IVTBL_DYNCAST_FAILED ? NULL :
+           const_cast <void *> (adjust_pointer <void> (src_ptr, offset));
+
+  void *dst_ptr = __ivtbl_do_dynamic_cast (src_ptr, src_type, dst_type, src2dst,
+                                           whole_ptr, whole_type);
+  offset = dst_ptr ? (const char *) dst_ptr - (const char *) src_ptr
+                   : IVTBL_DYNCAST_FAILED;
+  __ivtbl_cast_store(e, vtable, src_type, dst_type, src2dst, offset);
+  return dst_ptr;
+#else
+  return __ivtbl_do_dynamic_cast (src_ptr, src_type, dst_type, src2dst,
+                                  whole_ptr, whole_type);
+#endif
+}
+
 // this is the external interface to the dynamic cast machinery
 /* sub: source address to be adjusted; nonnull, and since the
  *      source object is polymorphic, *(void**)sub is a virtual pointer.
@@ -63,6 +183,39 @@ __ivtbl_dynamic_cast (const void *src_ptr,    // object started from
       adjust_pointer <void> (src_ptr, __ivtbl_get_ott(vtable, ottOff));
   const __class_type_info *whole_type = __ivtbl_get_rtti(vtable, rttiOff);
 
+  return __ivtbl_cached_dynamic_cast (src_ptr, vtable, src_type, dst_type,
+                                      src2dst, whole_ptr, whole_type);
+}
+
+// same as above for objects whose vptr points into a relative vtable,
+// rttiOff and ottOff are byte offsets of the 32-bit entries
+extern "C" void *
+__ivtbl_rel_dynamic_cast (const void *src_ptr,
+                const __class_type_info *src_type,
+                const __class_type_info *dst_type,
+                ptrdiff_t src2dst,
+                ptrdiff_t rttiOff,
+                ptrdiff_t ottOff)
+  {
+  const void *vtable = *static_cast <const void *const *> (src_ptr);
+
+  const void *whole_ptr =
+      adjust_pointer <void> (src_ptr, __ivtbl_rel_get_ott(vtable, ottOff));
+  const __class_type_info *whole_type = __ivtbl_rel_get_rtti(vtable, rttiOff);
+
+  return __ivtbl_cached_dynamic_cast (src_ptr, vtable, src_type, dst_type,
+                                      src2dst, whole_ptr, whole_type);
+}
+
+static void *
+__ivtbl_do_dynamic_cast (const void *src_ptr,
+                         const __class_type_info *src_type,
+                         const __class_type_info *dst_type,
+                         ptrdiff_t src2dst,
+                         const void *whole_ptr,
+                         const __class_type_info *whole_type)
+  {
+
   // If the whole object vptr doesn't refer to the whole object type, we're
   // in the middle of constructing a primary base, and src is a separate
   // base.  This has undefined behavior and we can't find anything outside
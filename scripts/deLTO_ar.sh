@@ -15,34 +15,10 @@ fi
 LIB_DIR=$(cd "$(dirname "$1")" && pwd)
 LIB="$LIB_DIR/$(basename $1)"
 
-# tmp dir to create the archive
-TMP_DIR=`mktemp -d`
-
-# full path of "ar"
-AR="$CUR_DIR/ar"
-
-# llvm linker
+# llvm tools
 LLVM_BIN_DIR="$($CONFIG LLVM_BUILD_DIR)/Release+Asserts/bin"
-LLC="${LLVM_BIN_DIR}/llc"
-
-pushd $TMP_DIR > /dev/null
-
-# get the files inside the archive
-FILES=$(/usr/bin/ar tP $LIB)
-
-# lower each bitcode into machine code
-for obj in $FILES; do
-  >&2 echo "LLC: $obj"
-  BN=$(basename $obj)
-  $LLC -filetype=obj $obj -o=${BN}.sd.o
-done
-
-# create the new library with the .a.sd extension
-NEW_LIB="${LIB}.sd"
-/usr/bin/ar rcs "$NEW_LIB" *.sd.o
-
-popd > /dev/null
-
-# remove the temporary directory
-rm -rf $TMP_DIR
+DELTO="${LLVM_BIN_DIR}/llvm-sd-delto"
 
+# lower each bitcode member into machine code, in parallel, and create the new
+# library with the .a.sd extension (JOBS defaults to the number of cores)
+$DELTO -v ${JOBS:+-j $JOBS} "$LIB" -o "${LIB}.sd"
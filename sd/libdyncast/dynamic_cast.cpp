@@ -1,111 +0,0 @@
-// Copyright (C) 1994-2015 Free Software Foundation, Inc.
-//
-// This file is part of GCC.
-//
-// GCC is free software; you can redistribute it and/or modify
-// it under the terms of the GNU General Public License as published by
-// the Free Software Foundation; either version 3, or (at your option)
-// any later version.
-
-// GCC is distributed in the hope that it will be useful,
-// but WITHOUT ANY WARRANTY; without even the implied warranty of
-// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-// GNU General Public License for more details.
-
-// Under Section 7 of GPL version 3, you are granted additional
-// permissions described in the GCC Runtime Library Exception, version
-// 3.1, as published by the Free Software Foundation.
-
-// You should have received a copy of the GNU General Public License and
-// a copy of the GCC Runtime Library Exception along with this program;
-// see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
-// <http://www.gnu.org/licenses/>.
-
-#include "tinfo.h"
-
-namespace __cxxabiv1 {
-
-static __class_type_info* __ivtbl_get_rtti(const void *vtable, const ptrdiff_t off) {
-  return *(adjust_pointer<__class_type_info*>(vtable, off));
-}
-
-
-static ptrdiff_t __ivtbl_get_ott(const void *vtable, const ptrdiff_t off) {
-  return *(adjust_pointer<ptrdiff_t>(vtable, off));
-}
-
-// this is the external interface to the dynamic cast machinery
-/* sub: source address to be adjusted; nonnull, and since the
- *      source object is polymorphic, *(void**)sub is a virtual pointer.
- * src: static type of the source object.
- * dst: destination type (the "T" in "dynamic_cast<T>(v)").
- * src2dst_offset: a static hint about the location of the
- *    source subobject with respect to the complete object;
- *    special negative values are:
- *       -1: no hint
- *       -2: src is not a public base of dst
- *       -3: src is a multiple public base type but never a
- *           virtual base type
- *    otherwise, the src type is a unique public nonvirtual
- *    base type of dst at offset src2dst_offset from the
- *    origin of dst.  */
-extern "C" void *
-__ivtbl_dynamic_cast (const void *src_ptr,    // object started from
-                const __class_type_info *src_type, // type of the starting object
-                const __class_type_info *dst_type, // desired target type
-                ptrdiff_t src2dst,
-                ptrdiff_t rttiOff,
-                ptrdiff_t ottOff) // how src and dst are related
-  {
-  const void *vtable = *static_cast <const void *const *> (src_ptr);
-
-  const void *whole_ptr =
-      adjust_pointer <void> (src_ptr, __ivtbl_get_ott(vtable, ottOff));
-  const __class_type_info *whole_type = __ivtbl_get_rtti(vtable, rttiOff);
-
-  // If the whole object vptr doesn't refer to the whole object type, we're
-  // in the middle of constructing a primary base, and src is a separate
-  // base.  This has undefined behavior and we can't find anything outside
-  // of the base we're actually constructing, so fail now rather than
-  // segfault later trying to use a vbase offset that doesn't exist.
-  const void *whole_vtable = *static_cast <const void *const *> (whole_ptr);
-  __class_type_info::__dyncast_result result; 
-
-  // TODO(dbounov): we had to remove this check since at static time we don't know
-  // the rtti offset for the whole object, since we don't know the precise whole
-  // object type. Should figure out a way to support this again
-  /*
-  const __class_type_info *whole_type1 = __ivtbl_get_rtti(whole_vtable, rttiOffWhole);
-
-  if (whole_type1 != whole_type)
-    return NULL;
-  */
-  
-  whole_type->__do_dyncast (src2dst, __class_type_info::__contained_public,
-                            dst_type, whole_ptr, src_type, src_ptr, result);
-  if (!result.dst_ptr)
-    return NULL;
-  if (contained_public_p (result.dst2src))
-    // Src is known to be a public base of dst.
-    return const_cast <void *> (result.dst_ptr);
-  if (contained_public_p (__class_type_info::__sub_kind (result.whole2src & result.whole2dst)))
-    // Both src and dst are known to be public bases of whole. Found a valid
-    // cross cast.
-    return const_cast <void *> (result.dst_ptr);
-  if (contained_nonvirtual_p (result.whole2src))
-    // Src is known to be a non-public nonvirtual base of whole, and not a
-    // base of dst. Found an invalid cross cast, which cannot also be a down
-    // cast
-    return NULL;
-  if (result.dst2src == __class_type_info::__unknown)
-    result.dst2src = dst_type->__find_public_src (src2dst, result.dst_ptr,
-                                                  src_type, src_ptr);
-  if (contained_public_p (result.dst2src))
-    // Found a valid down cast
-    return const_cast <void *> (result.dst_ptr);
-  // Must be an invalid down cast, or the cross cast wasn't bettered
-  return NULL;
-}
-
-}
-
@@ -30,9 +30,12 @@
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/IR/CallingConv.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/ValueHandle.h"
+#include "llvm/Support/Timer.h"
+#include <set>
 
 namespace llvm {
 class Module;
@@ -342,6 +345,18 @@ private:
   /// A queue of (optional) vtables to consider emitting.
   std::vector<const CXXRecordDecl*> DeferredVTables;
 
+  /// Names already added to the SafeDispatch string table of this module.
+  llvm::StringSet<> SDStringTable;
+
+  /// Vtables whose SafeDispatch sub-vtable info was already generated, keyed
+  /// by the record and, for construction vtables, the base subobject.
+  typedef std::pair<std::pair<const CXXRecordDecl *, const CXXRecordDecl *>,
+                    int64_t> SDVTableKey;
+  std::set<SDVTableKey> SDVTablesEmitted;
+
+  /// Time spent emitting the SafeDispatch metadata, for -ftime-report.
+  llvm::Timer SDMetadataTime;
+
   /// List of global values which are required to be present in the object file;
   /// bitcast to i8*. This is used for forcing visibility of symbols which may
   /// otherwise be optimized out.
@@ -620,6 +635,17 @@ public:
  
   CodeGenVTables &getVTables() { return VTables; }
 
+  llvm::StringSet<> &getSDStringTable() { return SDStringTable; }
+  llvm::Timer &getSDMetadataTime() { return SDMetadataTime; }
+
+  /// Returns false if the sub-vtable info of the given vtable was already
+  /// generated, otherwise records it as generated.
+  bool markSDVTableEmitted(const CXXRecordDecl *RD,
+                           const CXXRecordDecl *Base, int64_t BaseOffset) {
+    return SDVTablesEmitted.insert(
+        SDVTableKey(std::make_pair(RD, Base), BaseOffset)).second;
+  }
+
   ItaniumVTableContext &getItaniumVTableContext() {
     return VTables.getItaniumVTableContext();
   }
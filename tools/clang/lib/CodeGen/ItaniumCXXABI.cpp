@@ -37,7 +37,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 
-#include "llvm/Transforms/IPO/SafeDispatchMD.h"
+#include "llvm/IR/SafeDispatchMD.h"
 #include "llvm/Transforms/IPO/SafeDispatchTools.h"
 #include "llvm/Transforms/IPO/SafeDispatchVtblMD.h"
 #include <vector>
@@ -1351,9 +1351,22 @@ llvm::Value *ItaniumCXXABI::EmitDynamicCastToVoid(CodeGenFunction &CGF,
   // Get the vtable pointer.
   llvm::Value *VTable = CGF.GetVTablePtr(Value, PtrDiffLTy->getPointerTo());
 
+  // put mangled vtable name into a string
+  CXXRecordDecl* RD = SrcRecordTy->getAsCXXRecordDecl();
+  std::string Name = CGM.getCXXABI().GetClassMangledName(RD);
+
   // Get the offset-to-top from the vtable.
-  llvm::Value *OffsetToTop =
-      CGF.Builder.CreateConstInBoundsGEP1_64(VTable, -2ULL);
+  llvm::Value *OffsetToTop;
+  if (CGM.getCodeGenOpts().EmitIVTBL && sd_isVtableName(Name) && RD->isDynamicClass()) {
+    llvm::GlobalVariable* VTableGV = sd_needGlobalVar(this,RD) ?
+          this->getAddrOfVTable(RD,CharUnits()) : NULL;
+
+    // the offset-to-top moves (or is dropped) with the new layout as well
+    llvm::Value* newOTTInd = sd_getNewIndFromOld(CGM, CGF.Builder, VTableGV, Name, -2);
+    OffsetToTop = CGF.Builder.CreateGEP(VTable, newOTTInd);
+  } else {
+    OffsetToTop = CGF.Builder.CreateConstInBoundsGEP1_64(VTable, -2ULL);
+  }
   OffsetToTop = CGF.Builder.CreateLoad(OffsetToTop, "offset.to.top");
 
   // Finally, add the offset to the pointer.
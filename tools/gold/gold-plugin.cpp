@@ -13,13 +13,16 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Config/config.h" // plugin-api.h requires HAVE_STDINT_H
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/CodeGen/Analysis.h"
 #include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/CodeGen/ParallelCG.h"
 #include "llvm/IR/AutoUpgrade.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DiagnosticInfo.h"
@@ -27,6 +30,7 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/SafeDispatchMD.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/MC/SubtargetFeature.h"
@@ -34,11 +38,13 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/IPO/SafeDispatchTrace.h"
 #include "llvm/Transforms/Utils/GlobalStatus.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
@@ -93,6 +99,8 @@ namespace options {
   static bool generate_api_file = false;
   static OutputType TheOutputType = OT_NORMAL;
   static unsigned OptLevel = 2;
+  // Number of threads the optimized module is split over for code generation.
+  static unsigned Parallelism = 1;
   static std::string obj_path;
   static std::string extra_library_path;
   static std::string triple;
@@ -107,6 +115,14 @@ namespace options {
   static bool RunSDIVTBLPass = false;
   static bool RunSDOVTBLPass = false;
   static bool RunSDReturnPass = false;
+  static bool SDRelativeVTBLs = false;
+  static bool SDDeadVirtuals = false;
+  static bool SDTrimRTTI = false;
+  static std::string SDCacheDir;
+  // Chrome trace of the cost of the SD passes, disabled if empty.
+  static std::string SDTraceFile;
+  // Directory of the native object cache, disabled if empty.
+  static std::string cache_dir;
 
   static void process_plugin_option(const char* opt_)
   {
@@ -132,10 +148,27 @@ namespace options {
       RunSDReturnPass = true;
     } else if (opt == "sd-ovtbl") {
       RunSDOVTBLPass = true;
+    } else if (opt == "sd-rel-vtbl") {
+      SDRelativeVTBLs = true;
+    } else if (opt == "sd-dead-virtuals") {
+      SDDeadVirtuals = true;
+    } else if (opt == "sd-trim-rtti") {
+      SDTrimRTTI = true;
+    } else if (opt.startswith("sd-cache-dir=")) {
+      SDCacheDir = opt.substr(strlen("sd-cache-dir="));
+    } else if (opt.startswith("sd-trace=")) {
+      SDTraceFile = opt.substr(strlen("sd-trace="));
+    } else if (opt.startswith("cache-dir=")) {
+      cache_dir = opt.substr(strlen("cache-dir="));
     } else if (opt == "save-temps") {
       TheOutputType = OT_SAVE_TEMPS;
     } else if (opt == "disable-output") {
       TheOutputType = OT_DISABLE;
+    } else if (opt.startswith("jobs=")) {
+      if (opt.substr(strlen("jobs=")).getAsInteger(10, Parallelism) ||
+          Parallelism == 0)
+        report_fatal_error("Invalid parallelism level: " +
+                           opt.substr(strlen("jobs=")));
     } else if (opt.size() == 2 && opt[0] == 'O') {
       if (opt[1] < '0' || opt[1] > '3')
         report_fatal_error("Optimization level must be between 0 and 3");
@@ -726,6 +759,15 @@ getModuleForFile(LLVMContext &Context, claimed_file &F,
   return Obj.takeModule();
 }
 
+/// Reports the high-water mark of the resident set after a phase of the link.
+static void reportPeakRSS(const char *Phase) {
+  long PeakRSS = sdTrace::getPeakRSS();
+  if (!PeakRSS)
+    return;
+  message(LDPL_INFO, "LLVM gold plugin: peak RSS after %s: %ld MB", Phase,
+          PeakRSS / 1024);
+}
+
 static void runLTOPasses(Module &M, TargetMachine &TM) {
   legacy::PassManager passes;
   passes.add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
@@ -740,6 +782,10 @@ static void runLTOPasses(Module &M, TargetMachine &TM) {
   PMB.EmitIVTBLs = options::RunSDIVTBLPass;
   PMB.EmitOVTBLs = options::RunSDOVTBLPass;
   PMB.EmitReturnChecks = options::RunSDReturnPass;
+  PMB.EmitRelVTBLs = options::SDRelativeVTBLs;
+  PMB.RemoveDeadVirtuals = options::SDDeadVirtuals;
+  PMB.TrimRTTISlots = options::SDTrimRTTI;
+  PMB.SDCacheDir = options::SDCacheDir;
   PMB.OptLevel = options::OptLevel;
   PMB.populateLTOPassManager(passes);
   passes.run(M);
@@ -753,8 +799,8 @@ static void saveBCFile(StringRef Path, Module &M) {
   WriteBitcodeToFile(&M, OS, /* ShouldPreserveUseListOrder */ true);
 }
 
-static void codegen(Module &M) {
-  const std::string &TripleStr = M.getTargetTriple();
+static std::unique_ptr<TargetMachine>
+createTargetMachine(const std::string &TripleStr) {
   Triple TheTriple(TripleStr);
 
   std::string ErrMsg;
@@ -762,9 +808,6 @@ static void codegen(Module &M) {
   if (!TheTarget)
     message(LDPL_FATAL, "Target not found: %s", ErrMsg.c_str());
 
-  if (unsigned NumOpts = options::extra.size())
-    cl::ParseCommandLineOptions(NumOpts, &options::extra[0]);
-
   SubtargetFeatures Features;
   Features.getDefaultSubtargetFeatures(TheTriple);
   for (const std::string &A : MAttrs)
@@ -786,9 +829,70 @@ static void codegen(Module &M) {
     CGOptLevel = CodeGenOpt::Aggressive;
     break;
   }
-  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+  return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
       TripleStr, options::mcpu, Features.getString(), Options, RelocationModel,
       CodeModel::Default, CGOptLevel));
+}
+
+/// Opens the object file of the given partition. With obj-path the first
+/// partition is written to the path itself and the others get a suffix.
+static int openObjectFile(unsigned Part, SmallString<128> &Filename) {
+  int FD;
+  if (options::obj_path.empty()) {
+    std::error_code EC =
+        sys::fs::createTemporaryFile("lto-llvm", "o", FD, Filename);
+    if (EC)
+      message(LDPL_FATAL, "Could not create temporary file: %s",
+              EC.message().c_str());
+  } else {
+    Filename = options::obj_path;
+    if (Part != 0)
+      Filename += "." + utostr(Part);
+    std::error_code EC =
+        sys::fs::openFileForWrite(Filename.c_str(), FD, sys::fs::F_None);
+    if (EC)
+      message(LDPL_FATAL, "Could not open file: %s", EC.message().c_str());
+  }
+  return FD;
+}
+
+static void emitObjectFile(Module &M, TargetMachine &TM, int FD) {
+  legacy::PassManager CodeGenPasses;
+  raw_fd_ostream OS(FD, true);
+
+  if (TM.addPassesToEmitFile(CodeGenPasses, OS,
+                             TargetMachine::CGFT_ObjectFile))
+    message(LDPL_FATAL, "Failed to setup codegen");
+  CodeGenPasses.run(M);
+}
+
+/// Generates options::Parallelism objects from the optimized module, see
+/// llvm::splitCodeGen.
+static void splitCodegen(Module &M, std::vector<std::string> &Filenames) {
+  std::vector<std::unique_ptr<raw_fd_ostream>> OSs;
+  std::vector<raw_pwrite_stream *> OSPtrs;
+  for (unsigned I = 0; I < options::Parallelism; ++I) {
+    SmallString<128> Filename;
+    int FD = openObjectFile(I, Filename);
+    Filenames.push_back(Filename.str());
+    OSs.emplace_back(new raw_fd_ostream(FD, true));
+    OSPtrs.push_back(OSs.back().get());
+  }
+
+  splitCodeGen(M, OSPtrs,
+               [](StringRef TripleStr) {
+                 return createTargetMachine(TripleStr.str());
+               },
+               diagnosticHandler, nullptr);
+}
+
+static void codegen(Module &M, std::vector<std::string> &Filenames) {
+  const std::string &TripleStr = M.getTargetTriple();
+
+  if (unsigned NumOpts = options::extra.size())
+    cl::ParseCommandLineOptions(NumOpts, &options::extra[0]);
+
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(TripleStr);
 
   // Insert the sd_filename and sd_output metadata.
   SmallString<128> FileName = llvm::sys::path::filename(output_name);
@@ -805,45 +909,152 @@ static void codegen(Module &M) {
                                              llvm::MDString::get(M.getContext(), Model.c_str())));
   }
 
-  runLTOPasses(M, *TM);
+  {
+    sdTrace::Scope Trace("optimization");
+    runLTOPasses(M, *TM);
+  }
+  reportPeakRSS("optimization");
 
   if (options::TheOutputType == options::OT_SAVE_TEMPS)
     saveBCFile(output_name + ".opt.bc", M);
 
-  legacy::PassManager CodeGenPasses;
+  {
+    sdTrace::Scope Trace("code generation");
+    Trace.count("partitions", options::Parallelism);
+    if (options::Parallelism > 1) {
+      splitCodegen(M, Filenames);
+    } else {
+      SmallString<128> Filename;
+      int FD = openObjectFile(0, Filename);
+      emitObjectFile(M, *TM, FD);
+      Filenames.push_back(Filename.str());
+    }
+  }
+  reportPeakRSS("code generation");
+}
 
-  SmallString<128> Filename;
-  int FD;
-  if (options::obj_path.empty()) {
-    std::error_code EC =
-        sys::fs::createTemporaryFile("lto-llvm", "o", FD, Filename);
-    if (EC)
-      message(LDPL_FATAL, "Could not create temporary file: %s",
+static void addObjectFiles(const std::vector<std::string> &Filenames,
+                           bool Temporary) {
+  for (const std::string &Filename : Filenames) {
+    if (add_input_file(Filename.c_str()) != LDPS_OK)
+      message(LDPL_FATAL,
+              "Unable to add .o file to the link. File left behind in: %s",
+              Filename.c_str());
+
+    if (Temporary)
+      Cleanup.push_back(Filename);
+  }
+}
+
+static void hashCacheString(MD5 &Hasher, StringRef Str) {
+  Hasher.update(Str);
+  Hasher.update(StringRef("", 1));
+}
+
+/// Computes the key of the native objects produced for the claimed files. It
+/// covers the bitcode of every input, the resolution gold picked for each of
+/// their symbols, every option that affects code generation and the version
+/// of the plugin and of the cache format.
+static std::string computeCacheKey() {
+  MD5 Hasher;
+  hashCacheString(Hasher, SD_CACHE_FORMAT_VERSION);
+  hashCacheString(Hasher, LLVM_VERSION_STRING);
+
+  hashCacheString(Hasher, output_name);
+  hashCacheString(Hasher, utostr(RelocationModel));
+  hashCacheString(Hasher, utostr(options::OptLevel));
+  hashCacheString(Hasher, utostr(options::Parallelism));
+  hashCacheString(Hasher, options::triple);
+  hashCacheString(Hasher, options::mcpu);
+  for (const char *Opt : options::extra)
+    hashCacheString(Hasher, Opt);
+  for (const std::string &A : MAttrs)
+    hashCacheString(Hasher, A);
+  hashCacheString(Hasher, utostr(options::RunSDIVTBLPass));
+  hashCacheString(Hasher, utostr(options::RunSDOVTBLPass));
+  hashCacheString(Hasher, utostr(options::RunSDReturnPass));
+  hashCacheString(Hasher, utostr(options::SDRelativeVTBLs));
+  hashCacheString(Hasher, utostr(options::SDDeadVirtuals));
+  hashCacheString(Hasher, utostr(options::SDTrimRTTI));
+
+  for (claimed_file &F : Modules) {
+    ld_plugin_input_file File;
+    if (get_input_file(F.handle, &File) != LDPS_OK)
+      message(LDPL_FATAL, "Failed to get file information");
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+        MemoryBuffer::getOpenFileSlice(File.fd, File.name, File.filesize,
+                                       File.offset);
+    if (std::error_code EC = BufferOrErr.getError())
+      message(LDPL_FATAL, "Could not read %s: %s", File.name,
               EC.message().c_str());
-  } else {
-    Filename = options::obj_path;
-    std::error_code EC =
-        sys::fs::openFileForWrite(Filename.c_str(), FD, sys::fs::F_None);
-    if (EC)
-      message(LDPL_FATAL, "Could not open file: %s", EC.message().c_str());
+    hashCacheString(Hasher, (*BufferOrErr)->getBuffer());
+
+    if (!F.syms.empty()) {
+      if (get_symbols(F.handle, F.syms.size(), &F.syms[0]) != LDPS_OK)
+        message(LDPL_FATAL, "Failed to get symbol information");
+      for (const ld_plugin_symbol &Sym : F.syms) {
+        hashCacheString(Hasher, Sym.name);
+        hashCacheString(Hasher, utostr(Sym.resolution));
+      }
+    }
+
+    if (release_input_file(F.handle) != LDPS_OK)
+      message(LDPL_FATAL, "Failed to release file information");
   }
 
-  {
-    raw_fd_ostream OS(FD, true);
+  MD5::MD5Result Result;
+  Hasher.final(Result);
+  SmallString<32> Key;
+  MD5::stringifyResult(Result, Key);
+  return Key.str();
+}
 
-    if (TM->addPassesToEmitFile(CodeGenPasses, OS,
-                                TargetMachine::CGFT_ObjectFile))
-      message(LDPL_FATAL, "Failed to setup codegen");
-    CodeGenPasses.run(M);
+static std::string getCachedObjectPath(StringRef Key, unsigned Part) {
+  SmallString<128> Path(options::cache_dir);
+  sys::path::append(Path, "llvmcache-" + Key + "-" + utostr(Part) + ".o");
+  return Path.str();
+}
+
+static bool findCachedObjects(StringRef Key,
+                              std::vector<std::string> &Filenames) {
+  for (unsigned I = 0; I < options::Parallelism; ++I) {
+    std::string Path = getCachedObjectPath(Key, I);
+    if (!sys::fs::exists(Path)) {
+      Filenames.clear();
+      return false;
+    }
+    Filenames.push_back(Path);
   }
+  return true;
+}
 
-  if (add_input_file(Filename.c_str()) != LDPS_OK)
-    message(LDPL_FATAL,
-            "Unable to add .o file to the link. File left behind in: %s",
-            Filename.c_str());
+/// Copies the objects into the cache. Every entry is written to a temporary
+/// file first and renamed, so concurrent links never see partial objects.
+static void storeCachedObjects(StringRef Key,
+                               const std::vector<std::string> &Filenames) {
+  if (std::error_code EC = sys::fs::create_directories(options::cache_dir)) {
+    message(LDPL_WARNING, "Could not create cache directory %s: %s",
+            options::cache_dir.c_str(), EC.message().c_str());
+    return;
+  }
 
-  if (options::obj_path.empty())
-    Cleanup.push_back(Filename.c_str());
+  for (unsigned I = 0; I < Filenames.size(); ++I) {
+    SmallString<128> Model(options::cache_dir);
+    sys::path::append(Model, "llvmcache-%%%%%%%%.tmp");
+    SmallString<128> TmpPath;
+    std::error_code EC = sys::fs::createUniqueFile(Model, TmpPath);
+    if (!EC)
+      EC = sys::fs::copy_file(Filenames[I], TmpPath);
+    if (!EC)
+      EC = sys::fs::rename(TmpPath, getCachedObjectPath(Key, I));
+    if (EC) {
+      message(LDPL_WARNING, "Could not cache %s: %s", Filenames[I].c_str(),
+              EC.message().c_str());
+      sys::fs::remove(TmpPath);
+      return;
+    }
+  }
 }
 
 /// gold informs us that all symbols have been read. At this point, we use
@@ -853,6 +1064,28 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
   if (Modules.empty())
     return LDPS_OK;
 
+  if (!options::SDTraceFile.empty())
+    sdTrace::enable(options::SDTraceFile);
+
+  // Only the plain native objects are cached, runs asked to produce other
+  // outputs always go through the whole pipeline.
+  std::string CacheKey;
+  if (!options::cache_dir.empty() && options::obj_path.empty() &&
+      options::TheOutputType == options::OT_NORMAL && !ApiFile) {
+    CacheKey = computeCacheKey();
+
+    std::vector<std::string> Filenames;
+    if (findCachedObjects(CacheKey, Filenames)) {
+      message(LDPL_INFO, "LLVM gold plugin: using cached objects %s",
+              CacheKey.c_str());
+      addObjectFiles(Filenames, false);
+      if (!options::extra_library_path.empty() &&
+          set_extra_library_path(options::extra_library_path.c_str()) != LDPS_OK)
+        message(LDPL_FATAL, "Unable to set the extra library path.");
+      return LDPS_OK;
+    }
+  }
+
   LLVMContext Context;
   Context.setDiagnosticHandler(diagnosticHandler, nullptr, true);
 
@@ -863,23 +1096,33 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
 
   StringSet<> Internalize;
   StringSet<> Maybe;
-  for (claimed_file &F : Modules) {
-    ld_plugin_input_file File;
-    if (get_input_file(F.handle, &File) != LDPS_OK)
-      message(LDPL_FATAL, "Failed to get file information");
-    std::unique_ptr<Module> M =
-        getModuleForFile(Context, F, File, ApiFile, Internalize, Maybe);
-    if (!options::triple.empty())
-      M->setTargetTriple(options::triple.c_str());
-    else if (M->getTargetTriple().empty()) {
-      M->setTargetTriple(DefaultTriple);
-    }
+  {
+    sdTrace::Scope LinkTrace("linking");
+    LinkTrace.count("modules", Modules.size());
+    for (claimed_file &F : Modules) {
+      ld_plugin_input_file File;
+      if (get_input_file(F.handle, &File) != LDPS_OK)
+        message(LDPL_FATAL, "Failed to get file information");
+      std::unique_ptr<Module> M =
+          getModuleForFile(Context, F, File, ApiFile, Internalize, Maybe);
+      if (!options::triple.empty())
+        M->setTargetTriple(options::triple.c_str());
+      else if (M->getTargetTriple().empty()) {
+        M->setTargetTriple(DefaultTriple);
+      }
 
-    if (L.linkInModule(M.get()))
-      message(LDPL_FATAL, "Failed to link module");
-    if (release_input_file(F.handle) != LDPS_OK)
-      message(LDPL_FATAL, "Failed to release file information");
+      if (L.linkInModule(M.get()))
+        message(LDPL_FATAL, "Failed to link module");
+
+      // The bodies that were linked have been moved into the combined module,
+      // what is left of the source still points into gold's view of the file.
+      M.reset();
+      std::vector<ld_plugin_symbol>().swap(F.syms);
+      if (release_input_file(F.handle) != LDPS_OK)
+        message(LDPL_FATAL, "Failed to release file information");
+    }
   }
+  reportPeakRSS("linking");
 
   for (const auto &Name : Internalize) {
     GlobalValue *GV = Combined->getNamedValue(Name.first());
@@ -895,6 +1138,8 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
     if (canBeOmittedFromSymbolTable(GV))
       internalize(*GV);
   }
+  Internalize.clear();
+  Maybe.clear();
 
   if (options::TheOutputType == options::OT_DISABLE)
     return LDPS_OK;
@@ -910,7 +1155,11 @@ static ld_plugin_status allSymbolsReadHook(raw_fd_ostream *ApiFile) {
       return LDPS_OK;
   }
 
-  codegen(*L.getModule());
+  std::vector<std::string> Filenames;
+  codegen(*L.getModule(), Filenames);
+  if (!CacheKey.empty())
+    storeCachedObjects(CacheKey, Filenames);
+  addObjectFiles(Filenames, options::obj_path.empty());
 
   if (!options::extra_library_path.empty() &&
       set_extra_library_path(options::extra_library_path.c_str()) != LDPS_OK)
@@ -932,6 +1181,10 @@ static ld_plugin_status all_symbols_read_hook(void) {
     Ret = allSymbolsReadHook(&ApiFile);
   }
 
+  std::string TraceError;
+  if (!sdTrace::write(TraceError))
+    message(LDPL_ERROR, "Unable to write the SD trace: %s", TraceError.c_str());
+
   llvm_shutdown();
 
   if (options::TheOutputType == options::OT_BC_ONLY ||
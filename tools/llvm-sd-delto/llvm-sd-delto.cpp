@@ -0,0 +1,450 @@
+//===-- llvm-sd-delto.cpp - Lower the bitcode members of an archive -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compiles the bitcode members of a static archive to machine code and writes
+// the objects into a new archive, so that the library is linked outside the
+// SafeDispatch LTO:
+//
+//   llvm-sd-delto [-j N] [-O N] [llc options] libfoo.a [-o libfoo.a.sd]
+//
+// The members are compiled in one process by a pool of threads, the largest
+// first. Each thread has its own context and target machine, a target
+// machine caches its subtargets and cannot be shared between threads. The
+// native members are copied as they are. Thin archives are read from the
+// files they refer to, the new archive holds the objects and a symbol table.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Object/Archive.h"
+#include "llvm/Object/SymbolicFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace object;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input archive>"));
+
+static cl::opt<std::string>
+    OutputFilename("o", cl::desc("Output archive, defaults to <input>.sd"),
+                   cl::value_desc("filename"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::desc("Number of threads, defaults to the number of cores"),
+         cl::init(0));
+
+static cl::opt<char> OptLevel("O", cl::desc("Optimization level. [-O0, -O1, "
+                                            "-O2, or -O3] (default = '-O2')"),
+                              cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+
+static cl::opt<bool> Verbose("v", cl::desc("Print the members as they are "
+                                           "compiled"));
+
+static const char *ProgName;
+
+static const char ArchiveMagic[] = "!<arch>\n";
+static const char ThinArchiveMagic[] = "!<thin>\n";
+static const unsigned MemberHeaderSize = 60;
+static const unsigned MaxShortNameSize = 15;
+
+namespace {
+
+struct Member {
+  std::string Name;
+  MemoryBufferRef Input;
+  bool IsBitcode = false;
+
+  // the header fields of the original member
+  uint64_t ModTime = 0;
+  unsigned UID = 0;
+  unsigned GID = 0;
+  unsigned Mode = 0644;
+
+  SmallString<0> Object; // the compiled bitcode
+  std::string Error;
+
+  StringRef contents() const {
+    return IsBitcode ? Object.str() : Input.getBuffer();
+  }
+};
+
+/// The target machines of a thread, by triple.
+class TargetMachines {
+public:
+  TargetMachine *get(const std::string &TripleName, std::string &Error);
+
+private:
+  std::map<std::string, std::unique_ptr<TargetMachine>> Machines;
+};
+
+} // end anonymous namespace
+
+static CodeGenOpt::Level getCGOptLevel() {
+  switch (OptLevel) {
+  case '0':
+    return CodeGenOpt::None;
+  case '1':
+    return CodeGenOpt::Less;
+  case '3':
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+TargetMachine *TargetMachines::get(const std::string &TripleName,
+                                   std::string &Error) {
+  std::unique_ptr<TargetMachine> &TM = Machines[TripleName];
+  if (TM)
+    return TM.get();
+
+  Triple TheTriple(TripleName);
+  const Target *TheTarget =
+      TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+  if (!TheTarget)
+    return nullptr;
+
+  SubtargetFeatures Features;
+  for (const std::string &Attr : MAttrs)
+    Features.AddFeature(Attr);
+
+  TM.reset(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), MCPU, Features.getString(),
+      InitTargetOptionsFromCodeGenFlags(), RelocModel, CMModel,
+      getCGOptLevel()));
+  if (!TM)
+    Error = "no target machine for " + TripleName;
+  return TM.get();
+}
+
+static void compileMember(Member &M, TargetMachines &Machines) {
+  LLVMContext Context;
+  ErrorOr<Module *> ModOrErr = parseBitcodeFile(M.Input, Context);
+  if (std::error_code EC = ModOrErr.getError()) {
+    M.Error = EC.message();
+    return;
+  }
+  std::unique_ptr<Module> Mod(ModOrErr.get());
+
+  std::string TripleName = Mod->getTargetTriple();
+  if (TripleName.empty())
+    TripleName = sys::getDefaultTargetTriple();
+  TargetMachine *TM = Machines.get(TripleName, M.Error);
+  if (!TM)
+    return;
+
+  raw_svector_ostream OS(M.Object);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, OS, TargetMachine::CGFT_ObjectFile)) {
+    M.Error = "target does not support generation of object files";
+    return;
+  }
+  PM.run(*Mod);
+  OS.flush();
+}
+
+/// Compiles the bitcode members on Jobs threads.
+static void compileMembers(std::vector<Member> &Members) {
+  std::vector<Member *> Queue;
+  for (Member &M : Members)
+    if (M.IsBitcode)
+      Queue.push_back(&M);
+
+  // the largest members first, they do not end up alone at the end
+  std::stable_sort(Queue.begin(), Queue.end(),
+                   [](const Member *A, const Member *B) {
+                     return A->Input.getBufferSize() >
+                            B->Input.getBufferSize();
+                   });
+
+  unsigned NumThreads = Jobs ? Jobs : std::thread::hardware_concurrency();
+  NumThreads = std::max(1u, std::min<unsigned>(NumThreads, Queue.size()));
+
+  std::atomic<unsigned> Next(0);
+  auto Worker = [&]() {
+    TargetMachines Machines;
+    for (unsigned I = Next++; I < Queue.size(); I = Next++) {
+      if (Verbose)
+        errs() << "LLC: " << Queue[I]->Name << "\n";
+      compileMember(*Queue[I], Machines);
+    }
+  };
+
+  std::vector<std::thread> Threads;
+  for (unsigned I = 1; I < NumThreads; ++I)
+    Threads.emplace_back(Worker);
+  Worker();
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+/// Reads the members of the archive, the buffers of a thin archive are kept
+/// in Files.
+static bool readMembers(const Archive &Ar, bool IsThin,
+                        std::vector<Member> &Members,
+                        std::vector<std::unique_ptr<MemoryBuffer>> &Files) {
+  StringRef ArchiveDir = sys::path::parent_path(InputFilename);
+
+  for (const Archive::Child &C : Ar.children()) {
+    ErrorOr<StringRef> NameOrErr = C.getName();
+    if (std::error_code EC = NameOrErr.getError()) {
+      errs() << ProgName << ": '" << InputFilename << "': " << EC.message()
+             << "\n";
+      return false;
+    }
+
+    Member M;
+    M.Name = sys::path::filename(NameOrErr.get());
+    M.ModTime = C.getLastModified().toEpochTime();
+    M.UID = C.getUID();
+    M.GID = C.getGID();
+    M.Mode = C.getAccessMode();
+
+    if (IsThin) {
+      SmallString<128> Path(NameOrErr.get());
+      if (sys::path::is_relative(Path)) {
+        Path = ArchiveDir;
+        sys::path::append(Path, NameOrErr.get());
+      }
+      ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
+          MemoryBuffer::getFile(Path, -1, false);
+      if (std::error_code EC = FileOrErr.getError()) {
+        errs() << ProgName << ": '" << Path << "': " << EC.message() << "\n";
+        return false;
+      }
+      Files.push_back(std::move(FileOrErr.get()));
+      M.Input = Files.back()->getMemBufferRef();
+    } else {
+      M.Input = MemoryBufferRef(C.getBuffer(), M.Name);
+    }
+
+    M.IsBitcode = sys::fs::identify_magic(M.Input.getBuffer()) ==
+                  sys::fs::file_magic::bitcode;
+    Members.push_back(std::move(M));
+  }
+  return true;
+}
+
+static void writeField(raw_ostream &OS, const Twine &Value, unsigned Size) {
+  std::string Str = Value.str();
+  Str.resize(Size, ' ');
+  OS << Str;
+}
+
+static void writeMemberHeader(raw_ostream &OS, const Twine &Name,
+                              uint64_t ModTime, unsigned UID, unsigned GID,
+                              unsigned Mode, uint64_t Size) {
+  writeField(OS, Name, 16);
+  writeField(OS, Twine(ModTime), 12);
+  writeField(OS, Twine(UID % 1000000), 6);
+  writeField(OS, Twine(GID % 1000000), 6);
+  std::string Perms;
+  raw_string_ostream(Perms) << format("%o", Mode & 07777);
+  writeField(OS, Perms, 8);
+  writeField(OS, Twine(Size), 10);
+  OS << "`\n";
+}
+
+static void write32BE(raw_ostream &OS, uint32_t Value) {
+  for (int I = 3; I >= 0; --I)
+    OS << char((Value >> (8 * I)) & 0xff);
+}
+
+/// Collects the global symbols the members define, for the symbol table.
+static bool collectSymbols(const std::vector<Member> &Members,
+                           std::vector<unsigned> &SymbolMembers,
+                           std::string &SymbolNames) {
+  raw_string_ostream NameOS(SymbolNames);
+  for (unsigned I = 0; I < Members.size(); ++I) {
+    MemoryBufferRef Buffer(Members[I].contents(), Members[I].Name);
+    ErrorOr<std::unique_ptr<SymbolicFile>> ObjOrErr =
+        SymbolicFile::createSymbolicFile(Buffer, sys::fs::file_magic::unknown,
+                                         nullptr);
+    if (!ObjOrErr)
+      continue; // not an object file
+
+    for (const BasicSymbolRef &S : ObjOrErr.get()->symbols()) {
+      uint32_t Flags = S.getFlags();
+      if ((Flags & BasicSymbolRef::SF_FormatSpecific) ||
+          !(Flags & BasicSymbolRef::SF_Global) ||
+          (Flags & BasicSymbolRef::SF_Undefined))
+        continue;
+      if (S.printName(NameOS))
+        return false;
+      NameOS << '\0';
+      SymbolMembers.push_back(I);
+    }
+  }
+  NameOS.flush();
+  return true;
+}
+
+/// Writes a GNU archive with a symbol table, the sizes are known up front.
+static bool writeArchive(const std::vector<Member> &Members) {
+  std::vector<unsigned> SymbolMembers;
+  std::string SymbolNames;
+  if (!collectSymbols(Members, SymbolMembers, SymbolNames)) {
+    errs() << ProgName << ": cannot read the symbols of the objects\n";
+    return false;
+  }
+
+  uint64_t SymtabSize = 4 + 4 * SymbolMembers.size() + SymbolNames.size();
+  SymtabSize += SymtabSize % 2;
+
+  // the names that do not fit in the header
+  std::string StringTable;
+  std::vector<std::string> HeaderNames;
+  for (const Member &M : Members) {
+    if (M.Name.size() <= MaxShortNameSize) {
+      HeaderNames.push_back(M.Name + "/");
+      continue;
+    }
+    HeaderNames.push_back("/" + utostr(StringTable.size()));
+    StringTable += M.Name + "/\n";
+  }
+  if (StringTable.size() % 2)
+    StringTable += '\n';
+
+  uint64_t Offset = sizeof(ArchiveMagic) - 1;
+  if (!SymbolMembers.empty())
+    Offset += MemberHeaderSize + SymtabSize;
+  if (!StringTable.empty())
+    Offset += MemberHeaderSize + StringTable.size();
+
+  std::vector<uint32_t> MemberOffsets;
+  for (const Member &M : Members) {
+    MemberOffsets.push_back(Offset);
+    uint64_t Size = M.contents().size();
+    Offset += MemberHeaderSize + Size + Size % 2;
+  }
+  if (Offset > UINT32_MAX) {
+    errs() << ProgName << ": the archive would be larger than 4GB\n";
+    return false;
+  }
+
+  std::string Filename =
+      OutputFilename.empty() ? InputFilename + ".sd" : OutputFilename;
+  std::error_code EC;
+  tool_output_file Out(Filename, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << ProgName << ": " << Filename << ": " << EC.message() << "\n";
+    return false;
+  }
+  raw_fd_ostream &OS = Out.os();
+
+  OS << ArchiveMagic;
+  if (!SymbolMembers.empty()) {
+    writeMemberHeader(OS, "/", 0, 0, 0, 0, SymtabSize);
+    write32BE(OS, SymbolMembers.size());
+    for (unsigned I : SymbolMembers)
+      write32BE(OS, MemberOffsets[I]);
+    OS << SymbolNames;
+    if (SymbolNames.size() % 2)
+      OS << '\0';
+  }
+  if (!StringTable.empty()) {
+    writeField(OS, "//", 48);
+    writeField(OS, Twine(StringTable.size()), 10);
+    OS << "`\n" << StringTable;
+  }
+
+  for (unsigned I = 0; I < Members.size(); ++I) {
+    const Member &M = Members[I];
+    StringRef Contents = M.contents();
+    writeMemberHeader(OS, HeaderNames[I], M.ModTime, M.UID, M.GID, M.Mode,
+                      Contents.size());
+    OS << Contents;
+    if (Contents.size() % 2)
+      OS << '\n';
+  }
+
+  OS.flush();
+  if (OS.has_error())
+    return false;
+  Out.keep();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y; // Call llvm_shutdown() on exit.
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch archive lowering\n");
+  ProgName = argv[0];
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufferOrErr =
+      MemoryBuffer::getFile(InputFilename, -1, false);
+  if (std::error_code EC = BufferOrErr.getError()) {
+    errs() << ProgName << ": '" << InputFilename << "': " << EC.message()
+           << "\n";
+    return 1;
+  }
+  MemoryBufferRef Buffer = BufferOrErr.get()->getMemBufferRef();
+
+  ErrorOr<std::unique_ptr<Archive>> ArchiveOrErr = Archive::create(Buffer);
+  if (std::error_code EC = ArchiveOrErr.getError()) {
+    errs() << ProgName << ": '" << InputFilename << "': " << EC.message()
+           << "\n";
+    return 1;
+  }
+  bool IsThin = Buffer.getBuffer().startswith(ThinArchiveMagic);
+
+  std::vector<Member> Members;
+  std::vector<std::unique_ptr<MemoryBuffer>> Files;
+  if (!readMembers(*ArchiveOrErr.get(), IsThin, Members, Files))
+    return 1;
+
+  compileMembers(Members);
+
+  bool Failed = false;
+  for (const Member &M : Members) {
+    if (M.Error.empty())
+      continue;
+    errs() << ProgName << ": " << M.Name << ": " << M.Error << "\n";
+    Failed = true;
+  }
+  if (Failed || !writeArchive(Members))
+    return 1;
+  return 0;
+}
@@ -0,0 +1,367 @@
+//===-- llvm-sd-thin.cpp - Thin link for SafeDispatch --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Applies the SafeDispatch vtable layouts without merging the program into one
+// module. A build runs it in three steps:
+//
+//   llvm-sd-thin -prepare a.bc -o a.sd.bc          (per TU, writes a.sd.bc.sdsum)
+//   llvm-sd-thin -link *.sdsum -index index.bc -o sdtables.o -sd-cache-dir=D
+//   llvm-sd-thin -backend a.sd.bc -index index.bc -o a.o -sd-cache-dir=D
+//
+// The link only sees the class hierarchy and the vtables of the summaries, it
+// computes the layouts once, stores them in the SD cache and emits the new
+// vtables. The backends are independent of each other and can run in
+// parallel, they load the layouts from the cache and rewrite the vtable
+// loads, vcall indices and vptr checks of their TU. The objects of the
+// backends are linked together with the table object.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/IPO/SafeDispatchCHA.h"
+#include "llvm/Transforms/IPO/SafeDispatchThin.h"
+#include <memory>
+
+using namespace llvm;
+
+enum ThinMode { Prepare, Link, Backend };
+
+static cl::opt<ThinMode> Mode(
+    cl::desc("Step of the thin link:"), cl::Required,
+    cl::values(clEnumValN(Prepare, "prepare",
+                          "Prepare a TU and write its summary"),
+               clEnumValN(Link, "link",
+                          "Link the summaries into the index and the table object"),
+               clEnumValN(Backend, "backend",
+                          "Harden a prepared TU against the index"),
+               clEnumValEnd));
+
+static cl::list<std::string> InputFilenames(cl::Positional, cl::OneOrMore,
+                                            cl::desc("<input files>"));
+
+static cl::opt<std::string> OutputFilename("o", cl::Required,
+                                           cl::desc("Output filename"),
+                                           cl::value_desc("filename"));
+
+static cl::opt<std::string>
+    SummaryFilename("summary", cl::desc("Summary written by -prepare, "
+                                        "defaults to <output>.sdsum"),
+                    cl::value_desc("filename"));
+
+static cl::opt<std::string>
+    IndexFilename("index", cl::desc("Index written by -link, read by -backend"),
+                  cl::value_desc("filename"));
+
+static cl::opt<char> OptLevel("O", cl::desc("Optimization level. [-O0, -O1, "
+                                            "-O2, or -O3] (default = '-O2')"),
+                              cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+
+static cl::opt<bool> SDEmitIVTBLs("sd-ivtbl", cl::init(false),
+                                  cl::desc("Interleave the vtables"));
+
+static cl::opt<bool> SDEmitOVTBLs("sd-ovtbl", cl::init(false),
+                                  cl::desc("Order the vtables"));
+
+static cl::opt<std::string>
+    SDCacheDir("sd-cache-dir", cl::desc("Directory shared by the thin link "
+                                        "and the backends"),
+               cl::value_desc("directory"));
+
+// not supported by the thin link, see main
+static cl::opt<bool> SDEmitReturnChecks("sd-return", cl::init(false),
+                                        cl::Hidden);
+static cl::opt<bool> SDRemoveDeadVirtuals("sd-dead-virtuals", cl::init(false),
+                                          cl::Hidden);
+static cl::opt<bool> SDRelativeVTBLs("sd-rel-vtbl", cl::init(false),
+                                     cl::Hidden);
+static cl::opt<bool> SDTrimRTTISlots("sd-trim-rtti", cl::init(false),
+                                     cl::Hidden);
+
+static const char *ProgName;
+
+static void diagnosticHandler(const DiagnosticInfo &DI) {
+  if (DI.getSeverity() == DS_Error)
+    errs() << ProgName << ": error: ";
+  else if (DI.getSeverity() == DS_Warning)
+    errs() << ProgName << ": warning: ";
+  else
+    return;
+
+  DiagnosticPrinterRawOStream DP(errs());
+  DI.print(DP);
+  errs() << '\n';
+}
+
+static std::unique_ptr<Module> loadFile(const std::string &FN,
+                                        LLVMContext &Context) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(FN, Err, Context);
+  if (!M)
+    Err.print(ProgName, errs());
+  return M;
+}
+
+static bool writeFile(const Module &M, const std::string &FN) {
+  std::error_code EC;
+  tool_output_file Out(FN, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << ProgName << ": " << FN << ": " << EC.message() << '\n';
+    return false;
+  }
+  WriteBitcodeToFile(&M, Out.os());
+  Out.keep();
+  return true;
+}
+
+static CodeGenOpt::Level getCGOptLevel() {
+  switch (OptLevel) {
+  case '0':
+    return CodeGenOpt::None;
+  case '1':
+    return CodeGenOpt::Less;
+  case '3':
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+static bool runSDPasses(Module &M, bool IsBackend) {
+  if (verifyModule(M, &errs())) {
+    errs() << ProgName << ": " << M.getModuleIdentifier()
+           << ": error: linked module is broken!\n";
+    return false;
+  }
+
+  TargetLibraryInfoImpl TLII(Triple(M.getTargetTriple()));
+
+  PassManagerBuilder PMB;
+  PMB.OptLevel = OptLevel - '0';
+  PMB.LibraryInfo = &TLII;
+  PMB.VerifyInput = true;
+  PMB.VerifyOutput = true;
+  PMB.EmitIVTBLs = SDEmitIVTBLs;
+  PMB.EmitOVTBLs = SDEmitOVTBLs;
+  PMB.SDCacheDir = SDCacheDir;
+
+  legacy::PassManager PM;
+  PMB.populateSDThinPassManager(PM, IsBackend);
+  PM.run(M);
+  return true;
+}
+
+static bool codegen(Module &M) {
+  Triple TheTriple(M.getTargetTriple());
+  if (TheTriple.getTriple().empty())
+    TheTriple.setTriple(sys::getDefaultTargetTriple());
+
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+  if (!TheTarget) {
+    errs() << ProgName << ": " << Error << '\n';
+    return false;
+  }
+
+  SubtargetFeatures Features;
+  for (const std::string &Attr : MAttrs)
+    Features.AddFeature(Attr);
+
+  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), MCPU, Features.getString(),
+      InitTargetOptionsFromCodeGenFlags(), RelocModel, CMModel,
+      getCGOptLevel()));
+
+  std::error_code EC;
+  tool_output_file Out(OutputFilename, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << ProgName << ": " << OutputFilename << ": " << EC.message()
+           << '\n';
+    return false;
+  }
+
+  // drops what only the old vtables and the unused layouts referred to
+  legacy::PassManager PM;
+  PM.add(createGlobalDCEPass());
+  if (TM->addPassesToEmitFile(PM, Out.os(), TargetMachine::CGFT_ObjectFile)) {
+    errs() << ProgName << ": target does not support generation of object "
+                          "files\n";
+    return false;
+  }
+  PM.run(M);
+  Out.keep();
+  return true;
+}
+
+static int runPrepare(LLVMContext &Context) {
+  if (InputFilenames.size() != 1) {
+    errs() << ProgName << ": -prepare takes a single TU\n";
+    return 1;
+  }
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+      MemoryBuffer::getFileOrSTDIN(InputFilenames[0]);
+  if (std::error_code EC = Buffer.getError()) {
+    errs() << ProgName << ": " << InputFilenames[0] << ": " << EC.message()
+           << '\n';
+    return 1;
+  }
+
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M =
+      parseIR((*Buffer)->getMemBufferRef(), Err, Context);
+  if (!M) {
+    Err.print(ProgName, errs());
+    return 1;
+  }
+
+  // the promoted names are unique even if two TUs share a module identifier
+  MD5 Hash;
+  MD5::MD5Result Result;
+  SmallString<32> InputHash;
+  Hash.update((*Buffer)->getBuffer());
+  Hash.final(Result);
+  MD5::stringifyResult(Result, InputHash);
+
+  sd_thinPromoteLocals(*M, InputHash);
+  if (!writeFile(*M, OutputFilename))
+    return 1;
+
+  sd_thinStripToSummary(*M);
+  std::string Summary = SummaryFilename.empty() ? OutputFilename + ".sdsum"
+                                                : SummaryFilename;
+  return writeFile(*M, Summary) ? 0 : 1;
+}
+
+static int runLink(LLVMContext &Context) {
+  auto Index = make_unique<Module>("sd-thin-index", Context);
+  Linker L(Index.get(), diagnosticHandler);
+  for (const std::string &FN : InputFilenames) {
+    std::unique_ptr<Module> M = loadFile(FN, Context);
+    if (!M || L.linkInModule(M.get()))
+      return 1;
+  }
+
+  // the backends only see a part of the program, they find the layouts of
+  // the whole program under this key
+  std::string Key = SDBuildCHA::computeCacheKey(*Index);
+  Index->getOrInsertNamedMetadata(SD_MD_THIN_KEY)
+      ->addOperand(MDNode::get(Context, MDString::get(Context, Key)));
+  if (!writeFile(*Index, IndexFilename))
+    return 1;
+
+  if (!runSDPasses(*Index, false))
+    return 1;
+
+  sd_thinFinalizeTable(*Index);
+  return codegen(*Index) ? 0 : 1;
+}
+
+static int runBackend(LLVMContext &Context) {
+  if (InputFilenames.size() != 1) {
+    errs() << ProgName << ": -backend takes a single TU\n";
+    return 1;
+  }
+
+  std::unique_ptr<Module> Index = loadFile(IndexFilename, Context);
+  if (!Index)
+    return 1;
+  sd_thinImportIndex(*Index);
+
+  std::unique_ptr<Module> M = loadFile(InputFilenames[0], Context);
+  if (!M || Linker::LinkModules(Index.get(), M.get(), diagnosticHandler))
+    return 1;
+  Index->setModuleIdentifier(M->getModuleIdentifier());
+  M.reset();
+
+  if (!runSDPasses(*Index, true))
+    return 1;
+
+  sd_thinFinalizeBackend(*Index);
+  return codegen(*Index) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  llvm_shutdown_obj Y; // Call llvm_shutdown() on exit.
+  LLVMContext &Context = getGlobalContext();
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch thin link\n");
+  ProgName = argv[0];
+
+  // These depend on the whole program: the return checks need the static IDs
+  // and call sites of every TU, dead virtual elimination needs every virtual
+  // call, and relative and trimmed layouts are decided from the code.
+  if (SDEmitReturnChecks || SDRemoveDeadVirtuals || SDRelativeVTBLs ||
+      SDTrimRTTISlots) {
+    errs() << ProgName << ": -sd-return, -sd-dead-virtuals, -sd-rel-vtbl and "
+                          "-sd-trim-rtti need the monolithic LTO link\n";
+    return 1;
+  }
+
+  if (Mode != Prepare) {
+    if (IndexFilename.empty() || SDCacheDir.empty()) {
+      errs() << ProgName << ": -link and -backend need -index and "
+                            "-sd-cache-dir\n";
+      return 1;
+    }
+    if (!SDEmitIVTBLs && !SDEmitOVTBLs) {
+      errs() << ProgName << ": -link and -backend need -sd-ivtbl or "
+                            "-sd-ovtbl\n";
+      return 1;
+    }
+  }
+
+  switch (Mode) {
+  case Prepare:
+    return runPrepare(Context);
+  case Link:
+    return runLink(Context);
+  case Backend:
+    return runBackend(Context);
+  }
+  llvm_unreachable("unknown mode");
+}
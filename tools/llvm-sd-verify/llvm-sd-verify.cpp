@@ -0,0 +1,751 @@
+//===-- llvm-sd-verify.cpp - Check the return checks of a binary ----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Verifies the SafeDispatch return checks of a linked x86-64 executable:
+//
+//   llvm-sd-verify [-j N] [-max-errors N] [-v] a.out
+//
+// The backend (SDMachineFunction) puts nopl disp32(%rax) instructions after
+// every call, their displacements carry the ID of a static call site or the
+// min and the width of the range of a virtual one. The return checks load
+// these words through the return address and compare them with the IDs of
+// their function. The binary is mapped and its functions are disassembled in
+// parallel shards, every call site is matched with the NOPs following it and
+// every checked function with the ID constants it compares with. The call
+// sites are then validated against their callees: a direct call must carry an
+// ID its callee accepts, an indirect or virtual one an ID some function
+// accepts. The report ends with the coverage of the checks, the exit status is
+// 1 if a call site would fail its check.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/SafeDispatchMD.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrAnalysis.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace object;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input executable>"));
+
+static cl::opt<unsigned>
+    Jobs("j", cl::desc("Number of threads, defaults to the number of cores"),
+         cl::init(0));
+
+static cl::opt<unsigned>
+    MaxErrors("max-errors", cl::desc("Number of inconsistencies to print "
+                                     "(default = 50, 0 = all)"),
+              cl::init(50));
+
+static cl::opt<bool> Verbose("v", cl::desc("Also print the warnings"));
+
+static const char *ProgName;
+
+// The words of the call-site NOPs, see SDMachineFunction
+static const uint32_t SDWordMask = 0xFFFFF;
+static const uint32_t SDWordTag = SD_RETURN_ID_TAG;
+static const uint32_t SDUnknownWord = SD_RETURN_UNKNOWN_ID;
+
+// A return check loads the words at these offsets from the return address
+static const int64_t SDFirstWordOffset = 3;
+
+// The return address slot relative to the frame pointer
+static const int64_t SDFramePointerOffset = 8;
+
+// nopl disp32(%rax), the displacement starts at byte 3
+static const unsigned SDNopSize = 7;
+
+// The base, scale, index, displacement and segment of an x86 memory reference
+static const unsigned X86MemIndexOperand = 2;
+static const unsigned X86MemDispOperand = 3;
+static const unsigned X86MemOperands = 5;
+
+namespace {
+
+struct FunctionRecord {
+  StringRef Name;
+  uint64_t Address = 0;
+  ArrayRef<uint8_t> Bytes;
+
+  // The IDs (with the tag) the function compares its return address words
+  // with, empty when the function has no return check.
+  std::vector<uint32_t> CheckWords;
+  bool ReadsReturnWords = false;
+
+  bool isChecked() const { return ReadsReturnWords && !CheckWords.empty(); }
+};
+
+enum CallSiteKind { NoNop, StaticSite, VirtualSite, UnknownSite };
+
+struct CallSiteRecord {
+  uint64_t Address;
+  unsigned Function;
+  bool Direct;
+  uint64_t Target;
+  CallSiteKind Kind;
+  uint32_t First;  // the ID, or the min of a virtual site
+  uint32_t Second; // the width of a virtual site
+};
+
+struct ShardResult {
+  std::vector<CallSiteRecord> CallSites;
+  uint64_t Instructions = 0;
+  uint64_t InvalidBytes = 0;
+};
+
+/// The target descriptions are shared, the disassembler state is per thread.
+struct TargetInfo {
+  const Target *TheTarget = nullptr;
+  std::string TripleName;
+  std::unique_ptr<const MCRegisterInfo> MRI;
+  std::unique_ptr<const MCAsmInfo> AsmInfo;
+  std::unique_ptr<const MCSubtargetInfo> STI;
+  std::unique_ptr<const MCInstrInfo> MII;
+  std::unique_ptr<const MCInstrAnalysis> MIA;
+  unsigned StackPointer = 0;
+  unsigned FramePointer = 0;
+};
+
+struct Report {
+  unsigned Errors = 0;
+  unsigned Warnings = 0;
+  unsigned Printed = 0;
+
+  void error(const Twine &Msg) {
+    ++Errors;
+    print("error: ", Msg);
+  }
+
+  void warning(const Twine &Msg) {
+    ++Warnings;
+    if (Verbose)
+      print("warning: ", Msg);
+  }
+
+private:
+  void print(const char *Kind, const Twine &Msg) {
+    if (MaxErrors != 0 && Printed >= MaxErrors)
+      return;
+    outs() << Kind << Msg << "\n";
+    if (MaxErrors != 0 && ++Printed == MaxErrors)
+      outs() << "(further inconsistencies are not printed)\n";
+  }
+};
+
+/// The registers scanFunction follows from the return address to the compares
+/// of the first word, by their widest register.
+struct CheckState {
+  std::set<unsigned> ReturnAddress;
+  std::set<unsigned> FirstWord; // the word or a value computed from it
+  std::map<unsigned, uint32_t> Constants; // materialized IDs
+
+  // Bytes below the return address, -1 if unknown
+  int64_t StackDepth = 0;
+  // The depth of the function body, restored after an epilogue
+  int64_t FrameDepth = 0;
+
+  void clearRegisters() {
+    ReturnAddress.clear();
+    FirstWord.clear();
+    Constants.clear();
+  }
+};
+
+} // end anonymous namespace
+
+static bool isSDWord(uint32_t Word) {
+  return (Word & ~SDWordMask) == 0 && (Word & SDWordTag);
+}
+
+/// An immediate that can be the ID of a return check, no check accepts the
+/// unknown call sites.
+static bool isCheckImm(int64_t Imm) {
+  return Imm >= 0 && Imm <= SDWordMask && isSDWord(Imm) && Imm != SDUnknownWord;
+}
+
+/// The widest register containing Reg, the checks mix 32 and 64-bit views.
+static unsigned fullRegister(const MCRegisterInfo &MRI, unsigned Reg) {
+  for (MCSuperRegIterator SR(Reg, &MRI); SR.isValid(); ++SR)
+    if (!MCSuperRegIterator(*SR, &MRI).isValid())
+      return *SR;
+  return Reg;
+}
+
+/// Decodes the SD NOP at Offset of Bytes, if there is one.
+static bool decodeSDNop(ArrayRef<uint8_t> Bytes, uint64_t Offset,
+                        uint32_t &Word) {
+  if (Offset + SDNopSize > Bytes.size() || Bytes[Offset] != 0x0F ||
+      Bytes[Offset + 1] != 0x1F || Bytes[Offset + 2] != 0x80)
+    return false;
+  Word = support::endian::read32le(Bytes.data() + Offset + 3);
+  return isSDWord(Word);
+}
+
+static std::string hex(uint64_t Value) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+  OS << format("0x%" PRIx64, Value);
+  return OS.str();
+}
+
+static bool initTarget(const ObjectFile &Obj, TargetInfo &TI) {
+  Triple TheTriple("unknown-unknown-unknown");
+  TheTriple.setArch(Triple::ArchType(Obj.getArch()));
+  if (TheTriple.getArch() != Triple::x86_64) {
+    errs() << ProgName << ": '" << InputFilename
+           << "': the return checks exist on x86-64 only\n";
+    return false;
+  }
+
+  std::string Error;
+  TI.TheTarget = TargetRegistry::lookupTarget("", TheTriple, Error);
+  if (!TI.TheTarget) {
+    errs() << ProgName << ": " << Error << "\n";
+    return false;
+  }
+  TI.TripleName = TheTriple.getTriple();
+
+  TI.MRI.reset(TI.TheTarget->createMCRegInfo(TI.TripleName));
+  if (TI.MRI)
+    TI.AsmInfo.reset(TI.TheTarget->createMCAsmInfo(*TI.MRI, TI.TripleName));
+  TI.STI.reset(TI.TheTarget->createMCSubtargetInfo(TI.TripleName, "", ""));
+  TI.MII.reset(TI.TheTarget->createMCInstrInfo());
+  if (TI.MII)
+    TI.MIA.reset(TI.TheTarget->createMCInstrAnalysis(TI.MII.get()));
+
+  if (!TI.MRI || !TI.AsmInfo || !TI.STI || !TI.MII || !TI.MIA) {
+    errs() << ProgName << ": no disassembler for " << TI.TripleName << "\n";
+    return false;
+  }
+
+  for (unsigned Reg = 1, e = TI.MRI->getNumRegs(); Reg != e; ++Reg) {
+    StringRef Name = TI.MRI->getName(Reg);
+    if (Name == "RSP")
+      TI.StackPointer = Reg;
+    else if (Name == "RBP")
+      TI.FramePointer = Reg;
+  }
+  if (!TI.StackPointer || !TI.FramePointer) {
+    errs() << ProgName << ": no stack and frame pointer in " << TI.TripleName
+           << "\n";
+    return false;
+  }
+  return true;
+}
+
+/// Collects the functions of the text sections, ordered by address.
+static bool collectFunctions(const ObjectFile &Obj,
+                             std::vector<FunctionRecord> &Functions) {
+  std::map<uint64_t, StringRef> Starts;
+  for (const SymbolRef &Symbol : Obj.symbols()) {
+    SymbolRef::Type Type;
+    uint64_t Address;
+    StringRef Name;
+    if (Symbol.getType(Type) || Type != SymbolRef::ST_Function ||
+        Symbol.getAddress(Address) || Address == UnknownAddressOrSize ||
+        Symbol.getName(Name))
+      continue;
+    // aliases of the same code, keep the first name
+    Starts.insert(std::make_pair(Address, Name));
+  }
+
+  for (const SectionRef &Section : Obj.sections()) {
+    if (!Section.isText() || Section.isVirtual() || Section.getSize() == 0)
+      continue;
+
+    StringRef Contents;
+    if (Section.getContents(Contents))
+      return false;
+    ArrayRef<uint8_t> Bytes(reinterpret_cast<const uint8_t *>(Contents.data()),
+                            Contents.size());
+    uint64_t SectionAddr = Section.getAddress();
+    uint64_t SectionEnd = SectionAddr + Bytes.size();
+
+    // a function ends where the next one starts
+    auto I = Starts.lower_bound(SectionAddr);
+    while (I != Starts.end() && I->first < SectionEnd) {
+      auto Next = std::next(I);
+      uint64_t End = Next != Starts.end() && Next->first < SectionEnd
+                         ? Next->first
+                         : SectionEnd;
+
+      FunctionRecord F;
+      F.Name = I->second;
+      F.Address = I->first;
+      F.Bytes = Bytes.slice(I->first - SectionAddr, End - I->first);
+      Functions.push_back(F);
+      I = Next;
+    }
+  }
+
+  std::sort(Functions.begin(), Functions.end(),
+            [](const FunctionRecord &A, const FunctionRecord &B) {
+              return A.Address < B.Address;
+            });
+  return true;
+}
+
+/// Updates the stack depth of S for an instruction that writes the stack
+/// pointer, only the pushes, pops and constant adjustments are followed.
+static void updateStackDepth(const TargetInfo &TI, const MCInst &Inst,
+                             CheckState &S) {
+  StringRef Name = TI.MII->getName(Inst.getOpcode());
+  int64_t Imm = 0;
+  for (unsigned i = 0; i != Inst.getNumOperands(); ++i)
+    if (Inst.getOperand(i).isImm())
+      Imm = Inst.getOperand(i).getImm();
+
+  if (S.StackDepth < 0)
+    return;
+  if (Name.startswith("PUSH"))
+    S.StackDepth += 8;
+  else if (Name.startswith("POP"))
+    S.StackDepth -= 8;
+  else if (Name.startswith("SUB64ri"))
+    S.StackDepth += Imm;
+  else if (Name.startswith("ADD64ri"))
+    S.StackDepth -= Imm;
+  else
+    S.StackDepth = -1;
+
+  if (S.StackDepth >= 0)
+    S.FrameDepth = std::max(S.FrameDepth, S.StackDepth);
+}
+
+/// Disassembles F, records its call sites in Result and its check IDs in F.
+///
+/// A return check loads the return address from its slot, 8(%rbp) or the
+/// pushed bytes above %rsp, and the first word 3 bytes after it. The IDs of the check
+/// are the constants the compares and subtractions of that word use, either
+/// as immediates or materialized in a register. The additional IDs of a
+/// virtual function are compared with the same register one after the other.
+static void scanFunction(const TargetInfo &TI, const MCDisassembler &DisAsm,
+                         FunctionRecord &F, unsigned Index,
+                         ShardResult &Result) {
+  const MCRegisterInfo &MRI = *TI.MRI;
+  std::vector<uint32_t> Words;
+  CheckState S;
+  uint64_t Size;
+
+  for (uint64_t Offset = 0; Offset < F.Bytes.size(); Offset += Size) {
+    MCInst Inst;
+    uint64_t Address = F.Address + Offset;
+    if (!DisAsm.getInstruction(Inst, Size, F.Bytes.slice(Offset), Address,
+                               nulls(), nulls())) {
+      // padding or data in the text section
+      if (Size == 0)
+        Size = 1;
+      Result.InvalidBytes += Size;
+      continue;
+    }
+    ++Result.Instructions;
+
+    uint32_t Word;
+    if (decodeSDNop(F.Bytes, Offset, Word))
+      continue;
+
+    if (TI.MIA->isCall(Inst)) {
+      CallSiteRecord CS;
+      CS.Address = Address;
+      CS.Function = Index;
+      CS.Direct = TI.MIA->evaluateBranch(Inst, Address, Size, CS.Target);
+      CS.Kind = NoNop;
+      CS.First = CS.Second = 0;
+
+      uint64_t Next = Offset + Size;
+      if (decodeSDNop(F.Bytes, Next, CS.First)) {
+        CS.Kind = StaticSite;
+        if (CS.First == SDUnknownWord)
+          CS.Kind = UnknownSite;
+        else if (decodeSDNop(F.Bytes, Next + SDNopSize, CS.Second))
+          CS.Kind = VirtualSite;
+      }
+      Result.CallSites.push_back(CS);
+
+      // the callee does not keep the registers
+      S.clearRegisters();
+      continue;
+    }
+
+    const MCInstrDesc &Desc = TI.MII->get(Inst.getOpcode());
+    unsigned NumOps =
+        std::min<unsigned>(Inst.getNumOperands(), Desc.getNumOperands());
+    bool LoadsReturnAddress = false, LoadsFirstWord = false;
+    bool UsesFirstWord = false, UsesRegisters = false;
+    std::vector<uint32_t> IDs;
+
+    auto UseRegister = [&](unsigned Reg) {
+      Reg = fullRegister(MRI, Reg);
+      UsesRegisters = true;
+      if (S.FirstWord.count(Reg))
+        UsesFirstWord = true;
+      auto C = S.Constants.find(Reg);
+      if (C != S.Constants.end())
+        IDs.push_back(C->second);
+    };
+
+    for (unsigned i = 0; i != NumOps; ++i) {
+      const MCOperand &Op = Inst.getOperand(i);
+      uint8_t Type = Desc.OpInfo[i].OperandType;
+
+      if (Type == MCOI::OPERAND_MEMORY && i + X86MemOperands <= NumOps) {
+        const MCOperand &Base = Inst.getOperand(i);
+        const MCOperand &IndexReg = Inst.getOperand(i + X86MemIndexOperand);
+        const MCOperand &Disp = Inst.getOperand(i + X86MemDispOperand);
+        if (Base.isReg() && Base.getReg() && IndexReg.isReg() &&
+            !IndexReg.getReg() && Disp.isImm()) {
+          unsigned BaseReg = fullRegister(MRI, Base.getReg());
+          if ((BaseReg == TI.StackPointer && S.StackDepth >= 0 &&
+               Disp.getImm() == S.StackDepth) ||
+              (BaseReg == TI.FramePointer &&
+               Disp.getImm() == SDFramePointerOffset))
+            LoadsReturnAddress = true;
+          else if (Disp.getImm() == SDFirstWordOffset &&
+                   S.ReturnAddress.count(BaseReg))
+            LoadsFirstWord = true;
+        }
+        i += X86MemOperands - 1;
+      } else if (Op.isReg() && Op.getReg() && i >= Desc.getNumDefs()) {
+        UseRegister(Op.getReg());
+      } else if (Type == MCOI::OPERAND_IMMEDIATE && Op.isImm() &&
+                 isCheckImm(Op.getImm())) {
+        IDs.push_back(uint32_t(Op.getImm()));
+      }
+    }
+    // e.g. the accumulator of cmp $imm, %eax
+    for (unsigned i = 0; i != Desc.getNumImplicitUses(); ++i)
+      if (Desc.getImplicitUses()[i] != TI.StackPointer)
+        UseRegister(Desc.getImplicitUses()[i]);
+
+    if (LoadsFirstWord)
+      F.ReadsReturnWords = true;
+    if (LoadsFirstWord || UsesFirstWord)
+      Words.insert(Words.end(), IDs.begin(), IDs.end());
+
+    // a mov of an ID into a register, the compare may come later
+    bool MaterializesID = !LoadsFirstWord && !UsesRegisters && IDs.size() == 1;
+
+    std::vector<unsigned> Defs;
+    for (unsigned i = 0; i != Desc.getNumDefs() && i != NumOps; ++i)
+      if (Inst.getOperand(i).isReg() && Inst.getOperand(i).getReg())
+        Defs.push_back(Inst.getOperand(i).getReg());
+    Defs.insert(Defs.end(), Desc.getImplicitDefs(),
+                Desc.getImplicitDefs() + Desc.getNumImplicitDefs());
+
+    bool WritesStack = false;
+    for (unsigned Def : Defs) {
+      unsigned Reg = fullRegister(MRI, Def);
+      WritesStack |= Reg == TI.StackPointer;
+
+      if (LoadsReturnAddress)
+        S.ReturnAddress.insert(Reg);
+      else
+        S.ReturnAddress.erase(Reg);
+      if (LoadsFirstWord || UsesFirstWord)
+        S.FirstWord.insert(Reg);
+      else
+        S.FirstWord.erase(Reg);
+      if (MaterializesID)
+        S.Constants[Reg] = IDs.front();
+      else
+        S.Constants.erase(Reg);
+    }
+
+    if (WritesStack)
+      updateStackDepth(TI, Inst, S);
+    // the code after an epilogue runs with the frame of the body
+    if (TI.MIA->isReturn(Inst) || TI.MIA->isUnconditionalBranch(Inst))
+      S.StackDepth = S.FrameDepth;
+  }
+
+  if (!F.ReadsReturnWords)
+    return;
+  std::sort(Words.begin(), Words.end());
+  Words.erase(std::unique(Words.begin(), Words.end()), Words.end());
+  F.CheckWords = std::move(Words);
+}
+
+/// Scans the functions in parallel, a thread takes the next shard of
+/// functions until none is left.
+static void scanFunctions(const TargetInfo &TI,
+                          std::vector<FunctionRecord> &Functions,
+                          std::vector<ShardResult> &Results) {
+  unsigned NumThreads = Jobs ? Jobs : std::thread::hardware_concurrency();
+  if (NumThreads == 0)
+    NumThreads = 1;
+
+  // several shards per thread balance functions of very different sizes
+  uint64_t TotalBytes = 0;
+  for (const FunctionRecord &F : Functions)
+    TotalBytes += F.Bytes.size();
+  uint64_t ShardBytes = std::max<uint64_t>(TotalBytes / (NumThreads * 8), 1);
+
+  std::vector<std::pair<unsigned, unsigned>> Shards;
+  unsigned Begin = 0;
+  uint64_t Bytes = 0;
+  for (unsigned i = 0; i < Functions.size(); ++i) {
+    Bytes += Functions[i].Bytes.size();
+    if (Bytes >= ShardBytes || i + 1 == Functions.size()) {
+      Shards.push_back(std::make_pair(Begin, i + 1));
+      Begin = i + 1;
+      Bytes = 0;
+    }
+  }
+
+  NumThreads = std::min<unsigned>(NumThreads, Shards.size());
+  Results.resize(Shards.size());
+  std::atomic<unsigned> NextShard(0);
+
+  std::vector<std::thread> Threads;
+  for (unsigned t = 0; t < NumThreads; ++t) {
+    Threads.emplace_back([&]() {
+      MCObjectFileInfo MOFI;
+      MCContext Ctx(TI.AsmInfo.get(), TI.MRI.get(), &MOFI);
+      std::unique_ptr<MCDisassembler> DisAsm(
+          TI.TheTarget->createMCDisassembler(*TI.STI, Ctx));
+      if (!DisAsm)
+        return;
+
+      unsigned S;
+      while ((S = NextShard++) < Shards.size())
+        for (unsigned i = Shards[S].first; i < Shards[S].second; ++i)
+          scanFunction(TI, *DisAsm, Functions[i], i, Results[S]);
+    });
+  }
+  for (std::thread &T : Threads)
+    T.join();
+}
+
+static uint32_t idOf(uint32_t Word) { return Word & ~SDWordTag; }
+
+/// True if Words has an ID in [Min, Min + Width].
+static bool acceptsRange(ArrayRef<uint32_t> Words, uint32_t Min,
+                         uint32_t Width) {
+  auto I = std::lower_bound(Words.begin(), Words.end(), Min | SDWordTag);
+  return I != Words.end() && idOf(*I) - idOf(Min) <= idOf(Width);
+}
+
+static std::string describe(const std::vector<FunctionRecord> &Functions,
+                            const CallSiteRecord &CS) {
+  return "call at " + hex(CS.Address) + " in " +
+         Functions[CS.Function].Name.str();
+}
+
+/// Cross-validates the call sites and the checks and prints the report,
+/// returns the number of errors.
+static unsigned verify(const std::vector<FunctionRecord> &Functions,
+                       const std::vector<ShardResult> &Results) {
+  std::map<uint64_t, unsigned> ByAddress;
+  std::vector<uint32_t> AllWords;
+  unsigned Checked = 0;
+  for (unsigned i = 0; i < Functions.size(); ++i) {
+    ByAddress[Functions[i].Address] = i;
+    if (!Functions[i].isChecked())
+      continue;
+    ++Checked;
+    AllWords.insert(AllWords.end(), Functions[i].CheckWords.begin(),
+                    Functions[i].CheckWords.end());
+  }
+  std::sort(AllWords.begin(), AllWords.end());
+  AllWords.erase(std::unique(AllWords.begin(), AllWords.end()), AllWords.end());
+
+  Report R;
+  uint64_t Instructions = 0, InvalidBytes = 0;
+  unsigned Counts[4] = {0, 0, 0, 0};
+  unsigned Direct = 0, ToChecked = 0, External = 0;
+  std::vector<uint32_t> UsedWords;
+  std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+
+  for (const ShardResult &Result : Results) {
+    Instructions += Result.Instructions;
+    InvalidBytes += Result.InvalidBytes;
+
+    for (const CallSiteRecord &CS : Result.CallSites) {
+      ++Counts[CS.Kind];
+      if (CS.Kind == StaticSite)
+        UsedWords.push_back(CS.First);
+      else if (CS.Kind == VirtualSite)
+        Ranges.push_back(std::make_pair(idOf(CS.First),
+                                        idOf(CS.First) + idOf(CS.Second)));
+
+      if (!CS.Direct) {
+        if (CS.Kind == StaticSite &&
+            !std::binary_search(AllWords.begin(), AllWords.end(), CS.First))
+          R.error(describe(Functions, CS) + " carries " + hex(CS.First) +
+                  ", no function accepts it");
+        else if (CS.Kind == VirtualSite &&
+                 !acceptsRange(AllWords, CS.First, CS.Second))
+          R.error(describe(Functions, CS) + " carries the range " +
+                  hex(CS.First) + "+" + hex(idOf(CS.Second)) +
+                  ", no function accepts it");
+        continue;
+      }
+
+      ++Direct;
+      auto I = ByAddress.find(CS.Target);
+      if (I == ByAddress.end()) {
+        // PLT entries and other code without a symbol
+        ++External;
+        continue;
+      }
+      const FunctionRecord &Callee = Functions[I->second];
+      if (!Callee.isChecked())
+        continue;
+      ++ToChecked;
+
+      ArrayRef<uint32_t> Words = Callee.CheckWords;
+      switch (CS.Kind) {
+      case NoNop:
+        R.error(describe(Functions, CS) + " to " + Callee.Name +
+                " has no ID but its callee checks it");
+        break;
+      case UnknownSite:
+        R.warning(describe(Functions, CS) + " to " + Callee.Name +
+                  " is an unknown call site");
+        break;
+      case StaticSite:
+        if (!std::binary_search(Words.begin(), Words.end(), CS.First))
+          R.error(describe(Functions, CS) + " carries " + hex(CS.First) +
+                  ", " + Callee.Name + " does not accept it");
+        break;
+      case VirtualSite:
+        if (!acceptsRange(Words, CS.First, CS.Second))
+          R.error(describe(Functions, CS) + " carries the range " +
+                  hex(CS.First) + "+" + hex(idOf(CS.Second)) + ", " +
+                  Callee.Name + " accepts none of it");
+        break;
+      }
+    }
+  }
+
+  // IDs a function accepts but no call site of the binary carries, the
+  // callers are external or gone
+  std::sort(UsedWords.begin(), UsedWords.end());
+  std::sort(Ranges.begin(), Ranges.end());
+  std::vector<std::pair<uint32_t, uint32_t>> Covered;
+  for (auto &Range : Ranges) {
+    if (!Covered.empty() && Range.first <= Covered.back().second + 1)
+      Covered.back().second = std::max(Covered.back().second, Range.second);
+    else
+      Covered.push_back(Range);
+  }
+
+  unsigned Unused = 0;
+  for (uint32_t Word : AllWords) {
+    if (std::binary_search(UsedWords.begin(), UsedWords.end(), Word))
+      continue;
+    auto I = std::upper_bound(
+        Covered.begin(), Covered.end(),
+        std::make_pair(idOf(Word), std::numeric_limits<uint32_t>::max()));
+    if (I != Covered.begin() && idOf(Word) <= std::prev(I)->second)
+      continue;
+    ++Unused;
+    R.warning("no call site carries " + hex(Word));
+  }
+
+  unsigned CallSites = Counts[NoNop] + Counts[StaticSite] +
+                       Counts[VirtualSite] + Counts[UnknownSite];
+  auto Percent = [](unsigned Part, unsigned Whole) {
+    return format("%.1f%%", Whole ? 100.0 * Part / Whole : 0.0);
+  };
+
+  outs() << "\n";
+  outs() << "Instructions:                  " << Instructions << " ("
+         << InvalidBytes << " undecodable bytes)\n";
+  outs() << "Functions:                     " << Functions.size() << "\n";
+  outs() << "  with return checks:          " << Checked << " ("
+         << Percent(Checked, Functions.size()) << ")\n";
+  outs() << "  accepted IDs:                " << AllWords.size() << " ("
+         << Unused << " without a call site)\n";
+  outs() << "Call sites:                    " << CallSites << "\n";
+  outs() << "  static:                      " << Counts[StaticSite] << "\n";
+  outs() << "  virtual:                     " << Counts[VirtualSite] << "\n";
+  outs() << "  unknown:                     " << Counts[UnknownSite] << "\n";
+  outs() << "  without ID:                  " << Counts[NoNop] << " ("
+         << Percent(Counts[NoNop], CallSites) << ")\n";
+  outs() << "  direct:                      " << Direct << " (" << ToChecked
+         << " to checked functions, " << External << " external)\n";
+  outs() << "Errors:                        " << R.Errors << "\n";
+  outs() << "Warnings:                      " << R.Warnings << "\n";
+  return R.Errors;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y; // Call llvm_shutdown() on exit.
+
+  InitializeAllTargetInfos();
+  InitializeAllTargetMCs();
+  InitializeAllDisassemblers();
+
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch binary verifier\n");
+  ProgName = argv[0];
+
+  // the file is mapped, the sections refer into the mapping
+  ErrorOr<OwningBinary<Binary>> BinaryOrErr = createBinary(InputFilename);
+  if (std::error_code EC = BinaryOrErr.getError()) {
+    errs() << ProgName << ": '" << InputFilename << "': " << EC.message()
+           << "\n";
+    return 1;
+  }
+  ObjectFile *Obj = dyn_cast<ObjectFile>(BinaryOrErr.get().getBinary());
+  if (!Obj) {
+    errs() << ProgName << ": '" << InputFilename << "': not an object file\n";
+    return 1;
+  }
+
+  TargetInfo TI;
+  if (!initTarget(*Obj, TI))
+    return 1;
+
+  std::vector<FunctionRecord> Functions;
+  if (!collectFunctions(*Obj, Functions)) {
+    errs() << ProgName << ": '" << InputFilename
+           << "': cannot read the text sections\n";
+    return 1;
+  }
+  if (Functions.empty()) {
+    errs() << ProgName << ": '" << InputFilename
+           << "': no function symbols, the binary must not be stripped\n";
+    return 1;
+  }
+
+  std::vector<ShardResult> Results;
+  scanFunctions(TI, Functions, Results);
+  return verify(Functions, Results) ? 1 : 0;
+}
@@ -0,0 +1,742 @@
+//===-- llvm-sd-vtables.cpp - Dump the SafeDispatch vtable layouts --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Prints the vtables of an ELF executable or object file as JSON:
+//
+//   llvm-sd-vtables [-demangle] [-slots=false] [-class NAME]... a.out
+//
+// Every interleaved cloud emitted by SDLayoutBuilder (_SD_ZTV* and _SD_ZTC*)
+// and every vtable left in its original layout (_ZTV* and _ZTC*) is listed
+// with its slots, the padding in front of its first entry, its address
+// points and the range of address points a vptr of each of them may hold.
+//
+// The slots are resolved through the relocations of the file when it has
+// them (object files, position independent executables) and through the
+// symbol table otherwise. The layouts are not recorded in the binary, they
+// are reconstructed from the RTTI: the rtti slots of the vtables of a cloud
+// are interleaved right before their address points, so a run of k type_info
+// references is followed by k address points in the same order. The bases
+// listed in the type_info objects give the class hierarchy, the valid range
+// of an address point of a cloud holds the address points of its class and
+// of the classes derived from it. It is wider than the range SDLayoutBuilder
+// checks when a class has several subobjects of a base in the same cloud.
+// Clouds without rtti slots (-fno-rtti, TRIM_RTTI) are listed without
+// address points.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSONString.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+using namespace object;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input file>"));
+
+static cl::opt<bool> Demangle("demangle",
+                              cl::desc("Demangle the symbol and class names"));
+
+static cl::opt<bool> PrintSlots("slots", cl::desc("Print the slots of the "
+                                                  "vtables (default = true)"),
+                                cl::init(true));
+
+static cl::list<std::string>
+    ClassNames("class", cl::ZeroOrMore,
+               cl::desc("Only print the vtables with an address point of "
+                        "this class, mangled or demangled"));
+
+static const char *ProgName;
+
+// The type_info objects of the Itanium ABI: a vptr and a name, followed by
+// the base of a __si_class_type_info or the flags, the number of bases and
+// the (base, offset flags) pairs of a __vmi_class_type_info.
+static const uint64_t SITypeInfoSize = 24;
+static const uint64_t SIBaseOffset = 16;
+static const uint64_t VMIBaseCountOffset = 20;
+static const uint64_t VMIBasesOffset = 24;
+static const uint64_t VMIBaseSize = 16;
+
+#if !defined(_MSC_VER)
+// Assume that __cxa_demangle is provided by libcxxabi (except for Windows).
+extern "C" char *__cxa_demangle(const char *mangled_name, char *output_buffer,
+                                size_t *length, int *status);
+#endif
+
+namespace {
+
+/// A place in a section, the sections of an object file all start at 0.
+struct Location {
+  unsigned Section;
+  uint64_t Offset;
+
+  Location() : Section(0), Offset(0) {}
+  Location(unsigned Section, uint64_t Offset)
+      : Section(Section), Offset(Offset) {}
+
+  bool operator<(const Location &Other) const {
+    return Section != Other.Section ? Section < Other.Section
+                                    : Offset < Other.Offset;
+  }
+};
+
+struct SectionInfo {
+  StringRef Name;
+  uint64_t Address = 0;
+  ArrayRef<uint8_t> Bytes;
+  bool Alloc = false;
+};
+
+struct SymbolInfo {
+  StringRef Name;
+  Location Loc;
+  uint64_t Size = 0;
+};
+
+/// What a relocated or a resolved pointer refers to: a place in the file, or
+/// a symbol defined elsewhere.
+struct Target {
+  bool Defined = false;
+  Location Loc;
+  StringRef External;
+  int64_t Addend = 0;
+  unsigned Width = 8; // of the relocated field
+};
+
+enum SlotKind { NullSlot, IntSlot, RefSlot };
+
+struct Slot {
+  SlotKind Kind = NullSlot;
+  int64_t Value = 0;
+  Target Ref;
+};
+
+struct AddressPoint {
+  uint64_t Index;
+  StringRef TypeInfo;
+  std::vector<std::pair<uint64_t, uint64_t>> Ranges; // slot indices, [)
+};
+
+struct VTable {
+  const SymbolInfo *Symbol;
+  bool Cloud;
+  unsigned Width;
+  bool Relative;
+  std::vector<Slot> Slots;
+  std::vector<AddressPoint> AddrPts;
+  uint64_t Padding = 0;
+  uint64_t Nulls = 0;
+};
+
+/// The sections, symbols and relocations of the input file.
+class Image {
+public:
+  bool load(const ObjectFile &Obj);
+
+  /// Reads the entry of Width bytes at L, a relative entry holds the offset
+  /// of its target from the entry.
+  bool readSlot(Location L, unsigned Width, bool Relative, Slot &S) const;
+
+  const SymbolInfo *symbolAt(Location L) const;
+  const SymbolInfo *symbolContaining(Location L) const;
+  const SymbolInfo *typeInfo(StringRef Name) const;
+
+  /// The name of the type_info T refers to, empty if it is something else.
+  StringRef typeInfoAt(const Target &T) const;
+
+  uint64_t address(Location L) const {
+    return Sections[L.Section].Address + L.Offset;
+  }
+
+  const std::vector<SymbolInfo> &symbols() const { return Symbols; }
+  const SectionInfo &section(unsigned Index) const { return Sections[Index]; }
+
+private:
+  bool locate(uint64_t Address, Location &L) const;
+  void addRelocation(const ELFObjectFileBase &ElfObj,
+                     const RelocationRef &Reloc, Location L);
+
+  bool Relocatable = false;
+  std::vector<SectionInfo> Sections;
+  std::map<uintptr_t, unsigned> SectionIndices;
+  std::vector<unsigned> AllocOrder; // allocated sections by address
+  std::vector<SymbolInfo> Symbols;  // by location
+  std::map<Location, Target> Relocs;
+  std::map<StringRef, const SymbolInfo *> TypeInfos;
+};
+
+} // end anonymous namespace
+
+static std::string demangle(StringRef Name) {
+#if !defined(_MSC_VER)
+  int Status = 0;
+  char *Demangled = __cxa_demangle(Name.str().c_str(), nullptr, nullptr,
+                                   &Status);
+  if (Status != 0)
+    return Name;
+  std::string Result = Demangled;
+  free(Demangled);
+  return Result;
+#else
+  return Name;
+#endif
+}
+
+/// The class a type_info symbol describes, _ZTI3Foo is 3Foo or Foo.
+static std::string className(StringRef TypeInfo) {
+  StringRef Mangled = TypeInfo.substr(4);
+  return Demangle ? demangle(Mangled) : Mangled.str();
+}
+
+static std::string symbolName(StringRef Name) {
+  return Demangle && Name.startswith("_Z") ? demangle(Name) : Name.str();
+}
+
+bool Image::load(const ObjectFile &Obj) {
+  const ELFObjectFileBase *ElfObj = dyn_cast<ELFObjectFileBase>(&Obj);
+  if (!ElfObj)
+    return false;
+  Relocatable = Obj.isRelocatableObject();
+
+  for (const SectionRef &Section : Obj.sections()) {
+    SectionIndices[Section.getRawDataRefImpl().p] = Sections.size();
+
+    SectionInfo Info;
+    Section.getName(Info.Name);
+    Info.Address = Section.getAddress();
+    Info.Alloc = ElfObj->getSectionFlags(Section) & ELF::SHF_ALLOC;
+    StringRef Contents;
+    if (!Section.isVirtual() && !Section.getContents(Contents))
+      Info.Bytes = ArrayRef<uint8_t>(
+          reinterpret_cast<const uint8_t *>(Contents.data()), Contents.size());
+    if (Info.Alloc && !Relocatable && Section.getSize())
+      AllocOrder.push_back(Sections.size());
+    Sections.push_back(Info);
+  }
+
+  std::sort(AllocOrder.begin(), AllocOrder.end(),
+            [this](unsigned A, unsigned B) {
+              return Sections[A].Address < Sections[B].Address;
+            });
+
+  for (const SymbolRef &Symbol : Obj.symbols()) {
+    section_iterator Section = Obj.section_end();
+    uint64_t Address;
+    SymbolInfo Info;
+    if (Symbol.getSection(Section) || Section == Obj.section_end() ||
+        Symbol.getAddress(Address) || Address == UnknownAddressOrSize ||
+        Symbol.getName(Info.Name) || Symbol.getSize(Info.Size))
+      continue;
+
+    unsigned Index = SectionIndices[Section->getRawDataRefImpl().p];
+    Info.Loc = Location(Index, Address - Sections[Index].Address);
+    Symbols.push_back(Info);
+  }
+
+  // the named symbols first, the section symbols have no name
+  std::sort(Symbols.begin(), Symbols.end(),
+            [](const SymbolInfo &A, const SymbolInfo &B) {
+              if (A.Loc < B.Loc || B.Loc < A.Loc)
+                return A.Loc < B.Loc;
+              if (A.Name.empty() != B.Name.empty())
+                return B.Name.empty();
+              return A.Size > B.Size;
+            });
+  for (const SymbolInfo &Symbol : Symbols)
+    if (Symbol.Name.startswith("_ZTI"))
+      TypeInfos.insert(std::make_pair(Symbol.Name, &Symbol));
+
+  // an object file relocates its sections, an executable may carry dynamic
+  // relocations, the code is never needed
+  for (const SectionRef &Section : Obj.sections()) {
+    if (Section.relocation_begin() == Section.relocation_end())
+      continue;
+
+    section_iterator Relocated = Section.getRelocatedSection();
+    if (Relocatable) {
+      if (Relocated == Obj.section_end() || Relocated->isText())
+        continue;
+      unsigned Index = SectionIndices[Relocated->getRawDataRefImpl().p];
+      for (const RelocationRef &Reloc : Section.relocations()) {
+        uint64_t Offset;
+        if (!Reloc.getOffset(Offset))
+          addRelocation(*ElfObj, Reloc, Location(Index, Offset));
+      }
+      continue;
+    }
+
+    for (const RelocationRef &Reloc : Section.relocations()) {
+      uint64_t Address;
+      Location L;
+      if (!Reloc.getAddress(Address) && locate(Address, L) &&
+          !Sections[L.Section].Bytes.empty())
+        addRelocation(*ElfObj, Reloc, L);
+    }
+  }
+  return true;
+}
+
+void Image::addRelocation(const ELFObjectFileBase &ElfObj,
+                          const RelocationRef &Reloc, Location L) {
+  Target T;
+  if (ElfObj.getRelocationAddend(Reloc.getRawDataRefImpl(), T.Addend))
+    T.Addend = 0;
+
+  // the entries of a relative vtable are 32-bit pc-relative offsets
+  uint64_t Type;
+  if (!Reloc.getType(Type) &&
+      (Type == ELF::R_X86_64_PC32 || Type == ELF::R_X86_64_32 ||
+       Type == ELF::R_X86_64_32S))
+    T.Width = 4;
+
+  symbol_iterator Symbol = Reloc.getSymbol();
+  if (Symbol == ElfObj.symbol_end()) {
+    // R_X86_64_RELATIVE, the addend is the address
+    T.Defined = locate(T.Addend, T.Loc);
+    T.Addend = 0;
+  } else {
+    section_iterator Section = ElfObj.section_end();
+    uint64_t Address;
+    if (!Symbol->getSection(Section) && Section != ElfObj.section_end() &&
+        !Symbol->getAddress(Address) && Address != UnknownAddressOrSize) {
+      unsigned Index = SectionIndices[Section->getRawDataRefImpl().p];
+      T.Defined = true;
+      T.Loc = Location(Index, Address - Sections[Index].Address + T.Addend);
+      T.Addend = 0;
+    } else if (Symbol->getName(T.External)) {
+      return;
+    }
+  }
+  Relocs[L] = T;
+}
+
+bool Image::locate(uint64_t Address, Location &L) const {
+  auto I = std::upper_bound(AllocOrder.begin(), AllocOrder.end(), Address,
+                            [this](uint64_t Address, unsigned Index) {
+                              return Address < Sections[Index].Address;
+                            });
+  if (I == AllocOrder.begin())
+    return false;
+  const SectionInfo &Section = Sections[*std::prev(I)];
+  if (Address - Section.Address >= std::max<uint64_t>(Section.Bytes.size(), 1))
+    return false;
+  L = Location(*std::prev(I), Address - Section.Address);
+  return true;
+}
+
+bool Image::readSlot(Location L, unsigned Width, bool Relative,
+                     Slot &S) const {
+  const SectionInfo &Section = Sections[L.Section];
+  if (L.Offset + Width > Section.Bytes.size())
+    return false;
+
+  S = Slot();
+  auto Reloc = Relocs.find(L);
+  if (Reloc != Relocs.end() && Reloc->second.Width == Width) {
+    S.Kind = RefSlot;
+    S.Ref = Reloc->second;
+    return true;
+  }
+
+  const uint8_t *Bytes = Section.Bytes.data() + L.Offset;
+  S.Value = Width == 4 ? (int32_t) support::endian::read32le(Bytes)
+                       : (int64_t) support::endian::read64le(Bytes);
+  if (S.Value == 0)
+    return true;
+
+  // an executable holds the addresses themselves
+  S.Kind = IntSlot;
+  uint64_t Address = Relative ? address(L) + S.Value : S.Value;
+  Location TargetLoc;
+  if (!Relocatable && locate(Address, TargetLoc) &&
+      symbolContaining(TargetLoc)) {
+    S.Kind = RefSlot;
+    S.Ref.Defined = true;
+    S.Ref.Loc = TargetLoc;
+  }
+  return true;
+}
+
+const SymbolInfo *Image::symbolAt(Location L) const {
+  auto I = std::lower_bound(Symbols.begin(), Symbols.end(), L,
+                            [](const SymbolInfo &S, Location L) {
+                              return S.Loc < L;
+                            });
+  if (I == Symbols.end() || L < I->Loc || I->Name.empty())
+    return nullptr;
+  return &*I;
+}
+
+const SymbolInfo *Image::symbolContaining(Location L) const {
+  auto I = std::upper_bound(Symbols.begin(), Symbols.end(), L,
+                            [](Location L, const SymbolInfo &S) {
+                              return L < S.Loc;
+                            });
+  // the closest symbols may be nested in a bigger one
+  for (unsigned Tries = 0; I != Symbols.begin() && Tries < 16; ++Tries) {
+    --I;
+    if (I->Loc.Section != L.Section)
+      break;
+    if (!I->Name.empty() && L.Offset - I->Loc.Offset < std::max<uint64_t>(
+                                                            I->Size, 1))
+      return &*I;
+  }
+  return nullptr;
+}
+
+const SymbolInfo *Image::typeInfo(StringRef Name) const {
+  auto I = TypeInfos.find(Name);
+  return I != TypeInfos.end() ? I->second : nullptr;
+}
+
+StringRef Image::typeInfoAt(const Target &T) const {
+  StringRef Name = T.External;
+  if (T.Defined) {
+    const SymbolInfo *Symbol = symbolAt(T.Loc);
+    Name = Symbol ? Symbol->Name : StringRef();
+  }
+  return Name.startswith("_ZTI") && T.Addend == 0 ? Name : StringRef();
+}
+
+/// Reads the entries of V as absolute pointers, and those of a cloud also as
+/// relative offsets, and keeps the reading that resolves the most of them.
+static bool readSlots(const Image &Img, VTable &V) {
+  std::vector<Slot> Best;
+  unsigned BestRefs = 0;
+  V.Width = 8;
+  V.Relative = false;
+
+  for (unsigned Width : {8u, 4u}) {
+    if (Width == 4 && !V.Cloud)
+      break;
+    uint64_t Count = V.Symbol->Size / Width;
+    std::vector<Slot> Slots(Count);
+    unsigned Refs = 0;
+    for (uint64_t i = 0; i < Count; i++) {
+      Location L(V.Symbol->Loc.Section, V.Symbol->Loc.Offset + i * Width);
+      if (!Img.readSlot(L, Width, Width == 4, Slots[i]))
+        return false;
+      // an entry never refers into its own vtable, this is a small offset
+      Slot &S = Slots[i];
+      if (Width == 4 && S.Kind == RefSlot && S.Ref.Defined && S.Value &&
+          S.Ref.Loc.Section == V.Symbol->Loc.Section &&
+          S.Ref.Loc.Offset - V.Symbol->Loc.Offset < V.Symbol->Size)
+        S.Kind = IntSlot;
+      if (Slots[i].Kind == RefSlot)
+        ++Refs;
+    }
+    if (Refs > BestRefs || Best.empty()) {
+      Best.swap(Slots);
+      BestRefs = Refs;
+      V.Width = Width;
+      V.Relative = Width == 4;
+    }
+  }
+  V.Slots.swap(Best);
+
+  while (V.Padding < V.Slots.size() && V.Slots[V.Padding].Kind == NullSlot)
+    ++V.Padding;
+  for (const Slot &S : V.Slots)
+    if (S.Kind == NullSlot)
+      ++V.Nulls;
+  return true;
+}
+
+namespace {
+
+/// The class hierarchy described by the type_info objects.
+class Hierarchy {
+public:
+  explicit Hierarchy(const Image &Img) : Img(Img) {}
+
+  /// The classes TypeInfo derives from, itself included.
+  const std::set<StringRef> &ancestors(StringRef TypeInfo);
+
+private:
+  void readBases(StringRef TypeInfo, std::vector<StringRef> &Bases);
+
+  const Image &Img;
+  std::map<StringRef, std::set<StringRef>> Ancestors;
+};
+
+} // end anonymous namespace
+
+void Hierarchy::readBases(StringRef Name, std::vector<StringRef> &Bases) {
+  // defined in another module, its bases are unknown
+  const SymbolInfo *TypeInfo = Img.typeInfo(Name);
+  if (!TypeInfo)
+    return;
+
+  const SectionInfo &Section = Img.section(TypeInfo->Loc.Section);
+  uint64_t Start = TypeInfo->Loc.Offset;
+  std::vector<uint64_t> Offsets;
+
+  if (TypeInfo->Size == SITypeInfoSize) {
+    Offsets.push_back(SIBaseOffset);
+  } else if (TypeInfo->Size >= VMIBasesOffset &&
+             Start + VMIBasesOffset <= Section.Bytes.size()) {
+    uint32_t Count = support::endian::read32le(Section.Bytes.data() + Start +
+                                               VMIBaseCountOffset);
+    for (uint64_t i = 0; i < Count; i++) {
+      uint64_t Offset = VMIBasesOffset + i * VMIBaseSize;
+      if (Offset + VMIBaseSize > TypeInfo->Size)
+        break;
+      Offsets.push_back(Offset);
+    }
+  }
+
+  for (uint64_t Offset : Offsets) {
+    Slot S;
+    if (Img.readSlot(Location(TypeInfo->Loc.Section, Start + Offset), 8, false,
+                     S) && S.Kind == RefSlot)
+      if (!Img.typeInfoAt(S.Ref).empty())
+        Bases.push_back(Img.typeInfoAt(S.Ref));
+  }
+}
+
+const std::set<StringRef> &Hierarchy::ancestors(StringRef TypeInfo) {
+  auto I = Ancestors.find(TypeInfo);
+  if (I != Ancestors.end())
+    return I->second;
+
+  // insert first, a broken hierarchy must not recurse forever
+  std::set<StringRef> Result;
+  Result.insert(TypeInfo);
+  Ancestors[TypeInfo] = Result;
+
+  std::vector<StringRef> Bases;
+  readBases(TypeInfo, Bases);
+  for (StringRef Base : Bases) {
+    const std::set<StringRef> &BaseAncestors = ancestors(Base);
+    Result.insert(BaseAncestors.begin(), BaseAncestors.end());
+  }
+  return Ancestors[TypeInfo] = Result;
+}
+
+/// Finds the address points of V after its runs of rtti slots and computes
+/// the valid range of each of them.
+static void findAddressPoints(const Image &Img, Hierarchy &H, VTable &V) {
+  uint64_t Count = V.Slots.size();
+  for (uint64_t Start = 0; Start < Count;) {
+    uint64_t End = Start;
+    while (End < Count && V.Slots[End].Kind == RefSlot &&
+           !Img.typeInfoAt(V.Slots[End].Ref).empty())
+      ++End;
+    if (End == Start) {
+      ++Start;
+      continue;
+    }
+
+    for (uint64_t i = Start; i < End && End + (i - Start) < Count; i++) {
+      AddressPoint AP;
+      AP.Index = End + (i - Start);
+      AP.TypeInfo = Img.typeInfoAt(V.Slots[i].Ref);
+      V.AddrPts.push_back(AP);
+    }
+    Start = End;
+  }
+
+  // a vptr of a class may point to the address points of its descendants,
+  // the vptrs into an original vtable are not range checked
+  if (!V.Cloud)
+    return;
+  std::map<StringRef, std::vector<uint64_t>> Members;
+  for (const AddressPoint &AP : V.AddrPts)
+    for (StringRef Ancestor : H.ancestors(AP.TypeInfo))
+      Members[Ancestor].push_back(AP.Index);
+
+  for (AddressPoint &AP : V.AddrPts) {
+    for (uint64_t Index : Members[AP.TypeInfo]) {
+      if (!AP.Ranges.empty() && AP.Ranges.back().second == Index)
+        AP.Ranges.back().second++;
+      else
+        AP.Ranges.push_back(std::make_pair(Index, Index + 1));
+    }
+  }
+}
+
+static bool isSelected(const VTable &V) {
+  if (ClassNames.empty())
+    return true;
+  for (const AddressPoint &AP : V.AddrPts) {
+    StringRef Mangled = AP.TypeInfo.substr(4);
+    for (const std::string &Name : ClassNames)
+      if (Name == Mangled || Name == demangle(Mangled))
+        return true;
+  }
+  return false;
+}
+
+static void writeHex(raw_ostream &OS, uint64_t Value) {
+  OS << format("\"0x%" PRIx64 "\"", Value);
+}
+
+static void writeSlot(raw_ostream &OS, const Image &Img, const Slot &S) {
+  if (S.Kind == NullSlot) {
+    OS << "null";
+    return;
+  }
+  if (S.Kind == IntSlot) {
+    OS << S.Value;
+    return;
+  }
+
+  std::string Name;
+  raw_string_ostream NameOS(Name);
+  if (!S.Ref.Defined) {
+    NameOS << symbolName(S.Ref.External);
+    if (S.Ref.Addend)
+      NameOS << format("%+" PRId64, S.Ref.Addend);
+  } else if (const SymbolInfo *Symbol = Img.symbolContaining(S.Ref.Loc)) {
+    NameOS << symbolName(Symbol->Name);
+    if (Symbol->Loc.Offset != S.Ref.Loc.Offset)
+      NameOS << "+" << (S.Ref.Loc.Offset - Symbol->Loc.Offset);
+  } else {
+    NameOS << Img.section(S.Ref.Loc.Section).Name << "+" << S.Ref.Loc.Offset;
+  }
+  writeJSONString(OS, NameOS.str());
+}
+
+static void writeVTable(raw_ostream &OS, const Image &Img, const VTable &V) {
+  uint64_t Start = Img.address(V.Symbol->Loc);
+
+  OS << "    {\n      \"name\": ";
+  writeJSONString(OS, symbolName(V.Symbol->Name));
+  OS << ",\n      \"kind\": \"" << (V.Cloud ? "cloud" : "vtable") << "\"";
+  OS << ",\n      \"section\": ";
+  writeJSONString(OS, Img.section(V.Symbol->Loc.Section).Name);
+  OS << ",\n      \"address\": ";
+  writeHex(OS, Start);
+  OS << ",\n      \"size\": " << V.Symbol->Size;
+  OS << ",\n      \"entry_width\": " << V.Width;
+  OS << ",\n      \"relative\": " << (V.Relative ? "true" : "false");
+  OS << ",\n      \"entries\": " << V.Slots.size();
+  OS << ",\n      \"padding\": " << V.Padding;
+  OS << ",\n      \"null_entries\": " << V.Nulls;
+
+  OS << ",\n      \"address_points\": [";
+  for (unsigned i = 0; i < V.AddrPts.size(); i++) {
+    const AddressPoint &AP = V.AddrPts[i];
+    OS << (i ? ",\n" : "\n") << "        {\"index\": " << AP.Index
+       << ", \"address\": ";
+    writeHex(OS, Start + AP.Index * V.Width);
+    OS << ", \"class\": ";
+    writeJSONString(OS, className(AP.TypeInfo));
+    if (!V.Cloud) {
+      OS << "}";
+      continue;
+    }
+    OS << ", \"valid\": [";
+    for (unsigned j = 0; j < AP.Ranges.size(); j++) {
+      const std::pair<uint64_t, uint64_t> &R = AP.Ranges[j];
+      OS << (j ? ", " : "") << "{\"start\": " << R.first
+         << ", \"end\": " << R.second << ", \"start_address\": ";
+      writeHex(OS, Start + R.first * V.Width);
+      OS << ", \"end_address\": ";
+      writeHex(OS, Start + R.second * V.Width);
+      OS << "}";
+    }
+    OS << "]}";
+  }
+  OS << (V.AddrPts.empty() ? "]" : "\n      ]");
+
+  if (PrintSlots) {
+    OS << ",\n      \"slots\": [";
+    for (uint64_t i = 0; i < V.Slots.size(); i++) {
+      OS << (i ? ",\n" : "\n") << "        ";
+      writeSlot(OS, Img, V.Slots[i]);
+    }
+    OS << (V.Slots.empty() ? "]" : "\n      ]");
+  }
+  OS << "\n    }";
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y; // Call llvm_shutdown() on exit.
+
+  cl::ParseCommandLineOptions(argc, argv, "SafeDispatch vtable dumper\n");
+  ProgName = argv[0];
+
+  // the file is mapped, the sections refer into the mapping
+  ErrorOr<OwningBinary<Binary>> BinaryOrErr = createBinary(InputFilename);
+  if (std::error_code EC = BinaryOrErr.getError()) {
+    errs() << ProgName << ": '" << InputFilename << "': " << EC.message()
+           << "\n";
+    return 1;
+  }
+  ObjectFile *Obj = dyn_cast<ObjectFile>(BinaryOrErr.get().getBinary());
+  if (!Obj || !Obj->isLittleEndian() || Obj->getBytesInAddress() != 8) {
+    errs() << ProgName << ": '" << InputFilename
+           << "': not a 64-bit little-endian object file\n";
+    return 1;
+  }
+
+  Image Img;
+  if (!Img.load(*Obj)) {
+    errs() << ProgName << ": '" << InputFilename << "': not an ELF file\n";
+    return 1;
+  }
+
+  std::vector<VTable> VTables;
+  std::set<std::pair<unsigned, uint64_t>> Seen;
+  for (const SymbolInfo &Symbol : Img.symbols()) {
+    StringRef Name = Symbol.Name;
+    bool Cloud = Name.startswith("_SD_ZTV") || Name.startswith("_SD_ZTC");
+    if (!Cloud && !Name.startswith("_ZTV") && !Name.startswith("_ZTC"))
+      continue;
+    // the vtables of the runtime describe the type_info classes
+    if (Name.find("__cxxabiv1") != StringRef::npos || Symbol.Size == 0 ||
+        !Seen.insert(std::make_pair(Symbol.Loc.Section, Symbol.Loc.Offset))
+             .second)
+      continue;
+
+    VTable V;
+    V.Symbol = &Symbol;
+    V.Cloud = Cloud;
+    if (readSlots(Img, V))
+      VTables.push_back(std::move(V));
+  }
+
+  Hierarchy H(Img);
+  for (VTable &V : VTables)
+    findAddressPoints(Img, H, V);
+
+  raw_ostream &OS = outs();
+  OS << "{\n  \"file\": ";
+  writeJSONString(OS, InputFilename);
+  OS << ",\n  \"vtables\": [";
+  bool First = true;
+  for (const VTable &V : VTables) {
+    if (!isSelected(V))
+      continue;
+    OS << (First ? "\n" : ",\n");
+    writeVTable(OS, Img, V);
+    First = false;
+  }
+  OS << (First ? "]\n}\n" : "\n  ]\n}\n");
+  return 0;
+}